@@ -0,0 +1,557 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <network/AssetCache.h>
+
+static const size_t MaxAssets = 4096;
+// Bodies and compressed variants held in memory, in total and per file
+static const size_t MaxCachedBytes = 64 * 1024 * 1024;
+static const size_t MaxVariantSize = 16 * 1024 * 1024;
+// Smaller files are read in and closed, larger ones are kept open
+static const size_t MaxBodySize = 1024 * 1024;
+// Cached fds, out of the process' limit, so they can't crowd out sockets
+static const unsigned MaxOpenFds = 256;
+static const unsigned OpenFdsShare = 16;
+// Not worth compressing
+static const size_t MinCompressSize = 256;
+static const unsigned MaxDepth = 8;
+
+static const uint32_t WatchMask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                                  IN_CREATE | IN_DELETE | IN_ATTRIB;
+
+struct Variant {
+	std::vector<uint8_t> data;
+	std::string etag;
+};
+
+struct Asset {
+	Asset() : fd(-1), size(0), mtime(0) {}
+	~Asset() {
+		if (fd >= 0)
+			close(fd);
+	}
+
+	int fd;
+	uint64_t size;
+	time_t mtime;
+	std::string etag, lastmod;
+
+	std::vector<uint8_t> body;
+	Variant br, gz;
+};
+
+typedef std::shared_ptr<const Asset> AssetPtr;
+
+static std::map<std::string, AssetPtr> assets;
+static size_t cachedBytes;
+static unsigned openFds, maxOpenFds;
+// Bumped on every change, so a load that raced with one isn't cached
+static uint64_t generation;
+static std::map<int, std::string> watches;
+static std::string root;
+static int inotifyfd = -1;
+
+static pthread_mutex_t acmutex = PTHREAD_MUTEX_INITIALIZER;
+
+// User files come and go, they are never cached. Other spellings of a
+// path would escape invalidation.
+static bool cacheable(const std::string &path) {
+	return path.find("Downloads/") == std::string::npos &&
+	       path.find("//") == std::string::npos &&
+	       path.find("/./") == std::string::npos;
+}
+
+static bool compressible(const std::string &path) {
+	static const char * const exts[] = {
+		".html", ".htm", ".js", ".mjs", ".css", ".svg", ".json", ".txt",
+		".xml", ".map", ".wasm",
+	};
+	unsigned i;
+
+	for (i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+		const size_t len = strlen(exts[i]);
+		if (path.size() > len &&
+		    !strcasecmp(path.c_str() + path.size() - len, exts[i]))
+			return true;
+	}
+
+	return false;
+}
+
+static bool readAll(const int fd, const uint64_t size, std::vector<uint8_t> &out) {
+	uint64_t got = 0;
+
+	out.resize(size);
+	while (got < size) {
+		const ssize_t n = pread(fd, &out[got], size - got, got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		got += n;
+	}
+
+	return true;
+}
+
+static bool gzip(const std::vector<uint8_t> &in, std::vector<uint8_t> &out) {
+	z_stream zs;
+
+	memset(&zs, 0, sizeof(zs));
+	// 16 + window bits for a gzip header
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + 15, 8,
+	                 Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+
+	out.resize(deflateBound(&zs, in.size()) + 32);
+
+	zs.next_in = (Bytef *) &in[0];
+	zs.avail_in = in.size();
+	zs.next_out = &out[0];
+	zs.avail_out = out.size();
+
+	const int ret = deflate(&zs, Z_FINISH);
+	out.resize(zs.total_out);
+	deflateEnd(&zs);
+
+	return ret == Z_STREAM_END;
+}
+
+// A precompressed copy next to the file, if it's newer than the file
+static void loadSidecar(const std::string &fullpath, const char *ext,
+                        const struct stat &orig, Variant &v) {
+	struct stat st;
+	const std::string name = fullpath + ext;
+
+	const int fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) &&
+	    st.st_mtime >= orig.st_mtime && (uint64_t) st.st_size < MaxVariantSize) {
+		if (!readAll(fd, st.st_size, v.data))
+			v.data.clear();
+	}
+
+	close(fd);
+}
+
+// Compressing only pays off if the result gets cached
+static AssetPtr load(const std::string &path, const bool compress) {
+	const std::string fullpath = root + path;
+	struct stat st;
+	char buf[64];
+	struct tm tm;
+
+	const int fd = open(fullpath.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return AssetPtr();
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return AssetPtr();
+	}
+
+	std::shared_ptr<Asset> a(new Asset);
+	a->fd = fd;
+	a->size = st.st_size;
+	a->mtime = st.st_mtime;
+
+	sprintf(buf, "\"%lx-%llx-%llx", (unsigned long) st.st_ino,
+	        (unsigned long long) st.st_size,
+	        (unsigned long long) st.st_mtim.tv_sec * 1000000000ULL +
+	        st.st_mtim.tv_nsec);
+	a->etag = std::string(buf) + "\"";
+	a->br.etag = std::string(buf) + "-br\"";
+	a->gz.etag = std::string(buf) + "-gz\"";
+
+	gmtime_r(&a->mtime, &tm);
+	strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	a->lastmod = buf;
+
+	if (a->size <= MaxBodySize) {
+		if (!readAll(fd, a->size, a->body))
+			return AssetPtr();
+	}
+
+	if (compress && compressible(path) && a->size >= MinCompressSize &&
+	    a->size < MaxVariantSize) {
+		loadSidecar(fullpath, ".br", st, a->br);
+		loadSidecar(fullpath, ".gz", st, a->gz);
+
+		if (a->gz.data.empty()) {
+			std::vector<uint8_t> plain;
+			const std::vector<uint8_t> &in = a->body.empty() ? plain : a->body;
+			if ((!a->body.empty() || readAll(fd, a->size, plain)) &&
+			    gzip(in, a->gz.data)) {
+				// Only keep it if it's clearly smaller
+				if (a->gz.data.size() > a->size * 9 / 10)
+					a->gz.data.clear();
+			} else {
+				a->gz.data.clear();
+			}
+		}
+
+		a->gz.data.shrink_to_fit();
+	}
+
+	// Everything we need is in memory now
+	if (a->size <= MaxBodySize) {
+		close(a->fd);
+		a->fd = -1;
+	}
+
+	return a;
+}
+
+static size_t footprint(const AssetPtr &a) {
+	return a->body.size() + a->br.data.size() + a->gz.data.size();
+}
+
+static void forget(const AssetPtr &a) {
+	cachedBytes -= footprint(a);
+	if (a->fd >= 0)
+		openFds--;
+}
+
+// Call with acmutex held
+static void insert(const std::string &path, const AssetPtr &a) {
+	const size_t bytes = footprint(a);
+
+	if (assets.size() >= MaxAssets || cachedBytes + bytes > MaxCachedBytes)
+		return;
+	if (a->fd >= 0 && openFds >= maxOpenFds)
+		return;
+
+	std::map<std::string, AssetPtr>::iterator it = assets.find(path);
+	if (it != assets.end()) {
+		forget(it->second);
+		it->second = a;
+	} else {
+		assets[path] = a;
+	}
+
+	cachedBytes += bytes;
+	if (a->fd >= 0)
+		openFds++;
+}
+
+// Drops path, and everything below it if it was a directory. Call with
+// acmutex held.
+static void invalidate(const std::string &path) {
+	std::map<std::string, AssetPtr>::iterator it = assets.find(path);
+	if (it != assets.end()) {
+		forget(it->second);
+		assets.erase(it);
+	}
+
+	const std::string dir = path + "/";
+	it = assets.lower_bound(dir);
+	while (it != assets.end() && !it->first.compare(0, dir.size(), dir)) {
+		forget(it->second);
+		assets.erase(it++);
+	}
+}
+
+static void walk(const std::string &dir, const unsigned depth, const bool preload) {
+	struct dirent *ent;
+	struct stat st;
+
+	if (depth > MaxDepth)
+		return;
+
+	if (inotifyfd >= 0) {
+		const int wd = inotify_add_watch(inotifyfd, (root + dir).c_str(), WatchMask);
+		if (wd >= 0)
+			watches[wd] = dir;
+	}
+
+	DIR *d = opendir((root + dir).c_str());
+	if (!d)
+		return;
+
+	while ((ent = readdir(d))) {
+		if (ent->d_name[0] == '.')
+			continue;
+
+		const std::string path = dir + ent->d_name;
+		if (!cacheable(path + "/") || stat((root + path).c_str(), &st))
+			continue;
+
+		if (S_ISDIR(st.st_mode)) {
+			walk(path + "/", depth + 1, preload);
+		} else if (preload && S_ISREG(st.st_mode) && cacheable(path)) {
+			const AssetPtr a = load(path, true);
+			if (a)
+				insert(path, a);
+		}
+	}
+
+	closedir(d);
+}
+
+// Call with acmutex held
+static void drainEvents() {
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+
+	if (inotifyfd < 0)
+		return;
+
+	while ((len = read(inotifyfd, buf, sizeof(buf))) > 0) {
+		const char *ptr;
+
+		for (ptr = buf; ptr < buf + len;
+		     ptr += sizeof(struct inotify_event) + ((const struct inotify_event *) ptr)->len) {
+			const struct inotify_event * const ev = (const struct inotify_event *) ptr;
+
+			generation++;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				assets.clear();
+				cachedBytes = 0;
+				openFds = 0;
+				continue;
+			}
+
+			std::map<int, std::string>::iterator w = watches.find(ev->wd);
+			if (w == watches.end())
+				continue;
+
+			if (ev->mask & IN_IGNORED) {
+				watches.erase(w);
+				continue;
+			}
+
+			if (!ev->len)
+				continue;
+
+			std::string path = w->second + ev->name;
+			invalidate(path);
+
+			// The compressed copies belong to the file they're named after
+			const size_t plen = path.size();
+			if (plen > 3 && (!path.compare(plen - 3, 3, ".br") ||
+			                 !path.compare(plen - 3, 3, ".gz")))
+				invalidate(path.substr(0, plen - 3));
+
+			if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)) &&
+			    cacheable(path + "/"))
+				walk(path + "/", 1, false);
+		}
+	}
+}
+
+// Whether the Accept-Encoding header lists enc, without q=0
+static bool accepts(const char *request, const char *enc) {
+	const char *hdr = strcasestr(request, "\r\nAccept-Encoding:");
+	if (!hdr)
+		return false;
+
+	hdr += sizeof("\r\nAccept-Encoding:") - 1;
+	const char *end = strchr(hdr, '\r');
+	if (!end)
+		end = hdr + strlen(hdr);
+
+	const size_t enclen = strlen(enc);
+
+	while (hdr < end) {
+		while (hdr < end && (*hdr == ' ' || *hdr == ','))
+			hdr++;
+
+		const char *tokend = hdr;
+		while (tokend < end && *tokend != ',' && *tokend != ';' && *tokend != ' ')
+			tokend++;
+
+		const char *next = (const char *) memchr(hdr, ',', end - hdr);
+		if (!next)
+			next = end;
+
+		if ((size_t) (tokend - hdr) == enclen && !strncasecmp(hdr, enc, enclen)) {
+			const char *q = (const char *) memchr(tokend, '=', next - tokend);
+			return !q || strtod(q + 1, NULL) > 0;
+		}
+
+		hdr = next;
+	}
+
+	return false;
+}
+
+void ac_init(const char *httpdir) {
+	struct rlimit rl;
+
+	if (!httpdir || !httpdir[0])
+		return;
+
+	if (pthread_mutex_lock(&acmutex))
+		abort();
+
+	maxOpenFds = MaxOpenFds;
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY &&
+	    rl.rlim_cur / OpenFdsShare < maxOpenFds)
+		maxOpenFds = rl.rlim_cur / OpenFdsShare;
+
+	root = httpdir;
+	while (root.size() > 1 && root[root.size() - 1] == '/')
+		root.erase(root.size() - 1);
+
+	inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	walk("/", 0, true);
+
+	pthread_mutex_unlock(&acmutex);
+}
+
+unsigned char ac_get(const char *path, const char *request, struct asset_t *out) {
+	const std::string key(path);
+	uint64_t gen;
+	bool room;
+	AssetPtr a;
+
+	if (root.empty() || !cacheable(key))
+		return 0;
+
+	if (pthread_mutex_lock(&acmutex))
+		abort();
+
+	drainEvents();
+
+	std::map<std::string, AssetPtr>::const_iterator it = assets.find(key);
+	if (it != assets.end())
+		a = it->second;
+	gen = generation;
+	room = assets.size() < MaxAssets && cachedBytes < MaxCachedBytes;
+
+	pthread_mutex_unlock(&acmutex);
+
+	if (!a) {
+		// Load without the lock, two workers racing just load it twice
+		a = load(key, room);
+		if (!a)
+			return 0;
+
+		if (pthread_mutex_lock(&acmutex))
+			abort();
+		drainEvents();
+		if (gen == generation)
+			insert(key, a);
+		pthread_mutex_unlock(&acmutex);
+	}
+
+	const Variant *v = NULL;
+	if (!a->br.data.empty() && accepts(request, "br"))
+		v = &a->br;
+	else if (!a->gz.data.empty() && accepts(request, "gzip"))
+		v = &a->gz;
+
+	if (v) {
+		out->data = &v->data[0];
+		out->len = v->data.size();
+		out->encoding = v == &a->br ? "br" : "gzip";
+		out->etag = v->etag.c_str();
+	} else {
+		// Empty files have no body, but no fd either
+		out->data = a->fd < 0 ? (const uint8_t *) "" : NULL;
+		if (!a->body.empty())
+			out->data = &a->body[0];
+		out->len = a->size;
+		out->encoding = NULL;
+		out->etag = a->etag.c_str();
+	}
+
+	out->fd = a->fd;
+	out->lastmod = a->lastmod.c_str();
+	out->mtime = a->mtime;
+	out->handle = new AssetPtr(a);
+
+	return 1;
+}
+
+void ac_release(struct asset_t *asset) {
+	delete (AssetPtr *) asset->handle;
+	asset->handle = NULL;
+}
+
+unsigned char ac_isNotModified(const struct asset_t *asset, const char *request) {
+	const char *hdr = strcasestr(request, "\r\nIf-None-Match:");
+	if (hdr) {
+		hdr += sizeof("\r\nIf-None-Match:") - 1;
+		const char *end = strchr(hdr, '\r');
+		if (!end)
+			end = hdr + strlen(hdr);
+
+		const size_t etaglen = strlen(asset->etag);
+
+		while (hdr < end) {
+			while (hdr < end && (*hdr == ' ' || *hdr == ','))
+				hdr++;
+			if (end - hdr >= 2 && !strncmp(hdr, "W/", 2))
+				hdr += 2;
+
+			if (hdr < end && *hdr == '*')
+				return 1;
+			if ((size_t) (end - hdr) >= etaglen &&
+			    !strncmp(hdr, asset->etag, etaglen))
+				return 1;
+
+			const char *next = (const char *) memchr(hdr, ',', end - hdr);
+			hdr = next ? next : end;
+		}
+
+		// If-Modified-Since doesn't count when there are ETags
+		return 0;
+	}
+
+	hdr = strcasestr(request, "\r\nIf-Modified-Since:");
+	if (hdr) {
+		struct tm tm;
+
+		hdr += sizeof("\r\nIf-Modified-Since:") - 1;
+		while (*hdr == ' ')
+			hdr++;
+
+		memset(&tm, 0, sizeof(tm));
+		if (strptime(hdr, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+			return asset->mtime <= timegm(&tm);
+	}
+
+	return 0;
+}
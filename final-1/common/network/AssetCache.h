@@ -0,0 +1,65 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+//
+// The files of the web client, kept in memory and compressed (or open,
+// for the few large ones), and dropped again when inotify says they
+// changed.
+//
+
+#ifndef __NETWORK_ASSETCACHE_H__
+#define __NETWORK_ASSETCACHE_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct asset_t {
+	void *handle;
+
+	// Either the body is in memory, or it's len bytes of fd
+	const uint8_t *data;
+	int fd;
+	uint64_t len;
+
+	const char *encoding;	// "br", "gzip" or NULL
+	const char *etag;
+	const char *lastmod;
+	time_t mtime;
+};
+
+// Loads everything under httpdir, and starts watching it
+void ac_init(const char *httpdir);
+
+// Looks up path (relative to httpdir, with a leading /), in the best
+// encoding the request accepts. Returns 0 if it's not a regular file.
+// A found asset stays valid until ac_release().
+unsigned char ac_get(const char *path, const char *request, struct asset_t *out);
+void ac_release(struct asset_t *asset);
+
+// Whether the request's If-None-Match or If-Modified-Since still match
+unsigned char ac_isNotModified(const struct asset_t *asset, const char *request);
+
+#ifdef __cplusplus
+} // extern C
+#endif
+
+#endif // __NETWORK_ASSETCACHE_H__
@@ -22,12 +22,17 @@
 #include <kasmpasswd.h>
 #include <pthread.h>
 #include <network/GetAPIEnums.h>
+#include <network/SpscRing.h>
 #include <rfb/PixelBuffer.h>
 #include <rfb/PixelFormat.h>
 #include <stdint.h>
+#include <sys/time.h>
 #include <map>
 #include <string>
 #include <vector>
+#include <atomic>
+#include <condition_variable>
+#include <future>
 #include <mutex>
 
 namespace network {
@@ -40,6 +45,8 @@ namespace network {
     void mainUpdateScreen(rfb::PixelBuffer *pb);
     void mainUpdateBottleneckStats(const char userid[], const char stats[]);
     void mainClearBottleneckStats(const char userid[]);
+    void mainUpdateTransportStats(const char userid[], const char stats[]);
+    void mainClearTransportStats(const char userid[]);
     void mainUpdateServerFrameStats(uint8_t changedPerc, uint32_t all,
                                     uint32_t jpeg, uint32_t webp, uint32_t analysis,
                                     uint32_t jpegarea, uint32_t webparea,
@@ -48,6 +55,8 @@ namespace network {
                                     uint16_t w, uint16_t h);
     void mainUpdateClientFrameStats(const char userid[], uint32_t render, uint32_t all,
                                     uint32_t ping);
+    void mainUpdateEncCacheStats(uint64_t hits, uint64_t misses, uint64_t hitBytes,
+                                 uint64_t size, uint32_t entries);
     void mainUpdateUserInfo(const uint8_t ownerConn, const uint8_t numUsers);
 
     void mainUpdateSessionsInfo(std::string newSessionsInfo);
@@ -66,10 +75,9 @@ namespace network {
     void netGetUsers(const char **ptr);
 
     const std::string_view netGetSessions();
+    std::string netGetFrameTrace();
     void netGetBottleneckStats(char *buf, uint32_t len);
-    void netGetFrameStats(char *buf, uint32_t len);
-    void netResetFrameStatsCall();
-    uint8_t netServerFrameStatsReady();
+    void netGetTransportStats(char *buf, uint32_t len);
     void netUdpUpgrade(void *client, uint32_t ip);
     void netClearClipboard();
 
@@ -83,10 +91,13 @@ namespace network {
       CLEAR_CLIPBOARD,
     };
 
+    // Identical requests while one is in progress share its result.
+    // Waits for the server's stats, then up to 2s for the given number of
+    // clients. Returns 0 on timeout.
     uint8_t netRequestFrameStats(USER_ACTION what, const char *client);
+    uint8_t netWaitFrameStats(const uint8_t clients, char *buf, uint32_t len);
     uint8_t netOwnerConnected();
     uint8_t netNumActiveUsers();
-    uint8_t netGetClientFrameStatsNum();
 
     struct action_data {
       enum USER_ACTION action;
@@ -99,11 +110,24 @@ namespace network {
       };
     };
 
-    pthread_mutex_t userMutex;
-    std::vector<action_data> actionQueue;
+    // from main thread, returns false once there are no more
+    bool mainGetAction(action_data &act);
 
   private:
+    bool netQueueAction(const action_data &act);
+    void renderFrameStats(char *buf, uint32_t len);
+    bool renderUserStats(const std::map<std::string, std::string> &stats,
+                         const unsigned estimate, char *buf, uint32_t len);
+
     const char *passwdfile;
+    pthread_mutex_t userMutex;
+
+    // One queue per thread that sends actions in, so the main thread
+    // never waits on a network thread
+    enum { MAX_ACTION_THREADS = 32, ACTION_QUEUE_LEN = 16 };
+    SpscRing<action_data, ACTION_QUEUE_LEN> actionQueues[MAX_ACTION_THREADS];
+    std::atomic<unsigned> numActionQueues;
+    std::mutex actionQueueMutex;
 
     pthread_mutex_t screenMutex;
     rfb::ManagedPixelBuffer screenPb;
@@ -115,6 +139,11 @@ namespace network {
     uint8_t cachedQ;
 
     std::map<std::string, std::string> bottleneckStats;
+    std::string bottleneckJson;
+    struct timeval bottleneckJsonTime;
+    std::map<std::string, std::string> transportStats;
+    std::string transportJson;
+    struct timeval transportJsonTime;
     pthread_mutex_t statMutex;
 
     struct clientFrameStats_t {
@@ -140,9 +169,25 @@ namespace network {
 
       uint8_t inprogress;
     };
+    struct encCacheStats_t {
+      uint64_t hits;
+      uint64_t misses;
+      uint64_t hitBytes;
+      uint64_t size;
+      uint32_t entries;
+    };
     std::map<std::string, clientFrameStats_t> clientFrameStats;
     serverFrameStats_t serverFrameStats;
-    pthread_mutex_t frameStatMutex;
+    encCacheStats_t encCacheStats;
+    std::mutex frameStatMutex;
+    std::condition_variable frameStatCond;
+
+    // The request in progress, whoever waits first renders the result
+    USER_ACTION frameStatsAction;
+    std::string frameStatsClient;
+    std::promise<std::string> frameStatsPromise;
+    std::shared_future<std::string> frameStatsResult;
+    bool frameStatsRendering;
 
     uint8_t ownerConnected;
     uint8_t activeUsers;
@@ -23,8 +23,10 @@
 #include <network/jsonescape.h>
 #include <rfb/ConnParams.h>
 #include <rfb/EncodeManager.h>
+#include <rfb/FrameTrace.h>
 #include <rfb/LogWriter.h>
 #include <rfb/JpegCompressor.h>
+#include <rfb/util.h>
 #include <rfb/xxhash.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,6 +38,9 @@ using namespace rfb;
 
 static LogWriter vlog("GetAPIMessager");
 
+// Dashboards polling the stats share one rendering per interval
+static const unsigned STATS_INTERVAL = 1000;
+
 struct TightJPEGConfiguration {
     int quality;
     int subsampling;
@@ -55,18 +60,22 @@ static const struct TightJPEGConfiguration conf[10] = {
 };
 
 GetAPIMessager::GetAPIMessager(const char *passwdfile_): passwdfile(passwdfile_),
+					numActionQueues(0),
 					screenW(0), screenH(0), screenHash(0),
 					cachedW(0), cachedH(0), cachedQ(0),
+					frameStatsAction(NONE), frameStatsRendering(false),
 					ownerConnected(0), activeUsers(0),
 					sessionsInfo( "{\"users\":[]}"){
 
 	pthread_mutex_init(&screenMutex, NULL);
 	pthread_mutex_init(&userMutex, NULL);
 	pthread_mutex_init(&statMutex, NULL);
-	pthread_mutex_init(&frameStatMutex, NULL);
 	pthread_mutex_init(&userInfoMutex, NULL);
 
-	serverFrameStats.inprogress = 0;
+	memset(&bottleneckJsonTime, 0, sizeof(bottleneckJsonTime));
+	memset(&transportJsonTime, 0, sizeof(transportJsonTime));
+	memset(&serverFrameStats, 0, sizeof(serverFrameStats_t));
+	memset(&encCacheStats, 0, sizeof(encCacheStats_t));
 }
 
 // from main thread
@@ -116,6 +125,26 @@ void GetAPIMessager::mainClearBottleneckStats(const char userid[]) {
 		return;
 
 	bottleneckStats.erase(userid);
+	memset(&bottleneckJsonTime, 0, sizeof(bottleneckJsonTime));
+
+	pthread_mutex_unlock(&statMutex);
+}
+
+void GetAPIMessager::mainUpdateTransportStats(const char userid[], const char stats[]) {
+	if (pthread_mutex_trylock(&statMutex))
+		return;
+
+	transportStats[userid] = stats;
+
+	pthread_mutex_unlock(&statMutex);
+}
+
+void GetAPIMessager::mainClearTransportStats(const char userid[]) {
+	if (pthread_mutex_lock(&statMutex))
+		return;
+
+	transportStats.erase(userid);
+	memset(&transportJsonTime, 0, sizeof(transportJsonTime));
 
 	pthread_mutex_unlock(&statMutex);
 }
@@ -127,8 +156,7 @@ void GetAPIMessager::mainUpdateServerFrameStats(uint8_t changedPerc,
 	uint16_t enc, uint16_t scale, uint16_t shot,
 	uint16_t w, uint16_t h) {
 
-	if (pthread_mutex_lock(&frameStatMutex))
-		return;
+	std::lock_guard<std::mutex> lock(frameStatMutex);
 
 	serverFrameStats.changedPerc = changedPerc;
 	serverFrameStats.all = all;
@@ -145,14 +173,27 @@ void GetAPIMessager::mainUpdateServerFrameStats(uint8_t changedPerc,
 	serverFrameStats.w = w;
 	serverFrameStats.h = h;
 
-	pthread_mutex_unlock(&frameStatMutex);
+	frameStatCond.notify_all();
+}
+
+void GetAPIMessager::mainUpdateEncCacheStats(uint64_t hits, uint64_t misses,
+	uint64_t hitBytes, uint64_t size, uint32_t entries) {
+
+	std::unique_lock<std::mutex> lock(frameStatMutex, std::try_to_lock);
+	if (!lock.owns_lock())
+		return;
+
+	encCacheStats.hits = hits;
+	encCacheStats.misses = misses;
+	encCacheStats.hitBytes = hitBytes;
+	encCacheStats.size = size;
+	encCacheStats.entries = entries;
 }
 
 void GetAPIMessager::mainUpdateClientFrameStats(const char userid[], uint32_t render,
 	uint32_t all, uint32_t ping) {
 
-	if (pthread_mutex_lock(&frameStatMutex))
-		return;
+	std::lock_guard<std::mutex> lock(frameStatMutex);
 
 	clientFrameStats_t s;
 	s.render = render;
@@ -161,7 +202,7 @@ void GetAPIMessager::mainUpdateClientFrameStats(const char userid[], uint32_t re
 
 	clientFrameStats[userid] = s;
 
-	pthread_mutex_unlock(&frameStatMutex);
+	frameStatCond.notify_all();
 }
 
 void GetAPIMessager::mainUpdateUserInfo(const uint8_t ownerConn, const uint8_t numUsers) {
@@ -183,6 +224,18 @@ void GetAPIMessager::mainUpdateSessionsInfo(std::string newSessionsInfo)
 	lock.unlock();
 }
 
+bool GetAPIMessager::mainGetAction(action_data &act) {
+	const unsigned num = numActionQueues.load(std::memory_order_acquire);
+	unsigned i;
+
+	for (i = 0; i < num; i++) {
+		if (actionQueues[i].pop(act))
+			return true;
+	}
+
+	return false;
+}
+
 // from network threads
 uint8_t *GetAPIMessager::netGetScreenshot(uint16_t w, uint16_t h,
 	const uint8_t q, const bool dedup,
@@ -532,6 +585,12 @@ const std::string_view GetAPIMessager::netGetSessions()
 	return sessionsInfo;
 }
 
+std::string GetAPIMessager::netGetFrameTrace()
+{
+	// The trace rings are safe to read while the main thread records
+	return rfb::FrameTrace::exportChromeTrace();
+}
+
 void GetAPIMessager::netGetBottleneckStats(char *buf, uint32_t len) {
 /*
 {
@@ -544,26 +603,69 @@ void GetAPIMessager::netGetBottleneckStats(char *buf, uint32_t len) {
     }
 }
 */
-	std::map<std::string, std::string>::const_iterator it;
-	const char *prev = NULL;
-	FILE *f;
+	if (pthread_mutex_lock(&statMutex)) {
+		buf[0] = 0;
+		return;
+	}
 
+	// Rendered recently enough?
+	if (msSince(&bottleneckJsonTime) < STATS_INTERVAL) {
+		if (bottleneckJson.size() < len)
+			memcpy(buf, bottleneckJson.c_str(), bottleneckJson.size() + 1);
+		else
+			buf[0] = 0;
+	} else if (renderUserStats(bottleneckStats, 60, buf, len)) {
+		bottleneckJson = buf;
+		gettimeofday(&bottleneckJsonTime, NULL);
+	}
+
+	pthread_mutex_unlock(&statMutex);
+}
+
+void GetAPIMessager::netGetTransportStats(char *buf, uint32_t len) {
+/*
+{
+    "username.1": {
+        "192.168.100.2:14908": { "udp_sent": 1200, "udp_parity": 120, ... }
+    }
+}
+*/
 	if (pthread_mutex_lock(&statMutex)) {
 		buf[0] = 0;
 		return;
 	}
 
+	if (msSince(&transportJsonTime) < STATS_INTERVAL) {
+		if (transportJson.size() < len)
+			memcpy(buf, transportJson.c_str(), transportJson.size() + 1);
+		else
+			buf[0] = 0;
+	} else if (renderUserStats(transportStats, 400, buf, len)) {
+		transportJson = buf;
+		gettimeofday(&transportJsonTime, NULL);
+	}
+
+	pthread_mutex_unlock(&statMutex);
+}
+
+// Call with statMutex held. Groups the per-connection stats by user.
+bool GetAPIMessager::renderUserStats(const std::map<std::string, std::string> &stats,
+                                     const unsigned estimate, char *buf, uint32_t len) {
+	std::map<std::string, std::string>::const_iterator it;
+	const char *prev = NULL;
+	FILE *f;
+
 	// Conservative estimate
-	if (len < bottleneckStats.size() * 60) {
+	if (len < stats.size() * estimate) {
 		buf[0] = 0;
-		goto out;
+		return false;
 	}
 
 	f = fmemopen(buf, len, "w");
 
 	fprintf(f, "{\n");
 
-	for (it = bottleneckStats.begin(); it != bottleneckStats.end(); it++) {
+	for (it = stats.begin(); it != stats.end(); it++) {
 		// user@127.0.0.1_1627311208.791752::websocket
 		const char *id = it->first.c_str();
 		const char *data = it->second.c_str();
@@ -588,18 +690,18 @@ void GetAPIMessager::netGetBottleneckStats(char *buf, uint32_t len) {
 		prev = id;
 	}
 
-	if (!bottleneckStats.size())
+	if (!stats.size())
 		fprintf(f, "}\n");
 	else
 		fprintf(f, "\n\t}\n}\n");
 
 	fclose(f);
 
-out:
-	pthread_mutex_unlock(&statMutex);
+	return true;
 }
 
-void GetAPIMessager::netGetFrameStats(char *buf, uint32_t len) {
+// Call with frameStatMutex held
+void GetAPIMessager::renderFrameStats(char *buf, uint32_t len) {
 /*
 {
 	"frame" : {
@@ -611,7 +713,8 @@ void GetAPIMessager::netGetFrameStats(char *buf, uint32_t len) {
 	"server_side" : [
 		{ "process_name": "Analysis", "time": 20 },
 		{ "process_name": "TightWEBPEncoder", "time": 20, "count": 64, "area": 12 },
-		{ "process_name": "TightJPEGEncoder", "time": 20, "count": 64, "area": 12 }
+		{ "process_name": "TightJPEGEncoder", "time": 20, "count": 64, "area": 12 },
+		{ "process_name": "EncodeCache", "hits": 10, "misses": 2, "hit_bytes": 4096, "size": 8192, "entries": 2 }
 	],
 	"client_side" : [
 		{
@@ -629,17 +732,12 @@ void GetAPIMessager::netGetFrameStats(char *buf, uint32_t len) {
 	unsigned i = 0;
 	FILE *f;
 
-	if (pthread_mutex_lock(&frameStatMutex)) {
-		buf[0] = 0;
-		return;
-	}
-
 	const unsigned num = clientFrameStats.size();
 
 	// Conservative estimate
 	if (len < 1024) {
 		buf[0] = 0;
-		goto out;
+		return;
 	}
 
 	f = fmemopen(buf, len, "w");
@@ -662,7 +760,9 @@ void GetAPIMessager::netGetFrameStats(char *buf, uint32_t len) {
 	           "\t\t{ \"process_name\": \"Screenshot\", \"time\": %u },\n"
 	           "\t\t{ \"process_name\": \"Encoding_total\", \"time\": %u, \"videoscaling\": %u },\n"
 	           "\t\t{ \"process_name\": \"TightJPEGEncoder\", \"time\": %u, \"count\": %u, \"area\": %u },\n"
-	           "\t\t{ \"process_name\": \"TightWEBPEncoder\", \"time\": %u, \"count\": %u, \"area\": %u }\n"
+	           "\t\t{ \"process_name\": \"TightWEBPEncoder\", \"time\": %u, \"count\": %u, \"area\": %u },\n"
+	           "\t\t{ \"process_name\": \"EncodeCache\", \"hits\": %" PRIu64 ", \"misses\": %" PRIu64
+	           ", \"hit_bytes\": %" PRIu64 ", \"size\": %" PRIu64 ", \"entries\": %u }\n"
 	           "\t],\n",
 	           serverFrameStats.analysis,
 	           serverFrameStats.shot,
@@ -673,7 +773,12 @@ void GetAPIMessager::netGetFrameStats(char *buf, uint32_t len) {
 	           serverFrameStats.jpegarea,
 	           serverFrameStats.webp,
 	           serverFrameStats.nwebp,
-	           serverFrameStats.webparea);
+	           serverFrameStats.webparea,
+	           encCacheStats.hits,
+	           encCacheStats.misses,
+	           encCacheStats.hitBytes,
+	           encCacheStats.size,
+	           encCacheStats.entries);
 
 	fprintf(f, "\t\"client_side\" : [\n");
 
@@ -703,20 +808,6 @@ void GetAPIMessager::netGetFrameStats(char *buf, uint32_t len) {
 	fprintf(f, "\t]\n}\n");
 
 	fclose(f);
-
-	serverFrameStats.inprogress = 0;
-
-out:
-	pthread_mutex_unlock(&frameStatMutex);
-}
-
-void GetAPIMessager::netResetFrameStatsCall() {
-	if (pthread_mutex_lock(&frameStatMutex))
-		return;
-
-	serverFrameStats.inprogress = 0;
-
-	pthread_mutex_unlock(&frameStatMutex);
 }
 
 uint8_t GetAPIMessager::netRequestFrameStats(USER_ACTION what, const char *client) {
@@ -728,31 +819,83 @@ uint8_t GetAPIMessager::netRequestFrameStats(USER_ACTION what, const char *clien
 		act.data.password[PASSWORD_LEN - 1] = '\0';
 	}
 
-	// In progress already?
-	bool fail = false;
-	if (pthread_mutex_lock(&frameStatMutex))
-		return 0;
+	std::unique_lock<std::mutex> lock(frameStatMutex);
 
+	// In progress already?
 	if (serverFrameStats.inprogress) {
-		fail = true;
+		if (what == frameStatsAction && frameStatsClient == (client ? client : ""))
+			return 1;
+
 		vlog.error("Frame stats request already in progress, refusing another");
-	} else {
-		clientFrameStats.clear();
-		memset(&serverFrameStats, 0, sizeof(serverFrameStats_t));
-		serverFrameStats.inprogress = 1;
+		return 0;
 	}
 
-	pthread_mutex_unlock(&frameStatMutex);
-	if (fail)
-		return 0;
+	clientFrameStats.clear();
+	memset(&serverFrameStats, 0, sizeof(serverFrameStats_t));
+	serverFrameStats.inprogress = 1;
+
+	frameStatsAction = what;
+	frameStatsClient = client ? client : "";
+	frameStatsPromise = std::promise<std::string>();
+	frameStatsResult = frameStatsPromise.get_future().share();
+	frameStatsRendering = false;
 
 	// Send it in
-	if (pthread_mutex_lock(&userMutex))
+	if (!netQueueAction(act)) {
+		serverFrameStats.inprogress = 0;
+		frameStatsPromise.set_value("");
 		return 0;
+	}
 
-	actionQueue.push_back(act);
+	return 1;
+}
 
-	pthread_mutex_unlock(&userMutex);
+uint8_t GetAPIMessager::netWaitFrameStats(const uint8_t clients, char *buf, uint32_t len) {
+	std::unique_lock<std::mutex> lock(frameStatMutex);
+
+	buf[0] = 0;
+
+	if (!frameStatsResult.valid())
+		return 0;
+
+	const std::shared_future<std::string> result = frameStatsResult;
+
+	if (serverFrameStats.inprogress && !frameStatsRendering) {
+		frameStatsRendering = true;
+
+		if (!frameStatCond.wait_for(lock, std::chrono::seconds(10),
+		                            [this] { return serverFrameStats.w != 0; })) {
+			vlog.error("Main thread didn't respond to a frame stats request");
+			serverFrameStats.inprogress = 0;
+			frameStatsPromise.set_value("");
+			return 0;
+		}
+
+		if (clients) {
+			frameStatCond.wait_for(lock, std::chrono::seconds(2),
+			                       [this, clients] {
+			                         return clientFrameStats.size() >= clients;
+			                       });
+		}
+
+		std::vector<char> out(len);
+		renderFrameStats(&out[0], len);
+
+		serverFrameStats.inprogress = 0;
+		frameStatsPromise.set_value(&out[0]);
+	}
+
+	lock.unlock();
+
+	// Someone else is waiting for the same stats
+	if (result.wait_for(std::chrono::seconds(15)) != std::future_status::ready)
+		return 0;
+
+	const std::string &stats = result.get();
+	if (stats.empty() || stats.size() >= len)
+		return 0;
+
+	memcpy(buf, stats.c_str(), stats.size() + 1);
 
 	return 1;
 }
@@ -783,30 +926,30 @@ uint8_t GetAPIMessager::netNumActiveUsers() {
 	return ret;
 }
 
-uint8_t GetAPIMessager::netGetClientFrameStatsNum() {
-	uint8_t ret;
-
-	if (pthread_mutex_lock(&frameStatMutex))
-		return 0;
-
-	ret = clientFrameStats.size();
-
-	pthread_mutex_unlock(&frameStatMutex);
+// Called from any network thread, each gets its own queue the first
+// time. There is only ever one messager, so the thread can remember it.
+bool GetAPIMessager::netQueueAction(const action_data &act) {
+	static thread_local int queue = -1;
 
-	return ret;
-}
-
-uint8_t GetAPIMessager::netServerFrameStatsReady() {
-	uint8_t ret;
+	if (queue < 0) {
+		std::lock_guard<std::mutex> lock(actionQueueMutex);
 
-	if (pthread_mutex_lock(&frameStatMutex))
-		return 0;
+		const unsigned num = numActionQueues.load(std::memory_order_relaxed);
+		if (num >= MAX_ACTION_THREADS) {
+			vlog.error("Too many threads sending API requests, dropping one");
+			return false;
+		}
 
-	ret = serverFrameStats.w != 0;
+		queue = num;
+		numActionQueues.store(num + 1, std::memory_order_release);
+	}
 
-	pthread_mutex_unlock(&frameStatMutex);
+	if (!actionQueues[queue].push(act)) {
+		vlog.error("API request queue full, dropping a request");
+		return false;
+	}
 
-	return ret;
+	return true;
 }
 
 void GetAPIMessager::netUdpUpgrade(void *client, uint32_t ip) {
@@ -817,12 +960,7 @@ void GetAPIMessager::netUdpUpgrade(void *client, uint32_t ip) {
 	act.udp.ip = ip;
 
 	// Send it in
-	if (pthread_mutex_lock(&userMutex))
-		return;
-
-	actionQueue.push_back(act);
-
-	pthread_mutex_unlock(&userMutex);
+	netQueueAction(act);
 }
 
 void GetAPIMessager::netClearClipboard() {
@@ -830,11 +968,5 @@ void GetAPIMessager::netClearClipboard() {
 	act.action = CLEAR_CLIPBOARD;
 
 	// Send it in
-	if (pthread_mutex_lock(&userMutex))
-		return;
-
-	actionQueue.push_back(act);
-
-	pthread_mutex_unlock(&userMutex);
+	netQueueAction(act);
 }
-
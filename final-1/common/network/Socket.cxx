@@ -128,6 +128,18 @@ void Socket::setFd(int fd)
   isShutdown_ = false;
 }
 
+void Socket::setStreams(rdr::FdInStream* in, rdr::FdOutStream* out)
+{
+#ifndef WIN32
+  // - By default, close the socket on exec()
+  fcntl(out->getFd(), F_SETFD, FD_CLOEXEC);
+#endif
+
+  instream = in;
+  outstream = out;
+  isShutdown_ = false;
+}
+
 SocketListener::SocketListener(int fd)
   : fd(fd), filter(0)
 {
@@ -60,6 +60,9 @@ namespace network {
     Socket();
 
     void setFd(int fd);
+    // For sockets that speak more than plain bytes on the fd. Takes
+    // ownership of the streams.
+    void setStreams(rdr::FdInStream* in, rdr::FdOutStream* out);
 
   private:
     rdr::FdInStream* instream;
@@ -87,7 +90,7 @@ namespace network {
     // accept() returns a new Socket object if there is a connection
     // attempt in progress AND if the connection passes the filter
     // if one is installed.  Otherwise, returns 0.
-    Socket* accept();
+    virtual Socket* accept();
 
     virtual int getMyPort() = 0;
 
@@ -0,0 +1,68 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+//
+// SpscRing is a fixed size queue between exactly one producing and one
+// consuming thread, without locks. N must be a power of two.
+//
+
+#ifndef __NETWORK_SPSCRING_H__
+#define __NETWORK_SPSCRING_H__
+
+#include <atomic>
+
+namespace network {
+
+  template<class T, unsigned N> class SpscRing {
+  public:
+    SpscRing() : head(0), tail(0) {}
+
+    // Producer only. Returns false if full.
+    bool push(const T &item) {
+      const unsigned t = tail.load(std::memory_order_relaxed);
+      if (t - head.load(std::memory_order_acquire) == N)
+        return false;
+
+      items[t & (N - 1)] = item;
+      tail.store(t + 1, std::memory_order_release);
+      return true;
+    }
+
+    // Consumer only. Returns false if empty.
+    bool pop(T &item) {
+      const unsigned h = head.load(std::memory_order_relaxed);
+      if (h == tail.load(std::memory_order_acquire))
+        return false;
+
+      item = items[h & (N - 1)];
+      head.store(h + 1, std::memory_order_release);
+      return true;
+    }
+
+  private:
+    static_assert((N & (N - 1)) == 0, "N must be a power of two");
+
+    // Apart, so the two threads don't share a cache line
+    alignas(64) std::atomic<unsigned> head;
+    alignas(64) std::atomic<unsigned> tail;
+    T items[N];
+  };
+
+}
+
+#endif
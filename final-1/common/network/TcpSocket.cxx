@@ -35,7 +35,7 @@
 #include <errno.h>
 #endif
 
-#include <sys/un.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
@@ -50,6 +50,8 @@
 #include <network/GetAPI.h>
 #include <network/TcpSocket.h>
 #include <network/Udp.h>
+#include <network/WebSocketInStream.h>
+#include <network/WebSocketOutStream.h>
 #include <rfb/LogWriter.h>
 #include <rfb/Configuration.h>
 #include <rfb/ServerCore.h>
@@ -126,18 +128,25 @@ int network::getSockPort(int sock)
   }
 }
 
-WebSocket::WebSocket(int sock) : Socket(sock)
+WebSocket::WebSocket(int sock, SSL* ssl, SSL_CTX* sslctx, const char* name,
+                     const void* data, size_t len)
 {
+  setStreams(new WebSocketInStream(sock, ssl, data, len),
+             new WebSocketOutStream(sock, ssl, sslctx));
+
+  // Disable Nagle's algorithm, to reduce latency
+  enableNagles(false);
+
+  peerName = rfb::strDup(name);
+}
+
+WebSocket::~WebSocket()
+{
+  rfb::strFree(peerName);
 }
 
 char* WebSocket::getPeerAddress() {
-  struct sockaddr_un addr;
-  socklen_t len = sizeof(struct sockaddr_un);
-  if (getpeername(getFd(), (struct sockaddr *) &addr, &len) != 0) {
-    vlog.error("unable to get peer name for socket");
-    return rfb::strDup("websocket");
-  }
-  return rfb::strDup(addr.sun_path + 1);
+  return rfb::strDup(peerName);
 }
 
 char* WebSocket::getPeerEndpoint() {
@@ -325,6 +334,9 @@ bool TcpSocket::enableNagles(bool enable) {
 }
 
 bool TcpSocket::cork(bool enable) {
+  // Keep whole rects together in our own buffers too
+  outStream().cork(enable);
+
 #ifndef TCP_CORK
   return false;
 #else
@@ -485,16 +497,16 @@ static void bottleneckStatsCb(void *messager, char *buf, uint32_t len)
   msgr->netGetBottleneckStats(buf, len);
 }
 
-static void frameStatsCb(void *messager, char *buf, uint32_t len)
+static void transportStatsCb(void *messager, char *buf, uint32_t len)
 {
   GetAPIMessager *msgr = (GetAPIMessager *) messager;
-  msgr->netGetFrameStats(buf, len);
+  msgr->netGetTransportStats(buf, len);
 }
 
-static void resetFrameStatsCb(void *messager)
+static uint8_t waitFrameStatsCb(void *messager, uint8_t clients, char *buf, uint32_t len)
 {
   GetAPIMessager *msgr = (GetAPIMessager *) messager;
-  msgr->netResetFrameStatsCall();
+  return msgr->netWaitFrameStats(clients, buf, len);
 }
 
 static uint8_t requestFrameStatsNoneCb(void *messager)
@@ -533,18 +545,6 @@ static uint8_t numActiveUsersCb(void *messager)
   return msgr->netNumActiveUsers();
 }
 
-static uint8_t getClientFrameStatsNumCb(void *messager)
-{
-  GetAPIMessager *msgr = (GetAPIMessager *) messager;
-  return msgr->netGetClientFrameStatsNum();
-}
-
-static uint8_t serverFrameStatsReadyCb(void *messager)
-{
-  GetAPIMessager *msgr = (GetAPIMessager *) messager;
-  return msgr->netServerFrameStatsReady();
-}
-
 static void clearClipboardCb(void *messager)
 {
   GetAPIMessager *msgr = (GetAPIMessager *) messager;
@@ -563,6 +563,24 @@ static void getSessionsCb(void *messager,  char **ptr)
   *ptr = sessionInfo;
 }
 
+static void getFrameTraceCb(void *messager, char **ptr)
+{
+  GetAPIMessager *msgr = (GetAPIMessager *) messager;
+  const std::string trace = msgr->netGetFrameTrace();
+
+  // Freed by the caller
+  char *buf = (char *) malloc(trace.size() + 1);
+  memcpy(buf, trace.c_str(), trace.size() + 1);
+  *ptr = buf;
+}
+
+static void handoffCb(void *listener, int sockfd, SSL *ssl, SSL_CTX *sslctx,
+                      const char *peername, const char *data, unsigned len)
+{
+  WebsocketListener *l = (WebsocketListener *) listener;
+  l->handOff(new WebSocket(sockfd, ssl, sslctx, peername, data, len));
+}
+
 #if OPENSSL_VERSION_NUMBER < 0x1010000f
 
 static pthread_mutex_t *sslmutex;
@@ -652,25 +670,20 @@ WebsocketListener::WebsocketListener(const struct sockaddr *listenaddr,
 
   listen(sock); // sets the internal fd
 
-  //
-  // External TCP socket now created. Create the internal ones
-  //
-  internalSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+  listenSocket = sock;
 
-  char sockname[32];
-  sprintf(sockname, ".KasmVNCSock%u", getpid());
-
-  struct sockaddr_un addr;
-  addr.sun_family = AF_UNIX;
-  strcpy(addr.sun_path, sockname);
-  addr.sun_path[0] = '\0';
-
-  if (bind(internalSocket, (struct sockaddr *) &addr,
-           sizeof(sa_family_t) + strlen(sockname))) {
-    throw SocketException("failed to bind socket", errorNumber);
+  // The websocket threads own the TCP socket. What the server polls is a
+  // pipe they poke whenever a client has finished its handshake.
+  if (pipe(wakeupPipe) < 0) {
+    int e = errorNumber;
+    closesocket(sock);
+    throw SocketException("unable to create wakeup pipe", e);
   }
+  fcntl(wakeupPipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(wakeupPipe[1], F_SETFD, FD_CLOEXEC);
+  fcntl(wakeupPipe[0], F_SETFL, O_NONBLOCK);
 
-  listen(internalSocket);
+  fd = wakeupPipe[0];
 
   settings.passwdfile = NULL;
 
@@ -683,13 +696,12 @@ WebsocketListener::WebsocketListener(const struct sockaddr *listenaddr,
   settings.cert = cert;
   settings.key = certkey;
   settings.ssl_only = sslonly;
+  settings.ktls = rfb::Server::kernelTLS;
   settings.verbose = vlog.getLevel() >= vlog.LEVEL_DEBUG;
   settings.httpdir = NULL;
   if (httpdir && httpdir[0])
     settings.httpdir = realpath(httpdir, NULL);
 
-  settings.listen_sock = sock;
-
   settings.messager = messager = new GetAPIMessager(settings.passwdfile);
   settings.screenshotCb = screenshotCb;
   settings.adduserCb = adduserCb;
@@ -698,8 +710,8 @@ WebsocketListener::WebsocketListener(const struct sockaddr *listenaddr,
   settings.addOrUpdateUserCb = addOrUpdateUserCb;
   settings.getUsersCb = getUsersCb;
   settings.bottleneckStatsCb = bottleneckStatsCb;
-  settings.frameStatsCb = frameStatsCb;
-  settings.resetFrameStatsCb = resetFrameStatsCb;
+  settings.transportStatsCb = transportStatsCb;
+  settings.waitFrameStatsCb = waitFrameStatsCb;
 
   settings.requestFrameStatsNoneCb = requestFrameStatsNoneCb;
   settings.requestFrameStatsOwnerCb = requestFrameStatsOwnerCb;
@@ -708,16 +720,17 @@ WebsocketListener::WebsocketListener(const struct sockaddr *listenaddr,
 
   settings.ownerConnectedCb = ownerConnectedCb;
   settings.numActiveUsersCb = numActiveUsersCb;
-  settings.getClientFrameStatsNumCb = getClientFrameStatsNumCb;
-  settings.serverFrameStatsReadyCb = serverFrameStatsReadyCb;
 
   settings.clearClipboardCb = clearClipboardCb;
   settings.getSessionsCb = getSessionsCb;
+  settings.getFrameTraceCb = getFrameTraceCb;
+  settings.handoffCb = handoffCb;
 
   openssl_threads();
 
+  ws_start(sock, this);
+
   pthread_t tid;
-  pthread_create(&tid, NULL, start_server, NULL);
 
   uint16_t *nport = (uint16_t *) calloc(1, sizeof(uint16_t));
   if (rfb::Server::udpPort)
@@ -727,8 +740,45 @@ WebsocketListener::WebsocketListener(const struct sockaddr *listenaddr,
   pthread_create(&tid, NULL, udpserver, nport);
 }
 
+Socket* WebsocketListener::accept() {
+  WebSocket* s;
+  char c;
+
+  if (read(fd, &c, 1) != 1)
+    return NULL;
+
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    if (queue.empty())
+      return NULL;
+    s = queue.front();
+    queue.pop_front();
+  }
+
+  if (filter && !filter->verifyConnection(s)) {
+    delete s;
+    return NULL;
+  }
+
+  return s;
+}
+
+// Called by the websocket threads
+void WebsocketListener::handOff(WebSocket* sock) {
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    queue.push_back(sock);
+  }
+
+  const char c = 0;
+  if (write(wakeupPipe[1], &c, 1) != 1)
+    vlog.error("Unable to wake up the server for a new websocket: %s",
+               strerror(errno));
+}
+
 Socket* WebsocketListener::createSocket(int fd) {
-  return new WebSocket(fd);
+  // Never used, accept() gets its sockets from the websocket threads
+  return new TcpSocket(fd);
 }
 
 void WebsocketListener::getMyAddresses(std::list<char*>* result) {
@@ -774,7 +824,7 @@ void WebsocketListener::getMyAddresses(std::list<char*>* result) {
 }
 
 int WebsocketListener::getMyPort() {
-  return getSockPort(getFd());
+  return getSockPort(listenSocket);
 }
 
 
@@ -39,6 +39,9 @@
 #endif
 
 #include <list>
+#include <mutex>
+
+#include <openssl/ssl.h>
 
 /* Tunnelling support. */
 #define TUNNEL_PORT_OFFSET 5500
@@ -61,17 +64,25 @@ namespace network {
     virtual bool cork(bool enable);
 
   protected:
+    TcpSocket() {}
+
     bool enableNagles(bool enable);
   };
 
-  class WebSocket : public Socket {
+  // A client that upgraded to a websocket. The websocket front end hands
+  // over the TCP connection itself, together with its TLS state, once the
+  // handshake is done.
+  class WebSocket : public TcpSocket {
   public:
-    WebSocket(int sock);
+    WebSocket(int sock, SSL* ssl, SSL_CTX* sslctx, const char* peerName,
+              const void* data, size_t len);
+    virtual ~WebSocket();
 
     virtual char* getPeerAddress();
     virtual char* getPeerEndpoint();
 
-    virtual bool cork(bool enable) { return true; }
+  private:
+    char* peerName;
   };
 
   class TcpListener : public SocketListener {
@@ -98,7 +109,10 @@ namespace network {
 
     static void getMyAddresses(std::list<char*>* result);
 
-    int internalSocket;
+    // Clients come from the websocket threads, not from accept()ing on
+    // the fd, which only signals that one is waiting
+    virtual Socket* accept();
+    void handOff(WebSocket* sock);
 
     virtual GetAPIMessager *getMessager() { return messager; }
 
@@ -106,6 +120,10 @@ namespace network {
     virtual Socket* createSocket(int fd);
   private:
     GetAPIMessager *messager;
+    int listenSocket;
+    int wakeupPipe[2];
+    std::mutex queueMutex;
+    std::list<WebSocket*> queue;
   };
 
   void createLocalTcpListeners(std::list<SocketListener*> *listeners,
@@ -25,12 +25,14 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <time.h>
+#include <map>
 
 #include <network/GetAPI.h>
 #include <network/Udp.h>
 #include <network/webudp/WuHost.h>
 #include <network/webudp/Wu.h>
 #include <network/websocket.h>
+#include <rfb/FrameTrace.h>
 #include <rfb/LogWriter.h>
 #include <rfb/ServerCore.h>
 #include <rfb/xxhash.h>
@@ -41,9 +43,76 @@ static rfb::LogWriter vlog("WebUdp");
 static WuHost *host = NULL;
 
 rfb::IntParameter udpSize("udpSize", "UDP packet data size", 1296, 500, 1400);
+rfb::IntParameter udpFecOverhead("udpFecOverhead",
+	"Percentage of parity pieces to add to each UDP update. 0 to disable", 0, 0, 50);
 
 extern settings_t settings;
 
+/*
+ * Wire format
+ *
+ * Each update is split into pieces of udpSize bytes, each behind a header
+ * of five uint32_t: update id, piece index, piece count, hash, frame.
+ *
+ * With udpFecOverhead set, every group of G consecutive pieces is followed
+ * by one parity piece, the XOR of the group's pieces zero-padded to
+ * udpSize. Its index has PARITY_PIECE set, the rest being the group
+ * number, and its header carries two more uint32_t: the update's length
+ * and G. A client missing one piece of a group can rebuild it.
+ *
+ * Clients ask for anything else they lost over the data channel:
+ *   UDP_MSG_NACK:   type, update id, count, count piece indices
+ *   UDP_MSG_REPORT: type, pieces rebuilt from parity since the last report
+ */
+
+static const uint32_t PARITY_PIECE = 0x80000000;
+static const unsigned HDRLEN = sizeof(uint32_t) * 5;
+
+enum {
+	UDP_MSG_NACK = 0,
+	UDP_MSG_REPORT = 1
+};
+
+// Updates kept per client for resending
+static const unsigned HISTORY_UPDATES = 64;
+static const size_t HISTORY_BYTES = 4 * 1024 * 1024;
+
+// Who a client's NACKs are for
+static std::map<WuClient *, UdpStream *> streams;
+static pthread_mutex_t streamsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void gotClientMsg(WuClient *client, const uint8_t *msg, const int32_t len) {
+	uint32_t type;
+
+	if (len < (int32_t) sizeof(uint32_t)) {
+		vlog.error("Too short message from udp client");
+		return;
+	}
+	memcpy(&type, msg, sizeof(uint32_t));
+
+	pthread_mutex_lock(&streamsMutex);
+
+	std::map<WuClient *, UdpStream *>::iterator it = streams.find(client);
+	if (it == streams.end()) {
+		pthread_mutex_unlock(&streamsMutex);
+		return;
+	}
+
+	switch (type) {
+		case UDP_MSG_NACK:
+			it->second->gotNack(msg + sizeof(uint32_t), len - sizeof(uint32_t));
+		break;
+		case UDP_MSG_REPORT:
+			it->second->gotReport(msg + sizeof(uint32_t), len - sizeof(uint32_t));
+		break;
+		default:
+			vlog.error("Unknown message %u from udp client", type);
+		break;
+	}
+
+	pthread_mutex_unlock(&streamsMutex);
+}
+
 static void udperr(const char *msg, void *) {
 	vlog.error("%s", msg);
 }
@@ -83,8 +152,14 @@ void *udpserver(void *nport) {
 			break;
 			case WuEvent_ClientLeave:
 				vlog.info("client leave");
+				pthread_mutex_lock(&streamsMutex);
+				streams.erase(e.client);
+				pthread_mutex_unlock(&streamsMutex);
 				WuHostRemoveClient(host, e.client);
 			break;
+			case WuEvent_BinaryData:
+				gotClientMsg(e.client, e.data, e.length);
+			break;
 			default:
 				vlog.error("client sent data, this is unexpected");
 			break;
@@ -94,32 +169,99 @@ void *udpserver(void *nport) {
 	return NULL;
 }
 
-// Send one packet, split into N UDP-sized pieces
-static uint8_t udpsend(WuClient *client, const uint8_t *data, unsigned len, uint32_t *id,
-			const uint32_t *frame) {
+static uint32_t numPieces(const unsigned len) {
+	const uint32_t DATA_MAX = udpSize;
+	return (len / DATA_MAX) + ((len % DATA_MAX) ? 1 : 0);
+}
+
+static uint8_t sendPiece(WuClient *client, const uint8_t *data, const unsigned len,
+			const uint32_t id, const uint32_t i, const uint32_t pieces,
+			const uint32_t frame) {
 	const uint32_t DATA_MAX = udpSize;
 
-	uint8_t buf[1400 + sizeof(uint32_t) * 5];
-	const uint32_t pieces = (len / DATA_MAX) + ((len % DATA_MAX) ? 1 : 0);
+	uint8_t buf[1400 + HDRLEN];
+	const unsigned off = i * DATA_MAX;
+	const unsigned curlen = len - off > DATA_MAX ? DATA_MAX : len - off;
+	const uint32_t hash = XXH64(data + off, curlen, 0);
 
+	memcpy(buf, &id, sizeof(uint32_t));
+	memcpy(&buf[4], &i, sizeof(uint32_t));
+	memcpy(&buf[8], &pieces, sizeof(uint32_t));
+	memcpy(&buf[12], &hash, sizeof(uint32_t));
+	memcpy(&buf[16], &frame, sizeof(uint32_t));
+
+	memcpy(&buf[HDRLEN], data + off, curlen);
+
+	return WuHostSendBinary(host, client, buf, curlen + HDRLEN) < 0;
+}
+
+static uint8_t sendParity(WuClient *client, const uint8_t *data, const unsigned len,
+			const uint32_t id, const uint32_t group, const uint32_t groupSize,
+			const uint32_t pieces, const uint32_t frame) {
+	const uint32_t DATA_MAX = udpSize;
+
+	uint8_t buf[1400 + HDRLEN + sizeof(uint32_t) * 2];
+	uint8_t * const parity = &buf[HDRLEN + sizeof(uint32_t) * 2];
+	const uint32_t first = group * groupSize;
+	const uint32_t last = first + groupSize < pieces ? first + groupSize : pieces;
+	const uint32_t index = PARITY_PIECE | group;
 	uint32_t i;
 
-	for (i = 0; i < pieces; i++) {
-		const unsigned curlen = len > DATA_MAX ? DATA_MAX : len;
-		const uint32_t hash = XXH64(data, curlen, 0);
+	memset(parity, 0, DATA_MAX);
 
-		memcpy(buf, id, sizeof(uint32_t));
-		memcpy(&buf[4], &i, sizeof(uint32_t));
-		memcpy(&buf[8], &pieces, sizeof(uint32_t));
-		memcpy(&buf[12], &hash, sizeof(uint32_t));
-		memcpy(&buf[16], frame, sizeof(uint32_t));
+	for (i = first; i < last; i++) {
+		const uint8_t *src = data + i * DATA_MAX;
+		const unsigned curlen = len - i * DATA_MAX > DATA_MAX ? DATA_MAX :
+					len - i * DATA_MAX;
+		unsigned j;
 
-		memcpy(&buf[20], data, curlen);
-		data += curlen;
-		len -= curlen;
+		for (j = 0; j + sizeof(uint64_t) <= curlen; j += sizeof(uint64_t)) {
+			uint64_t a, b;
+			memcpy(&a, parity + j, sizeof(uint64_t));
+			memcpy(&b, src + j, sizeof(uint64_t));
+			a ^= b;
+			memcpy(parity + j, &a, sizeof(uint64_t));
+		}
+		for (; j < curlen; j++)
+			parity[j] ^= src[j];
+	}
+
+	const uint32_t hash = XXH64(parity, DATA_MAX, 0);
+
+	memcpy(buf, &id, sizeof(uint32_t));
+	memcpy(&buf[4], &index, sizeof(uint32_t));
+	memcpy(&buf[8], &pieces, sizeof(uint32_t));
+	memcpy(&buf[12], &hash, sizeof(uint32_t));
+	memcpy(&buf[16], &frame, sizeof(uint32_t));
+	memcpy(&buf[20], &len, sizeof(uint32_t));
+	memcpy(&buf[24], &groupSize, sizeof(uint32_t));
+
+	return WuHostSendBinary(host, client, buf,
+				DATA_MAX + HDRLEN + sizeof(uint32_t) * 2) < 0;
+}
 
-		if (WuHostSendBinary(host, client, buf, curlen + sizeof(uint32_t) * 5) < 0)
+// Send one packet, split into N UDP-sized pieces, plus parity if enabled
+static uint8_t udpsend(WuClient *client, const uint8_t *data, unsigned len, uint32_t *id,
+			const uint32_t *frame, UdpStats *stats) {
+	const uint32_t pieces = numPieces(len);
+	uint32_t groupSize = 0;
+	uint32_t i;
+
+	if (udpFecOverhead)
+		groupSize = (100 + udpFecOverhead / 2) / udpFecOverhead;
+
+	for (i = 0; i < pieces; i++) {
+		if (sendPiece(client, data, len, *id, i, pieces, *frame))
 			return 1;
+		stats->sent++;
+
+		// Parity follows each complete group, and the last partial one
+		if (groupSize && ((i + 1) % groupSize == 0 || i + 1 == pieces)) {
+			if (sendParity(client, data, len, *id, i / groupSize, groupSize,
+					pieces, *frame))
+				return 1;
+			stats->parity++;
+		}
 	}
 
 	(*id)++;
@@ -128,22 +270,58 @@ static uint8_t udpsend(WuClient *client, const uint8_t *data, unsigned len, uint
 }
 
 UdpStream::UdpStream(): OutStream(), client(NULL), total_len(0), id(0), failed(false),
-	                frame(0) {
+	                frame(0), historyBytes(0) {
 	ptr = data;
 	end = data + UDPSTREAM_BUFSIZE;
 
+	memset(&stats, 0, sizeof(UdpStats));
+	pthread_mutex_init(&historyMutex, NULL);
+
 	srand(time(NULL));
 }
 
+UdpStream::~UdpStream() {
+	pthread_mutex_lock(&streamsMutex);
+	if (client && streams.count(client) && streams[client] == this)
+		streams.erase(client);
+	pthread_mutex_unlock(&streamsMutex);
+
+	pthread_mutex_destroy(&historyMutex);
+}
+
+void UdpStream::setClient(WuClient *cli) {
+	pthread_mutex_lock(&streamsMutex);
+	if (client && streams.count(client) && streams[client] == this)
+		streams.erase(client);
+	client = cli;
+	if (client)
+		streams[client] = this;
+	pthread_mutex_unlock(&streamsMutex);
+}
+
 void UdpStream::flush() {
 	const unsigned len = ptr - data;
 	total_len += len;
 
+	rfb::TraceSpan span(rfb::TRACE_UDP_SEND, len);
+
 	if (client) {
-		if (udpsend(client, data, len, &id, &frame)) {
+		const uint32_t sentid = id;
+		UdpStats sent;
+		memset(&sent, 0, sizeof(UdpStats));
+
+		if (udpsend(client, data, len, &id, &frame, &sent)) {
 			vlog.error("Error sending udp, client gone?");
 			failed = true;
 		}
+
+		pthread_mutex_lock(&historyMutex);
+		stats.sent += sent.sent;
+		stats.parity += sent.parity;
+		pthread_mutex_unlock(&historyMutex);
+
+		if (id != sentid)
+			remember(data, len);
 	} else {
 		vlog.error("Tried to send udp without a client");
 	}
@@ -151,6 +329,96 @@ void UdpStream::flush() {
 	ptr = data;
 }
 
+// Keeps a copy of the update just sent, under the id it was sent as
+void UdpStream::remember(const uint8_t *buf, const unsigned len) {
+	pthread_mutex_lock(&historyMutex);
+
+	sentUpdate old;
+	while (history.size() >= HISTORY_UPDATES ||
+	       (!history.empty() && historyBytes + len > HISTORY_BYTES)) {
+		historyBytes -= history.front().data.size();
+		old.data.swap(history.front().data);
+		history.pop_front();
+	}
+
+	// Reuse the oldest buffer, to not allocate on every flush
+	history.push_back(sentUpdate());
+	sentUpdate &u = history.back();
+	u.id = id - 1;
+	u.frame = frame;
+	u.data.swap(old.data);
+	u.data.assign(buf, buf + len);
+	historyBytes += len;
+
+	pthread_mutex_unlock(&historyMutex);
+}
+
+void UdpStream::gotNack(const uint8_t *msg, const uint32_t len) {
+	uint32_t nackid, count, i;
+
+	if (len < sizeof(uint32_t) * 2)
+		return;
+	memcpy(&nackid, msg, sizeof(uint32_t));
+	memcpy(&count, msg + 4, sizeof(uint32_t));
+	if (count > (len - sizeof(uint32_t) * 2) / sizeof(uint32_t))
+		return;
+
+	pthread_mutex_lock(&historyMutex);
+
+	stats.lost += count;
+
+	std::deque<sentUpdate>::const_iterator it;
+	for (it = history.begin(); it != history.end(); it++) {
+		if (it->id == nackid)
+			break;
+	}
+
+	if (it == history.end()) {
+		// Too old, the next full frame has to fix it
+		stats.expired += count;
+		pthread_mutex_unlock(&historyMutex);
+		return;
+	}
+
+	const uint32_t pieces = numPieces(it->data.size());
+	for (i = 0; i < count; i++) {
+		uint32_t piece;
+		memcpy(&piece, msg + sizeof(uint32_t) * (2 + i), sizeof(uint32_t));
+		if (piece >= pieces)
+			continue;
+
+		if (sendPiece(client, it->data.data(), it->data.size(), it->id, piece,
+				pieces, it->frame))
+			break;
+		stats.resent++;
+	}
+
+	pthread_mutex_unlock(&historyMutex);
+}
+
+void UdpStream::gotReport(const uint8_t *msg, const uint32_t len) {
+	uint32_t recovered;
+
+	if (len < sizeof(uint32_t))
+		return;
+	memcpy(&recovered, msg, sizeof(uint32_t));
+
+	pthread_mutex_lock(&historyMutex);
+	stats.lost += recovered;
+	stats.recovered += recovered;
+	pthread_mutex_unlock(&historyMutex);
+}
+
+UdpStats UdpStream::getStats() {
+	UdpStats out;
+
+	pthread_mutex_lock(&historyMutex);
+	out = stats;
+	pthread_mutex_unlock(&historyMutex);
+
+	return out;
+}
+
 void UdpStream::overrun(size_t needed) {
 	vlog.error("Udp buffer overrun");
 	abort();
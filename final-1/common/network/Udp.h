@@ -19,7 +19,10 @@
 #ifndef __NETWORK_UDP_H__
 #define __NETWORK_UDP_H__
 
+#include <pthread.h>
 #include <stdint.h>
+#include <deque>
+#include <vector>
 #include <rdr/OutStream.h>
 
 void *udpserver(void *unused);
@@ -29,16 +32,24 @@ namespace network {
 
 	#define UDPSTREAM_BUFSIZE (1024 * 1024)
 
+	struct UdpStats {
+		uint32_t sent;		// data pieces
+		uint32_t parity;	// parity pieces
+		uint32_t lost;		// pieces the client missed
+		uint32_t recovered;	// lost pieces the client rebuilt from parity
+		uint32_t resent;	// pieces sent again on request
+		uint32_t expired;	// requested, but no longer kept
+	};
+
 	class UdpStream: public rdr::OutStream {
 		public:
 			UdpStream();
+			virtual ~UdpStream();
 			virtual void flush();
 			virtual size_t length() { return total_len; }
 			virtual void overrun(size_t needed);
 
-			void setClient(WuClient *cli) {
-				client = cli;
-			}
+			void setClient(WuClient *cli);
 
 			void setFrameNumber(const unsigned in) {
 				frame = in;
@@ -46,13 +57,32 @@ namespace network {
 
 			bool isFailed() const;
 			void clearFailed();
+
+			UdpStats getStats();
+
+			// Messages from the client, on the udp thread
+			void gotNack(const uint8_t *msg, const uint32_t len);
+			void gotReport(const uint8_t *msg, const uint32_t len);
 		private:
+			void remember(const uint8_t *buf, const unsigned len);
+
 			uint8_t data[UDPSTREAM_BUFSIZE];
 			WuClient *client;
 			size_t total_len;
 			uint32_t id;
 			bool failed;
 			uint32_t frame;
+
+			// Recent updates, for resending pieces the client lost
+			struct sentUpdate {
+				uint32_t id;
+				uint32_t frame;
+				std::vector<uint8_t> data;
+			};
+			std::deque<sentUpdate> history;
+			size_t historyBytes;
+			UdpStats stats;
+			pthread_mutex_t historyMutex;
 	};
 }
 
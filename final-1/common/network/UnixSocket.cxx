@@ -111,6 +111,7 @@ char* UnixSocket::getPeerEndpoint() {
 
 bool UnixSocket::cork(bool enable)
 {
+  outStream().cork(enable);
   return true;
 }
 
@@ -0,0 +1,242 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <openssl/err.h>
+
+#include <network/WebSocketInStream.h>
+#include <rdr/Exception.h>
+
+using namespace network;
+using namespace rdr;
+
+enum {
+  OPCODE_CONTINUATION = 0x0,
+  OPCODE_TEXT = 0x1,
+  OPCODE_BINARY = 0x2,
+  OPCODE_CLOSE = 0x8
+};
+
+WebSocketInStream::WebSocketInStream(int fd_, SSL* ssl_,
+                                     const void* data, size_t len)
+  : FdInStream(fd_), ssl(ssl_), early(NULL), earlyLen(len), earlyPos(0),
+    headerLen(0), headerNeed(2), payloadLeft(0), maskPos(0),
+    dataFrame(false), closed(false)
+{
+  if (len) {
+    early = new U8[len];
+    memcpy(early, data, len);
+  }
+}
+
+WebSocketInStream::~WebSocketInStream()
+{
+  delete [] early;
+}
+
+bool WebSocketInStream::fillBuffer(size_t maxSize, bool wait)
+{
+  while (true) {
+    size_t n;
+
+    if (closed)
+      throw EndOfStream();
+
+    n = readRaw((U8*)end, maxSize, wait);
+    if (n == 0)
+      return false;
+
+    // Frames are decoded in place, so the payload only gets copied
+    // once, when unmasking it
+    n = decode((U8*)end, n);
+    if (n) {
+      end += n;
+      return true;
+    }
+
+    // Only headers or control frames so far
+  }
+}
+
+size_t WebSocketInStream::readRaw(U8* buf, size_t len, bool wait)
+{
+  int n;
+
+  if (earlyPos < earlyLen) {
+    if (len > earlyLen - earlyPos)
+      len = earlyLen - earlyPos;
+    memcpy(buf, early + earlyPos, len);
+    earlyPos += len;
+    return len;
+  }
+
+  while (true) {
+    // TLS may already hold decrypted data the fd knows nothing about
+    if (!(ssl && SSL_pending(ssl)) && !waitReadable(wait))
+      return 0;
+
+    if (ssl) {
+      ERR_clear_error();
+      n = SSL_read(ssl, buf, len);
+      if (n > 0)
+        return n;
+
+      switch (SSL_get_error(ssl, n)) {
+      case SSL_ERROR_WANT_READ:
+      case SSL_ERROR_WANT_WRITE:
+        // Only part of a record has arrived
+        if (!wait)
+          return 0;
+        continue;
+      case SSL_ERROR_ZERO_RETURN:
+        throw EndOfStream();
+      case SSL_ERROR_SYSCALL:
+        if (n == 0 || errno == 0)
+          throw EndOfStream();
+        throw SystemException("read", errno);
+      default:
+        throw Exception("TLS read failed: %s",
+                        ERR_reason_error_string(ERR_peek_last_error()));
+      }
+    }
+
+    do {
+      n = ::recv(getFd(), (char*)buf, len, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0)
+      return n;
+    if (n == 0)
+      throw EndOfStream();
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      throw SystemException("read", errno);
+    if (!wait)
+      return 0;
+  }
+}
+
+static void unmask(U8* out, const U8* in, size_t len,
+                   const U8 mask[4], unsigned maskPos)
+{
+  U8 m[8];
+  U64 m64;
+  size_t i;
+
+  for (i = 0; i < 8; i++)
+    m[i] = mask[(maskPos + i) & 3];
+  memcpy(&m64, m, sizeof(m64));
+
+  // out never runs ahead of in, so going forwards is safe in place
+  for (i = 0; i + 8 <= len; i += 8) {
+    U64 v;
+    memcpy(&v, in + i, sizeof(v));
+    v ^= m64;
+    memcpy(out + i, &v, sizeof(v));
+  }
+  for (; i < len; i++)
+    out[i] = in[i] ^ m[i & 7];
+}
+
+//
+// decode() strips the frame headers from len raw bytes at buf and unmasks
+// the payload, compacting it to the start of buf. Frames may be split
+// anywhere across calls. Returns the number of payload bytes.
+//
+
+size_t WebSocketInStream::decode(U8* buf, size_t len)
+{
+  const U8* in = buf;
+  const U8* const inEnd = buf + len;
+  U8* out = buf;
+
+  while (in < inEnd) {
+    if (headerLen < headerNeed) {
+      while (in < inEnd && headerLen < headerNeed)
+        header[headerLen++] = *in++;
+      if (headerLen < headerNeed)
+        break;
+
+      if (headerLen == 2) {
+        const unsigned len7 = header[1] & 0x7f;
+
+        if (!(header[1] & 0x80))
+          throw Exception("Received unmasked websocket frame from client");
+
+        headerNeed = 2 + (len7 == 126 ? 2 : len7 == 127 ? 8 : 0) + 4;
+        continue;
+      }
+
+      const unsigned opcode = header[0] & 0x0f;
+      const unsigned len7 = header[1] & 0x7f;
+      unsigned i;
+
+      if (len7 == 126) {
+        payloadLeft = (header[2] << 8) | header[3];
+      } else if (len7 == 127) {
+        payloadLeft = 0;
+        for (i = 0; i < 8; i++)
+          payloadLeft = (payloadLeft << 8) | header[2 + i];
+      } else {
+        payloadLeft = len7;
+      }
+      memcpy(mask, header + headerLen - 4, 4);
+      maskPos = 0;
+
+      switch (opcode) {
+      case OPCODE_CONTINUATION:
+      case OPCODE_BINARY:
+        dataFrame = true;
+        break;
+      case OPCODE_TEXT:
+        throw Exception("Text websocket frames are not supported");
+      case OPCODE_CLOSE:
+        closed = true;
+        dataFrame = false;
+        break;
+      default:
+        // Ping and pong, nothing to do with the RFB stream
+        dataFrame = false;
+      }
+    }
+
+    size_t n = inEnd - in;
+    if (n > payloadLeft)
+      n = payloadLeft;
+
+    if (dataFrame) {
+      unmask(out, in, n, mask, maskPos);
+      out += n;
+    }
+    in += n;
+    payloadLeft -= n;
+    maskPos = (maskPos + n) & 3;
+
+    if (!payloadLeft) {
+      headerLen = 0;
+      headerNeed = 2;
+    }
+  }
+
+  return out - buf;
+}
@@ -0,0 +1,63 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+//
+// WebSocketInStream reads the payload of RFC 6455 frames straight off the
+// client's TCP socket, optionally through TLS.
+//
+
+#ifndef __NETWORK_WEBSOCKETINSTREAM_H__
+#define __NETWORK_WEBSOCKETINSTREAM_H__
+
+#include <openssl/ssl.h>
+#include <rdr/FdInStream.h>
+
+namespace network {
+
+  class WebSocketInStream : public rdr::FdInStream {
+
+  public:
+    // data holds whatever the handshake read past the request. The ssl
+    // object stays owned by the matching WebSocketOutStream.
+    WebSocketInStream(int fd, SSL* ssl, const void* data, size_t len);
+    virtual ~WebSocketInStream();
+
+  private:
+    virtual bool fillBuffer(size_t maxSize, bool wait);
+
+    size_t readRaw(rdr::U8* buf, size_t len, bool wait);
+    size_t decode(rdr::U8* buf, size_t len);
+
+    SSL* ssl;
+
+    rdr::U8* early;
+    size_t earlyLen, earlyPos;
+
+    // Frame currently being parsed
+    rdr::U8 header[14];
+    size_t headerLen, headerNeed;
+    rdr::U64 payloadLeft;
+    rdr::U8 mask[4];
+    unsigned maskPos;
+    bool dataFrame;
+    bool closed;
+  };
+
+}
+
+#endif
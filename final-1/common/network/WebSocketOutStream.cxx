@@ -0,0 +1,253 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <openssl/err.h>
+
+#include <network/WebSocketOutStream.h>
+#include <rdr/Exception.h>
+
+using namespace network;
+using namespace rdr;
+
+static const U8 OPCODE_BINARY = 0x2;
+
+// Most payload pieces handed to a single sendmsg()
+static const int MAX_IOV = 64;
+
+WebSocketOutStream::WebSocketOutStream(int fd_, SSL* ssl_, SSL_CTX* sslctx_)
+  : FdOutStream(fd_), ssl(ssl_), sslctx(sslctx_), ktls(false),
+    headerLen(0), headerSent(0), frameLeft(0), tlsLen(0), tlsStaged(false)
+{
+  // overrun() may move the buffered data while a write is pending
+  if (ssl)
+    SSL_set_mode(ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+#ifdef SSL_OP_ENABLE_KTLS
+  // Plain writes become TLS records in the kernel, header and payload
+  // go out straight from our buffers
+  if (ssl && BIO_get_ktls_send(SSL_get_wbio(ssl)))
+    ktls = true;
+#endif
+}
+
+WebSocketOutStream::~WebSocketOutStream()
+{
+  // Must happen here, FdOutStream would send it unframed
+  try {
+    while (bufferUsage())
+      flushBuffer(true);
+  } catch (Exception&) {
+    advance(bufferUsage());
+  }
+
+  if (ssl)
+    SSL_free(ssl);
+  if (sslctx)
+    SSL_CTX_free(sslctx);
+}
+
+bool WebSocketOutStream::flushBuffer(bool wait)
+{
+  if (!frameLeft) {
+    // Everything buffered so far goes out as one frame
+    const size_t len = bufferUsage();
+
+    header[0] = 0x80 | OPCODE_BINARY;
+    if (len < 126) {
+      header[1] = len;
+      headerLen = 2;
+    } else if (len < 65536) {
+      header[1] = 126;
+      header[2] = len >> 8;
+      header[3] = len;
+      headerLen = 4;
+    } else {
+      header[1] = 127;
+      for (unsigned i = 0; i < 8; i++)
+        header[2 + i] = (U64) len >> (56 - i * 8);
+      headerLen = 10;
+    }
+
+    headerSent = 0;
+    frameLeft = len;
+  }
+
+  size_t n = writeFrame((blocking || wait) ? timeoutms : 0);
+
+  // Timeout?
+  if (n == 0) {
+    // If non-blocking then we're done here
+    if (!blocking && !wait)
+      return false;
+
+    throw TimedOut();
+  }
+
+  return true;
+}
+
+//
+// writeFrame() sends more of the current frame, header first. Like
+// FdOutStream::writeWithTimeout() it writes straight away and only waits
+// for the fd to become writable when that would block, returning 0 if the
+// timeout expires first.
+//
+
+size_t WebSocketOutStream::writeFrame(int timeoutms)
+{
+  bool waited = false;
+
+  while (true) {
+    ssize_t n;
+
+    n = (ssl && !ktls) ? writeTLS() : writePlain();
+    if (n > 0) {
+      gettimeofday(&lastWrite, NULL);
+      return n;
+    }
+
+    // Writable, but TLS or the kernel still said no
+    if (waited && timeoutms == 0)
+      return 0;
+
+    if (!waitWritable(timeoutms))
+      return 0;
+    waited = true;
+  }
+}
+
+ssize_t WebSocketOutStream::writePlain()
+{
+  struct iovec iov[1 + MAX_IOV];
+  struct msghdr msg;
+  size_t limit;
+  int flags;
+  ssize_t n;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+
+  flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+  limit = frameLeft;
+
+  // The header is rebuilt for every frame, so it has to be copied. Kernel
+  // TLS refuses MSG_ZEROCOPY.
+  if (headerSent < headerLen) {
+    iov[msg.msg_iovlen].iov_base = header + headerSent;
+    iov[msg.msg_iovlen].iov_len = headerLen - headerSent;
+    msg.msg_iovlen++;
+  } else if (!ssl) {
+    flags |= zeroCopyFlags(limit);
+  }
+  msg.msg_iovlen += gather(iov + msg.msg_iovlen, MAX_IOV, limit);
+
+  while (true) {
+    do {
+      syscalls++;
+      n = sendmsg(fd, &msg, flags);
+    } while (n < 0 && errno == EINTR);
+
+#ifdef MSG_ZEROCOPY
+    // Out of memory for pinning pages, so just copy this time
+    if (n < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+      flags &= ~MSG_ZEROCOPY;
+      continue;
+    }
+#endif
+    break;
+  }
+
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    throw SystemException("write", errno);
+  }
+
+  sentZeroCopy(flags);
+  consume(n);
+
+  return n;
+}
+
+ssize_t WebSocketOutStream::writeTLS()
+{
+  struct iovec iov;
+  int n;
+
+  // SSL_write() takes one piece at a time
+  gather(&iov, 1, frameLeft);
+
+  if (!tlsLen) {
+    if (headerSent < headerLen) {
+      const size_t hlen = headerLen - headerSent;
+      size_t plen = sizeof(staging) - hlen;
+      if (plen > iov.iov_len)
+        plen = iov.iov_len;
+
+      memcpy(staging, header + headerSent, hlen);
+      memcpy(staging + hlen, iov.iov_base, plen);
+      tlsLen = hlen + plen;
+      tlsStaged = true;
+    } else {
+      tlsLen = iov.iov_len;
+      tlsStaged = false;
+    }
+  }
+
+  ERR_clear_error();
+  syscalls++;
+  n = SSL_write(ssl, tlsStaged ? staging : iov.iov_base, tlsLen);
+  if (n <= 0) {
+    switch (SSL_get_error(ssl, n)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      return 0;
+    case SSL_ERROR_SYSCALL:
+      throw SystemException("write", errno);
+    default:
+      throw Exception("TLS write failed: %s",
+                      ERR_reason_error_string(ERR_peek_last_error()));
+    }
+  }
+
+  tlsLen = 0;
+  consume(n);
+
+  return n;
+}
+
+void WebSocketOutStream::consume(size_t n)
+{
+  size_t hlen = headerLen - headerSent;
+  if (hlen > n)
+    hlen = n;
+
+  headerSent += hlen;
+  n -= hlen;
+
+  advance(n);
+  frameLeft -= n;
+}
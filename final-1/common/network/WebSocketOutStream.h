@@ -0,0 +1,69 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+//
+// WebSocketOutStream sends everything written to it as binary RFC 6455
+// frames, straight onto the client's TCP socket, optionally through TLS.
+// Each flush becomes one frame. The payload is sent from the stream's own
+// buffers, only the frame header is added in front of it.
+//
+
+#ifndef __NETWORK_WEBSOCKETOUTSTREAM_H__
+#define __NETWORK_WEBSOCKETOUTSTREAM_H__
+
+#include <openssl/ssl.h>
+#include <rdr/FdOutStream.h>
+
+namespace network {
+
+  class WebSocketOutStream : public rdr::FdOutStream {
+
+  public:
+    // Takes ownership of ssl and sslctx, which may be NULL
+    WebSocketOutStream(int fd, SSL* ssl, SSL_CTX* sslctx);
+    virtual ~WebSocketOutStream();
+
+  private:
+    virtual bool flushBuffer(bool wait);
+
+    size_t writeFrame(int timeoutms);
+    ssize_t writePlain();
+    ssize_t writeTLS();
+    void consume(size_t n);
+
+    SSL* ssl;
+    SSL_CTX* sslctx;
+
+    // The kernel encrypts, so writes skip SSL_write()
+    bool ktls;
+
+    // Frame currently being sent
+    rdr::U8 header[10];
+    size_t headerLen, headerSent;
+    size_t frameLeft;
+
+    // SSL_write() must be retried with the same data after WANT_WRITE.
+    // The header goes out in one record with the start of the payload.
+    rdr::U8 staging[16384];
+    size_t tlsLen;
+    bool tlsStaged;
+  };
+
+}
+
+#endif
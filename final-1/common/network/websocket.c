@@ -21,8 +21,11 @@
 #include <inttypes.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -37,6 +40,7 @@
 #include <openssl/sha.h> /* sha1 hash */
 #include "websocket.h"
 #include "jsonescape.h"
+#include <network/AssetCache.h>
 #include <network/Blacklist.h>
 
 /*
@@ -44,7 +48,6 @@
  *
  *   Warning: not thread safe
  */
-int pipe_error = 0;
 settings_t settings;
 
 extern int wakeuppipe[2];
@@ -52,13 +55,6 @@ extern int wakeuppipe[2];
 extern char *extra_headers;
 extern unsigned extra_headers_len;
 
-void traffic(const char * token) {
-    /*if ((settings.verbose) && (! settings.daemon)) {
-        fprintf(stdout, "%s", token);
-        fflush(stdout);
-    }*/
-}
-
 void error(char *msg)
 {
     perror(msg);
@@ -214,21 +210,86 @@ static void percent_encode(const char *src, char *dst) {
  * SSL Wrapper Code
  */
 
+/*
+ * A timeout on a blocking socket shows up as if it would block. Shutting
+ * it down makes everything after fail at once, rather than each call
+ * waiting out the timeout again.
+ */
+static ssize_t ws_check_stall(ws_ctx_t *ctx, ssize_t ret) {
+    if (ret <= 0 && ctx->stall_timeout && ws_would_block(ctx, ret)) {
+        handler_emsg("Client stalled, dropping it\n");
+        shutdown(ctx->sockfd, SHUT_RDWR);
+    }
+
+    return ret;
+}
+
 ssize_t ws_recv(ws_ctx_t *ctx, void *buf, size_t len) {
     if (ctx->ssl) {
         //handler_msg("SSL recv\n");
-        return SSL_read(ctx->ssl, buf, len);
+        return ws_check_stall(ctx, SSL_read(ctx->ssl, buf, len));
     } else {
-        return recv(ctx->sockfd, buf, len, 0);
+        return ws_check_stall(ctx, recv(ctx->sockfd, buf, len, 0));
     }
 }
 
 ssize_t ws_send(ws_ctx_t *ctx, const void *buf, size_t len) {
     if (ctx->ssl) {
         //handler_msg("SSL send\n");
-        return SSL_write(ctx->ssl, buf, len);
+        return ws_check_stall(ctx, SSL_write(ctx->ssl, buf, len));
     } else {
-        return send(ctx->sockfd, buf, len, 0);
+        return ws_check_stall(ctx, send(ctx->sockfd, buf, len, 0));
+    }
+}
+
+/*
+ * Sends len bytes of the file from offset off. Without TLS, or when the
+ * kernel does the TLS, the pages go out without passing through us.
+ * Returns the bytes sent, or -1.
+ */
+ssize_t ws_sendfile(ws_ctx_t *ctx, int fd, off_t off, size_t len) {
+    char buf[WS_MAX_BUF_SIZE];
+    size_t sent = 0;
+    ssize_t ret;
+
+    while (sent < len) {
+        if (!ctx->ssl) {
+            ret = ws_check_stall(ctx, sendfile(ctx->sockfd, fd, &off, len - sent));
+#ifdef SSL_OP_ENABLE_KTLS
+        } else if (BIO_get_ktls_send(SSL_get_wbio(ctx->ssl))) {
+            ret = ws_check_stall(ctx, SSL_sendfile(ctx->ssl, fd, off, len - sent, 0));
+            if (ret > 0)
+                off += ret;
+#endif
+        } else {
+            ret = pread(fd, buf, len - sent < sizeof(buf) ? len - sent : sizeof(buf), off);
+            if (ret > 0) {
+                ret = ws_send(ctx, buf, ret);
+                if (ret > 0)
+                    off += ret;
+            }
+        }
+
+        if (ret < 0 && !ctx->ssl && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        sent += ret;
+    }
+
+    return sent;
+}
+
+/*
+ * Whether a failed ws_recv()/ws_send() on a non-blocking socket only
+ * needs to be retried once the socket is ready again.
+ */
+int ws_would_block(ws_ctx_t *ctx, ssize_t ret) {
+    if (ctx->ssl) {
+        const int err = SSL_get_error(ctx->ssl, ret);
+        return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE;
+    } else {
+        return ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
     }
 }
 
@@ -237,15 +298,6 @@ ws_ctx_t *alloc_ws_ctx() {
     if (! (ctx = calloc(sizeof(ws_ctx_t), 1)) )
         { fatal("malloc()"); }
 
-    if (! (ctx->cin_buf = malloc(BUFSIZE)) )
-        { fatal("malloc of cin_buf"); }
-    if (! (ctx->cout_buf = malloc(BUFSIZE)) )
-        { fatal("malloc of cout_buf"); }
-    if (! (ctx->tin_buf = malloc(BUFSIZE)) )
-        { fatal("malloc of tin_buf"); }
-    if (! (ctx->tout_buf = malloc(BUFSIZE)) )
-        { fatal("malloc of tout_buf"); }
-
     ctx->headers = malloc(sizeof(headers_t));
     ctx->ssl = NULL;
     ctx->ssl_ctx = NULL;
@@ -253,10 +305,6 @@ ws_ctx_t *alloc_ws_ctx() {
 }
 
 void free_ws_ctx(ws_ctx_t *ctx) {
-    free(ctx->cin_buf);
-    free(ctx->cout_buf);
-    free(ctx->tin_buf);
-    free(ctx->tout_buf);
     free(ctx->headers);
     free(ctx);
 }
@@ -266,53 +314,173 @@ ws_ctx_t *ws_socket(ws_ctx_t *ctx, int socket) {
     return ctx;
 }
 
-ws_ctx_t *ws_socket_ssl(ws_ctx_t *ctx, int socket, const char * certfile, const char * keyfile) {
-    int ret;
-    char msg[1024];
-    const char * use_keyfile;
-    ws_socket(ctx, socket);
+/*
+ * One TLS context serves every connection, so the key and certificate
+ * are parsed once, and clients can resume their sessions by id or by
+ * ticket. It is reloaded when the files change. The ticket keys carry
+ * over, so sessions from before the reload still resume.
+ */
 
-    if (keyfile && (keyfile[0] != '\0')) {
-        // Separate key file
-        use_keyfile = keyfile;
-    } else {
-        // Combined key and cert file
-        use_keyfile = certfile;
-    }
+#define WS_TLS_CHECK_MS 1000
+#define WS_TLS_SESSION_CACHE 1024
+#define WS_TLS_SESSION_TIMEOUT 3600
+
+static pthread_mutex_t tls_mutex = PTHREAD_MUTEX_INITIALIZER;
+static SSL_CTX *tls_ctx;
+static struct stat tls_cert_st, tls_key_st;
+static uint64_t tls_checked;
+static uint64_t tls_handshakes, tls_resumed, tls_reloads, tls_kernel;
+
+static uint64_t now_ms();
+
+static uint8_t tls_file_changed(const char *file, const struct stat *old,
+                                struct stat *cur) {
+    if (stat(file, cur))
+        memset(cur, 0, sizeof(struct stat));
+
+    return cur->st_ino != old->st_ino || cur->st_dev != old->st_dev ||
+           cur->st_size != old->st_size ||
+           cur->st_mtim.tv_sec != old->st_mtim.tv_sec ||
+           cur->st_mtim.tv_nsec != old->st_mtim.tv_nsec;
+}
 
-    ctx->ssl_ctx = SSL_CTX_new(SSLv23_server_method());
-    if (ctx->ssl_ctx == NULL) {
+static SSL_CTX *tls_ctx_load(const char *certfile, const char *keyfile,
+                             SSL_CTX *old) {
+    unsigned char keys[80];
+    SSL_CTX *ctx;
+
+    ctx = SSL_CTX_new(SSLv23_server_method());
+    if (ctx == NULL) {
         ERR_print_errors_fp(stderr);
-        fatal("Failed to configure SSL context");
+        return NULL;
     }
 
-    SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
 
-    if (SSL_CTX_use_PrivateKey_file(ctx->ssl_ctx, use_keyfile,
-                                    SSL_FILETYPE_PEM) <= 0) {
-        sprintf(msg, "Unable to load private key file %s\n", use_keyfile);
-        fatal(msg);
+#ifdef SSL_OP_ENABLE_KTLS
+    // Have the kernel do the record encryption once the keys are known,
+    // where the kernel and cipher allow it
+    if (settings.ktls)
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+    if (SSL_CTX_use_PrivateKey_file(ctx, keyfile, SSL_FILETYPE_PEM) <= 0) {
+        handler_emsg("Unable to load private key file %s\n", keyfile);
+        SSL_CTX_free(ctx);
+        return NULL;
     }
 
-    if (SSL_CTX_use_certificate_chain_file(ctx->ssl_ctx, certfile) <= 0) {
-        sprintf(msg, "Unable to load certificate file %s\n", certfile);
-        fatal(msg);
+    if (SSL_CTX_use_certificate_chain_file(ctx, certfile) <= 0) {
+        handler_emsg("Unable to load certificate file %s\n", certfile);
+        SSL_CTX_free(ctx);
+        return NULL;
     }
 
-//    if (SSL_CTX_set_cipher_list(ctx->ssl_ctx, "DEFAULT") != 1) {
+//    if (SSL_CTX_set_cipher_list(ctx, "DEFAULT") != 1) {
 //        sprintf(msg, "Unable to set cipher\n");
 //        fatal(msg);
 //    }
 
-    // Associate socket and ssl object
-    ctx->ssl = SSL_new(ctx->ssl_ctx);
-    SSL_set_fd(ctx->ssl, socket);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *) "KasmVNC", 7);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, WS_TLS_SESSION_CACHE);
+    SSL_CTX_set_timeout(ctx, WS_TLS_SESSION_TIMEOUT);
 
-    ret = SSL_accept(ctx->ssl);
-    if (ret < 0) {
-        ERR_print_errors_fp(stderr);
-        return NULL;
+#ifdef TLS1_3_VERSION
+    // TLS 1.3 resumption, but without early data. It could be replayed,
+    // and not every request is a harmless GET.
+    SSL_CTX_set_max_early_data(ctx, 0);
+#endif
+
+    if (old && SSL_CTX_get_tlsext_ticket_keys(old, keys, sizeof(keys)) == 1)
+        SSL_CTX_set_tlsext_ticket_keys(ctx, keys, sizeof(keys));
+
+    return ctx;
+}
+
+// Loads the context, or reloads it if the files changed. Must be called
+// with tls_mutex held.
+static void tls_ctx_check(const char *certfile, const char *keyfile) {
+    struct stat cert_st, key_st;
+    const uint64_t now = now_ms();
+    SSL_CTX *fresh;
+    uint8_t changed;
+
+    if (tls_ctx && now - tls_checked < WS_TLS_CHECK_MS)
+        return;
+    tls_checked = now;
+
+    changed = tls_file_changed(certfile, &tls_cert_st, &cert_st);
+    changed |= tls_file_changed(keyfile, &tls_key_st, &key_st);
+    if (tls_ctx && !changed)
+        return;
+
+    // A failed reload keeps the old one, the files may be half written
+    fresh = tls_ctx_load(certfile, keyfile, tls_ctx);
+    if (!fresh)
+        return;
+
+    if (tls_ctx) {
+        SSL_CTX_free(tls_ctx);
+        tls_reloads++;
+        handler_msg("Reloaded the TLS certificate\n");
+    }
+
+    tls_ctx = fresh;
+    tls_cert_st = cert_st;
+    tls_key_st = key_st;
+}
+
+static const char *tls_keyfile(const char *certfile, const char *keyfile) {
+    if (keyfile && (keyfile[0] != '\0')) {
+        // Separate key file
+        return keyfile;
+    } else {
+        // Combined key and cert file
+        return certfile;
     }
+}
+
+// Load the certificate up front, instead of on the first TLS client
+static void tls_preload() {
+    if (!settings.cert || access(settings.cert, R_OK) != 0)
+        return;
+
+    pthread_mutex_lock(&tls_mutex);
+    tls_ctx_check(settings.cert, tls_keyfile(settings.cert, settings.key));
+    pthread_mutex_unlock(&tls_mutex);
+}
+
+static void tls_count_handshake(SSL *ssl) {
+    pthread_mutex_lock(&tls_mutex);
+    tls_handshakes++;
+    if (SSL_session_reused(ssl))
+        tls_resumed++;
+#ifdef SSL_OP_ENABLE_KTLS
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)))
+        tls_kernel++;
+#endif
+    pthread_mutex_unlock(&tls_mutex);
+}
+
+ws_ctx_t *ws_socket_ssl(ws_ctx_t *ctx, int socket, const char * certfile, const char * keyfile) {
+    ws_socket(ctx, socket);
+
+    pthread_mutex_lock(&tls_mutex);
+    tls_ctx_check(certfile, tls_keyfile(certfile, keyfile));
+    if (tls_ctx)
+        SSL_CTX_up_ref(tls_ctx);
+    ctx->ssl_ctx = tls_ctx;
+    pthread_mutex_unlock(&tls_mutex);
+
+    if (ctx->ssl_ctx == NULL)
+        fatal("Failed to configure SSL context");
+
+    // Associate socket and ssl object. The handshake itself is driven
+    // by the event loop, as the socket is non-blocking.
+    ctx->ssl = SSL_new(ctx->ssl_ctx);
+    SSL_set_fd(ctx->ssl, socket);
+    SSL_set_accept_state(ctx->ssl);
 
     return ctx;
 }
@@ -399,232 +567,6 @@ int ws_b64_pton(const char * const src, unsigned char * dst, size_t dstlen) {
     return len;
 }
 
-/* ------------------------------------------------------- */
-
-
-int encode_hixie(u_char const *src, size_t srclength,
-                 char *target, size_t targsize) {
-    int sz = 0, len = 0;
-    target[sz++] = '\x00';
-    len = ws_b64_ntop(src, srclength, target+sz, targsize-sz);
-    if (len < 0) {
-        return len;
-    }
-    sz += len;
-    target[sz++] = '\xff';
-    return sz;
-}
-
-int decode_hixie(char *src, size_t srclength,
-                 u_char *target, size_t targsize,
-                 unsigned int *opcode, unsigned int *left) {
-    char *start, *end, cntstr[4];
-    int len, framecount = 0, retlen = 0;
-    if ((src[0] != '\x00') || (src[srclength-1] != '\xff')) {
-        handler_emsg("WebSocket framing error\n");
-        return -1;
-    }
-    *left = srclength;
-
-    if (srclength == 2 &&
-        (src[0] == '\xff') &&
-        (src[1] == '\x00')) {
-        // client sent orderly close frame
-        *opcode = 0x8; // Close frame
-        return 0;
-    }
-    *opcode = 0x1; // Text frame
-
-    start = src+1; // Skip '\x00' start
-    do {
-        /* We may have more than one frame */
-        end = (char *)memchr(start, '\xff', srclength);
-        *end = '\x00';
-        len = ws_b64_pton(start, target+retlen, targsize-retlen);
-        if (len < 0) {
-            return len;
-        }
-        retlen += len;
-        start = end + 2; // Skip '\xff' end and '\x00' start
-        framecount++;
-    } while (end < (src+srclength-1));
-    if (framecount > 1) {
-        snprintf(cntstr, 3, "%d", framecount);
-        traffic(cntstr);
-    }
-    *left = 0;
-    return retlen;
-}
-
-int encode_hybi(u_char const *src, size_t srclength,
-                char *target, size_t targsize, unsigned int opcode)
-{
-    unsigned long long payload_offset = 2;
-    int len = 0;
-
-    if (opcode != OPCODE_TEXT && opcode != OPCODE_BINARY) {
-        handler_emsg("Invalid opcode. Opcode must be 0x01 for text mode, or 0x02 for binary mode.\n");
-        return -1;
-    }
-
-    target[0] = (char)((opcode & 0x0F) | 0x80);
-
-    if ((int)srclength <= 0) {
-        return 0;
-    }
-
-    if (opcode & OPCODE_TEXT) {
-        len = ((srclength - 1) / 3) * 4 + 4;
-    } else {
-        len = srclength;
-    }
-
-    if (len <= 125) {
-        target[1] = (char) len;
-        payload_offset = 2;
-    } else if ((len > 125) && (len < 65536)) {
-        target[1] = (char) 126;
-        *(u_short*)&(target[2]) = htons(len);
-        payload_offset = 4;
-    } else {
-        handler_emsg("Sending frames larger than 65535 bytes not supported\n");
-        return -1;
-        //target[1] = (char) 127;
-        // *(u_long*)&(target[2]) = htonl(b64_sz);
-        //payload_offset = 10;
-    }
-
-    if (opcode & OPCODE_TEXT) {
-        len = ws_b64_ntop(src, srclength, target+payload_offset, targsize-payload_offset);
-    } else {
-        memcpy(target+payload_offset, src, srclength);
-        len = srclength;
-    }
-
-    if (len < 0) {
-        return len;
-    }
-
-    return len + payload_offset;
-}
-
-int decode_hybi(unsigned char *src, size_t srclength,
-                u_char *target, size_t targsize,
-                unsigned int *opcode, unsigned int *left)
-{
-    unsigned char *frame, *mask, *payload, save_char;
-    char cntstr[4];
-    int masked = 0;
-    int i = 0, len, framecount = 0;
-    size_t remaining = 0;
-    unsigned int target_offset = 0, hdr_length = 0, payload_length = 0;
-
-    *left = srclength;
-    frame = src;
-
-    //printf("Deocde new frame\n");
-    while (1) {
-        // Need at least two bytes of the header
-        // Find beginning of next frame. First time hdr_length, masked and
-        // payload_length are zero
-        frame += hdr_length + 4*masked + payload_length;
-        //printf("frame[0..3]: 0x%x 0x%x 0x%x 0x%x (tot: %d)\n",
-        //       (unsigned char) frame[0],
-        //       (unsigned char) frame[1],
-        //       (unsigned char) frame[2],
-        //       (unsigned char) frame[3], srclength);
-
-        if (frame > src + srclength) {
-            //printf("Truncated frame from client, need %d more bytes\n", frame - (src + srclength) );
-            break;
-        }
-        remaining = (src + srclength) - frame;
-        if (remaining < 2) {
-            //printf("Truncated frame header from client\n");
-            break;
-        }
-        framecount ++;
-
-        *opcode = frame[0] & 0x0f;
-        masked = (frame[1] & 0x80) >> 7;
-
-        if (*opcode == 0x8) {
-            // client sent orderly close frame
-            break;
-        }
-
-        payload_length = frame[1] & 0x7f;
-        if (payload_length < 126) {
-            hdr_length = 2;
-            //frame += 2 * sizeof(char);
-        } else if (payload_length == 126) {
-            payload_length = (frame[2] << 8) + frame[3];
-            hdr_length = 4;
-        } else {
-            handler_emsg("Receiving frames larger than 65535 bytes not supported\n");
-            return -1;
-        }
-        if ((hdr_length + 4*masked + payload_length) > remaining) {
-            continue;
-        }
-        //printf("    payload_length: %u, raw remaining: %u\n", payload_length, remaining);
-        payload = frame + hdr_length + 4*masked;
-
-        if (*opcode != OPCODE_TEXT && *opcode != OPCODE_BINARY) {
-            handler_msg("Ignoring non-data frame, opcode 0x%x\n", *opcode);
-            continue;
-        }
-
-        if (payload_length == 0) {
-            handler_msg("Ignoring empty frame\n");
-            continue;
-        }
-
-        if ((payload_length > 0) && (!masked)) {
-            handler_emsg("Received unmasked payload from client\n");
-            return -1;
-        }
-
-        // Terminate with a null for base64 decode
-        save_char = payload[payload_length];
-        payload[payload_length] = '\0';
-
-        // unmask the data
-        mask = payload - 4;
-        for (i = 0; i < payload_length; i++) {
-            payload[i] ^= mask[i%4];
-        }
-
-        if (*opcode & OPCODE_TEXT) {
-            // base64 decode the data
-            len = ws_b64_pton((const char*)payload, target+target_offset, targsize);
-        } else {
-            memcpy(target+target_offset, payload, payload_length);
-            len = payload_length;
-        }
-
-        // Restore the first character of the next frame
-        payload[payload_length] = save_char;
-        if (len < 0) {
-            handler_emsg("Base64 decode error code %d", len);
-            return len;
-        }
-        target_offset += len;
-
-        //printf("    len %d, raw %s\n", len, frame);
-    }
-
-    if (framecount > 1) {
-        snprintf(cntstr, 3, "%d", framecount);
-        traffic(cntstr);
-    }
-
-    *left = remaining;
-    return target_offset;
-}
-
-
-
 int parse_handshake(ws_ctx_t *ws_ctx, char *handshake) {
     char *start, *end;
     headers_t *headers = ws_ctx->headers;
@@ -732,41 +674,6 @@ int parse_handshake(ws_ctx_t *ws_ctx, char *handshake) {
     return 1;
 }
 
-int parse_hixie76_key(char * key) {
-    unsigned long i, spaces = 0, num = 0;
-    for (i=0; i < strlen(key); i++) {
-        if (key[i] == ' ') {
-            spaces += 1;
-        }
-        if ((key[i] >= 48) && (key[i] <= 57)) {
-            num = num * 10 + (key[i] - 48);
-        }
-    }
-    return num / spaces;
-}
-
-int gen_md5(headers_t *headers, char *target) {
-    unsigned long key1 = parse_hixie76_key(headers->key1);
-    unsigned long key2 = parse_hixie76_key(headers->key2);
-    char *key3 = headers->key3;
-
-    MD5_CTX c;
-    char in[HIXIE_MD5_DIGEST_LENGTH] = {
-        key1 >> 24, key1 >> 16, key1 >> 8, key1,
-        key2 >> 24, key2 >> 16, key2 >> 8, key2,
-        key3[0], key3[1], key3[2], key3[3],
-        key3[4], key3[5], key3[6], key3[7]
-    };
-
-    MD5_Init(&c);
-    MD5_Update(&c, (void *)in, sizeof in);
-    MD5_Final((void *)target, &c);
-
-    target[HIXIE_MD5_DIGEST_LENGTH] = '\0';
-
-    return 1;
-}
-
 static void gen_sha1(headers_t *headers, char *target) {
     SHA_CTX c;
     unsigned char hash[SHA_DIGEST_LENGTH];
@@ -895,6 +802,57 @@ static void dirlisting(ws_ctx_t *ws_ctx, const char fullpath[], const char path[
     weblog(200, wsthread_handler_id, 0, origip, ip, user, 1, path, totallen);
 }
 
+// Cached files are revalidated on every use, which is cheap with ETags
+static void servecached(ws_ctx_t *ws_ctx, const struct asset_t *asset,
+                        const char *in, const char path[],
+                        const char * const user, const char * const ip,
+                        const char * const origip) {
+    char buf[WS_MAX_BUF_SIZE], encoding[64] = "";
+
+    if (ac_isNotModified(asset, in)) {
+        sprintf(buf, "HTTP/1.1 304 Not Modified\r\n"
+                     "Server: KasmVNC/4.0\r\n"
+                     "Connection: close\r\n"
+                     "ETag: %s\r\n"
+                     "Last-Modified: %s\r\n"
+                     "Cache-Control: no-cache\r\n"
+                     "Vary: Accept-Encoding\r\n"
+                     "%s"
+                     "\r\n",
+                     asset->etag, asset->lastmod, extra_headers ? extra_headers : "");
+        ws_send(ws_ctx, buf, strlen(buf));
+        weblog(304, wsthread_handler_id, 0, origip, ip, user, 1, path, strlen(buf));
+        return;
+    }
+
+    if (asset->encoding)
+        sprintf(encoding, "Content-Encoding: %s\r\n", asset->encoding);
+
+    sprintf(buf, "HTTP/1.1 200 OK\r\n"
+                 "Server: KasmVNC/4.0\r\n"
+                 "Connection: close\r\n"
+                 "Content-type: %s\r\n"
+                 "Content-length: %" PRIu64 "\r\n"
+                 "%s"
+                 "ETag: %s\r\n"
+                 "Last-Modified: %s\r\n"
+                 "Cache-Control: no-cache\r\n"
+                 "Vary: Accept-Encoding\r\n"
+                 "%s"
+                 "\r\n",
+                 name2mime(path), asset->len, encoding, asset->etag, asset->lastmod,
+                 extra_headers ? extra_headers : "");
+    const unsigned hdrlen = strlen(buf);
+    ws_send(ws_ctx, buf, hdrlen);
+
+    if (asset->data)
+        ws_send(ws_ctx, asset->data, asset->len);
+    else
+        ws_sendfile(ws_ctx, asset->fd, 0, asset->len);
+
+    weblog(200, wsthread_handler_id, 0, origip, ip, user, 1, path, hdrlen + asset->len);
+}
+
 static void servefile(ws_ctx_t *ws_ctx, const char *in, const char * const user,
                       const char * const ip, const char * const origip) {
     char buf[WS_MAX_BUF_SIZE], path[PATH_MAX], fullpath[PATH_MAX];
@@ -934,6 +892,14 @@ static void servefile(ws_ctx_t *ws_ctx, const char *in, const char * const user,
     }
 
     handler_msg("Requested file '%s'\n", buf);
+
+    struct asset_t asset;
+    if (ac_get(buf, in, &asset)) {
+        servecached(ws_ctx, &asset, in, path, user, ip, origip);
+        ac_release(&asset);
+        return;
+    }
+
     sprintf(fullpath, "%s/%s", settings.httpdir, buf);
 
     DIR *dir = opendir(fullpath);
@@ -966,10 +932,7 @@ static void servefile(ws_ctx_t *ws_ctx, const char *in, const char * const user,
 
     //fprintf(stderr, "http servefile output '%s'\n", buf);
 
-    unsigned count;
-    while ((count = fread(buf, 1, WS_MAX_BUF_SIZE, f))) {
-        ws_send(ws_ctx, buf, count);
-    }
+    ws_sendfile(ws_ctx, fileno(f), 0, filesize);
     fclose(f);
 
     weblog(200, wsthread_handler_id, 0, origip, ip, user, 1, path, hdrlen + filesize);
@@ -1511,6 +1474,23 @@ static uint8_t ownerapi(ws_ctx_t *ws_ctx, const char *in, const char * const use
 
         handler_msg("Sent bottleneck stats to API caller\n");
         ret = 1;
+    } else entry("/api/get_transport_stats") {
+        char statbuf[16384];
+        settings.transportStatsCb(settings.messager, statbuf, sizeof(statbuf));
+
+        sprintf(buf, "HTTP/1.1 200 OK\r\n"
+                 "Server: KasmVNC/4.0\r\n"
+                 "Connection: close\r\n"
+                 "Content-type: text/plain\r\n"
+                 "Content-length: %lu\r\n"
+                 "%s"
+                 "\r\n", strlen(statbuf), extra_headers ? extra_headers : "");
+        ws_send(ws_ctx, buf, strlen(buf));
+        ws_send(ws_ctx, statbuf, strlen(statbuf));
+        weblog(200, wsthread_handler_id, 0, origip, ip, user, 1, origpath, strlen(buf) + strlen(statbuf));
+
+        handler_msg("Sent transport stats to API caller\n");
+        ret = 1;
     } else entry("/api/get_users")
     {
         const char *ptr;
@@ -1551,6 +1531,50 @@ static uint8_t ownerapi(ws_ctx_t *ws_ctx, const char *in, const char * const use
 
         handler_msg("Sent session list to API caller\n");
         ret = 1;
+    } else entry("/api/get_frame_trace") {
+        char *traceData;
+        settings.getFrameTraceCb(settings.messager, &traceData);
+
+        sprintf(buf, "HTTP/1.1 200 OK\r\n"
+                 "Server: KasmVNC/4.0\r\n"
+                 "Connection: close\r\n"
+                 "Content-type: application/json\r\n"
+                 "Content-Disposition: attachment; filename=\"frame_trace.json\"\r\n"
+                 "Content-length: %lu\r\n"
+                 "%s"
+                 "\r\n", strlen(traceData), extra_headers ? extra_headers : "");
+        ws_send(ws_ctx, buf, strlen(buf));
+        ws_send(ws_ctx, traceData, strlen(traceData));
+        weblog(200, wsthread_handler_id, 0, origip, ip, user, 1, origpath, strlen(buf) + strlen(traceData));
+
+        free(traceData);
+
+        handler_msg("Sent frame trace to API caller\n");
+        ret = 1;
+    } else entry("/api/get_tls_stats") {
+        char statbuf[256];
+
+        pthread_mutex_lock(&tls_mutex);
+        sprintf(statbuf, "{ \"handshakes\": %" PRIu64 ", \"resumed\": %" PRIu64
+                ", \"kernel_tls\": %" PRIu64 ", \"reloads\": %" PRIu64
+                ", \"cached_sessions\": %ld }",
+                tls_handshakes, tls_resumed, tls_kernel, tls_reloads,
+                tls_ctx ? SSL_CTX_sess_number(tls_ctx) : 0L);
+        pthread_mutex_unlock(&tls_mutex);
+
+        sprintf(buf, "HTTP/1.1 200 OK\r\n"
+                 "Server: KasmVNC/4.0\r\n"
+                 "Connection: close\r\n"
+                 "Content-type: application/json\r\n"
+                 "Content-length: %lu\r\n"
+                 "%s"
+                 "\r\n", strlen(statbuf), extra_headers ? extra_headers : "");
+        ws_send(ws_ctx, buf, strlen(buf));
+        ws_send(ws_ctx, statbuf, strlen(statbuf));
+        weblog(200, wsthread_handler_id, 0, origip, ip, user, 1, origpath, strlen(buf) + strlen(statbuf));
+
+        handler_msg("Sent TLS stats to API caller\n");
+        ret = 1;
     } else entry("/api/get_frame_stats") {
         char statbuf[4096], decname[1024];
         unsigned waitfor;
@@ -1591,34 +1615,12 @@ static uint8_t ownerapi(ws_ctx_t *ws_ctx, const char *in, const char * const use
                 goto nope;
         }
 
-        unsigned waits;
-        {
-            uint8_t failed = 1;
-            for (waits = 0; waits < 500; waits++) { // wait up to 10s
-                usleep(20 * 1000);
-                if (settings.serverFrameStatsReadyCb(settings.messager)) {
-                    failed = 0;
-                    break;
-                }
-            }
-
-            if (failed) {
-                handler_msg("Main thread didn't respond, aborting (bug, if nothing happened for 10s)\n");
-                settings.resetFrameStatsCb(settings.messager);
-                goto timeout;
-            }
-        }
-
-        if (waitfor) {
-            for (waits = 0; waits < 20; waits++) { // wait up to 2s
-                if (settings.getClientFrameStatsNumCb(settings.messager) >= waitfor)
-                    break;
-                usleep(100 * 1000);
-            }
+        // Identical requests in flight share one round through the main thread
+        if (!settings.waitFrameStatsCb(settings.messager, waitfor, statbuf, 4096)) {
+            handler_msg("Main thread didn't respond, aborting (bug, if nothing happened for 10s)\n");
+            goto timeout;
         }
 
-        settings.frameStatsCb(settings.messager, statbuf, 4096);
-
         sprintf(buf, "HTTP/1.1 200 OK\r\n"
                  "Server: KasmVNC/4.0\r\n"
                  "Connection: close\r\n"
@@ -1803,75 +1805,17 @@ timeout:
     return 1;
 }
 
-ws_ctx_t *do_handshake(int sock, char * const ip) {
-    char handshake[16 * 1024], response[4096], sha1[29], trailer[17];
-    char *scheme, *pre;
+/*
+ * Handles a complete request, already read by the event loop. Runs on a
+ * worker with the socket blocking. Returns the context if the request
+ * upgraded to a websocket, NULL if it was answered or refused.
+ */
+static ws_ctx_t *do_handshake(ws_ctx_t *ws_ctx, char *handshake, char * const ip) {
+    char response[4096], sha1[29];
     headers_t *headers;
-    int len, i, offset;
-    ws_ctx_t * ws_ctx;
+    int len;
     char *response_protocol;
 
-    // Peek, but don't read the data
-    len = recv(sock, handshake, 1024, MSG_PEEK);
-    handshake[len] = 0;
-    if (len == 0) {
-        handler_msg("ignoring empty handshake\n");
-        return NULL;
-    } else if ((bcmp(handshake, "\x16", 1) == 0) ||
-               (bcmp(handshake, "\x80", 1) == 0)) {
-        // SSL
-        if (!settings.cert) {
-            handler_msg("SSL connection but no cert specified\n");
-            return NULL;
-        } else if (access(settings.cert, R_OK) != 0) {
-            handler_msg("SSL connection but '%s' not found\n",
-                        settings.cert);
-            return NULL;
-        }
-        ws_ctx = alloc_ws_ctx();
-        ws_socket_ssl(ws_ctx, sock, settings.cert, settings.key);
-        if (! ws_ctx) { return NULL; }
-        scheme = "wss";
-        handler_msg("using SSL socket\n");
-    } else if (settings.ssl_only) {
-        handler_msg("non-SSL connection disallowed\n");
-        return NULL;
-    } else {
-        ws_ctx = alloc_ws_ctx();
-        ws_socket(ws_ctx, sock);
-        if (! ws_ctx) { return NULL; }
-        scheme = "ws";
-        handler_msg("using plain (not SSL) socket\n");
-    }
-    offset = 0;
-    for (i = 0; i < 10; i++) {
-        /* (offset + 1): reserve one byte for the trailing '\0' */
-        if (0 > (len = ws_recv(ws_ctx, handshake + offset, sizeof(handshake) - (offset + 1)))) {
-            handler_emsg("Read error during handshake: %m\n");
-            free_ws_ctx(ws_ctx);
-            return NULL;
-        } else if (0 == len) {
-            handler_emsg("Client closed during handshake\n");
-            free_ws_ctx(ws_ctx);
-            return NULL;
-        }
-        offset += len;
-        handshake[offset] = 0;
-        if (strstr(handshake, "\r\n\r\n")) {
-            break;
-        } else if (sizeof(handshake) <= (size_t)(offset + 1)) {
-            handler_emsg("Oversized handshake\n");
-            send400(ws_ctx, "-", ip, ", too large");
-            free_ws_ctx(ws_ctx);
-            return NULL;
-        } else if (9 == i) {
-            handler_emsg("Incomplete handshake\n");
-            free_ws_ctx(ws_ctx);
-            return NULL;
-        }
-        usleep(10);
-    }
-
     // Proxied?
     char origip[64];
     memcpy(origip, ip, 64);
@@ -1911,7 +1855,6 @@ ws_ctx_t *do_handshake(int sock, char * const ip) {
                           "\r\n");
         ws_send(ws_ctx, response, strlen(response));
         weblog(401, wsthread_handler_id, 0, origip, ip, "-", 1, url, strlen(response));
-        free_ws_ctx(ws_ctx);
         return NULL;
     }
 
@@ -1928,7 +1871,6 @@ ws_ctx_t *do_handshake(int sock, char * const ip) {
                               "\r\n", extra_headers ? extra_headers : "");
             ws_send(ws_ctx, response, strlen(response));
             weblog(401, wsthread_handler_id, 0, origip, ip, "-", 1, url, strlen(response));
-            free_ws_ctx(ws_ctx);
             return NULL;
         }
 
@@ -1938,7 +1880,6 @@ ws_ctx_t *do_handshake(int sock, char * const ip) {
             wserr("Authentication attempt failed, client sent invalid BasicAuth\n");
             bl_addFailure(ip);
             send403(ws_ctx, origip, ip);
-            free_ws_ctx(ws_ctx);
             return NULL;
         }
         len = end - hdr;
@@ -2011,7 +1952,6 @@ ws_ctx_t *do_handshake(int sock, char * const ip) {
                               "\r\n", extra_headers ? extra_headers : "");
             ws_send(ws_ctx, response, strlen(response));
             weblog(401, wsthread_handler_id, 0, origip, ip, inuser, 1, url, strlen(response));
-            free_ws_ctx(ws_ctx);
             return NULL;
         }
         handler_emsg("BasicAuth matched\n");
@@ -2045,39 +1985,28 @@ ws_ctx_t *do_handshake(int sock, char * const ip) {
             servefile(ws_ctx, handshake, inuser, ip, origip);
 
 done:
-        free_ws_ctx(ws_ctx);
         return NULL;
     }
 
     headers = ws_ctx->headers;
 
+    // The server reads binary frames straight off the socket, so the
+    // Hixie drafts and base64 text frames are no longer understood
     response_protocol = strtok(headers->protocols, ",");
-    if (!response_protocol || !strlen(response_protocol)) {
-        ws_ctx->opcode = OPCODE_BINARY;
-        response_protocol = "null";
-    } else if (!strcmp(response_protocol, "base64")) {
-      ws_ctx->opcode = OPCODE_TEXT;
-    } else {
-        ws_ctx->opcode = OPCODE_BINARY;
+    if (ws_ctx->hybi <= 0 ||
+        (response_protocol && !strcmp(response_protocol, "base64"))) {
+        handler_emsg("Only binary HyBi/IETF 6455 websockets are supported\n");
+        send400(ws_ctx, origip, ip, ", unsupported websocket protocol");
+        return NULL;
     }
 
-    if (ws_ctx->hybi > 0) {
-        handler_msg("using protocol HyBi/IETF 6455 %d\n", ws_ctx->hybi);
-        gen_sha1(headers, sha1);
-        snprintf(response, sizeof(response), SERVER_HANDSHAKE_HYBI, sha1, response_protocol);
-    } else {
-        if (ws_ctx->hixie == 76) {
-            handler_msg("using protocol Hixie 76\n");
-            gen_md5(headers, trailer);
-            pre = "Sec-";
-        } else {
-            handler_msg("using protocol Hixie 75\n");
-            trailer[0] = '\0';
-            pre = "";
-        }
-        snprintf(response, sizeof(response), SERVER_HANDSHAKE_HIXIE, pre, headers->origin,
-                 pre, scheme, headers->host, headers->path, pre, "base64", trailer);
-    }
+    ws_ctx->opcode = OPCODE_BINARY;
+    if (!response_protocol || !strlen(response_protocol))
+        response_protocol = "null";
+
+    handler_msg("using protocol HyBi/IETF 6455 %d\n", ws_ctx->hybi);
+    gen_sha1(headers, sha1);
+    snprintf(response, sizeof(response), SERVER_HANDSHAKE_HYBI, sha1, response_protocol);
 
     //handler_msg("response: %s\n", response);
     ws_send(ws_ctx, response, strlen(response));
@@ -2085,91 +2014,460 @@ done:
     return ws_ctx;
 }
 
-void proxy_handler(ws_ctx_t *ws_ctx);
-
 __thread unsigned wsthread_handler_id;
 
-void *subthread(void *ptr) {
+/*
+ * Event loop
+ *
+ * One thread owns an edge-triggered epoll set holding the listening
+ * sockets and every connection still sending its request. The TLS
+ * handshake and reading the request never block it. A complete request
+ * goes to a small fixed pool of workers, as auth, the owner API and file
+ * serving call into the server and may wait on it. Owner API calls have
+ * their own pool, a screenshot or frame stats wait there never holds up
+ * a viewer connecting. Workers block on the socket, but with a timeout,
+ * so a few clients that stop reading can't take the whole pool. Upgraded
+ * websockets are handed to the server itself, which does the framing on
+ * the socket.
+ */
 
-    struct wspass_t * const pass = ptr;
+#define WS_WORKER_THREADS 8
+#define WS_API_THREADS 2
+#define WS_MAX_EVENTS 64
+#define WS_HANDSHAKE_TIMEOUT_MS 10000
+#define WS_WORKER_IO_TIMEOUT_MS 10000
+
+typedef enum {
+    WS_CONN_PEEK,
+    WS_CONN_TLS,
+    WS_CONN_REQUEST,
+    WS_CONN_WORKER,
+} ws_conn_state_t;
+
+typedef struct ws_conn_t ws_conn_t;
+
+// Either a connection, or a listening socket and its owner
+typedef struct {
+    ws_conn_t *conn;
+    int listen_sock;
+    void *listener;
+} ws_endpoint_t;
+
+struct ws_conn_t {
+    ws_conn_state_t state;
+    unsigned id;
+    int sockfd;
+    ws_ctx_t *ws_ctx;
+    void *listener;
+    char ip[64];
+
+    char handshake[16 * 1024];
+    unsigned handshake_len;
+    uint64_t deadline;
+
+    uint8_t dead;
+    ws_endpoint_t ep;
+
+    // Links in the pending, worker or dead list
+    ws_conn_t *prev, *next;
+};
+
+static int epfd = -1;
+static pthread_once_t loop_once = PTHREAD_ONCE_INIT;
+
+// Only touched by the event loop
+static ws_conn_t *pending, *dead;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    ws_conn_t *head, *tail;
+} ws_queue_t;
+
+static ws_queue_t work_queue = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL
+};
+static ws_queue_t api_queue = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL
+};
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    const int csock = pass->csock;
-    wsthread_handler_id = pass->id;
+static void set_nonblocking(int fd, const uint8_t on) {
+    const int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+}
 
-    ws_ctx_t *ws_ctx;
+// How long a blocking send or receive may go without progress, 0 for ever
+static void set_io_timeout(int fd, const unsigned ms) {
+    struct timeval tv;
 
-    ws_ctx = do_handshake(csock, pass->ip);
-    if (ws_ctx == NULL) {
-        handler_msg("No connection after handshake\n");
-        goto out;   // Child process exits
-    }
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
 
-    memcpy(ws_ctx->ip, pass->ip, sizeof(pass->ip));
+static void epoll_add(int fd, const uint32_t events, ws_endpoint_t *ep) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = ep;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        handler_emsg("epoll_ctl(): %s\n", strerror(errno));
+}
 
-    proxy_handler(ws_ctx);
-    if (pipe_error) {
-        handler_emsg("Closing due to SIGPIPE\n");
-    }
-out:
-    free((void *) pass);
+static void pending_remove(ws_conn_t *conn) {
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        pending = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    conn->prev = conn->next = NULL;
+}
 
-    if (ws_ctx) {
-        ws_socket_free(ws_ctx);
-        free_ws_ctx(ws_ctx);
+static void conn_free(ws_conn_t *conn) {
+    if (conn->ws_ctx) {
+        ws_socket_free(conn->ws_ctx);
+        free_ws_ctx(conn->ws_ctx);
     } else {
-        shutdown(csock, SHUT_RDWR);
-        close(csock);
+        shutdown(conn->sockfd, SHUT_RDWR);
+        close(conn->sockfd);
     }
+    free(conn);
+
     handler_msg("handler exit\n");
+}
 
-    return NULL;
+// Other events for the same connection may be in the current batch,
+// so the memory is only released once the batch is done
+static void conn_kill(ws_conn_t *conn) {
+    if (conn->dead)
+        return;
+    conn->dead = 1;
+
+    pending_remove(conn);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+
+    conn->next = dead;
+    dead = conn;
 }
 
-void *start_server(void *unused) {
+static void accept_clients(const ws_endpoint_t *listen_ep) {
     int csock;
     struct sockaddr_in cli_addr;
     socklen_t clilen;
 
-//    printf("Waiting for connections on %s:%d\n",
-//            settings.listen_host, settings.listen_port);
-
     while (1) {
         clilen = sizeof(cli_addr);
-        pipe_error = 0;
-        do {
-            csock = accept(settings.listen_sock,
-                           (struct sockaddr *) &cli_addr,
-                           &clilen);
-        } while (csock == -1 && errno == EINTR);
-
+        csock = accept4(listen_ep->listen_sock, (struct sockaddr *) &cli_addr,
+                        &clilen, SOCK_NONBLOCK | SOCK_CLOEXEC);
         if (csock < 0) {
-            error("ERROR on accept");
-            continue;
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                error("ERROR on accept");
+            return;
         }
-        struct wspass_t *pass = calloc(1, sizeof(struct wspass_t));
-        inet_ntop(cli_addr.sin_family, &cli_addr.sin_addr, pass->ip, sizeof(pass->ip));
+
+        ws_conn_t *conn = calloc(1, sizeof(ws_conn_t));
+        inet_ntop(cli_addr.sin_family, &cli_addr.sin_addr, conn->ip, sizeof(conn->ip));
 
         char logbuf[2][1024];
         wslog(logbuf[0], settings.handler_id, 0);
         sprintf(logbuf[1], "got client connection from %s\n",
-                    pass->ip);
+                    conn->ip);
         fprintf(stderr, "%s%s", logbuf[0], logbuf[1]);
 
-        pthread_t tid;
-        pass->id = settings.handler_id;
-        pass->csock = csock;
+        conn->id = settings.handler_id++;
+        conn->sockfd = csock;
+        conn->listener = listen_ep->listener;
+        conn->state = WS_CONN_PEEK;
+        conn->deadline = now_ms() + WS_HANDSHAKE_TIMEOUT_MS;
+        conn->ep.conn = conn;
+
+        conn->next = pending;
+        if (pending)
+            pending->prev = conn;
+        pending = conn;
+
+        epoll_add(csock, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, &conn->ep);
+    }
+}
+
+// TLS detection, the TLS handshake and reading the request
+// Whether the request line asks for something under /api/
+static uint8_t is_api_request(const char *request) {
+    const char *target = strchr(request, ' ');
+
+    return target && !strncmp(target + 1, "/api/", 5);
+}
+
+static void handle_request_io(ws_conn_t *conn) {
+    ssize_t len;
+
+    if (conn->state == WS_CONN_PEEK) {
+        unsigned char first;
+
+        // Peek, but don't read the data
+        len = recv(conn->sockfd, &first, 1, MSG_PEEK);
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return;
+        if (len <= 0) {
+            handler_msg("ignoring empty handshake\n");
+            conn_kill(conn);
+            return;
+        }
+
+        if (first == 0x16 || first == 0x80) {
+            // SSL
+            if (!settings.cert) {
+                handler_msg("SSL connection but no cert specified\n");
+                conn_kill(conn);
+                return;
+            } else if (access(settings.cert, R_OK) != 0) {
+                handler_msg("SSL connection but '%s' not found\n",
+                            settings.cert);
+                conn_kill(conn);
+                return;
+            }
+            conn->ws_ctx = ws_socket_ssl(alloc_ws_ctx(), conn->sockfd,
+                                         settings.cert, settings.key);
+            conn->state = WS_CONN_TLS;
+            handler_msg("using SSL socket\n");
+        } else if (settings.ssl_only) {
+            handler_msg("non-SSL connection disallowed\n");
+            conn_kill(conn);
+            return;
+        } else {
+            conn->ws_ctx = ws_socket(alloc_ws_ctx(), conn->sockfd);
+            conn->state = WS_CONN_REQUEST;
+            handler_msg("using plain (not SSL) socket\n");
+        }
+    }
+
+    if (conn->state == WS_CONN_TLS) {
+        const int ret = SSL_do_handshake(conn->ws_ctx->ssl);
+        if (ret != 1) {
+            if (ws_would_block(conn->ws_ctx, ret))
+                return;
+            ERR_print_errors_fp(stderr);
+            conn_kill(conn);
+            return;
+        }
+        tls_count_handshake(conn->ws_ctx->ssl);
+        conn->state = WS_CONN_REQUEST;
+    }
+
+    while (1) {
+        /* (len + 1): reserve one byte for the trailing '\0' */
+        len = ws_recv(conn->ws_ctx, conn->handshake + conn->handshake_len,
+                      sizeof(conn->handshake) - (conn->handshake_len + 1));
+        if (len <= 0 && ws_would_block(conn->ws_ctx, len)) {
+            return;
+        } else if (len < 0 && errno == EINTR && !conn->ws_ctx->ssl) {
+            continue;
+        } else if (len < 0) {
+            handler_emsg("Read error during handshake: %m\n");
+            conn_kill(conn);
+            return;
+        } else if (len == 0) {
+            handler_emsg("Client closed during handshake\n");
+            conn_kill(conn);
+            return;
+        }
+
+        conn->handshake_len += len;
+        conn->handshake[conn->handshake_len] = 0;
+        if (strstr(conn->handshake, "\r\n\r\n")) {
+            break;
+        } else if (sizeof(conn->handshake) <= conn->handshake_len + 1) {
+            handler_emsg("Oversized handshake\n");
+            send400(conn->ws_ctx, "-", conn->ip, ", too large");
+            conn_kill(conn);
+            return;
+        }
+    }
+
+    // Complete, the rest is up to a worker
+    pending_remove(conn);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+    conn->state = WS_CONN_WORKER;
+
+    ws_queue_t * const q = is_api_request(conn->handshake) ? &api_queue : &work_queue;
+
+    pthread_mutex_lock(&q->mutex);
+    if (q->tail)
+        q->tail->next = conn;
+    else
+        q->head = conn;
+    q->tail = conn;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+// Gives the socket and its TLS state to the server, which frames the
+// RFB stream itself from now on
+static void hand_off(ws_conn_t *conn) {
+    ws_ctx_t * const ws_ctx = conn->ws_ctx;
+    const char * const body = strstr(conn->handshake, "\r\n\r\n") + 4;
+    const unsigned extra = conn->handshake + conn->handshake_len - body;
+    char peername[128];
+    struct timeval tv;
+
+    // Same name the proxied unix socket peers used to get
+    gettimeofday(&tv, NULL);
+    snprintf(peername, sizeof(peername), "%s@%s_%lu.%lu", ws_ctx->user,
+             ws_ctx->ip, tv.tv_sec, tv.tv_usec);
+
+    ws_ctx->stall_timeout = 0;
+    set_io_timeout(conn->sockfd, 0);
+    set_nonblocking(conn->sockfd, 1);
+
+    handler_msg("handing websocket over to the VNC server\n");
+    settings.handoffCb(conn->listener, conn->sockfd, ws_ctx->ssl, ws_ctx->ssl_ctx,
+                       peername, body, extra);
+
+    ws_ctx->ssl = NULL;
+    ws_ctx->ssl_ctx = NULL;
+    free_ws_ctx(ws_ctx);
+    free(conn);
+}
+
+static void *worker(void *arg) {
+    ws_queue_t * const q = arg;
+
+    while (1) {
+        ws_conn_t *conn;
+
+        pthread_mutex_lock(&q->mutex);
+        while (!q->head)
+            pthread_cond_wait(&q->cond, &q->mutex);
+        conn = q->head;
+        q->head = conn->next;
+        if (!q->head)
+            q->tail = NULL;
+        conn->next = NULL;
+        pthread_mutex_unlock(&q->mutex);
+
+        wsthread_handler_id = conn->id;
+        set_nonblocking(conn->sockfd, 0);
+        set_io_timeout(conn->sockfd, WS_WORKER_IO_TIMEOUT_MS);
+        conn->ws_ctx->stall_timeout = 1;
+
+        if (!do_handshake(conn->ws_ctx, conn->handshake, conn->ip)) {
+            handler_msg("No connection after handshake\n");
+            conn_free(conn);
+            continue;
+        }
+
+        memcpy(conn->ws_ctx->ip, conn->ip, sizeof(conn->ip));
+
+        hand_off(conn);
+    }
+
+    return NULL;
+}
+
+static void *event_loop(void *unused) {
+    struct epoll_event events[WS_MAX_EVENTS];
+    int i, n;
+
+    while (1) {
+        n = epoll_wait(epfd, events, WS_MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno != EINTR)
+                error("ERROR on epoll_wait");
+            continue;
+        }
+
+        for (i = 0; i < n; i++) {
+            ws_endpoint_t * const ep = events[i].data.ptr;
+
+            if (!ep->conn) {
+                accept_clients(ep);
+                continue;
+            }
 
-        pthread_attr_t attr;
-        pthread_attr_init(&attr);
-        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            ws_conn_t * const conn = ep->conn;
+            if (conn->dead)
+                continue;
 
-        pthread_create(&tid, &attr, subthread, pass);
+            wsthread_handler_id = conn->id;
+            handle_request_io(conn);
+        }
 
-        pthread_attr_destroy(&attr);
+        // Drop clients that never finished their request
+        const uint64_t now = now_ms();
+        ws_conn_t *conn, *next;
+        for (conn = pending; conn; conn = next) {
+            next = conn->next;
+            if (now > conn->deadline) {
+                wsthread_handler_id = conn->id;
+                handler_emsg("Incomplete handshake\n");
+                conn_kill(conn);
+            }
+        }
 
-        settings.handler_id += 1;
+        while (dead) {
+            conn = dead;
+            dead = conn->next;
+            wsthread_handler_id = conn->id;
+            conn_free(conn);
+        }
     }
     handler_msg("websockify exit\n");
 
     return NULL;
 }
+
+static void start_loop() {
+    pthread_t tid;
+    pthread_attr_t attr;
+    unsigned i;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        fatal("Failed to create the websocket event loop");
+
+    tls_preload();
+    ac_init(settings.httpdir);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (i = 0; i < WS_WORKER_THREADS; i++) {
+        pthread_create(&tid, &attr, worker, &work_queue);
+        pthread_setname_np(tid, "websocketwork");
+    }
+
+    for (i = 0; i < WS_API_THREADS; i++) {
+        pthread_create(&tid, &attr, worker, &api_queue);
+        pthread_setname_np(tid, "websocketapi");
+    }
+
+    pthread_create(&tid, &attr, event_loop, NULL);
+    pthread_setname_np(tid, "websocket");
+
+    pthread_attr_destroy(&attr);
+}
+
+// Called once per listening socket, the first call starts the threads
+void ws_start(int listen_sock, void *listener) {
+    ws_endpoint_t *ep = calloc(1, sizeof(ws_endpoint_t));
+
+//    printf("Waiting for connections on %s:%d\n",
+//            settings.listen_host, settings.listen_port);
+
+    pthread_once(&loop_once, start_loop);
+
+    ep->listen_sock = listen_sock;
+    ep->listener = listener;
+
+    set_nonblocking(listen_sock, 1);
+    epoll_add(listen_sock, EPOLLIN | EPOLLET, ep);
+}
@@ -4,17 +4,6 @@
 #include "datelog.h"
 #include "kasmpasswd.h"
 
-#define BUFSIZE 65536
-#define DBUFSIZE (BUFSIZE * 3) / 4 - 20
-
-#define SERVER_HANDSHAKE_HIXIE "HTTP/1.1 101 Web Socket Protocol Handshake\r\n\
-Upgrade: WebSocket\r\n\
-Connection: Upgrade\r\n\
-%sWebSocket-Origin: %s\r\n\
-%sWebSocket-Location: %s://%s%s\r\n\
-%sWebSocket-Protocol: %s\r\n\
-\r\n%s"
-
 #define SERVER_HANDSHAKE_HYBI "HTTP/1.1 101 Switching Protocols\r\n\
 Upgrade: websocket\r\n\
 Connection: Upgrade\r\n\
@@ -53,32 +42,26 @@ typedef struct {
     int        hybi;
     int        opcode;
     headers_t *headers;
-    char      *cin_buf;
-    char      *cout_buf;
-    char      *tin_buf;
-    char      *tout_buf;
 
     char      user[USERNAME_LEN];
     char      ip[64];
-} ws_ctx_t;
 
-struct wspass_t {
-    int csock;
-    unsigned id;
-    char ip[64];
-};
+    // Blocking, with send and receive timeouts. A peer that stalls
+    // that long gets cut off.
+    uint8_t    stall_timeout;
+} ws_ctx_t;
 
 struct kasmpasswd_entry_t;
 
 typedef struct {
     int verbose;
-    int listen_sock;
     unsigned int handler_id;
     const char *cert;
     const char *key;
     uint8_t disablebasicauth;
     const char *passwdfile;
     int ssl_only;
+    uint8_t ktls;
     const char *httpdir;
 
     void *messager;
@@ -93,8 +76,8 @@ typedef struct {
                            const uint8_t read, const uint8_t write, const uint8_t owner);
     uint8_t (*addOrUpdateUserCb)(void *messager, const struct kasmpasswd_entry_t *entry);
     void (*bottleneckStatsCb)(void *messager, char *buf, uint32_t len);
-    void (*frameStatsCb)(void *messager, char *buf, uint32_t len);
-    void (*resetFrameStatsCb)(void *messager);
+    void (*transportStatsCb)(void *messager, char *buf, uint32_t len);
+    uint8_t (*waitFrameStatsCb)(void *messager, uint8_t clients, char *buf, uint32_t len);
 
     uint8_t (*requestFrameStatsNoneCb)(void *messager);
     uint8_t (*requestFrameStatsOwnerCb)(void *messager);
@@ -104,12 +87,16 @@ typedef struct {
     uint8_t (*ownerConnectedCb)(void *messager);
     uint8_t (*numActiveUsersCb)(void *messager);
     void (*getUsersCb)(void *messager, const char **buf);
-    uint8_t (*getClientFrameStatsNumCb)(void *messager);
-    uint8_t (*serverFrameStatsReadyCb)(void *messager);
 
     void (*clearClipboardCb)(void *messager);
 
     void (*getSessionsCb)(void *messager, char **buf);
+    void (*getFrameTraceCb)(void *messager, char **buf);
+
+    // Upgraded websockets go to the listener that accepted them, along
+    // with the TLS state and any data read past the request
+    void (*handoffCb)(void *listener, int sockfd, SSL *ssl, SSL_CTX *sslctx,
+                      const char *peername, const char *data, unsigned len);
 } settings_t;
 
 #ifdef __cplusplus
@@ -122,6 +109,10 @@ ssize_t ws_recv(ws_ctx_t *ctx, void *buf, size_t len);
 
 ssize_t ws_send(ws_ctx_t *ctx, const void *buf, size_t len);
 
+ssize_t ws_sendfile(ws_ctx_t *ctx, int fd, off_t off, size_t len);
+
+int ws_would_block(ws_ctx_t *ctx, ssize_t ret);
+
 /* base64.c declarations */
 //int b64_ntop(u_char const *src, size_t srclength, char *target, size_t targsize);
 //int b64_pton(char const *src, u_char *target, size_t targsize);
@@ -149,20 +140,7 @@ extern __thread unsigned wsthread_handler_id;
 #define handler_msg(...) gen_handler_msg(stderr, __VA_ARGS__);
 #define handler_emsg(...) gen_handler_msg(stderr, __VA_ARGS__);
 
-void traffic(const char * token);
-
-int encode_hixie(u_char const *src, size_t srclength,
-                 char *target, size_t targsize);
-int decode_hixie(char *src, size_t srclength,
-                 u_char *target, size_t targsize,
-                 unsigned int *opcode, unsigned int *left);
-int encode_hybi(u_char const *src, size_t srclength,
-                char *target, size_t targsize, unsigned int opcode);
-int decode_hybi(unsigned char *src, size_t srclength,
-                u_char *target, size_t targsize,
-                unsigned int *opcode, unsigned int *left);
-
-void *start_server(void *unused);
+void ws_start(int listen_sock, void *listener);
 
 #ifdef __cplusplus
 } // extern C
@@ -22,6 +22,8 @@
 #include <config.h>
 #endif
 
+#include <string.h>
+
 #include <rdr/BufferedOutStream.h>
 #include <rdr/Exception.h>
 
@@ -30,8 +32,13 @@ using namespace rdr;
 
 static const size_t DEFAULT_BUF_SIZE = 16384;
 
+// How much may be queued up before writers have to wait for the socket
+static const size_t MAX_CHAIN_SIZE = 4 * 1024 * 1024;
+// Sent buffers kept around for reuse
+static const size_t MAX_SPARE = 16;
+
 BufferedOutStream::BufferedOutStream()
-  : bufSize(DEFAULT_BUF_SIZE), offset(0)
+  : bufSize(DEFAULT_BUF_SIZE), offset(0), chainBytes(0), corked(false)
 {
   ptr = start = sentUpTo = new U8[bufSize];
   end = start + bufSize;
@@ -41,21 +48,29 @@ BufferedOutStream::~BufferedOutStream()
 {
   // FIXME: Complain about non-flushed buffer?
   delete [] start;
+
+  while (!chain.empty()) {
+    delete [] chain.front().start;
+    chain.pop_front();
+  }
+
+  for (size_t i = 0; i < spare.size(); i++)
+    delete [] spare[i];
 }
 
 size_t BufferedOutStream::length()
 {
-  return offset + ptr - sentUpTo;
+  return offset + bufferUsage();
 }
 
 size_t BufferedOutStream::bufferUsage()
 {
-  return ptr - sentUpTo;
+  return chainBytes + (ptr - sentUpTo);
 }
 
 void BufferedOutStream::flush()
 {
-  while (sentUpTo < ptr) {
+  while (bufferUsage() > 0) {
     size_t len;
 
     len = bufferUsage();
@@ -71,6 +86,67 @@ void BufferedOutStream::flush()
     ptr = sentUpTo = start;
 }
 
+int BufferedOutStream::gather(struct iovec* iov, int maxiov, size_t limit)
+{
+  std::deque<Chunk>::iterator it;
+  int n = 0;
+
+  for (it = chain.begin(); it != chain.end() && n < maxiov && limit; ++it) {
+    size_t len = it->end - it->sentUpTo;
+    if (len > limit)
+      len = limit;
+    iov[n].iov_base = it->sentUpTo;
+    iov[n].iov_len = len;
+    limit -= len;
+    n++;
+  }
+
+  if (n < maxiov && limit && ptr != sentUpTo) {
+    size_t len = ptr - sentUpTo;
+    if (len > limit)
+      len = limit;
+    iov[n].iov_base = sentUpTo;
+    iov[n].iov_len = len;
+    n++;
+  }
+
+  return n;
+}
+
+void BufferedOutStream::advance(size_t n)
+{
+  while (n && !chain.empty()) {
+    Chunk& c = chain.front();
+    const size_t len = c.end - c.sentUpTo;
+
+    if (n < len) {
+      c.sentUpTo += n;
+      chainBytes -= n;
+      return;
+    }
+
+    n -= len;
+    chainBytes -= len;
+    chunkSent(c.start);
+    chain.pop_front();
+  }
+
+  sentUpTo += n;
+}
+
+void BufferedOutStream::chunkSent(U8* buf)
+{
+  recycle(buf);
+}
+
+void BufferedOutStream::recycle(U8* buf)
+{
+  if (spare.size() < MAX_SPARE)
+    spare.push_back(buf);
+  else
+    delete [] buf;
+}
+
 void BufferedOutStream::overrun(size_t needed)
 {
   if (needed > bufSize)
@@ -78,18 +154,41 @@ void BufferedOutStream::overrun(size_t needed)
                     "requested size of %lu bytes exceeds maximum of %lu bytes",
                     (long unsigned)needed, (long unsigned)bufSize);
 
-  // First try to get rid of the data we have
-  flush();
+  // First try to get rid of the data we have, unless we're collecting
+  // a whole update
+  if (!corked)
+    flush();
 
   // Still not enough space?
   while (needed > avail()) {
-    // Can we shuffle things around?
-    // (don't do this if it gains us less than 25%)
-    if (((size_t)(sentUpTo - start) > bufSize / 4) &&
-        (needed < bufSize - (ptr - sentUpTo))) {
+    if (sentUpTo == ptr) {
+      ptr = sentUpTo = start;
+    } else if (chain.empty() &&
+               ((size_t)(sentUpTo - start) > bufSize / 4) &&
+               (needed < bufSize - (ptr - sentUpTo))) {
+      // Can we shuffle things around?
+      // (don't do this if it gains us less than 25%)
       memmove(start, sentUpTo, ptr - sentUpTo);
       ptr = start + (ptr - sentUpTo);
       sentUpTo = start;
+    } else if (bufferUsage() < MAX_CHAIN_SIZE) {
+      // Queue this buffer and carry on in another one
+      Chunk c;
+
+      c.start = start;
+      c.sentUpTo = sentUpTo;
+      c.end = ptr;
+      chain.push_back(c);
+      chainBytes += ptr - sentUpTo;
+
+      if (!spare.empty()) {
+        start = spare.back();
+        spare.pop_back();
+      } else {
+        start = new U8[bufSize];
+      }
+      ptr = sentUpTo = start;
+      end = start + bufSize;
     } else {
       size_t len;
 
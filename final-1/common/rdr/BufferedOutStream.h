@@ -24,6 +24,11 @@
 #ifndef __RDR_BUFFEREDOUTSTREAM_H__
 #define __RDR_BUFFEREDOUTSTREAM_H__
 
+#include <sys/uio.h>
+
+#include <deque>
+#include <vector>
+
 #include <rdr/OutStream.h>
 
 namespace rdr {
@@ -38,6 +43,10 @@ namespace rdr {
 
     size_t bufferUsage();
 
+    // While corked, a full buffer is queued behind the others instead of
+    // being sent, so an update goes out in a few large writes
+    void cork(bool enable) { corked = enable; }
+
   private:
     // flushBuffer() requests that the stream be flushed. Returns true if it is
     // able to progress the output (which might still not mean any bytes
@@ -53,9 +62,31 @@ namespace rdr {
     size_t offset;
     U8* start;
 
+    std::vector<U8*> spare;
+
   protected:
+    // Full buffers waiting to go out, all before [sentUpTo, ptr)
+    struct Chunk {
+      U8* start;
+      U8* sentUpTo;
+      U8* end;
+    };
+    std::deque<Chunk> chain;
+    size_t chainBytes;
+    bool corked;
+
     U8* sentUpTo;
 
+    // Describes up to limit bytes of what is waiting, in at most maxiov
+    // pieces. Returns the number of pieces.
+    int gather(struct iovec* iov, int maxiov, size_t limit);
+    // The first n bytes of what is waiting have been sent
+    void advance(size_t n);
+
+    // A queued buffer has been sent in full. The default reuses it.
+    virtual void chunkSent(U8* buf);
+    void recycle(U8* buf);
+
   protected:
     BufferedOutStream();
   };
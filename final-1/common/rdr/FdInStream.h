@@ -45,6 +45,11 @@ namespace rdr {
     void setBlockCallback(FdInStreamBlockCallback* blockCallback);
     int getFd() { return fd; }
 
+  protected:
+    // Returns once the fd is readable. If wait is false, returns false
+    // instead of blocking.
+    bool waitReadable(bool wait);
+
   private:
     virtual bool fillBuffer(size_t maxSize, bool wait);
 
@@ -37,6 +37,11 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <poll.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
 #endif
 
 /* Old systems have select() in sys/time.h */
@@ -51,8 +56,14 @@
 
 using namespace rdr;
 
+// Most pieces handed to a single sendmsg()
+static const int MAX_IOV = 64;
+// Below this, copying is cheaper than pinning the pages
+static const size_t MIN_ZEROCOPY_SIZE = 65536;
+
 FdOutStream::FdOutStream(int fd_, bool blocking_, int timeoutms_)
-  : fd(fd_), blocking(blocking_), timeoutms(timeoutms_)
+  : fd(fd_), blocking(blocking_), timeoutms(timeoutms_), syscalls(0),
+    zeroCopy(false), zcNext(0), zcDone(0)
 {
   gettimeofday(&lastWrite, NULL);
 }
@@ -60,10 +71,28 @@ FdOutStream::FdOutStream(int fd_, bool blocking_, int timeoutms_)
 FdOutStream::~FdOutStream()
 {
   try {
-    while (sentUpTo != ptr)
+    while (bufferUsage())
       flushBuffer(true);
   } catch (Exception&) {
   }
+
+  // Give the kernel a moment to finish with our buffers. Whatever it
+  // still holds after that is leaked rather than handed back to malloc.
+  for (int i = 0; i < 10 && zcNext != zcDone; i++) {
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = 0;
+    if (poll(&pfd, 1, 10) < 0 && errno != EINTR)
+      break;
+    reapZeroCopy();
+  }
+  if (zcNext == zcDone) {
+    while (!zcPending.empty()) {
+      delete [] zcPending.front().buf;
+      zcPending.pop_front();
+    }
+  }
 }
 
 void FdOutStream::setTimeout(int timeoutms_) {
@@ -79,11 +108,28 @@ unsigned FdOutStream::getIdleTime()
   return rfb::msSince(&lastWrite);
 }
 
+bool FdOutStream::setZeroCopy(bool enable)
+{
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+  int one = enable ? 1 : 0;
+
+  if (enable == zeroCopy)
+    return true;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0)
+    return false;
+
+  zeroCopy = enable;
+
+  return true;
+#else
+  return !enable;
+#endif
+}
+
 bool FdOutStream::flushBuffer(bool wait)
 {
-  size_t n = writeWithTimeout((const void*) sentUpTo,
-                              ptr - sentUpTo,
-                              (blocking || wait)? timeoutms : 0);
+  size_t n = writeWithTimeout((blocking || wait)? timeoutms : 0);
 
   // Timeout?
   if (n == 0) {
@@ -94,22 +140,169 @@ bool FdOutStream::flushBuffer(bool wait)
     throw TimedOut();
   }
 
-  sentUpTo += n;
+  advance(n);
+
+  // Anything already done shouldn't wait for the next write
+  if (zcNext != zcDone)
+    reapZeroCopy();
 
   return true;
 }
 
+void FdOutStream::chunkSent(U8* buf)
+{
+  ZcBuf zb;
+
+  // The kernel may still be reading from it
+  if (zcNext != zcDone) {
+    zb.seq = zcNext - 1;
+    zb.buf = buf;
+    zcPending.push_back(zb);
+    return;
+  }
+
+  BufferedOutStream::chunkSent(buf);
+}
+
+int FdOutStream::zeroCopyFlags(size_t& limit)
+{
+#ifdef MSG_ZEROCOPY
+  if (zcNext != zcDone)
+    reapZeroCopy();
+
+  // Only the queued buffers can be left with the kernel, never the one
+  // we are still writing into
+  if (zeroCopy && chainBytes >= MIN_ZEROCOPY_SIZE) {
+    if (limit > chainBytes)
+      limit = chainBytes;
+    return MSG_ZEROCOPY;
+  }
+#endif
+
+  return 0;
+}
+
+void FdOutStream::sentZeroCopy(int flags)
+{
+#ifdef MSG_ZEROCOPY
+  if (flags & MSG_ZEROCOPY)
+    zcNext++;
+#endif
+}
+
+//
+// writeWithTimeout() writes as much as it can of what is waiting to the file
+// descriptor, in one sendmsg() when possible.  The fd is always written
+// without blocking first, and only if that would block do we wait for it to
+// become writable.  If there is a timeout set and that timeout expires, it
+// returns 0.  Otherwise it returns the number of bytes written.  It also has
+// to cope with the annoying possibility of both select() and sendmsg()
+// returning EINTR.
+//
+
+size_t FdOutStream::writeWithTimeout(int timeoutms)
+{
+  struct iovec iov[MAX_IOV];
+  struct msghdr msg;
+  size_t limit;
+  int flags;
+  int n;
+
+  memset(&msg, 0, sizeof(msg));
+
+  flags = 0;
+#ifdef MSG_DONTWAIT
+  flags |= MSG_DONTWAIT;
+#endif
+#ifdef MSG_NOSIGNAL
+  flags |= MSG_NOSIGNAL;
+#endif
+
+  limit = (size_t)-1;
+  flags |= zeroCopyFlags(limit);
+  msg.msg_iovlen = gather(iov, MAX_IOV, limit);
+  msg.msg_iov = iov;
+
+  while (true) {
+    do {
+      syscalls++;
+      n = ::sendmsg(fd, &msg, flags);
+    } while (n < 0 && (errno == EINTR));
+
+    if (n >= 0)
+      break;
+
+#ifdef MSG_ZEROCOPY
+    // Out of memory for pinning pages, so just copy this time
+    if ((errno == ENOBUFS) && (flags & MSG_ZEROCOPY)) {
+      flags &= ~MSG_ZEROCOPY;
+      continue;
+    }
+#endif
+
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+      throw SystemException("write", errno);
+
+    if (!waitWritable(timeoutms))
+      return 0;
+  }
+
+  sentZeroCopy(flags);
+
+  gettimeofday(&lastWrite, NULL);
+
+  return n;
+}
+
 //
-// writeWithTimeout() writes up to the given length in bytes from the given
-// buffer to the file descriptor.  If there is a timeout set and that timeout
-// expires, it throws a TimedOut exception.  Otherwise it returns the number of
-// bytes written.  It never attempts to send() unless select() indicates that
-// the fd is writable - this means it can be used on an fd which has been set
-// non-blocking.  It also has to cope with the annoying possibility of both
-// select() and send() returning EINTR.
+// reapZeroCopy() collects the kernel's notices of finished zero copy sends
+// and lets go of the buffers they covered.
 //
 
-size_t FdOutStream::writeWithTimeout(const void* data, size_t length, int timeoutms)
+void FdOutStream::reapZeroCopy()
+{
+#if defined(__linux__) && defined(MSG_ZEROCOPY)
+  while (zcNext != zcDone) {
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr* cm;
+    int n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    syscalls++;
+    n = recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+    if (n < 0)
+      break;
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      struct sock_extended_err serr;
+
+      if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+            (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+        continue;
+
+      memcpy(&serr, CMSG_DATA(cm), sizeof(serr));
+      if (serr.ee_errno != 0 || serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+
+      // ee_data is the last send of a completed range
+      if ((int32_t)(serr.ee_data + 1 - zcDone) > 0)
+        zcDone = serr.ee_data + 1;
+    }
+  }
+
+  while (!zcPending.empty() &&
+         (int32_t)(zcPending.front().seq - zcDone) < 0) {
+    BufferedOutStream::chunkSent(zcPending.front().buf);
+    zcPending.pop_front();
+  }
+#endif
+}
+
+bool FdOutStream::waitWritable(int timeoutms)
 {
   int n;
 
@@ -127,30 +320,12 @@ size_t FdOutStream::writeWithTimeout(const void* data, size_t length, int timeou
 
     FD_ZERO(&fds);
     FD_SET(fd, &fds);
+    syscalls++;
     n = select(fd+1, 0, &fds, 0, tvp);
   } while (n < 0 && errno == EINTR);
 
   if (n < 0)
     throw SystemException("select", errno);
 
-  if (n == 0)
-    return 0;
-
-  do {
-    // select only guarantees that you can write SO_SNDLOWAT without
-    // blocking, which is normally 1. Use MSG_DONTWAIT to avoid
-    // blocking, when possible.
-#ifndef MSG_DONTWAIT
-    n = ::send(fd, (const char*)data, length, 0);
-#else
-    n = ::send(fd, (const char*)data, length, MSG_DONTWAIT);
-#endif
-  } while (n < 0 && (errno == EINTR));
-
-  if (n < 0)
-    throw SystemException("write", errno);
-
-  gettimeofday(&lastWrite, NULL);
-
-  return n;
+  return n > 0;
 }
@@ -24,8 +24,11 @@
 #ifndef __RDR_FDOUTSTREAM_H__
 #define __RDR_FDOUTSTREAM_H__
 
+#include <stdint.h>
 #include <sys/time.h>
 
+#include <deque>
+
 #include <rdr/BufferedOutStream.h>
 
 namespace rdr {
@@ -43,13 +46,47 @@ namespace rdr {
 
     unsigned getIdleTime();
 
-  private:
-    virtual bool flushBuffer(bool wait);
-    size_t writeWithTimeout(const void* data, size_t length, int timeoutms);
+    // Queued buffers of at least a few pages are handed to the kernel
+    // without copying (MSG_ZEROCOPY), and only reused once it reports
+    // them done. Returns false if the socket can't do that.
+    bool setZeroCopy(bool enable);
+
+    // Collects the kernel's notices of finished zero copy sends. Until
+    // they are read the socket polls as having an error, so this needs
+    // calling whenever it does.
+    void reapZeroCopy();
+
+    // Number of send, wait and completion system calls made so far
+    unsigned long long getSyscalls() { return syscalls; }
+
+  protected:
+    // Returns once the fd is writable, or false if timeoutms expired
+    bool waitWritable(int timeoutms);
+
+    // Returns MSG_ZEROCOPY if the next send should use it, in which case
+    // limit is cut down to the queued buffers. sentZeroCopy() must be told
+    // about each send that used it.
+    int zeroCopyFlags(size_t& limit);
+    void sentZeroCopy(int flags);
+
     int fd;
     bool blocking;
     int timeoutms;
     struct timeval lastWrite;
+    unsigned long long syscalls;
+
+  private:
+    virtual bool flushBuffer(bool wait);
+    virtual void chunkSent(U8* buf);
+    size_t writeWithTimeout(int timeoutms);
+
+    bool zeroCopy;
+    uint32_t zcNext, zcDone;
+    struct ZcBuf {
+      uint32_t seq;
+      U8* buf;
+    };
+    std::deque<ZcBuf> zcPending;
   };
 
 }
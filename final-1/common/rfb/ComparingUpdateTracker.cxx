@@ -27,6 +27,9 @@
 #include <rfb/LogWriter.h>
 #include <rfb/ServerCore.h>
 #include <rfb/ComparingUpdateTracker.h>
+#include <rfb/FrameTrace.h>
+#include <rfb/cpuid.h>
+#include <tbb/parallel_for.h>
 
 #include <rfb/adler32.h>
 #include <rfb/xxhash.h>
@@ -673,13 +676,17 @@ public:
 ComparingUpdateTracker::ComparingUpdateTracker(PixelBuffer* buffer)
   : fb(buffer), oldFb(fb->getPF(), 0, 0), firstCompare(true),
     enabled(true), detectScroll(false), totalPixels(0), missedPixels(0),
-    scrollHasher(NULL)
+    movedPixels(0), scrollHasher(NULL), blocksW(0), blocksH(0),
+    serialCompare(false)
 {
     changed.assign_union(fb->getRect());
     if (Server::detectHorizontal)
       scrollHasher = new scrollHasher_bothDir_t;
     else
       scrollHasher = new scrollHasher_vert_t;
+
+    setSerialCompare(false);
+    arena.initialize(cpu_info::cores_count);
 }
 
 ComparingUpdateTracker::~ComparingUpdateTracker()
@@ -712,6 +719,8 @@ bool ComparingUpdateTracker::compare(bool skipScrollDetection, const Region &ski
       oldFb.imageRect(pos, srcData, srcStride);
     }
 
+    resetBlockHashes();
+
     firstCompare = false;
 
     return false;
@@ -720,6 +729,7 @@ bool ComparingUpdateTracker::compare(bool skipScrollDetection, const Region &ski
   copied.get_rects(&rects, copy_delta.x<=0, copy_delta.y<=0);
   for (i = rects.begin(); i != rects.end(); i++)
     oldFb.copyRect(*i, copy_delta);
+  invalidateBlockHashes(copied);
 
   changed.get_rects(&rects);
 
@@ -734,6 +744,7 @@ bool ComparingUpdateTracker::compare(bool skipScrollDetection, const Region &ski
   if (atLeast64 && Server::detectScrolling && !skipScrollDetection &&
       (changedArea * 100) / (fb->width() * fb->height()) > (unsigned) Server::scrollDetectLimit) {
     detectScroll = true;
+    TraceSpan span(TRACE_SCROLL_DETECT);
     Rect pos(0, 0, oldFb.width(), oldFb.height());
     int unused;
     scrollHasher->calcHashes(oldFb.getBuffer(pos, &unused), oldFb.width(), oldFb.height(),
@@ -744,8 +755,15 @@ bool ComparingUpdateTracker::compare(bool skipScrollDetection, const Region &ski
   copyPassRects.clear();
 
   Region newChanged;
-  for (i = rects.begin(); i != rects.end(); i++)
-    compareRect(*i, &newChanged, skipCursorArea);
+  if (detectScroll) {
+    for (i = rects.begin(); i != rects.end(); i++)
+      compareRect(*i, &newChanged, skipCursorArea);
+    // The scroll path updates oldFb on its own terms
+    invalidateBlockHashes(changed);
+  } else {
+    compareRects(rects, &newChanged, skipCursorArea,
+                 Server::detectScrolling && !skipScrollDetection);
+  }
 
   changed.get_rects(&rects);
   for (i = rects.begin(); i != rects.end(); i++)
@@ -767,6 +785,20 @@ bool ComparingUpdateTracker::compare(bool skipScrollDetection, const Region &ski
   return true;
 }
 
+void ComparingUpdateTracker::setSerialCompare(bool serial)
+{
+  serialCompare = serial;
+
+  if (serial)
+    firstChangedLine = memcmp_firstChangedLine;
+  else if (cpu_info::has_avx2)
+    firstChangedLine = AVX2_firstChangedLine;
+  else if (cpu_info::has_sse2)
+    firstChangedLine = SSE2_firstChangedLine;
+  else
+    firstChangedLine = memcmp_firstChangedLine;
+}
+
 void ComparingUpdateTracker::enable()
 {
   enabled = true;
@@ -862,27 +894,27 @@ void ComparingUpdateTracker::compareRect(const Rect& inr, Region* newChanged,
       int blockRight = __rfbmin(blockLeft+BLOCK_SIZE, r.br.x);
       int blockWidthInBytes = (blockRight-blockLeft) * bytesPerPixel;
       bool changed = false;
-      int y;
 
-      for (y = blockTop; y < blockBottom; y++)
+      const unsigned firstLine = firstChangedLine(oldPtr, oldStrideBytes,
+                                                  newPtr, newStrideBytes,
+                                                  blockWidthInBytes,
+                                                  blockBottom - blockTop);
+      int y = blockTop + firstLine;
+      newPtr += newStrideBytes * firstLine;
+      oldPtr += oldStrideBytes * firstLine;
+
+      if (y < blockBottom)
       {
-        if (memcmp(oldPtr, newPtr, blockWidthInBytes) != 0)
+        // A block has changed - copy the remainder to the oldFb
+        changed = true;
+        const rdr::U8* savedPtr = newPtr;
+        for (int y2 = y; y2 < blockBottom; y2++)
         {
-          // A block has changed - copy the remainder to the oldFb
-          changed = true;
-          const rdr::U8* savedPtr = newPtr;
-          for (int y2 = y; y2 < blockBottom; y2++)
-          {
-            memcpy(oldPtr, newPtr, blockWidthInBytes);
-            newPtr += newStrideBytes;
-            oldPtr += oldStrideBytes;
-          }
-          newPtr = savedPtr;
-          break;
+          memcpy(oldPtr, newPtr, blockWidthInBytes);
+          newPtr += newStrideBytes;
+          oldPtr += oldStrideBytes;
         }
-
-        newPtr += newStrideBytes;
-        oldPtr += oldStrideBytes;
+        newPtr = savedPtr;
       }
 
       if (!changed || (changed && !detectScroll) ||
@@ -964,6 +996,266 @@ void ComparingUpdateTracker::compareRect(const Rect& inr, Region* newChanged,
   }
 }
 
+// Without scroll detection every block stands on its own. Blocks are
+// aligned to a fixed grid so that their hashes can be kept across
+// frames: a damaged block whose fresh hash matches the stored one is
+// dropped without reading oldFb, and a changed block whose hash matches
+// another block's previous content is sent as a copy of it. Hashing and
+// updating oldFb are spread over the arena one row of blocks at a time.
+
+enum { BLOCK_CLEAN, BLOCK_UNCHANGED, BLOCK_CHANGED, BLOCK_MOVED };
+
+static rdr::U64 hashBlock(const rdr::U8* data, const int strideBytes,
+                          const int widthBytes, const int lines)
+{
+  rdr::U64 hash = 0;
+
+  for (int y = 0; y < lines; y++, data += strideBytes)
+    hash = XXH64(data, widthBytes, hash);
+
+  return hash;
+}
+
+Rect ComparingUpdateTracker::blockRect(unsigned idx) const
+{
+  const int x = (idx % blocksW) * BLOCK_SIZE;
+  const int y = (idx / blocksW) * BLOCK_SIZE;
+
+  return Rect(x, y, __rfbmin(x + BLOCK_SIZE, fb->width()),
+              __rfbmin(y + BLOCK_SIZE, fb->height()));
+}
+
+void ComparingUpdateTracker::resetBlockHashes()
+{
+  blocksW = (fb->width() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  blocksH = (fb->height() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  blockHashes.assign(blocksW * blocksH, 0);
+  blockHashValid.assign(blocksW * blocksH, 0);
+  blockHashIndex.clear();
+}
+
+void ComparingUpdateTracker::invalidateBlockHashes(const Region& r)
+{
+  std::vector<Rect> rects;
+  std::vector<Rect>::const_iterator i;
+
+  r.get_rects(&rects);
+  for (i = rects.begin(); i != rects.end(); i++) {
+    const Rect cr = i->intersect(fb->getRect());
+    if (cr.is_empty())
+      continue;
+
+    for (int by = cr.tl.y / BLOCK_SIZE; by <= (cr.br.y - 1) / BLOCK_SIZE; by++) {
+      for (int bx = cr.tl.x / BLOCK_SIZE; bx <= (cr.br.x - 1) / BLOCK_SIZE; bx++)
+        blockHashValid[by * blocksW + bx] = 0;
+    }
+  }
+}
+
+void ComparingUpdateTracker::compareRects(const std::vector<Rect>& inrects,
+                                          Region* newChanged,
+                                          const Region &skipCursorArea,
+                                          bool detectMoves)
+{
+  std::vector<rdr::U8> state;
+  std::vector<rdr::U64> newHashes;
+  std::vector<unsigned> rows;
+  std::vector<std::vector<Rect> > changedBlocks;
+  std::vector<Rect>::const_iterator i;
+
+  if (blocksW * blocksH != blockHashes.size() ||
+      blocksW != (unsigned) (fb->width() + BLOCK_SIZE - 1) / BLOCK_SIZE)
+    resetBlockHashes();
+
+  state.assign(blockHashes.size(), BLOCK_CLEAN);
+  newHashes.resize(blockHashes.size());
+
+  // Damage rarely follows the grid, so mark every block it touches
+  for (i = inrects.begin(); i != inrects.end(); i++) {
+    const Rect r = i->intersect(fb->getRect());
+    if (r.is_empty())
+      continue;
+
+    for (int by = r.tl.y / BLOCK_SIZE; by <= (r.br.y - 1) / BLOCK_SIZE; by++) {
+      for (int bx = r.tl.x / BLOCK_SIZE; bx <= (r.br.x - 1) / BLOCK_SIZE; bx++)
+        state[by * blocksW + bx] = BLOCK_UNCHANGED;
+    }
+  }
+
+  for (unsigned by = 0; by < blocksH; by++) {
+    for (unsigned bx = 0; bx < blocksW; bx++) {
+      if (state[by * blocksW + bx] != BLOCK_CLEAN) {
+        rows.push_back(by);
+        break;
+      }
+    }
+  }
+
+  if (rows.empty())
+    return;
+
+  const int bytesPerPixel = fb->getPF().bpp/8;
+  const bool forceAll = skipCursorArea.numRects() != 0;
+
+  // First pass, read only: hash the damaged blocks and sort out the
+  // ones that really changed. Blocks without a trusted hash yet fall
+  // back to comparing against oldFb.
+  auto hashRow = [&](size_t n) {
+    for (unsigned idx = rows[n] * blocksW; idx < (rows[n] + 1) * blocksW; idx++) {
+      if (state[idx] == BLOCK_CLEAN)
+        continue;
+
+      const Rect b = blockRect(idx);
+      const int widthBytes = b.width() * bytesPerPixel;
+      int fbStride;
+      const rdr::U8* newPtr = fb->getBuffer(b, &fbStride);
+
+      newHashes[idx] = hashBlock(newPtr, fbStride * bytesPerPixel,
+                                 widthBytes, b.height());
+
+      if (blockHashValid[idx]) {
+        if (newHashes[idx] != blockHashes[idx])
+          state[idx] = BLOCK_CHANGED;
+      } else {
+        int oldStride;
+        const rdr::U8* oldPtr = oldFb.getBuffer(b, &oldStride);
+
+        if (firstChangedLine(oldPtr, oldStride * bytesPerPixel,
+                             newPtr, fbStride * bytesPerPixel,
+                             widthBytes, b.height()) < (unsigned) b.height())
+          state[idx] = BLOCK_CHANGED;
+      }
+    }
+  };
+
+  if (serialCompare || rows.size() < 2) {
+    for (size_t n = 0; n < rows.size(); n++)
+      hashRow(n);
+  } else {
+    arena.execute([&] {
+      tbb::parallel_for(static_cast<size_t>(0), rows.size(), hashRow);
+    });
+  }
+
+  // Second pass, serial and in grid order: changed blocks whose content
+  // was somewhere else in the previous frame become copies. The client
+  // applies copies in order, so a block that already received a copy
+  // can't be a source any more.
+  for (size_t n = 0; n < rows.size(); n++) {
+    for (unsigned idx = rows[n] * blocksW; idx < (rows[n] + 1) * blocksW; idx++) {
+      if (state[idx] != BLOCK_CHANGED || !detectMoves)
+        continue;
+
+      const Rect b = blockRect(idx);
+      if (b.width() != BLOCK_SIZE || b.height() != BLOCK_SIZE)
+        continue;
+      if (forceAll && !skipCursorArea.intersect(b).is_empty())
+        continue;
+
+      std::unordered_map<rdr::U64, unsigned>::const_iterator it =
+        blockHashIndex.find(newHashes[idx]);
+      if (it == blockHashIndex.end())
+        continue;
+
+      const unsigned src = it->second;
+      if (src == idx || !blockHashValid[src] ||
+          blockHashes[src] != newHashes[idx] || state[src] == BLOCK_MOVED)
+        continue;
+
+      // Don't bet the screen on a 64-bit hash
+      const Rect sb = blockRect(src);
+      int fbStride, oldStride;
+      const rdr::U8* newPtr = fb->getBuffer(b, &fbStride);
+      const rdr::U8* oldPtr = oldFb.getBuffer(sb, &oldStride);
+
+      if (memcmp_firstChangedLine(oldPtr, oldStride * bytesPerPixel,
+                                  newPtr, fbStride * bytesPerPixel,
+                                  BLOCK_SIZE * bytesPerPixel,
+                                  BLOCK_SIZE) != BLOCK_SIZE)
+        continue;
+
+      state[idx] = BLOCK_MOVED;
+      tryMerge(copyPassRects, b.tl.y, b.tl.x, b.br.x, BLOCK_SIZE,
+               sb.tl.x, sb.tl.y);
+      movedPixels += b.area();
+    }
+  }
+
+  // Keep the index in step with the hashes about to be stored
+  for (size_t n = 0; n < rows.size(); n++) {
+    for (unsigned idx = rows[n] * blocksW; idx < (rows[n] + 1) * blocksW; idx++) {
+      if (state[idx] == BLOCK_CLEAN)
+        continue;
+      if (blockHashValid[idx] && blockHashes[idx] == newHashes[idx])
+        continue;
+
+      if (blockHashValid[idx]) {
+        std::unordered_map<rdr::U64, unsigned>::iterator it =
+          blockHashIndex.find(blockHashes[idx]);
+        if (it != blockHashIndex.end() && it->second == idx)
+          blockHashIndex.erase(it);
+      }
+
+      const Rect b = blockRect(idx);
+      if (b.width() == BLOCK_SIZE && b.height() == BLOCK_SIZE)
+        blockHashIndex[newHashes[idx]] = idx;
+    }
+  }
+
+  // Third pass: bring oldFb and the hashes up to date
+  changedBlocks.resize(rows.size());
+
+  auto updateRow = [&](size_t n) {
+    for (unsigned idx = rows[n] * blocksW; idx < (rows[n] + 1) * blocksW; idx++) {
+      if (state[idx] == BLOCK_CLEAN)
+        continue;
+
+      const Rect b = blockRect(idx);
+
+      if (state[idx] != BLOCK_UNCHANGED) {
+        const int widthBytes = b.width() * bytesPerPixel;
+        int fbStride, oldStride;
+        const rdr::U8* newPtr = fb->getBuffer(b, &fbStride);
+        rdr::U8* oldPtr = oldFb.getBufferRW(b, &oldStride);
+
+        for (int y = 0; y < b.height(); y++)
+          memcpy(oldPtr + y * oldStride * bytesPerPixel,
+                 newPtr + y * fbStride * bytesPerPixel, widthBytes);
+
+        oldFb.commitBufferRW(b);
+      }
+
+      blockHashes[idx] = newHashes[idx];
+      blockHashValid[idx] = 1;
+
+      if (state[idx] == BLOCK_CHANGED ||
+          (forceAll && state[idx] == BLOCK_UNCHANGED))
+        changedBlocks[n].push_back(b);
+    }
+  };
+
+  if (serialCompare || rows.size() < 2) {
+    for (size_t n = 0; n < rows.size(); n++)
+      updateRow(n);
+  } else {
+    arena.execute([&] {
+      tbb::parallel_for(static_cast<size_t>(0), rows.size(), updateRow);
+    });
+  }
+
+  std::vector<Rect> blocks;
+  for (size_t n = 0; n < rows.size(); n++)
+    blocks.insert(blocks.end(), changedBlocks[n].begin(), changedBlocks[n].end());
+
+  if (!blocks.empty()) {
+    Region temp;
+    temp.setOrderedRects(blocks);
+    // Blocks are whole, but only the damaged part of them can differ
+    newChanged->assign_union(temp.intersect(changed));
+  }
+}
+
 void ComparingUpdateTracker::logStats()
 {
   double ratio;
@@ -977,7 +1269,12 @@ void ComparingUpdateTracker::logStats()
   vlog.info("%s in / %s out", a, b);
   vlog.info("(1:%g ratio)", ratio);
 
-  totalPixels = missedPixels = 0;
+  if (movedPixels) {
+    siPrefix(movedPixels, "pixels", a, sizeof(a));
+    vlog.info("%s sent as moved blocks", a);
+  }
+
+  totalPixels = missedPixels = movedPixels = 0;
 }
 
 void ComparingUpdateTracker::getUpdateInfo(UpdateInfo* info, const Region& cliprgn)
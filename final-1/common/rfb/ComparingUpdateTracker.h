@@ -20,6 +20,9 @@
 #define __RFB_COMPARINGUPDATETRACKER_H__
 
 #include <rfb/UpdateTracker.h>
+#include <rfb/compare_simd.h>
+#include <tbb/task_arena.h>
+#include <unordered_map>
 
 class scrollHasher_t;
 
@@ -45,6 +48,10 @@ namespace rfb {
 
     void logStats();
 
+    // setSerialCompare() makes compare() use a single thread and plain
+    // memcmp, for benchmarking against the default parallel SIMD path.
+    void setSerialCompare(bool serial);
+
     virtual void getUpdateInfo(UpdateInfo* info, const Region& cliprgn);
     virtual void clear();
 
@@ -52,15 +59,32 @@ namespace rfb {
 
   private:
     void compareRect(const Rect& r, Region* newchanged, const Region &skipCursorArea);
+    void compareRects(const std::vector<Rect>& rects, Region* newchanged,
+                      const Region &skipCursorArea, bool detectMoves);
+    Rect blockRect(unsigned idx) const;
+    void resetBlockHashes();
+    void invalidateBlockHashes(const Region& r);
     PixelBuffer* fb;
     ManagedPixelBuffer oldFb;
     bool firstCompare;
     bool enabled;
     bool detectScroll;
 
-    rdr::U32 totalPixels, missedPixels;
+    rdr::U32 totalPixels, missedPixels, movedPixels;
     scrollHasher_t *scrollHasher;
     std::vector<CopyPassRect> copyPassRects;
+
+    // Hash of every BLOCK_SIZE block of oldFb, kept across frames. Only
+    // blocks with blockHashValid set are trusted, and full size blocks
+    // are indexed by hash as sources for moved content.
+    std::vector<rdr::U64> blockHashes;
+    std::vector<rdr::U8> blockHashValid;
+    std::unordered_map<rdr::U64, unsigned> blockHashIndex;
+    unsigned blocksW, blocksH;
+
+    tbb::task_arena arena;
+    bool serialCompare;
+    firstChangedLineFunc firstChangedLine;
   };
 
 }
@@ -31,16 +31,24 @@
  * We use a simplistic form of slow start in order to ramp up quickly
  * from an idle state. We do not have any persistent threshold though
  * as we have too much noise for it to be reliable.
+ *
+ * As an alternative there is a model based controller in the style of
+ * BBR. Rather than reacting to the delay, it estimates the bottleneck
+ * bandwidth (windowed max of delivery rate samples) and the propagation
+ * delay (windowed min of the RTT), and derives the window and the send
+ * rate from their product. That keeps the queue short on long links,
+ * where a delay based window easily grows into the bloated buffers.
  */
 
 #include <assert.h>
+#include <stddef.h>
 #include <sys/time.h>
 
 #ifdef __linux__
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <netinet/tcp.h>
+#include <linux/tcp.h>
 #include <linux/sockios.h>
 #endif
 
@@ -68,6 +76,41 @@ static const unsigned MINIMUM_WINDOW = 4096;
 // limit for now...
 static const unsigned MAXIMUM_WINDOW = 4194304;
 
+// The model bounds the window by itself, this is only a sanity limit
+static const unsigned BBR_MAXIMUM_WINDOW = 33554432;
+
+// Gains are in 1/256ths. 2/ln(2) is the smallest gain that doubles the
+// delivery rate every round in startup.
+static const unsigned BBR_HIGH_GAIN = 739;
+static const unsigned BBR_CWND_GAIN = 512;
+static const unsigned BBR_PACING_GAINS[] = { 320, 192, 256, 256, 256, 256, 256, 256 };
+static const int BBR_CYCLE_LENGTH = sizeof(BBR_PACING_GAINS) / sizeof(BBR_PACING_GAINS[0]);
+
+// Rounds the bandwidth filter remembers
+static const unsigned BBR_BW_WINDOW = 10;
+// How long a minimum RTT is trusted before it is probed again (ms)
+static const unsigned BBR_RTPROP_WINDOW = 10000;
+static const unsigned BBR_PROBE_RTT_TIME = 200;
+
+static inline unsigned usBetween(const struct timeval *first,
+                                 const struct timeval *second)
+{
+  if (isBefore(second, first))
+    return 0;
+  // Cap it well before it wraps
+  if (second->tv_sec - first->tv_sec > 3600)
+    return 3600000000U;
+  return (second->tv_sec - first->tv_sec) * 1000000 +
+         second->tv_usec - first->tv_usec;
+}
+
+static inline void addUs(struct timeval *tv, unsigned us)
+{
+  tv->tv_usec += us;
+  tv->tv_sec += tv->tv_usec / 1000000;
+  tv->tv_usec %= 1000000;
+}
+
 // Compare position even when wrapped around
 static inline bool isAfter(unsigned a, unsigned b) {
   return a != b && a - b <= UINT_MAX / 2;
@@ -76,21 +119,39 @@ static inline bool isAfter(unsigned a, unsigned b) {
 static LogWriter vlog("Congestion");
 
 Congestion::Congestion() :
+    model(modelVegas), sockFd(-1),
     lastPosition(0), extraBuffer(0),
     baseRTT(-1), congWindow(INITIAL_WINDOW), inSlowStart(true),
-    safeBaseRTT(-1), measurements(0), minRTT(-1), minCongestedRTT(-1)
+    safeBaseRTT(-1), measurements(0), minRTT(-1), minCongestedRTT(-1),
+    bbrState(bbrStartup), btlBw(0), rtProp(-1), round(0), roundEnd(0),
+    fullBw(0), fullBwRounds(0), cycleIndex(0),
+    pacingGain(BBR_HIGH_GAIN), cwndGain(BBR_HIGH_GAIN), heldBack(false)
 {
   gettimeofday(&lastUpdate, NULL);
   gettimeofday(&lastSent, NULL);
   memset(&lastPong, 0, sizeof(lastPong));
+  memset(&prevPong, 0, sizeof(prevPong));
   gettimeofday(&lastPongArrival, NULL);
   gettimeofday(&lastAdjustment, NULL);
+  gettimeofday(&rtPropStamp, NULL);
+  gettimeofday(&cycleStamp, NULL);
+  gettimeofday(&pacedUntil, NULL);
+  memset(&probeRTTDone, 0, sizeof(probeRTTDone));
 }
 
 Congestion::~Congestion()
 {
 }
 
+void Congestion::setModel(Model m, int fd)
+{
+  model = m;
+  sockFd = fd;
+
+  if (model == modelBBR)
+    vlog.debug("Using model based congestion control");
+}
+
 void Congestion::updatePosition(unsigned pos)
 {
   struct timeval now;
@@ -105,7 +166,9 @@ void Congestion::updatePosition(unsigned pos)
   // Idle for too long?
   // We use a very crude RTO calculation in order to keep things simple
   // FIXME: should implement RFC 2861
-  if (msBetween(&lastSent, &now) > __rfbmax(baseRTT*2, 100)) {
+  // The BBR model survives idle periods, it is refreshed by probing
+  if ((model == modelVegas) &&
+      (msBetween(&lastSent, &now) > __rfbmax(baseRTT*2, 100))) {
 
 #ifdef CONGESTION_DEBUG
     vlog.debug("Connection idle for %d ms, resetting congestion control",
@@ -134,6 +197,22 @@ void Congestion::updatePosition(unsigned pos)
       extraBuffer -= consumed;
   }
 
+  // Spread the frames out at the pacing rate. Startup skips this, as
+  // the model is still far below the link there.
+  if ((model == modelBBR) && (delta > 0) && (bbrState != bbrStartup) &&
+      (rtProp != (unsigned)-1)) {
+    if (isBefore(&pacedUntil, &now))
+      pacedUntil = now;
+    addUs(&pacedUntil, (unsigned long long)delta * 1000000 / getPacingRate());
+
+    // A single big frame must not hold back the next one for long,
+    // the window limits the backlog anyway
+    if (usBetween(&now, &pacedUntil) > rtProp) {
+      pacedUntil = now;
+      addUs(&pacedUntil, rtProp);
+    }
+  }
+
   lastPosition = pos;
   lastUpdate = now;
 }
@@ -149,6 +228,13 @@ void Congestion::sentPing()
   rttInfo.extra = getExtraBuffer();
   rttInfo.congested = isCongested();
 
+  // For the model, what matters is if we were held back at any point
+  // since the last ping, as data is only sent when we are not
+  if (model == modelBBR) {
+    rttInfo.congested = rttInfo.congested || heldBack;
+    heldBack = false;
+  }
+
   pings.push_back(rttInfo);
 }
 
@@ -166,6 +252,7 @@ void Congestion::gotPong()
   rttInfo = pings.front();
   pings.pop_front();
 
+  prevPong = lastPong;
   lastPong = rttInfo;
   lastPongArrival = now;
 
@@ -177,6 +264,11 @@ void Congestion::gotPong()
   if (rtt < baseRTT)
     safeBaseRTT = baseRTT = rtt;
 
+  if (model == modelBBR) {
+    gotPongBBR(&now, usBetween(&rttInfo.tv, &now));
+    return;
+  }
+
   // Pings sent before the last adjustment aren't interesting as they
   // aren't a measurement of the current congestion window
   if (isBefore(&rttInfo.tv, &lastAdjustment))
@@ -216,10 +308,17 @@ void Congestion::gotPong()
 
 bool Congestion::isCongested()
 {
-  if (getInFlight() < congWindow)
-    return false;
+  if (getInFlight() >= congWindow) {
+    heldBack = true;
+    return true;
+  }
 
-  return true;
+  if ((model == modelBBR) && (getPacingDelay() > 0)) {
+    heldBack = true;
+    return true;
+  }
+
+  return false;
 }
 
 int Congestion::getUncongestedETA()
@@ -235,8 +334,11 @@ int Congestion::getUncongestedETA()
   targetAcked = lastPosition - congWindow;
 
   // Simple case?
-  if (isAfter(lastPong.pos, targetAcked))
+  if (isAfter(lastPong.pos, targetAcked)) {
+    if (model == modelBBR)
+      return (getPacingDelay() + 999) / 1000;
     return 0;
+  }
 
   // No measurements yet?
   if (baseRTT == (unsigned)-1)
@@ -291,6 +393,9 @@ int Congestion::getUncongestedETA()
 
 size_t Congestion::getBandwidth()
 {
+  if (model == modelBBR)
+    return getPacingRate();
+
   // No measurements yet? Guess RTT of 60 ms
   if (safeBaseRTT == (unsigned)-1)
     return congWindow * 1000 / 60;
@@ -487,3 +592,205 @@ void Congestion::updateCongestion()
   minRTT = minCongestedRTT = -1;
 }
 
+
+void Congestion::gotPongBBR(const struct timeval *now, unsigned rtt)
+{
+  bool expired, newRound;
+  unsigned delivered, interval;
+  size_t bw;
+
+  if (rtt < 1)
+    rtt = 1;
+
+  // Minimum RTT over the last few seconds. An old minimum might no
+  // longer hold after a route change, so it expires and gets probed.
+  expired = msBetween(&rtPropStamp, now) > BBR_RTPROP_WINDOW;
+  if ((rtt <= rtProp) || expired) {
+    rtProp = rtt;
+    rtPropStamp = *now;
+  }
+
+  // A round is over once the data sent at its start has been acked
+  newRound = !isAfter(roundEnd, lastPong.pos);
+  if (newRound) {
+    round++;
+    roundEnd = lastPosition;
+  }
+
+  // Delivery rate. The data between the previous ping and this one was
+  // sent no earlier than the previous ping, and needed at least the
+  // minimum RTT on top of its transfer time to be acked. So this is
+  // never more than the bottleneck bandwidth, only less when we had
+  // nothing to send.
+  if (prevPong.tv.tv_sec != 0) {
+    delivered = lastPong.pos - prevPong.pos;
+    interval = usBetween(&prevPong.tv, now);
+    if (interval > rtProp)
+      interval -= rtProp;
+    else
+      interval = 0;
+
+    if ((delivered > 0) && (interval > 0)) {
+      bw = (unsigned long long)delivered * 1000000 / interval;
+
+#ifdef __linux__
+      // The kernel knows what the socket delivered, and we cannot
+      // have done better than that. Kernels before 4.9 don't fill in
+      // tcpi_delivery_rate, which the returned length tells us.
+      if (sockFd != -1) {
+        struct tcp_info info;
+        socklen_t len;
+
+        len = sizeof(info);
+        memset(&info, 0, sizeof(info));
+        if ((getsockopt(sockFd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) &&
+            (len > offsetof(struct tcp_info, tcpi_delivery_rate)) &&
+            !info.tcpi_delivery_rate_app_limited &&
+            (info.tcpi_delivery_rate > 0) && (info.tcpi_delivery_rate < bw))
+          bw = info.tcpi_delivery_rate;
+      }
+#endif
+
+      // Samples from when we had too little to send are low, only
+      // keep them if they raise the estimate
+      if (lastPong.congested || (bw > btlBw)) {
+        while (!bwSamples.empty() && (bwSamples.back().bw <= bw))
+          bwSamples.pop_back();
+        bwSamples.push_back({round, bw});
+      }
+    }
+  }
+
+  while (!bwSamples.empty() &&
+         (round - bwSamples.front().round >= BBR_BW_WINDOW))
+    bwSamples.pop_front();
+
+  if (!bwSamples.empty())
+    btlBw = bwSamples.front().bw;
+
+  // Startup is over when three rounds that filled the window gave no
+  // real growth
+  if (newRound && lastPong.congested && (bbrState == bbrStartup)) {
+    if (btlBw >= fullBw * 5 / 4) {
+      fullBw = btlBw;
+      fullBwRounds = 0;
+    } else if (++fullBwRounds >= 3) {
+#ifdef CONGESTION_DEBUG
+      vlog.debug("Pipe full at %g Mbps, draining", btlBw * 8.0 / 1000000.0);
+#endif
+      bbrState = bbrDrain;
+    }
+  }
+
+  if (expired && (bbrState != bbrProbeRTT)) {
+#ifdef CONGESTION_DEBUG
+    vlog.debug("Minimum RTT expired, probing");
+#endif
+    bbrState = bbrProbeRTT;
+    memset(&probeRTTDone, 0, sizeof(probeRTTDone));
+  }
+
+  updateModel(now, newRound);
+}
+
+void Congestion::updateModel(const struct timeval *now, bool newRound)
+{
+  unsigned bdp, inFlight;
+
+  // No model yet? Keep the initial window.
+  if ((btlBw == 0) || (rtProp == (unsigned)-1))
+    return;
+
+  bdp = (unsigned long long)btlBw * rtProp / 1000000;
+  inFlight = getInFlight();
+
+  switch (bbrState) {
+  case bbrStartup:
+    pacingGain = cwndGain = BBR_HIGH_GAIN;
+    break;
+  case bbrDrain:
+    // Get rid of the queue startup built
+    pacingGain = 256 * 256 / BBR_HIGH_GAIN;
+    cwndGain = BBR_HIGH_GAIN;
+    if (inFlight <= bdp) {
+      bbrState = bbrProbeBW;
+      cycleIndex = 2;
+      cycleStamp = *now;
+    }
+    break;
+  case bbrProbeBW:
+    // Push a bit more for a round, let the queue drain the next, then
+    // cruise at the estimate
+    cwndGain = BBR_CWND_GAIN;
+    if ((usBetween(&cycleStamp, now) > rtProp) ||
+        ((BBR_PACING_GAINS[cycleIndex] < 256) && (inFlight <= bdp))) {
+      cycleIndex = (cycleIndex + 1) % BBR_CYCLE_LENGTH;
+      cycleStamp = *now;
+    }
+    pacingGain = BBR_PACING_GAINS[cycleIndex];
+    break;
+  case bbrProbeRTT:
+    // Nearly empty the pipe for a moment so the RTT can be measured
+    // without our own queue in it
+    pacingGain = 256;
+    cwndGain = BBR_CWND_GAIN;
+    if (probeRTTDone.tv_sec == 0) {
+      if (inFlight <= MINIMUM_WINDOW) {
+        probeRTTDone = *now;
+        addUs(&probeRTTDone, BBR_PROBE_RTT_TIME * 1000);
+        roundEnd = lastPosition;
+      }
+    } else if (newRound && !isBefore(now, &probeRTTDone)) {
+      rtPropStamp = *now;
+      bbrState = fullBwRounds >= 3 ? bbrProbeBW : bbrStartup;
+      cycleIndex = 2;
+      cycleStamp = *now;
+    }
+    break;
+  }
+
+  if (bbrState == bbrProbeRTT)
+    congWindow = MINIMUM_WINDOW;
+  else
+    congWindow = (unsigned long long)bdp * cwndGain / 256;
+
+  if (congWindow < MINIMUM_WINDOW)
+    congWindow = MINIMUM_WINDOW;
+  if (congWindow > BBR_MAXIMUM_WINDOW)
+    congWindow = BBR_MAXIMUM_WINDOW;
+
+#ifdef CONGESTION_DEBUG
+  vlog.debug("RTT: %u us, Window: %d KiB, Bandwidth: %g Mbps, state %d, gain %u/256",
+             rtProp, congWindow / 1024, btlBw * 8.0 / 1000000.0,
+             bbrState, pacingGain);
+#endif
+}
+
+size_t Congestion::getPacingRate()
+{
+  size_t rate;
+
+  // No model yet? Same guess as the window based one.
+  if (btlBw == 0) {
+    if (safeBaseRTT == (unsigned)-1)
+      rate = (size_t)congWindow * 1000 / 60;
+    else
+      rate = (size_t)congWindow * 1000 / safeBaseRTT;
+    return rate * pacingGain / 256;
+  }
+
+  rate = btlBw * pacingGain / 256;
+  if (rate < 1)
+    rate = 1;
+
+  return rate;
+}
+
+unsigned Congestion::getPacingDelay()
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+
+  return usBetween(&now, &pacedUntil);
+}
@@ -27,6 +27,20 @@ namespace rfb {
     Congestion();
     ~Congestion();
 
+    enum Model {
+      // Delay based window, in the style of TCP Vegas
+      modelVegas,
+      // Bottleneck bandwidth and minimum RTT are estimated, and the
+      // window and send rate follow from those, in the style of BBR
+      modelBBR,
+    };
+
+    // setModel() picks the controller for this connection. Should be
+    // called before anything is sent. The BBR model also looks at
+    // TCP_INFO for the socket, where supported.
+    void setModel(Model m, int fd = -1);
+    Model getModel() const { return model; }
+
     // updatePosition() registers the current stream position and can
     // and should be called often.
     void updatePosition(unsigned pos);
@@ -64,7 +78,15 @@ namespace rfb {
 
     void updateCongestion();
 
+    void gotPongBBR(const struct timeval *now, unsigned rtt);
+    void updateModel(const struct timeval *now, bool newRound);
+    size_t getPacingRate();
+    unsigned getPacingDelay();
+
   private:
+    Model model;
+    int sockFd;
+
     unsigned lastPosition;
     unsigned extraBuffer;
     struct timeval lastUpdate;
@@ -91,6 +113,30 @@ namespace rfb {
     int measurements;
     struct timeval lastAdjustment;
     unsigned minRTT, minCongestedRTT;
+
+    // BBR model state
+    enum BBRState { bbrStartup, bbrDrain, bbrProbeBW, bbrProbeRTT };
+
+    struct BWSample {
+      unsigned round;
+      size_t bw;
+    };
+
+    BBRState bbrState;
+    std::list<struct BWSample> bwSamples;
+    size_t btlBw;
+    unsigned rtProp; // microseconds
+    struct timeval rtPropStamp;
+    unsigned round, roundEnd;
+    size_t fullBw;
+    int fullBwRounds;
+    int cycleIndex;
+    struct timeval cycleStamp;
+    struct timeval probeRTTDone;
+    unsigned pacingGain, cwndGain; // in 1/256ths
+    struct timeval pacedUntil;
+    bool heldBack;
+    struct RTTInfo prevPong;
   };
 }
 
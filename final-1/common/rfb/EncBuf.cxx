@@ -0,0 +1,70 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <mutex>
+
+#include <rfb/EncBuf.h>
+
+using namespace rfb;
+
+// Enough for every encoding thread to have a few in flight. Huge ones
+// are from full screen rects, and not worth holding on to.
+static const size_t PoolMax = 64;
+static const size_t PoolMaxCapacity = 4 * 1024 * 1024;
+
+struct Pool {
+  std::mutex mutex;
+  std::vector<std::vector<uint8_t> *> bufs;
+};
+
+// Never freed, the encode cache lets go of its buffers after exit
+// has torn down the other statics
+static Pool *pool = new Pool;
+
+static void release(std::vector<uint8_t> *buf)
+{
+  if (buf->capacity() <= PoolMaxCapacity) {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+
+    if (pool->bufs.size() < PoolMax) {
+      pool->bufs.push_back(buf);
+      return;
+    }
+  }
+
+  delete buf;
+}
+
+EncBuf rfb::newEncBuf()
+{
+  std::vector<uint8_t> *buf = NULL;
+
+  {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+
+    if (!pool->bufs.empty()) {
+      buf = pool->bufs.back();
+      pool->bufs.pop_back();
+    }
+  }
+
+  if (!buf)
+    buf = new std::vector<uint8_t>;
+
+  return EncBuf(buf, release);
+}
@@ -0,0 +1,39 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+#ifndef __RFB_ENCBUF_H__
+#define __RFB_ENCBUF_H__
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+namespace rfb {
+
+  // The output of one compressed rect. Reference counted, so the encode
+  // cache and every viewer sending it share the one copy the encoder
+  // wrote. When the last reference goes, the vector returns to a pool
+  // with its capacity, so the next encode doesn't have to grow one.
+  //
+  // Buffers from the pool keep their old contents, size them before use.
+  typedef std::shared_ptr<std::vector<uint8_t> > EncBuf;
+
+  EncBuf newEncBuf();
+}
+
+#endif
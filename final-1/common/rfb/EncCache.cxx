@@ -22,51 +22,89 @@
 
 using namespace rfb;
 
-EncCache::EncCache() {
-  enabled = false;
+EncCache::EncCache() : enabled(false), curSize(0), maxSize(0),
+  hits(0), misses(0), hitBytes(0) {
 }
 
 EncCache::~EncCache() {
 }
 
 void EncCache::clear() {
-  std::map<EncId, const void *>::iterator it;
-  for (it = cache.begin(); it != cache.end(); it++)
-    free((void *) it->second);
+  std::lock_guard<std::mutex> lock(mutex);
 
   cache.clear();
+  lru.clear();
+  curSize = 0;
 }
 
-void EncCache::add(uint8_t type, uint16_t x, uint16_t y, uint16_t w, uint16_t h,
-                   uint32_t len, const void *data) {
+void EncCache::setMaxSize(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex);
 
-  EncId id;
+  maxSize = bytes;
+  evict();
+}
+
+void EncCache::add(const EncId &id, const EncBuf &data) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (data->size() > maxSize / 4)
+    return;
+
+  std::map<EncId, entry_t>::iterator it = cache.find(id);
+  if (it != cache.end()) {
+    // Another viewer raced us to it, just refresh it
+    lru.splice(lru.begin(), lru, it->second.lru);
+    return;
+  }
+
+  lru.push_front(id);
+
+  entry_t &e = cache[id];
+  e.data = data;
+  e.lru = lru.begin();
+  curSize += e.data->size();
 
-  id.type = type;
-  id.x = x;
-  id.y = y;
-  id.w = w;
-  id.h = h;
-  id.len = len;
+  evict();
+}
+
+bool EncCache::get(const EncId &id, EncBuf &out) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  std::map<EncId, entry_t>::iterator it = cache.find(id);
+  if (it == cache.end()) {
+    misses++;
+    return false;
+  }
 
-  cache[id] = data;
+  lru.splice(lru.begin(), lru, it->second.lru);
+
+  out = it->second.data;
+  hits++;
+  hitBytes += out->size();
+
+  return true;
 }
 
-const void *EncCache::get(uint8_t type, uint16_t x, uint16_t y, uint16_t w, uint16_t h,
-                          uint32_t &len) const {
+EncCache::stats_t EncCache::getStats() const {
+  std::lock_guard<std::mutex> lock(mutex);
 
-  EncId id;
+  stats_t s;
+  s.hits = hits;
+  s.misses = misses;
+  s.hitBytes = hitBytes;
+  s.size = curSize;
+  s.entries = cache.size();
 
-  id.type = type;
-  id.x = x;
-  id.y = y;
-  id.w = w;
-  id.h = h;
+  return s;
+}
 
-  std::map<EncId, const void *>::const_iterator it = cache.find(id);
-  if (it == cache.end())
-    return NULL;
+// Must be called with the mutex held
+void EncCache::evict() {
+  while (curSize > maxSize && !lru.empty()) {
+    std::map<EncId, entry_t>::iterator it = cache.find(lru.back());
 
-  len = it->first.len;
-  return it->second;
+    curSize -= it->second.data->size();
+    cache.erase(it);
+    lru.pop_back();
+  }
 }
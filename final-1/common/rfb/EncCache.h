@@ -21,44 +21,83 @@
 #ifndef __RFB_ENCCACHE_H__
 #define __RFB_ENCCACHE_H__
 
+#include <list>
 #include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
 
 #include <rdr/types.h>
+#include <rfb/EncBuf.h>
 
 #include <stdint.h>
 #include <stdlib.h>
 
 namespace rfb {
 
+  // Everything that influences the compressed output of a full colour
+  // rect. The position is not part of it, the pixels are identified by
+  // their hash, so the same content anywhere on screen, in any frame and
+  // for any viewer maps to the same entry.
   struct EncId {
+    uint64_t hash;
     uint8_t type;
-    uint16_t x, y, w, h;
-    uint32_t len;
+    uint8_t quality;
+    uint8_t video;
+    uint32_t pf;
+    uint16_t w, h;
 
     bool operator <(const EncId &other) const {
-      return type < other.type ||
-             x < other.x ||
-             y < other.y ||
-             w < other.w ||
-             h < other.h;
+      return std::tie(hash, type, quality, video, pf, w, h) <
+             std::tie(other.hash, other.type, other.quality, other.video,
+                      other.pf, other.w, other.h);
     }
   };
 
+  // Content-addressed cache of encoded full colour rects, shared by all
+  // connections. Blinking cursors, toggled tabs and repeated dialogs are
+  // served from earlier encodes without running JPEG/WEBP/QOI again.
+  // Bounded in bytes, the least recently used entries are evicted first.
+  //
+  // Lookups happen from the encoding threads, so everything is locked.
   class EncCache {
   public:
     EncCache();
     ~EncCache();
 
     void clear();
-    void add(uint8_t type, uint16_t x, uint16_t y, uint16_t w, uint16_t h,
-             uint32_t len, const void *data);
-    const void *get(uint8_t type, uint16_t x, uint16_t y, uint16_t w, uint16_t h,
-                    uint32_t &len) const;
+    void setMaxSize(size_t bytes);
+
+    // The buffers are shared, not copied. Never change one after
+    // adding it, or after getting it.
+    void add(const EncId &id, const EncBuf &data);
+    bool get(const EncId &id, EncBuf &out);
+
+    struct stats_t {
+      uint64_t hits;
+      uint64_t misses;
+      uint64_t hitBytes;
+      uint64_t size;
+      uint32_t entries;
+    };
+
+    stats_t getStats() const;
 
     bool enabled;
 
   protected:
-    std::map<EncId, const void *> cache;
+    void evict();
+
+    struct entry_t {
+      EncBuf data;
+      std::list<EncId>::iterator lru;
+    };
+
+    std::map<EncId, entry_t> cache;
+    std::list<EncId> lru;
+    size_t curSize, maxSize;
+    uint64_t hits, misses, hitBytes;
+    mutable std::mutex mutex;
   };
 }
 
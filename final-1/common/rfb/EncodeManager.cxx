@@ -19,9 +19,12 @@
  * USA.
  */
 
+#include <assert.h>
+#include <algorithm>
 #include <cstdlib>
 #include <rfb/cpuid.h>
 #include <rfb/EncCache.h>
+#include <rfb/ScaledFrames.h>
 #include <rfb/EncodeManager.h>
 #include <rfb/Encoder.h>
 #include <rfb/Palette.h>
@@ -42,6 +45,8 @@
 #include <rfb/TightJPEGEncoder.h>
 #include <rfb/TightWEBPEncoder.h>
 #include <rfb/TightQOIEncoder.h>
+#include <rfb/FrameTrace.h>
+#include <rfb/xxhash.h>
 #include <execution>
 #include <tbb/parallel_for.h>
 
@@ -49,9 +54,6 @@ using namespace rfb;
 
 static LogWriter vlog("EncodeManager");
 
-// If this rect was touched this update, add this to its quality score
-#define SCORE_INCREMENT 32
-
 // Split each rectangle into smaller ones no larger than this area,
 // and no wider than this width.
 static const int SubRectMaxArea = 65536;
@@ -63,6 +65,14 @@ static const int SolidSearchBlock = 16;
 // Don't bother with blocks smaller than this
 static const int SolidBlockMinArea = 2048;
 
+// How far from the pointer rects count as being looked at
+static const int RoiPointerRadius = 192;
+
+// Lossy rects remembered for ordering the refinement, and the age
+// beyond which they all count the same
+static const size_t MaxLossyAreas = 1024;
+static const unsigned RefineMaxAge = 10000;
+
 namespace rfb {
 
 enum EncoderClass {
@@ -92,12 +102,6 @@ struct RectInfo {
   Palette *palette;
 };
 
-struct QualityInfo {
-  struct timeval lastUpdate{};
-  Rect rect;
-  unsigned score{};
-};
-
 };
 
 static const char *encoderClassName(EncoderClass klass)
@@ -148,6 +152,22 @@ static const char *encoderTypeName(EncoderType type)
   return "Unknown Encoder Type";
 }
 
+static uint64_t hashRect(const PixelBuffer *pb, const Rect& rect)
+{
+  int stride;
+  const rdr::U8 *buf = pb->getBuffer(rect, &stride);
+  const unsigned bpp = pb->getPF().bpp / 8;
+  const size_t lineBytes = rect.width() * bpp;
+  uint64_t hash = 0;
+
+  for (int y = 0; y < rect.height(); y++) {
+    hash = XXH64(buf, lineBytes, hash);
+    buf += stride * bpp;
+  }
+
+  return hash;
+}
+
 static void updateMaxVideoRes(uint16_t *x, uint16_t *y) {
   sscanf(Server::maxVideoResolution, "%hux%hu", x, y);
   *x &= ~1;
@@ -160,12 +180,16 @@ static void updateMaxVideoRes(uint16_t *x, uint16_t *y) {
   }
 }
 
-EncodeManager::EncodeManager(SConnection* conn_, EncCache *encCache_) : conn(conn_),
+EncodeManager::EncodeManager(SConnection* conn_, EncCache *encCache_,
+                             ScaledFrames *scaledFrames_) : conn(conn_),
+  refining(false), refineBpp(0.5f), refineUsPerPixel(0),
   dynamicQualityMin(-1), dynamicQualityOff(-1),
   areaCur(0), videoDetected(false), videoTimer(this),
-  watermarkStats(0),
+  scaledFrames(scaledFrames_), videoShadow(NULL),
+  watermarkStats(0), rateControlled(false), bandwidthKnown(false),
+  roiPointer(-1, -1), roiRaise(0), roiLower(0),
   maxEncodingTime(0), framesSinceEncPrint(0),
-  encCache(encCache_)
+  encCache(encCache_), encCachePF(0)
 {
   StatsVector::iterator iter;
 
@@ -183,6 +207,7 @@ EncodeManager::EncodeManager(SConnection* conn_, EncCache *encCache_) : conn(con
 
   webpBenchResult = ((TightWEBPEncoder *) encoders[encoderTightWEBP])->benchmark();
   vlog.info("WEBP benchmark result: %u ms", webpBenchResult);
+  rateController.setWebpBenchmark(webpBenchResult);
 
   unsigned videoTime = rfb::Server::videoTime;
   if (videoTime < 1) videoTime = 1;
@@ -221,13 +246,13 @@ EncodeManager::~EncodeManager()
 
   logStats();
 
+  if (videoShadow)
+    scaledFrames->release(videoShadow);
+
   delete [] areaPercentages;
 
   for (iter = encoders.begin();iter != encoders.end();iter++)
     delete *iter;
-
-  for (std::list<QualityInfo*>::iterator it = qualityList.begin(); it != qualityList.end(); it++)
-    delete *it;
 }
 
 void EncodeManager::logStats()
@@ -383,7 +408,10 @@ void EncodeManager::doUpdate(bool allowLossy, const Region& changed_,
       dynamicQualityOff = 0;
     }
 
+    refining = !allowLossy;
     prepareEncoders(allowLossy);
+    rateControlled = false;
+    roiRaise = roiLower = 0;
 
     changed = changed_;
 
@@ -425,13 +453,39 @@ void EncodeManager::doUpdate(bool allowLossy, const Region& changed_,
      * We start by searching for solid rects, which are then removed
      * from the changed region.
      */
-    if (conn->cp.supportsLastRect && !conn->cp.supportsQOI)
+    if (conn->cp.supportsLastRect && (!conn->cp.supportsQOI || refining))
       writeSolidRects(&changed, pb);
 
+    const int refineStart = conn->getOutStream(conn->cp.supportsUdp)->length();
+
     writeRects(changed, pb,
                &start, true);
+
+    // Learn what the refinement really costs, instead of guessing
+    if (refining) {
+      std::vector<Rect> rects;
+      size_t pixels = 0;
+
+      changed.get_rects(&rects);
+      for (const Rect &r: rects)
+        pixels += r.area();
+
+      if (pixels >= 4096) {
+        const int bytes = conn->getOutStream(conn->cp.supportsUdp)->length() - refineStart;
+        struct timeval now;
+
+        gettimeofday(&now, NULL);
+        const float us = (now.tv_sec - start.tv_sec) * 1000000.0f +
+                         (now.tv_usec - start.tv_usec);
+
+        refineBpp = (refineBpp * 3 + bytes / (float) pixels) / 4;
+        refineUsPerPixel = (refineUsPerPixel * 3 + us / (float) pixels) / 4;
+      }
+    }
     if (!videoDetected) // In case detection happened between the calls
       writeRects(cursorRegion, renderedCursor);
+    else
+      writeRects(cursorRegion, pb);
 
     if (watermarkData && conn->sendWatermark()) {
       beforeLength = conn->getOutStream(conn->cp.supportsUdp)->length();
@@ -451,6 +505,7 @@ void EncodeManager::doUpdate(bool allowLossy, const Region& changed_,
     }
 
     updateQualities();
+    pruneLossyAreas();
 
     conn->writer()->writeFramebufferUpdateEnd();
 }
@@ -562,6 +617,16 @@ void EncodeManager::prepareEncoders(bool allowLossy)
   activeEncoders[encoderIndexedRLE] = indexedRLE;
   activeEncoders[encoderFullColour] = fullColour;
 
+  // Only needed to tell apart viewers whose full colour encoder converts
+  // to the client's format, the lossy ones all work on the native one
+  if (encoders[fullColour]->flags & EncoderUseNativePF) {
+    encCachePF = 0;
+  } else {
+    char pfstr[256];
+    conn->cp.pf().print(pfstr, sizeof(pfstr));
+    encCachePF = (uint32_t) XXH64(pfstr, strlen(pfstr), 0) | 1;
+  }
+
   for (iter = activeEncoders.begin(); iter != activeEncoders.end(); ++iter) {
     Encoder *encoder;
 
@@ -577,34 +642,73 @@ void EncodeManager::prepareEncoders(bool allowLossy)
 Region EncodeManager::getLosslessRefresh(const Region& req,
                                          size_t maxUpdateSize)
 {
+  struct Candidate {
+    Rect rect;
+    float weight;
+  };
   std::vector<Rect> rects;
+  std::vector<Candidate> candidates;
+  struct timeval now;
   Region refresh;
-  size_t area;
+  size_t area, budget;
 
-  // We make a conservative guess at the compression ratio at 2:1
-  maxUpdateSize *= 2;
+  // Spend our share of the spare bandwidth, at what refining has
+  // compressed to so far
+  budget = maxUpdateSize * Server::refineBandwidth / 100 /
+           __rfbmax(refineBpp, 0.01f);
+
+  // and never hold up the next real update for long
+  if (refineUsPerPixel > 0) {
+    const size_t timeBudget = 500 * 1000 / Server::frameRate / refineUsPerPixel;
+    budget = __rfbmin(budget, timeBudget);
+  }
+
+  gettimeofday(&now, NULL);
 
-  area = 0;
   lossyRegion.intersect(req).get_rects(&rects);
-  while (!rects.empty()) {
-    size_t idx;
-    Rect rect;
+  for (const Rect &rect: rects) {
+    unsigned age = RefineMaxAge;
+    int quality = 9;
+
+    // The newest lossy write here tells how long it has been still,
+    // and how bad it looks
+    for (std::vector<LossyArea>::const_reverse_iterator it = lossyAreas.rbegin();
+         it != lossyAreas.rend(); ++it) {
+      if (it->rect.intersect(rect).is_empty())
+        continue;
+      age = __rfbmin(msBetween(&it->since, &now), RefineMaxAge);
+      quality = it->quality;
+      break;
+    }
+
+    float weight = age * (1 + (9 - __rfbmin(__rfbmax(quality, 0), 9)) / 3.0f);
+    if (Server::regionOfInterest && inRegionOfInterest(rect))
+      weight *= 2;
 
-    // Grab a random rect so we don't keep damaging and restoring the
-    // same rect over and over
-    idx = rand() % rects.size();
+    candidates.push_back({rect, weight});
+  }
 
-    rect = rects[idx];
+  // Smaller rects go first between equals, so more of them get done
+  std::sort(candidates.begin(), candidates.end(),
+            [](const Candidate &a, const Candidate &b) {
+              if (a.weight != b.weight)
+                return a.weight > b.weight;
+              return a.rect.area() < b.rect.area();
+            });
+
+  area = 0;
+  for (const Candidate &candidate: candidates) {
+    Rect rect = candidate.rect;
 
     // Add rects until we exceed the threshold, then include as much as
     // possible of the final rect
-    if ((area + rect.area()) > maxUpdateSize) {
+    if ((area + rect.area()) > budget) {
       // Use the narrowest axis to avoid getting to thin rects
       if (rect.width() > rect.height()) {
-        int width = (maxUpdateSize - area) / rect.height();
+        int width = (budget - area) / rect.height();
         rect.br.x = rect.tl.x + __rfbmax(1, width);
       } else {
-        int height = (maxUpdateSize - area) / rect.width();
+        int height = (budget - area) / rect.width();
         rect.br.y = rect.tl.y + __rfbmax(1, height);
       }
       refresh.assign_union(Region(rect));
@@ -613,13 +717,28 @@ Region EncodeManager::getLosslessRefresh(const Region& req,
 
     area += rect.area();
     refresh.assign_union(Region(rect));
-
-    rects.erase(rects.begin() + idx);
   }
 
   return refresh;
 }
 
+void EncodeManager::pruneLossyAreas()
+{
+  std::vector<LossyArea>::iterator it;
+
+  for (it = lossyAreas.begin(); it != lossyAreas.end(); ) {
+    if (lossyRegion.intersect(Region(it->rect)).is_empty())
+      it = lossyAreas.erase(it);
+    else
+      ++it;
+  }
+
+  // Past the cap the oldest go, they are refined first anyway
+  if (lossyAreas.size() > MaxLossyAreas)
+    lossyAreas.erase(lossyAreas.begin(),
+                     lossyAreas.begin() + (lossyAreas.size() - MaxLossyAreas));
+}
+
 int EncodeManager::computeNumRects(const Region& changed)
 {
   int numRects;
@@ -684,9 +803,19 @@ Encoder *EncodeManager::startRect(const Rect& rect, int type, const bool trackQu
     encoder->setFineQualityLevel(-1, subsampleUndefined);
   }
 
-  if (encoder->flags & EncoderLossy && (!encoder->treatLossless() || videoDetected))
+  if (encoder->flags & EncoderLossy && (!encoder->treatLossless() || videoDetected)) {
+    LossyArea lossy;
+
+    lossy.rect = rect;
+    gettimeofday(&lossy.since, NULL);
+    if (type == encoderFullColour && dynamicQualityMin > -1)
+      lossy.quality = scaledQuality(rect);
+    else
+      lossy.quality = conn->cp.qualityLevel;
+    lossyAreas.push_back(lossy);
+
     lossyRegion.assign_union(Region(rect));
-  else
+  } else
     lossyRegion.assign_subtract(Region(rect));
 
   return encoder;
@@ -882,6 +1011,67 @@ void EncodeManager::checkWebpFallback(const timeval *start) {
     }
 }
 
+void EncodeManager::planRate(const std::vector<Rect> &rects)
+{
+  const int fullColour = activeEncoders[encoderFullColour];
+  unsigned pixels = 0;
+
+  // Only the lossy encoders have a quality to pick
+  if (dynamicQualityMin < 0 ||
+      (fullColour != encoderTightJPEG && fullColour != encoderTightWEBP))
+    return;
+
+  for (const auto &rect : rects)
+    pixels += rect.area();
+
+  // Encoding may take the frame time, WEBP only its share of it
+  const unsigned msBudget = 1000 / rfb::Server::frameRate;
+  const unsigned webpMsBudget = fullColour == encoderTightWEBP ?
+                                __rfbmax(1u, msBudget * Server::webpEncodingTime / 100) : 0;
+
+  rateController.plan(bandwidthKnown ? curMaxUpdateSize : SIZE_MAX,
+                      msBudget, webpMsBudget, pixels,
+                      arena.max_concurrency(),
+                      dynamicQualityMin, dynamicQualityMin + dynamicQualityOff);
+  rateControlled = true;
+
+  if (fullColour == encoderTightWEBP && !rateController.useWebp())
+    activeEncoders[encoderFullColour] = encoderTightJPEG;
+}
+
+bool EncodeManager::inRegionOfInterest(const Rect &rect) const
+{
+  const Rect pointer(roiPointer.x - RoiPointerRadius, roiPointer.y - RoiPointerRadius,
+                     roiPointer.x + RoiPointerRadius, roiPointer.y + RoiPointerRadius);
+
+  return rect.overlaps(pointer) || rect.overlaps(roiFocus);
+}
+
+void EncodeManager::planRegionOfInterest(std::vector<Rect> &rects)
+{
+  unsigned total = 0, interest = 0;
+
+  // Interesting rects go first, so they are encoded and shown first
+  const auto mid = std::stable_partition(rects.begin(), rects.end(),
+                                         [this](const Rect &r) {
+                                           return inRegionOfInterest(r);
+                                         });
+
+  for (auto it = rects.begin(); it != rects.end(); ++it) {
+    total += it->area();
+    if (it < mid)
+      interest += it->area();
+  }
+
+  if (!interest || interest == total)
+    return;
+
+  // A level up costs about as much as a level down saves. Only raise
+  // when the rest is at least as big, so the total does not grow.
+  roiLower = 1;
+  roiRaise = interest * 2 <= total ? 1 : 0;
+}
+
 bool EncodeManager::handleTimeout(Timer* t)
 {
   if (t == &videoTimer) {
@@ -943,23 +1133,8 @@ PixelBuffer *rfb::nearestScale(const PixelBuffer *pb, const uint16_t w, const ui
                                  const float diff)
 {
   ManagedPixelBuffer *newpb = new ManagedPixelBuffer(pb->getPF(), w, h);
-  uint16_t x, y;
-  int oldstride, newstride;
-  const rdr::U8 *oldpxorig = pb->getBuffer(pb->getRect(), &oldstride);
-  const rdr::U8 *oldpx;
-  rdr::U8 *newpx = newpb->getBufferRW(newpb->getRect(), &newstride);
-  const uint16_t bpp = pb->getPF().bpp / 8;
-  const float rowstep = 1 / diff;
-
-  for (y = 0; y < h; y++) {
-    const uint16_t ny = rowstep * y;
-    oldpx = oldpxorig + oldstride * bpp * ny;
-    for (x = 0; x < w; x++) {
-      const uint16_t newx = x / diff;
-      memcpy(&newpx[x * bpp], &oldpx[newx * bpp], bpp);
-    }
-    newpx += newstride * bpp;
-  }
+
+  nearestRect(pb, newpb, newpb->getRect(), diff);
 
   return newpb;
 }
@@ -968,46 +1143,8 @@ PixelBuffer *rfb::bilinearScale(const PixelBuffer *pb, const uint16_t w, const u
                                  const float diff)
 {
   ManagedPixelBuffer *newpb = new ManagedPixelBuffer(pb->getPF(), w, h);
-  uint16_t x, y;
-  int oldstride, newstride;
-  const rdr::U8 *oldpx = pb->getBuffer(pb->getRect(), &oldstride);
-  rdr::U8 *newpx = newpb->getBufferRW(newpb->getRect(), &newstride);
-  const uint16_t bpp = pb->getPF().bpp / 8;
-  const float invdiff = 1 / diff;
-
-  for (y = 0; y < h; y++) {
-    const float ny = y * invdiff;
-    const uint16_t lowy = ny;
-    const uint16_t highy = lowy + 1;
-    const uint16_t bot = (ny - lowy) * 256;
-    const uint16_t top = 256 - bot;
-
-    const rdr::U8 *lowyptr = oldpx + oldstride * bpp * lowy;
-    const rdr::U8 *highyptr = oldpx + oldstride * bpp * highy;
-
-    for (x = 0; x < w; x++) {
-      const float nx = x * invdiff;
-      const uint16_t lowx = nx;
-      const uint16_t highx = lowx + 1;
-      const uint16_t right = (nx - lowx) * 256;
-      const uint16_t left = 256 - right;
-
-      unsigned i;
-      uint32_t val, val2;
-      for (i = 0; i < bpp; i++) {
-        val = lowyptr[lowx * bpp + i] * left;
-        val += lowyptr[highx * bpp + i] * right;
-        val >>= 8;
-
-        val2 = highyptr[lowx * bpp + i] * left;
-        val2 += highyptr[highx * bpp + i] * right;
-        val2 >>= 8;
-
-        newpx[x * bpp + i] = (val * top + val2 * bot) >> 8;
-      }
-    }
-    newpx += newstride * bpp;
-  }
+
+  bilinearRect(pb, newpb, newpb->getRect(), diff);
 
   return newpb;
 }
@@ -1017,7 +1154,13 @@ PixelBuffer *rfb::progressiveBilinearScale(const PixelBuffer *pb,
                                  const float tgtdiff)
 {
   if (cpu_info::has_sse2) {
+    // The AVX2 and AVX-512 bilinear kernels beat SSE2_scale
+    const bool simdBilinear = cpu_info::has_avx2;
+
     if (tgtdiff >= 0.5f) {
+      if (simdBilinear)
+        return bilinearScale(pb, tgtw, tgth, tgtdiff);
+
       ManagedPixelBuffer *newpb = new ManagedPixelBuffer(pb->getPF(), tgtw, tgth);
 
       int oldstride, newstride;
@@ -1039,13 +1182,7 @@ PixelBuffer *rfb::progressiveBilinearScale(const PixelBuffer *pb,
       newh = oldh / 2;
 
       newpb = new ManagedPixelBuffer(pb->getPF(), neww, newh);
-
-      int oldstride, newstride;
-      const rdr::U8 *oldpx = pb->getBuffer(pb->getRect(), &oldstride);
-      rdr::U8 *newpx = ((ManagedPixelBuffer *) newpb)->getBufferRW(newpb->getRect(),
-                                                                   &newstride);
-
-      SSE2_halve(oldpx, neww, newh, newpx, oldstride, newstride);
+      halveRect(pb, (ManagedPixelBuffer *) newpb, Rect(0, 0, neww * 2, newh * 2));
 
       if (del)
         delete pb;
@@ -1059,14 +1196,18 @@ PixelBuffer *rfb::progressiveBilinearScale(const PixelBuffer *pb,
       oldw = pb->getRect().width();
       oldh = pb->getRect().height();
 
-      newpb = new ManagedPixelBuffer(pb->getPF(), tgtw, tgth);
+      if (simdBilinear) {
+        newpb = bilinearScale(pb, tgtw, tgth, tgtw / (float) oldw);
+      } else {
+        newpb = new ManagedPixelBuffer(pb->getPF(), tgtw, tgth);
 
-      int oldstride, newstride;
-      const rdr::U8 *oldpx = pb->getBuffer(pb->getRect(), &oldstride);
-      rdr::U8 *newpx = ((ManagedPixelBuffer *) newpb)->getBufferRW(newpb->getRect(),
-                                                                   &newstride);
+        int oldstride, newstride;
+        const rdr::U8 *oldpx = pb->getBuffer(pb->getRect(), &oldstride);
+        rdr::U8 *newpx = ((ManagedPixelBuffer *) newpb)->getBufferRW(newpb->getRect(),
+                                                                     &newstride);
 
-      SSE2_scale(oldpx, tgtw, tgth, newpx, oldstride, newstride, tgtw / (float) oldw);
+        SSE2_scale(oldpx, tgtw, tgth, newpx, oldstride, newstride, tgtw / (float) oldw);
+      }
       if (del)
         delete pb;
     }
@@ -1115,8 +1256,9 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
   std::vector<Rect> rects, subrects, scaledrects;
   std::vector<uint8_t> encoderTypes;
   std::vector<uint8_t> isWebp, fromCache;
+  std::vector<EncId> encIds;
   std::vector<Palette> palettes;
-  std::vector<std::vector<uint8_t> > compresseds;
+  std::vector<EncBuf> compresseds;
   std::vector<uint32_t> ms;
 
   webpTookTooLong.store(false, std::memory_order_relaxed);
@@ -1127,11 +1269,6 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
     updateVideoStats(rects, pb);
   }
 
-  if (videoDetected) {
-    rects.clear();
-    rects.push_back(pb->getRect());
-  }
-
   subrects.reserve(rects.size() * 1.5f);
 
   for (const auto& rect : rects) {
@@ -1172,11 +1309,15 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
     }
   }
 
+  if (start && Server::regionOfInterest)
+    planRegionOfInterest(subrects);
+
   const size_t subrects_size = subrects.size();
 
   encoderTypes.resize(subrects_size);
   isWebp.resize(subrects_size);
   fromCache.resize(subrects_size);
+  encIds.resize(subrects_size);
   palettes.resize(subrects_size);
   compresseds.resize(subrects_size);
   scaledrects.resize(subrects_size);
@@ -1186,7 +1327,10 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
   // scale to that res, keeping aspect ratio
   struct timeval scalestart;
   gettimeofday(&scalestart, NULL);
+  const rdr::U64 scaleStartNs = FrameTrace::isEnabled() ? FrameTrace::now() : 0;
 
+  // Only what changed gets scaled and sent, the rest of the scaled copy
+  // is kept from earlier frames
   const PixelBuffer *scaledpb = NULL;
   if (videoDetected &&
       (maxVideoX < pb->getRect().width() || maxVideoY < pb->getRect().height())) {
@@ -1197,50 +1341,49 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
 
     const uint16_t neww = pb->getRect().width() * diff;
     const uint16_t newh = pb->getRect().height() * diff;
-    switch (Server::videoScaling) {
-      case 0:
-        scaledpb = nearestScale(pb, neww, newh,
-                      diff);
-      break;
-      case 1:
-        scaledpb = bilinearScale(pb, neww, newh,
-                      diff);
-      break;
-      case 2:
-        scaledpb = progressiveBilinearScale(pb, neww, newh,
-                      diff);
-      break;
+
+    if (mainScreen) {
+      // Shared with the other viewers at this size, the first one this
+      // frame scales it. The scalers split into row bands on the
+      // encoding threads.
+      arena.execute([&] {
+        ScaledShadow *shadow = scaledFrames->acquire(pb, neww, newh, diff,
+                                                     Server::videoScaling);
+        if (videoShadow)
+          scaledFrames->release(videoShadow);
+        videoShadow = shadow;
+      });
     }
 
-    for (uint32_t i = 0; i < subrects_size; ++i) {
-      const Rect old = scaledrects[i] = subrects[i];
-      scaledrects[i].br.x *= diff;
-      scaledrects[i].br.y *= diff;
-      scaledrects[i].tl.x *= diff;
-      scaledrects[i].tl.y *= diff;
-
-      // Make sure everything is at least one pixel still
-      if (old.br.x != old.tl.x && scaledrects[i].br.x == scaledrects[i].tl.x) {
-        if (scaledrects[i].br.x < neww - 1)
-          scaledrects[i].br.x++;
-        else
-          scaledrects[i].tl.x--;
-      }
+    if (videoShadow) {
+      scaledpb = videoShadow->getBuffer();
 
-      if (old.br.y != old.tl.y && scaledrects[i].br.y == scaledrects[i].tl.y) {
-        if (scaledrects[i].br.y < newh - 1)
-          scaledrects[i].br.y++;
-        else
-          scaledrects[i].tl.y--;
+      // Scaling reaches a little past what changed, and all of that
+      // has to go out or it's left stale at the edges
+      for (uint32_t i = 0; i < subrects_size; ++i) {
+        subrects[i] = videoShadow->sendRect(subrects[i]);
+        scaledrects[i] = videoShadow->scaleRect(subrects[i]);
       }
     }
+  } else if (mainScreen && videoShadow) {
+    scaledFrames->release(videoShadow);
+    videoShadow = NULL;
   }
   scalingTime = msSince(&scalestart);
+  if (scaledpb && scaleStartNs) {
+    FrameTrace::record(TRACE_SCALE, scaleStartNs, FrameTrace::now(),
+                       scaledpb->getRect().area());
+  }
+
+  if (start && Server::rateControl) {
+    planRate(scaledpb ? scaledrects : subrects);
+  }
 
     arena.execute([&] {
         tbb::parallel_for(static_cast<size_t>(0), subrects_size, [&](size_t i) {
+            TraceSpan span(TRACE_ENCODE_RECT, subrects[i].area());
             encoderTypes[i] = getEncoderType(subrects[i], pb, &palettes[i], compresseds[i],
-                        &isWebp[i], &fromCache[i],
+                        &isWebp[i], &fromCache[i], &encIds[i],
                         scaledpb, scaledrects[i], ms[i]);
             checkWebpFallback(start);
         });
@@ -1255,6 +1398,27 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
     }
   }
 
+  if (start && rateControlled) {
+    unsigned damaged = 0, lossy = 0;
+
+    for (uint32_t i = 0; i < subrects_size; ++i) {
+      const unsigned pixels = scaledpb ? scaledrects[i].area() : subrects[i].area();
+
+      damaged += pixels;
+      if (encoderTypes[i] != encoderFullColour)
+        continue;
+
+      lossy += pixels;
+      if (!fromCache[i] && compresseds[i])
+        rateController.addSample(isWebp[i] ? RateController::rateWEBP :
+                                             RateController::rateJPEG,
+                                 scaledQuality(subrects[i]), pixels,
+                                 compresseds[i]->size(), ms[i]);
+    }
+
+    rateController.addFrame(damaged, lossy);
+  }
+
   if (start) {
     encodingTime = msSince(start);
 
@@ -1277,25 +1441,19 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
     activeEncoders[encoderFullColour] = encoderTightJPEG;
 
   for (uint32_t i = 0; i < subrects_size; ++i) {
-    if (encCache->enabled && !compresseds[i].empty() && !fromCache[i] &&
-        !encoders[encoderTightQOI]->isSupported()) {
-      void *tmp = malloc(compresseds[i].size());
-      memcpy(tmp, &compresseds[i][0], compresseds[i].size());
-      encCache->add(isWebp[i] ? encoderTightWEBP : encoderTightJPEG,
-                    subrects[i].tl.x, subrects[i].tl.y, subrects[i].width(), subrects[i].height(),
-                    compresseds[i].size(), tmp);
-    }
-
     writeSubRect(subrects[i], pb, encoderTypes[i], palettes[i], compresseds[i], isWebp[i]);
-  }
 
-  if (scaledpb)
-    delete scaledpb;
+    // Keep fresh encodes around for later frames and the other viewers
+    if (encCache->enabled && compresseds[i] && !fromCache[i]) {
+      assert((encIds[i].type == encoderTightWEBP) == !!isWebp[i]);
+      encCache->add(encIds[i], compresseds[i]);
+    }
+  }
 }
 
 uint8_t EncodeManager::getEncoderType(const Rect& rect, const PixelBuffer *pb,
-                                      Palette *pal, std::vector<uint8_t> &compressed,
-                                      uint8_t *isWebp, uint8_t *fromCache,
+                                      Palette *pal, EncBuf &compressed,
+                                      uint8_t *isWebp, uint8_t *fromCache, EncId *id,
                                       const PixelBuffer *scaledpb, const Rect& scaledrect,
                                       uint32_t &ms) const
 {
@@ -1345,26 +1503,40 @@ uint8_t EncodeManager::getEncoderType(const Rect& rect, const PixelBuffer *pb,
       type = encoderIndexed;
   }
 
-  if (scaledpb || conn->cp.supportsQOI)
+  // Text and other few colour content is cheaper through the palette
+  // encoders when refining
+  if (scaledpb || (conn->cp.supportsQOI && !(refining && info.palette->size())))
     type = encoderFullColour;
 
   *isWebp = 0;
   *fromCache = 0;
   ms = 0;
   if (type == encoderFullColour) {
-    uint32_t len;
-    const void *data;
     struct timeval start;
     gettimeofday(&start, NULL);
 
-    if (encCache->enabled &&
-        (data = encCache->get(activeEncoders[encoderFullColour],
-                              rect.tl.x, rect.tl.y, rect.width(), rect.height(),
-                              len))) {
-      compressed.resize(len);
-      memcpy(&compressed[0], data, len);
+    // Other rects of this frame may trip the WEBP fallback while we run,
+    // so the cache key and the encoder must come from the same read
+    const bool webpSlow = webpTookTooLong.load(std::memory_order_relaxed);
+
+    if (encCache->enabled) {
+      // The encoders only see the (possibly scaled) pixels, so that's
+      // what identifies the output
+      id->hash = hashRect(scaledpb ? scaledpb : pb, scaledpb ? scaledrect : rect);
+      id->type = activeEncoders[encoderFullColour];
+      if (id->type == encoderTightWEBP && webpSlow)
+        id->type = encoderTightJPEG;
+      id->quality = id->type == encoderTightQOI ? 0 : scaledQuality(rect);
+      id->video = videoDetected;
+      id->pf = encCachePF;
+      id->w = scaledpb ? scaledrect.width() : rect.width();
+      id->h = scaledpb ? scaledrect.height() : rect.height();
+    }
+
+    if (encCache->enabled && encCache->get(*id, compressed)) {
+      *isWebp = id->type == encoderTightWEBP;
       *fromCache = 1;
-    } else if (activeEncoders[encoderFullColour] == encoderTightWEBP && !webpTookTooLong) {
+    } else if (activeEncoders[encoderFullColour] == encoderTightWEBP && !webpSlow) {
       if (scaledpb) {
         delete ppb;
         ppb = preparePixelBuffer(scaledrect, scaledpb,
@@ -1375,9 +1547,10 @@ uint8_t EncodeManager::getEncoderType(const Rect& rect, const PixelBuffer *pb,
         ppb = preparePixelBuffer(rect, pb, false);
       }
 
+      compressed = newEncBuf();
       ((TightWEBPEncoder *) encoders[encoderTightWEBP])->compressOnly(ppb,
                                                                       scaledQuality(rect),
-                                                                      compressed,
+                                                                      *compressed,
                                                                       videoDetected);
       *isWebp = 1;
     } else if (activeEncoders[encoderFullColour] == encoderTightQOI) {
@@ -1391,11 +1564,12 @@ uint8_t EncodeManager::getEncoderType(const Rect& rect, const PixelBuffer *pb,
         ppb = preparePixelBuffer(rect, pb, false);
       }
 
+      compressed = newEncBuf();
       ((TightQOIEncoder *) encoders[encoderTightQOI])->compressOnly(ppb,
                                                                       scaledQuality(rect),
-                                                                      compressed,
+                                                                      *compressed,
                                                                       videoDetected);
-    } else if (activeEncoders[encoderFullColour] == encoderTightJPEG || webpTookTooLong) {
+    } else if (activeEncoders[encoderFullColour] == encoderTightJPEG || webpSlow) {
       if (scaledpb) {
         delete ppb;
         ppb = preparePixelBuffer(scaledrect, scaledpb,
@@ -1406,12 +1580,17 @@ uint8_t EncodeManager::getEncoderType(const Rect& rect, const PixelBuffer *pb,
         ppb = preparePixelBuffer(rect, pb, false);
       }
 
+      compressed = newEncBuf();
       ((TightJPEGEncoder *) encoders[encoderTightJPEG])->compressOnly(ppb,
                                                                       scaledQuality(rect),
-                                                                      compressed,
+                                                                      *compressed,
                                                                       videoDetected);
     }
 
+    // Encoder errors fall back to the normal path
+    if (compressed && compressed->empty())
+      compressed.reset();
+
     ms = msSince(&start);
   }
 
@@ -1422,25 +1601,25 @@ uint8_t EncodeManager::getEncoderType(const Rect& rect, const PixelBuffer *pb,
 
 void EncodeManager::writeSubRect(const Rect& rect, const PixelBuffer *pb,
                                  const uint8_t type, const Palette &pal,
-                                 const std::vector<uint8_t> &compressed,
+                                 const EncBuf &compressed,
                                  const uint8_t isWebp)
 {
   PixelBuffer *ppb;
   Encoder *encoder;
 
-  encoder = startRect(rect, type, compressed.size() == 0, isWebp);
+  encoder = startRect(rect, type, !compressed, isWebp);
 
-  if (compressed.size()) {
+  if (compressed) {
     if (isWebp) {
-      ((TightWEBPEncoder *) encoder)->writeOnly(compressed);
+      ((TightWEBPEncoder *) encoder)->writeOnly(*compressed);
       webpstats.area += rect.area();
       webpstats.rects++;
     } else if (encoders[encoderTightQOI]->isSupported()) {
-      ((TightQOIEncoder *) encoder)->writeOnly(compressed);
+      ((TightQOIEncoder *) encoder)->writeOnly(*compressed);
       jpegstats.area += rect.area(); // Also QOI for now
       jpegstats.rects++;
     } else {
-      ((TightJPEGEncoder *) encoder)->writeOnly(compressed);
+      ((TightJPEGEncoder *) encoder)->writeOnly(*compressed);
       jpegstats.area += rect.area();
       jpegstats.rects++;
     }
@@ -1660,97 +1839,18 @@ void EncodeManager::updateQualities() {
   struct timeval now;
   gettimeofday(&now, NULL);
 
-  // Remove elements that haven't been touched in 5s. Update the scores.
-  for (std::list<QualityInfo*>::iterator it = qualityList.begin(); it != qualityList.end(); ) {
-    QualityInfo * const cur = *it;
-    const unsigned since = msBetween(&cur->lastUpdate, &now);
-    if (since > 5000) {
-      delete cur;
-      it = qualityList.erase(it);
-    } else {
-      cur->score -= cur->score / 16;
-      it++;
-    }
-  }
-}
-
-static bool closeEnough(const Rect& unioned, const int& unionArea,
-                        const Rect& check, const int& checkArea) {
-  const Point p = unioned.tl.subtract(check.tl);
-  if (abs(p.x) > 32 ||
-      abs(p.y) > 32)
-      return false;
-
-  if (abs(unionArea - checkArea) > 4096)
-    return false;
-
-  return true;
+  qualityTracker.update(now);
 }
 
 void EncodeManager::trackRectQuality(const Rect& rect) {
-
-  const int searchArea = rect.area();
   struct timeval now;
   gettimeofday(&now, NULL);
 
-  for (std::list<QualityInfo*>::iterator it = qualityList.begin(); it != qualityList.end(); it++) {
-    QualityInfo * const cur = *it;
-    const int curArea = cur->rect.area();
-    const Rect unioned = cur->rect.union_boundary(rect);
-    const int unionArea = unioned.area();
-    // Is this close enough to match?
-    // e.g. ads that change parts in one frame and more in others
-    if (rect.enclosed_by(cur->rect) ||
-        cur->rect.enclosed_by(rect) ||
-        closeEnough(unioned, unionArea, cur->rect, curArea) ||
-        closeEnough(unioned, unionArea, rect, searchArea)) {
-
-        // This existing rect matched. Set it to the larger of the two,
-        // and add to its score.
-        if (searchArea > curArea)
-          cur->rect = rect;
-
-        cur->score += SCORE_INCREMENT;
-        cur->lastUpdate = now;
-        return;
-    }
-  }
-
-  // It wasn't found, add it
-  QualityInfo *info = new QualityInfo;
-  info->rect = rect;
-  info->score = 0;
-  info->lastUpdate = now;
-  qualityList.push_back(info);
+  qualityTracker.track(rect, now);
 }
 
-// Returns the change-tracked quality, 0-128, where 128 is max quality
 unsigned EncodeManager::getQuality(const Rect& rect) const {
-
-  const int searchArea = rect.area();
-
-  for (std::list<QualityInfo*>::const_iterator it = qualityList.begin(); it != qualityList.end(); it++) {
-    const QualityInfo * const cur = *it;
-    const int curArea = cur->rect.area();
-    const Rect unioned = cur->rect.union_boundary(rect);
-    const int unionArea = unioned.area();
-    // Is this close enough to match?
-    // e.g. ads that change parts in one frame and more in others
-    if (rect.enclosed_by(cur->rect) ||
-        cur->rect.enclosed_by(rect) ||
-        closeEnough(unioned, unionArea, cur->rect, curArea) ||
-        closeEnough(unioned, unionArea, rect, searchArea)) {
-
-        unsigned score = cur->score;
-        if (score > 128)
-          score = 128;
-        score = 128 - score;
-
-        return score;
-    }
-  }
-
-  return 128; // Not found, this shouldn't happen - return max quality then
+  return qualityTracker.getQuality(rect);
 }
 
 // Returns the scaled quality, 0-9, where 9 is max
@@ -1767,13 +1867,35 @@ unsigned EncodeManager::scaledQuality(const Rect& rect) const {
   dynamic /= 128;
   dynamic += dynamicQualityMin;
 
-  // Bandwidth adjustment
-  if (!Server::preferBandwidth) {
+  if (rateControlled) {
+    // The tracker only ranks the rects against each other, the level
+    // comes from what the frame can afford
+    const int planned = rateController.getQuality();
+    int level = planned - (dynamicQualityMin + dynamicQualityOff - (int) dynamic);
+
+    if (!Server::preferBandwidth && level < 7)
+      level = __rfbmin(planned, 7);
+    if (level < dynamicQualityMin)
+      level = dynamicQualityMin;
+
+    dynamic = level;
+  } else if (!Server::preferBandwidth) {
+    // Bandwidth adjustment
     // Prefer quality, if there's bandwidth available, don't go below 7
     if (curMaxUpdateSize > 2000 && dynamic < 7)
       dynamic = 7;
   }
 
+  // Sharper where the user is looking, softer elsewhere
+  if (roiRaise || roiLower) {
+    if (inRegionOfInterest(rect)) {
+      if ((int) dynamic < dynamicQualityMin + dynamicQualityOff)
+        dynamic += roiRaise;
+    } else if ((int) dynamic > dynamicQualityMin) {
+      dynamic -= roiLower;
+    }
+  }
+
   return dynamic;
 }
 
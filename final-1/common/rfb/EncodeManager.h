@@ -22,11 +22,13 @@
 #define __RFB_ENCODEMANAGER_H__
 
 #include <vector>
-#include <list>
 
 #include <rdr/types.h>
+#include <rfb/EncBuf.h>
 #include <rfb/PixelBuffer.h>
+#include <rfb/QualityTracker.h>
 #include <rfb/Region.h>
+#include <rfb/RateController.h>
 #include <rfb/Timer.h>
 #include <rfb/UpdateTracker.h>
 
@@ -43,14 +45,16 @@ namespace rfb {
   class PixelBuffer;
   class RenderedCursor;
   class EncCache;
+  class ScaledFrames;
+  class ScaledShadow;
+  struct EncId;
   struct Rect;
 
   struct RectInfo;
-  struct QualityInfo;
 
   class EncodeManager: public Timer::Callback {
   public:
-    EncodeManager(SConnection* conn, EncCache *encCache);
+    EncodeManager(SConnection* conn, EncCache *encCache, ScaledFrames *scaledFrames);
     ~EncodeManager() override;
 
     void logStats();
@@ -80,6 +84,22 @@ namespace rfb {
         return scalingTime;
     };
 
+    // If maxUpdateSize comes from a real bandwidth estimate
+    void setBandwidthKnown(bool known) {
+        bandwidthKnown = known;
+    };
+
+    // Where the user is looking, the pointer and the focused window
+    void setRegionOfInterest(const Point &pointer, const Rect &focus) {
+        roiPointer = pointer;
+        roiFocus = focus;
+    };
+
+    // NULL unless the last frame went through the rate controller
+    [[nodiscard]] const RateController *getRateControl() const {
+        return rateControlled ? &rateController : NULL;
+    };
+
     void resetZlib();
 
     struct codecstats_t {
@@ -99,6 +119,7 @@ namespace rfb {
     void prepareEncoders(bool allowLossy);
 
     Region getLosslessRefresh(const Region& req, size_t maxUpdateSize);
+    void pruneLossyAreas();
 
     int computeNumRects(const Region& changed);
 
@@ -114,15 +135,18 @@ namespace rfb {
                     const struct timeval *start = NULL,
                     const bool mainScreen = false);
     void checkWebpFallback(const struct timeval *start);
+    void planRate(const std::vector<Rect> &rects);
+    bool inRegionOfInterest(const Rect &rect) const;
+    void planRegionOfInterest(std::vector<Rect> &rects);
     void updateVideoStats(const std::vector<Rect> &rects, const PixelBuffer* pb);
 
     void writeSubRect(const Rect& rect, const PixelBuffer *pb, const uint8_t type,
-                      const Palette& pal, const std::vector<uint8_t> &compressed,
+                      const Palette& pal, const EncBuf &compressed,
                       const uint8_t isWebp);
 
     uint8_t getEncoderType(const Rect& rect, const PixelBuffer *pb, Palette *pal,
-                           std::vector<uint8_t> &compressed, uint8_t *isWebp,
-                           uint8_t *fromCache,
+                           EncBuf &compressed, uint8_t *isWebp,
+                           uint8_t *fromCache, EncId *id,
                            const PixelBuffer *scaledpb, const Rect& scaledrect,
                            uint32_t &ms) const;
 
@@ -175,6 +199,17 @@ namespace rfb {
 
     Region lossyRegion;
 
+    // When and how well each lossy rect was sent, oldest first, so the
+    // refinement can pick what has been still the longest
+    struct LossyArea {
+      Rect rect;
+      struct timeval since;
+      int quality;
+    };
+    std::vector<LossyArea> lossyAreas;
+    bool refining;
+    float refineBpp, refineUsPerPixel;
+
     struct EncoderStats {
       unsigned rects;
       unsigned long long bytes;
@@ -183,7 +218,7 @@ namespace rfb {
     };
     typedef std::vector< std::vector<struct EncoderStats> > StatsVector;
 
-    std::list<QualityInfo*> qualityList;
+    QualityTracker qualityTracker;
     int dynamicQualityMin;
     int dynamicQualityOff;
 
@@ -192,6 +227,8 @@ namespace rfb {
     bool videoDetected;
     Timer videoTimer;
     uint16_t maxVideoX, maxVideoY;
+    ScaledFrames *scaledFrames;
+    ScaledShadow *videoShadow;
 
     unsigned updates;
     EncoderStats copyStats;
@@ -203,11 +240,17 @@ namespace rfb {
     unsigned webpFallbackUs;
     unsigned webpBenchResult;
     std::atomic<bool> webpTookTooLong{false};
+    RateController rateController;
+    bool rateControlled, bandwidthKnown;
+    Point roiPointer;
+    Rect roiFocus;
+    int roiRaise, roiLower;
     unsigned encodingTime;
     unsigned maxEncodingTime, framesSinceEncPrint;
     unsigned scalingTime;
 
     EncCache *encCache;
+    uint32_t encCachePF;
 
     class OffsetPixelBuffer : public FullFramePixelBuffer {
     public:
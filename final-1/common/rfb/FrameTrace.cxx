@@ -0,0 +1,224 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <mutex>
+#include <vector>
+#include <rfb/FrameTrace.h>
+
+using namespace rfb;
+
+std::atomic<bool> FrameTrace::enabled(true);
+
+// A span is three words: start, duration << 8 | stage, tid << 32 | arg.
+// Every word is atomic so that a reader racing the writer gets garbage
+// at worst, which the head check then throws away.
+struct traceRing_t {
+  std::atomic<rdr::U64> head;
+  std::atomic<rdr::U64> spans[FrameTrace::RING_SIZE][3];
+
+  std::atomic<bool> inUse;
+  rdr::U32 tid;
+  char name[16];
+};
+
+static std::mutex ringsMutex;
+static std::vector<traceRing_t *> rings;
+
+// Rings outlive their threads and get handed to new ones, so threads
+// coming and going don't grow memory
+struct ringHolder_t {
+  traceRing_t *ring;
+
+  ringHolder_t(): ring(NULL) {}
+  ~ringHolder_t() {
+    if (ring)
+      ring->inUse.store(false, std::memory_order_release);
+  }
+};
+
+static thread_local ringHolder_t ringHolder;
+
+static traceRing_t *getRing()
+{
+  if (ringHolder.ring)
+    return ringHolder.ring;
+
+  std::lock_guard<std::mutex> lock(ringsMutex);
+
+  traceRing_t *ring = NULL;
+  for (size_t i = 0; i < rings.size(); i++) {
+    if (!rings[i]->inUse.load(std::memory_order_acquire)) {
+      ring = rings[i];
+      break;
+    }
+  }
+
+  if (!ring) {
+    ring = new traceRing_t;
+    ring->head.store(0, std::memory_order_relaxed);
+    rings.push_back(ring);
+  }
+
+  ring->inUse.store(true, std::memory_order_relaxed);
+  ring->tid = syscall(SYS_gettid);
+  if (pthread_getname_np(pthread_self(), ring->name, sizeof(ring->name)))
+    strcpy(ring->name, "unknown");
+
+  ringHolder.ring = ring;
+  return ring;
+}
+
+rdr::U64 FrameTrace::now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (rdr::U64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void FrameTrace::record(TraceStage stage, rdr::U64 startNs, rdr::U64 endNs,
+                        rdr::U32 arg)
+{
+  traceRing_t * const ring = getRing();
+  const rdr::U64 head = ring->head.load(std::memory_order_relaxed);
+  std::atomic<rdr::U64> * const span = ring->spans[head % RING_SIZE];
+
+  // Pairs with the fence in exportChromeTrace(): a reader that sees any
+  // of these stores also sees the head that came before them
+  std::atomic_thread_fence(std::memory_order_release);
+
+  span[0].store(startNs, std::memory_order_relaxed);
+  span[1].store((endNs - startNs) << 8 | stage, std::memory_order_relaxed);
+  span[2].store((rdr::U64) ring->tid << 32 | arg, std::memory_order_relaxed);
+
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+static const char *stageName(unsigned stage)
+{
+  switch (stage) {
+  case TRACE_FRAME:
+    return "frame";
+  case TRACE_GRAB:
+    return "grabRegion";
+  case TRACE_COMPARE:
+    return "compare";
+  case TRACE_SCROLL_DETECT:
+    return "scrollDetect";
+  case TRACE_SCALE:
+    return "scale";
+  case TRACE_ENCODE_RECT:
+    return "encodeRect";
+  case TRACE_CLIENT_UPDATE:
+    return "clientUpdate";
+  case TRACE_FLUSH:
+    return "flush";
+  case TRACE_UDP_SEND:
+    return "udpSend";
+  }
+
+  return "unknown";
+}
+
+static const char *stageArgName(unsigned stage)
+{
+  switch (stage) {
+  case TRACE_FRAME:
+    return "clients";
+  case TRACE_SCALE:
+  case TRACE_ENCODE_RECT:
+    return "pixels";
+  case TRACE_UDP_SEND:
+    return "bytes";
+  }
+
+  return NULL;
+}
+
+std::string FrameTrace::exportChromeTrace()
+{
+  std::string out;
+  std::vector<rdr::U64> copy;
+  char buf[256];
+  const int pid = getpid();
+  bool first = true;
+
+  out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+  std::lock_guard<std::mutex> lock(ringsMutex);
+
+  for (size_t r = 0; r < rings.size(); r++) {
+    traceRing_t * const ring = rings[r];
+
+    if (ring->inUse.load(std::memory_order_acquire)) {
+      snprintf(buf, sizeof(buf),
+               "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+               "\"args\":{\"name\":\"%s\"}}",
+               first ? "" : ",\n", pid, ring->tid, ring->name);
+      out += buf;
+      first = false;
+    }
+
+    const rdr::U64 head = ring->head.load(std::memory_order_acquire);
+    const rdr::U64 from = head > RING_SIZE ? head - RING_SIZE : 0;
+
+    copy.resize((head - from) * 3);
+    for (rdr::U64 i = from; i < head; i++) {
+      for (unsigned w = 0; w < 3; w++)
+        copy[(i - from) * 3 + w] =
+          ring->spans[i % RING_SIZE][w].load(std::memory_order_relaxed);
+    }
+
+    // Whatever the writer got to while we copied can't be trusted
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const rdr::U64 newHead = ring->head.load(std::memory_order_acquire);
+    const rdr::U64 valid = newHead >= RING_SIZE ? newHead - RING_SIZE + 1 : 0;
+
+    for (rdr::U64 i = from < valid ? valid : from; i < head; i++) {
+      const rdr::U64 *span = &copy[(i - from) * 3];
+      const unsigned stage = span[1] & 0xff;
+      const char *argName = stageArgName(stage);
+      int len;
+
+      len = snprintf(buf, sizeof(buf),
+                     "%s{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\","
+                     "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u",
+                     first ? "" : ",\n", stageName(stage),
+                     span[0] / 1000.0, (span[1] >> 8) / 1000.0,
+                     pid, (unsigned) (span[2] >> 32));
+      if (argName)
+        snprintf(buf + len, sizeof(buf) - len, ",\"args\":{\"%s\":%u}}",
+                 argName, (unsigned) span[2]);
+      else
+        snprintf(buf + len, sizeof(buf) - len, "}");
+
+      out += buf;
+      first = false;
+    }
+  }
+
+  out += "\n]}\n";
+
+  return out;
+}
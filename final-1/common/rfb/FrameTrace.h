@@ -0,0 +1,94 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+// -=- FrameTrace.h - Always-on tracing of the frame pipeline
+
+#ifndef __RFB_FRAMETRACE_H__
+#define __RFB_FRAMETRACE_H__
+
+#include <atomic>
+#include <string>
+#include <rdr/types.h>
+
+namespace rfb {
+
+  enum TraceStage {
+    TRACE_FRAME,
+    TRACE_GRAB,
+    TRACE_COMPARE,
+    TRACE_SCROLL_DETECT,
+    TRACE_SCALE,
+    TRACE_ENCODE_RECT,
+    TRACE_CLIENT_UPDATE,
+    TRACE_FLUSH,
+    TRACE_UDP_SEND,
+    TRACE_NUM_STAGES
+  };
+
+  // Every thread that records spans gets its own ring holding the last
+  // RING_SIZE of them. Recording is two clock reads and a few relaxed
+  // stores, with no locks and no allocation after the first span of a
+  // thread. exportChromeTrace() may run on any thread while the rings
+  // are being written, and skips spans that were overwritten under it.
+  // The result loads in chrome://tracing and Perfetto.
+
+  class FrameTrace {
+  public:
+    enum { RING_SIZE = 8192 };
+
+    static bool isEnabled() {
+      return enabled.load(std::memory_order_relaxed);
+    }
+    static void setEnabled(bool enable) {
+      enabled.store(enable, std::memory_order_relaxed);
+    }
+
+    // Monotonic clock in nanoseconds
+    static rdr::U64 now();
+
+    static void record(TraceStage stage, rdr::U64 startNs, rdr::U64 endNs,
+                       rdr::U32 arg = 0);
+
+    static std::string exportChromeTrace();
+
+  private:
+    static std::atomic<bool> enabled;
+  };
+
+  // Records the lifetime of the object as one span
+  class TraceSpan {
+  public:
+    TraceSpan(TraceStage stage_, rdr::U32 arg_ = 0)
+      : stage(stage_), arg(arg_),
+        start(FrameTrace::isEnabled() ? FrameTrace::now() : 0) {}
+    ~TraceSpan() {
+      if (start)
+        FrameTrace::record(stage, start, FrameTrace::now(), arg);
+    }
+
+    void setArg(rdr::U32 arg_) { arg = arg_; }
+
+  private:
+    TraceStage stage;
+    rdr::U32 arg;
+    rdr::U64 start;
+  };
+
+}
+
+#endif
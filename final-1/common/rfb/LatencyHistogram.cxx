@@ -0,0 +1,137 @@
+/* Copyright (C) 2024 - Latency Tracking Module
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+// -=- LatencyHistogram.cxx - Fixed-size, lock-free latency histogram
+
+#include <rfb/LatencyHistogram.h>
+#include <math.h>
+
+using namespace rfb;
+
+static const rdr::U64 maxValue = 0xffffffffULL;
+
+LatencyHistogram::LatencyHistogram()
+{
+  reset();
+}
+
+unsigned LatencyHistogram::bucketIndex(rdr::U64 us)
+{
+  if (us > maxValue)
+    us = maxValue;
+  if (us < SUB_COUNT)
+    return us;
+
+  const unsigned shift = 63 - __builtin_clzll(us) - SUB_BITS + 1;
+
+  return shift * HALF_COUNT + (us >> shift);
+}
+
+rdr::U64 LatencyHistogram::bucketLow(unsigned idx)
+{
+  if (idx < SUB_COUNT)
+    return idx;
+
+  const unsigned shift = idx / HALF_COUNT - 1;
+
+  return (rdr::U64) (idx - shift * HALF_COUNT) << shift;
+}
+
+rdr::U64 LatencyHistogram::bucketHigh(unsigned idx)
+{
+  if (idx < SUB_COUNT)
+    return idx + 1;
+
+  const unsigned shift = idx / HALF_COUNT - 1;
+
+  return (rdr::U64) (idx - shift * HALF_COUNT + 1) << shift;
+}
+
+void LatencyHistogram::record(rdr::U64 us)
+{
+  counts[bucketIndex(us)].fetch_add(1, std::memory_order_relaxed);
+  count.fetch_add(1, std::memory_order_relaxed);
+  sumUs.fetch_add(us, std::memory_order_relaxed);
+  lastUs.store(us, std::memory_order_relaxed);
+
+  rdr::U64 cur = minUs.load(std::memory_order_relaxed);
+  while (us < cur &&
+         !minUs.compare_exchange_weak(cur, us, std::memory_order_relaxed))
+    ;
+
+  cur = maxUs.load(std::memory_order_relaxed);
+  while (us > cur &&
+         !maxUs.compare_exchange_weak(cur, us, std::memory_order_relaxed))
+    ;
+}
+
+void LatencyHistogram::reset()
+{
+  for (unsigned i = 0; i < NUM_BUCKETS; i++)
+    counts[i].store(0, std::memory_order_relaxed);
+
+  count.store(0, std::memory_order_relaxed);
+  sumUs.store(0, std::memory_order_relaxed);
+  minUs.store(~0ULL, std::memory_order_relaxed);
+  maxUs.store(0, std::memory_order_relaxed);
+  lastUs.store(0, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::snapshot(Snapshot* out) const
+{
+  out->count = 0;
+  for (unsigned i = 0; i < NUM_BUCKETS; i++) {
+    out->counts[i] = counts[i].load(std::memory_order_relaxed);
+    out->count += out->counts[i];
+  }
+
+  out->sumUs = sumUs.load(std::memory_order_relaxed);
+  out->minUs = out->count ? minUs.load(std::memory_order_relaxed) : 0;
+  out->maxUs = maxUs.load(std::memory_order_relaxed);
+  out->lastUs = lastUs.load(std::memory_order_relaxed);
+}
+
+double LatencyHistogram::Snapshot::mean() const
+{
+  if (!count)
+    return 0.0;
+
+  return sumUs / 1000.0 / count;
+}
+
+double LatencyHistogram::Snapshot::percentile(double p) const
+{
+  if (!count)
+    return 0.0;
+
+  rdr::U64 rank = (rdr::U64) ceil(p / 100.0 * count);
+  if (rank < 1)
+    rank = 1;
+
+  rdr::U64 seen = 0;
+  unsigned i;
+  for (i = 0; i < NUM_BUCKETS - 1; i++) {
+    seen += counts[i];
+    if (seen >= rank)
+      break;
+  }
+
+  // Middle of the bucket, but never outside what was actually seen
+  rdr::U64 us = (bucketLow(i) + bucketHigh(i) - 1) / 2;
+  if (us < minUs)
+    us = minUs;
+  if (us > maxUs)
+    us = maxUs;
+
+  return us / 1000.0;
+}
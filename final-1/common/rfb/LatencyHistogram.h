@@ -0,0 +1,68 @@
+/* Copyright (C) 2024 - Latency Tracking Module
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+// -=- LatencyHistogram.h - Fixed-size, lock-free latency histogram
+
+#ifndef __RFB_LATENCYHISTOGRAM_H__
+#define __RFB_LATENCYHISTOGRAM_H__
+
+#include <atomic>
+#include <rdr/types.h>
+
+namespace rfb {
+
+  // Log-linear histogram of durations in microseconds, along the lines
+  // of HdrHistogram. Values below 64us get a bucket each, above that
+  // every power of two is split into 32 buckets, so results are within
+  // about 3%. Anything past 2^32us (71 minutes) lands in the top bucket.
+  //
+  // record() only does relaxed atomic adds, so it never blocks. Readers
+  // take a snapshot, which may miss the few samples recorded meanwhile.
+
+  class LatencyHistogram {
+  public:
+    enum {
+      SUB_BITS = 6,
+      SUB_COUNT = 1 << SUB_BITS,
+      HALF_COUNT = SUB_COUNT / 2,
+      NUM_BUCKETS = (32 - SUB_BITS + 2) * HALF_COUNT
+    };
+
+    LatencyHistogram();
+
+    void record(rdr::U64 us);
+    void reset();
+
+    struct Snapshot {
+      rdr::U64 counts[NUM_BUCKETS];
+      rdr::U64 count, sumUs, minUs, maxUs, lastUs;
+
+      // All in milliseconds, 0 when empty
+      double mean() const;
+      double percentile(double p) const;
+    };
+
+    void snapshot(Snapshot* out) const;
+
+    static unsigned bucketIndex(rdr::U64 us);
+    static rdr::U64 bucketLow(unsigned idx);
+    static rdr::U64 bucketHigh(unsigned idx);
+
+  private:
+    std::atomic<rdr::U64> counts[NUM_BUCKETS];
+    std::atomic<rdr::U64> count, sumUs, minUs, maxUs, lastUs;
+  };
+
+} // namespace rfb
+
+#endif // __RFB_LATENCYHISTOGRAM_H__
@@ -30,13 +30,30 @@ std::string LatencyMetrics::doubleToString(double value, int precision)
   return stream.str();
 }
 
-std::string LatencyMetrics::getTimestampString(const struct timeval& tv)
+void LatencyMetrics::writeHistogramCSV(std::ostringstream& csv, const char* type,
+                                       const LatencyHistogram::Snapshot& snap)
 {
-  char buffer[32];
-  time_t t = tv.tv_sec;
-  struct tm* tm_info = localtime(&t);
-  strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", tm_info);
-  return std::string(buffer);
+  for (unsigned i = 0; i < LatencyHistogram::NUM_BUCKETS; i++) {
+    if (!snap.counts[i])
+      continue;
+
+    csv << type << ","
+        << doubleToString(LatencyHistogram::bucketLow(i) / 1000.0, 3) << ","
+        << doubleToString(LatencyHistogram::bucketHigh(i) / 1000.0, 3) << ","
+        << snap.counts[i] << "\n";
+  }
+}
+
+void LatencyMetrics::writePercentilesJSON(std::ostringstream& json, const char* name,
+                                          const LatencyHistogram::Snapshot& snap,
+                                          bool last)
+{
+  json << "    \"" << name << "\": { "
+       << "\"p50\": " << doubleToString(snap.percentile(50)) << ", "
+       << "\"p95\": " << doubleToString(snap.percentile(95)) << ", "
+       << "\"p99\": " << doubleToString(snap.percentile(99)) << ", "
+       << "\"p99_9\": " << doubleToString(snap.percentile(99.9)) << ", "
+       << "\"count\": " << snap.count << " }" << (last ? "\n" : ",\n");
 }
 
 std::string LatencyMetrics::exportToJSON(const LatencyTracker& tracker)
@@ -56,6 +73,10 @@ std::string LatencyMetrics::exportToJSON(const LatencyTracker& tracker)
   json << "    \"average\": " << doubleToString(stats.avgClickLatency) << ",\n";
   json << "    \"minimum\": " << doubleToString(stats.minClickLatency) << ",\n";
   json << "    \"maximum\": " << doubleToString(stats.maxClickLatency) << ",\n";
+  json << "    \"p50\": " << doubleToString(stats.p50ClickLatency) << ",\n";
+  json << "    \"p95\": " << doubleToString(stats.p95ClickLatency) << ",\n";
+  json << "    \"p99\": " << doubleToString(stats.p99ClickLatency) << ",\n";
+  json << "    \"p99_9\": " << doubleToString(stats.p999ClickLatency) << ",\n";
   json << "    \"count\": " << stats.clickCount << "\n";
   json << "  },\n";
   json << "  \"display_latency\": {\n";
@@ -63,24 +84,24 @@ std::string LatencyMetrics::exportToJSON(const LatencyTracker& tracker)
   json << "    \"average\": " << doubleToString(stats.avgDisplayLatency) << ",\n";
   json << "    \"minimum\": " << doubleToString(stats.minDisplayLatency) << ",\n";
   json << "    \"maximum\": " << doubleToString(stats.maxDisplayLatency) << ",\n";
+  json << "    \"p50\": " << doubleToString(stats.p50DisplayLatency) << ",\n";
+  json << "    \"p95\": " << doubleToString(stats.p95DisplayLatency) << ",\n";
+  json << "    \"p99\": " << doubleToString(stats.p99DisplayLatency) << ",\n";
+  json << "    \"p99_9\": " << doubleToString(stats.p999DisplayLatency) << ",\n";
   json << "    \"count\": " << stats.displayCount << "\n";
   json << "  },\n";
-  json << "  \"detailed_records\": [\n";
-  
-  const auto& latencies = tracker.getAllLatencies();
-  for (size_t i = 0; i < latencies.size(); ++i) {
-    const auto& data = latencies[i];
-    json << "    {\n";
-    json << "      \"id\": " << data.id << ",\n";
-    json << "      \"type\": \"" << (data.eventType == 0 ? "click" : "display") << "\",\n";
-    json << "      \"latency_ms\": " << doubleToString(data.latencyMs) << ",\n";
-    json << "      \"timestamp\": \"" << getTimestampString(data.timestamp) << "\"\n";
-    json << "    }";
-    if (i < latencies.size() - 1) json << ",";
-    json << "\n";
+
+  // Per stage times are from the previous stage
+  LatencyHistogram::Snapshot snap;
+  json << "  \"input_to_photon\": {\n";
+  for (int stage = LatencyTracker::STAGE_DAMAGE;
+       stage < LatencyTracker::NUM_STAGES; stage++) {
+    tracker.getStageHistogram(stage, &snap);
+    writePercentilesJSON(json, LatencyTracker::stageName(stage), snap, false);
   }
-  
-  json << "  ]\n";
+  tracker.getInputToPhotonHistogram(&snap);
+  writePercentilesJSON(json, "total", snap, true);
+  json << "  }\n";
   json << "}\n";
   
   return json.str();
@@ -90,17 +111,23 @@ std::string LatencyMetrics::exportToCSV(const LatencyTracker& tracker)
 {
   std::ostringstream csv;
   
+  LatencyHistogram::Snapshot snap;
+
   // Header
-  csv << "ID,Type,Latency(ms),Timestamp\n";
-  
-  // Data
-  const auto& latencies = tracker.getAllLatencies();
-  for (const auto& data : latencies) {
-    csv << data.id << ","
-        << (data.eventType == 0 ? "click" : "display") << ","
-        << doubleToString(data.latencyMs) << ","
-        << getTimestampString(data.timestamp) << "\n";
+  csv << "Type,From(ms),To(ms),Count\n";
+  
+  // One row per non-empty bucket
+  tracker.getClickHistogram(&snap);
+  writeHistogramCSV(csv, "click", snap);
+  tracker.getDisplayHistogram(&snap);
+  writeHistogramCSV(csv, "display", snap);
+  for (int stage = LatencyTracker::STAGE_DAMAGE;
+       stage < LatencyTracker::NUM_STAGES; stage++) {
+    tracker.getStageHistogram(stage, &snap);
+    writeHistogramCSV(csv, LatencyTracker::stageName(stage), snap);
   }
+  tracker.getInputToPhotonHistogram(&snap);
+  writeHistogramCSV(csv, "input_to_photon", snap);
   
   return csv.str();
 }
@@ -117,6 +144,10 @@ std::string LatencyMetrics::exportStatistics(const LatencyTracker& tracker)
   stats_str << "  Average: " << doubleToString(stats.avgClickLatency) << " ms\n";
   stats_str << "  Minimum: " << doubleToString(stats.minClickLatency) << " ms\n";
   stats_str << "  Maximum: " << doubleToString(stats.maxClickLatency) << " ms\n";
+  stats_str << "  p50: " << doubleToString(stats.p50ClickLatency) << " ms\n";
+  stats_str << "  p95: " << doubleToString(stats.p95ClickLatency) << " ms\n";
+  stats_str << "  p99: " << doubleToString(stats.p99ClickLatency) << " ms\n";
+  stats_str << "  p99.9: " << doubleToString(stats.p999ClickLatency) << " ms\n";
   stats_str << "  Last: " << doubleToString(tracker.getLastClickLatency()) << " ms\n\n";
   
   stats_str << "DISPLAY LATENCY:\n";
@@ -124,7 +155,25 @@ std::string LatencyMetrics::exportStatistics(const LatencyTracker& tracker)
   stats_str << "  Average: " << doubleToString(stats.avgDisplayLatency) << " ms\n";
   stats_str << "  Minimum: " << doubleToString(stats.minDisplayLatency) << " ms\n";
   stats_str << "  Maximum: " << doubleToString(stats.maxDisplayLatency) << " ms\n";
-  stats_str << "  Last: " << doubleToString(tracker.getLastDisplayLatency()) << " ms\n";
+  stats_str << "  p50: " << doubleToString(stats.p50DisplayLatency) << " ms\n";
+  stats_str << "  p95: " << doubleToString(stats.p95DisplayLatency) << " ms\n";
+  stats_str << "  p99: " << doubleToString(stats.p99DisplayLatency) << " ms\n";
+  stats_str << "  p99.9: " << doubleToString(stats.p999DisplayLatency) << " ms\n";
+  stats_str << "  Last: " << doubleToString(tracker.getLastDisplayLatency()) << " ms\n\n";
+
+  LatencyHistogram::Snapshot snap;
+  stats_str << "INPUT TO PHOTON (p50 / p99):\n";
+  for (int stage = LatencyTracker::STAGE_DAMAGE;
+       stage < LatencyTracker::NUM_STAGES; stage++) {
+    tracker.getStageHistogram(stage, &snap);
+    stats_str << "  " << LatencyTracker::stageName(stage) << ": "
+              << doubleToString(snap.percentile(50)) << " / "
+              << doubleToString(snap.percentile(99)) << " ms\n";
+  }
+  tracker.getInputToPhotonHistogram(&snap);
+  stats_str << "  Total: " << doubleToString(snap.percentile(50)) << " / "
+            << doubleToString(snap.percentile(99)) << " ms ("
+            << snap.count << " samples)\n";
   
   return stats_str.str();
 }
@@ -17,6 +17,7 @@
 #define __RFB_LATENCYMETRICS_H__
 
 #include <rfb/LatencyTracker.h>
+#include <sstream>
 #include <string>
 
 namespace rfb {
@@ -26,7 +27,7 @@ namespace rfb {
     // Export to JSON format for dashboard
     static std::string exportToJSON(const LatencyTracker& tracker);
     
-    // Export to CSV format for logging
+    // Export the latency histograms in CSV format for logging
     static std::string exportToCSV(const LatencyTracker& tracker);
     
     // Export detailed statistics
@@ -40,7 +41,11 @@ namespace rfb {
   private:
     // Helper functions
     static std::string doubleToString(double value, int precision = 2);
-    static std::string getTimestampString(const struct timeval& tv);
+    static void writeHistogramCSV(std::ostringstream& csv, const char* type,
+                                  const LatencyHistogram::Snapshot& snap);
+    static void writePercentilesJSON(std::ostringstream& json, const char* name,
+                                     const LatencyHistogram::Snapshot& snap,
+                                     bool last);
   };
 
 } // namespace rfb
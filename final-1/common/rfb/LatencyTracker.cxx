@@ -14,10 +14,8 @@
 // -=- LatencyTracker.cxx - Implementation of latency tracking
 
 #include <rfb/LatencyTracker.h>
-#include <rfb/util.h>
 #include <rfb/LogWriter.h>
-#include <os/Mutex.h>
-#include <algorithm>
+#include <time.h>
 
 using namespace rfb;
 
@@ -25,211 +23,344 @@ static rfb::LogWriter vlog("LatencyTracker");
 
 LatencyTracker::LatencyTracker()
 {
-  mutex = new os::Mutex();
+  reset();
 }
 
 LatencyTracker::~LatencyTracker()
 {
-  delete mutex;
 }
 
-double LatencyTracker::timeDiffMs(const struct timeval& start, const struct timeval& end)
+rdr::U64 LatencyTracker::nowUs()
 {
-  long seconds = end.tv_sec - start.tv_sec;
-  long microseconds = end.tv_usec - start.tv_usec;
-  
-  if (microseconds < 0) {
-    seconds--;
-    microseconds += 1000000;
-  }
-  
-  return (seconds * 1000.0) + (microseconds / 1000.0);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (rdr::U64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-void LatencyTracker::recordClickStart(rdr::U32 clickId, int x, int y)
+void LatencyTracker::startEvent(PendingEvent* ring, rdr::U32 id)
 {
-  os::AutoMutex a(mutex);
-  
-  ClickEvent& ce = clickEvents[clickId];
-  gettimeofday(&ce.startTime, NULL);
-  ce.x = x;
-  ce.y = y;
-  ce.completed = false;
+  PendingEvent& pe = ring[id % MAX_PENDING];
+
+  pe.startUs.store(nowUs(), std::memory_order_relaxed);
+  pe.id.store(id, std::memory_order_release);
+}
+
+bool LatencyTracker::completeEvent(PendingEvent* ring, rdr::U32 id, rdr::U64* us)
+{
+  PendingEvent& pe = ring[id % MAX_PENDING];
+
+  if (pe.id.load(std::memory_order_acquire) != id)
+    return false;
+
+  // A start of 0 means this one was already completed
+  const rdr::U64 start = pe.startUs.exchange(0, std::memory_order_relaxed);
+  if (!start)
+    return false;
+
+  *us = nowUs() - start;
+  return true;
+}
+
+void LatencyTracker::recordClickStart(rdr::U32 clickId)
+{
+  startEvent(pendingClicks, clickId);
 }
 
 void LatencyTracker::recordClickComplete(rdr::U32 clickId)
 {
-  os::AutoMutex a(mutex);
-  
-  std::map<rdr::U32, ClickEvent>::iterator it = clickEvents.find(clickId);
-  if (it == clickEvents.end()) {
+  rdr::U64 us;
+
+  if (!completeEvent(pendingClicks, clickId, &us)) {
     vlog.debug("Click event %u not found", clickId);
     return;
   }
-  
-  gettimeofday(&it->second.completeTime, NULL);
-  it->second.completed = true;
-  
-  double latency = timeDiffMs(it->second.startTime, it->second.completeTime);
-  
-  LatencyData data;
-  data.id = clickId;
-  data.latencyMs = latency;
-  data.eventType = 0; // Click
-  gettimeofday(&data.timestamp, NULL);
-  
-  recordedLatencies.push_back(data);
-  
-  vlog.debug("Click %u latency: %.2f ms at (%d, %d)", clickId, latency, it->second.x, it->second.y);
+
+  clickHistogram.record(us);
+
+  vlog.debug("Click %u latency: %.2f ms", clickId, us / 1000.0);
 }
 
 void LatencyTracker::recordDisplayStart(rdr::U32 frameId)
 {
-  os::AutoMutex a(mutex);
-  
-  DisplayEvent& de = displayEvents[frameId];
-  gettimeofday(&de.startTime, NULL);
-  de.completed = false;
+  startEvent(pendingDisplays, frameId);
 }
 
 void LatencyTracker::recordDisplayComplete(rdr::U32 frameId)
 {
-  os::AutoMutex a(mutex);
-  
-  std::map<rdr::U32, DisplayEvent>::iterator it = displayEvents.find(frameId);
-  if (it == displayEvents.end()) {
+  rdr::U64 us;
+
+  if (!completeEvent(pendingDisplays, frameId, &us)) {
     vlog.debug("Display event %u not found", frameId);
     return;
   }
-  
-  gettimeofday(&it->second.completeTime, NULL);
-  it->second.completed = true;
-  
-  double latency = timeDiffMs(it->second.startTime, it->second.completeTime);
-  
-  LatencyData data;
-  data.id = frameId;
-  data.latencyMs = latency;
-  data.eventType = 1; // Display
-  gettimeofday(&data.timestamp, NULL);
-  
-  recordedLatencies.push_back(data);
-  
-  vlog.debug("Display %u latency: %.2f ms", frameId, latency);
+
+  displayHistogram.record(us);
+
+  vlog.debug("Display %u latency: %.2f ms", frameId, us / 1000.0);
 }
 
 double LatencyTracker::getLastClickLatency() const
 {
-  os::AutoMutex a(mutex);
-  
-  // Find last click event
-  for (auto it = recordedLatencies.rbegin(); it != recordedLatencies.rend(); ++it) {
-    if (it->eventType == 0) {
-      return it->latencyMs;
-    }
-  }
-  
-  return 0.0;
+  LatencyHistogram::Snapshot snap;
+  clickHistogram.snapshot(&snap);
+
+  return snap.lastUs / 1000.0;
 }
 
 double LatencyTracker::getLastDisplayLatency() const
 {
-  os::AutoMutex a(mutex);
-  
-  // Find last display event
-  for (auto it = recordedLatencies.rbegin(); it != recordedLatencies.rend(); ++it) {
-    if (it->eventType == 1) {
-      return it->latencyMs;
-    }
-  }
-  
-  return 0.0;
+  LatencyHistogram::Snapshot snap;
+  displayHistogram.snapshot(&snap);
+
+  return snap.lastUs / 1000.0;
 }
 
 double LatencyTracker::getAverageClickLatency() const
 {
-  os::AutoMutex a(mutex);
-  
-  double sum = 0.0;
-  int count = 0;
-  
-  for (const auto& data : recordedLatencies) {
-    if (data.eventType == 0) {
-      sum += data.latencyMs;
-      count++;
-    }
-  }
-  
-  return count > 0 ? sum / count : 0.0;
+  LatencyHistogram::Snapshot snap;
+  clickHistogram.snapshot(&snap);
+
+  return snap.mean();
 }
 
 double LatencyTracker::getAverageDisplayLatency() const
 {
-  os::AutoMutex a(mutex);
-  
-  double sum = 0.0;
-  int count = 0;
-  
-  for (const auto& data : recordedLatencies) {
-    if (data.eventType == 1) {
-      sum += data.latencyMs;
-      count++;
-    }
-  }
-  
-  return count > 0 ? sum / count : 0.0;
+  LatencyHistogram::Snapshot snap;
+  displayHistogram.snapshot(&snap);
+
+  return snap.mean();
+}
+
+void LatencyTracker::getClickHistogram(LatencyHistogram::Snapshot* out) const
+{
+  clickHistogram.snapshot(out);
 }
 
-const std::vector<LatencyData>& LatencyTracker::getAllLatencies() const
+void LatencyTracker::getDisplayHistogram(LatencyHistogram::Snapshot* out) const
 {
-  return recordedLatencies;
+  displayHistogram.snapshot(out);
 }
 
 LatencyTracker::Statistics LatencyTracker::getStatistics() const
 {
-  os::AutoMutex a(mutex);
-  
   Statistics stats;
+  LatencyHistogram::Snapshot snap;
+  
+  clickHistogram.snapshot(&snap);
+  stats.clickCount = snap.count;
+  if (snap.count) {
+    stats.minClickLatency = snap.minUs / 1000.0;
+    stats.maxClickLatency = snap.maxUs / 1000.0;
+    stats.avgClickLatency = snap.mean();
+    stats.p50ClickLatency = snap.percentile(50);
+    stats.p95ClickLatency = snap.percentile(95);
+    stats.p99ClickLatency = snap.percentile(99);
+    stats.p999ClickLatency = snap.percentile(99.9);
+  }
+
+  displayHistogram.snapshot(&snap);
+  stats.displayCount = snap.count;
+  if (snap.count) {
+    stats.minDisplayLatency = snap.minUs / 1000.0;
+    stats.maxDisplayLatency = snap.maxUs / 1000.0;
+    stats.avgDisplayLatency = snap.mean();
+    stats.p50DisplayLatency = snap.percentile(50);
+    stats.p95DisplayLatency = snap.percentile(95);
+    stats.p99DisplayLatency = snap.percentile(99);
+    stats.p999DisplayLatency = snap.percentile(99.9);
+  }
   
-  double clickMin = -1, clickMax = -1, clickSum = 0.0;
-  double displayMin = -1, displayMax = -1, displaySum = 0.0;
-  
-  for (const auto& data : recordedLatencies) {
-    if (data.eventType == 0) { // Click
-      stats.clickCount++;
-      clickSum += data.latencyMs;
-      if (clickMin < 0 || data.latencyMs < clickMin) clickMin = data.latencyMs;
-      if (clickMax < 0 || data.latencyMs > clickMax) clickMax = data.latencyMs;
-    } else { // Display
-      stats.displayCount++;
-      displaySum += data.latencyMs;
-      if (displayMin < 0 || data.latencyMs < displayMin) displayMin = data.latencyMs;
-      if (displayMax < 0 || data.latencyMs > displayMax) displayMax = data.latencyMs;
+  return stats;
+}
+
+const char* LatencyTracker::stageName(int stage)
+{
+  switch (stage) {
+  case STAGE_INPUT:
+    return "input";
+  case STAGE_DAMAGE:
+    return "damage";
+  case STAGE_COMPARE:
+    return "compare";
+  case STAGE_ENCODE:
+    return "encode";
+  case STAGE_FLUSH:
+    return "flush";
+  case STAGE_ACK:
+    return "ack";
+  }
+
+  return "unknown";
+}
+
+void LatencyTracker::probeInput()
+{
+  const rdr::U64 now = nowUs();
+
+  // Drop whatever got stuck, probes are kept in input order
+  while (numProbes && now - probes[0].stamps[STAGE_INPUT] > probeTimeoutUs)
+    finishProbe(0);
+
+  if (numProbes >= MAX_PROBES)
+    return;
+
+  Probe& p = probes[numProbes++];
+  p.stamps[STAGE_INPUT] = now;
+  p.stage = STAGE_INPUT;
+  p.update = 0;
+  p.willAck = false;
+}
+
+void LatencyTracker::advanceProbes(int from, int to, rdr::U64 now)
+{
+  for (unsigned i = 0; i < numProbes; i++) {
+    if (probes[i].stage != from)
+      continue;
+
+    probes[i].stamps[to] = now;
+    probes[i].stage = to;
+  }
+}
+
+void LatencyTracker::probeDamage()
+{
+  const rdr::U64 now = nowUs();
+
+  for (unsigned i = 0; i < numProbes; ) {
+    if (probes[i].stage == STAGE_INPUT &&
+        now - probes[i].stamps[STAGE_INPUT] > damageTimeoutUs) {
+      finishProbe(i);
+      continue;
     }
+    i++;
   }
-  
-  if (stats.clickCount > 0) {
-    stats.minClickLatency = clickMin;
-    stats.maxClickLatency = clickMax;
-    stats.avgClickLatency = clickSum / stats.clickCount;
+
+  advanceProbes(STAGE_INPUT, STAGE_DAMAGE, now);
+}
+
+void LatencyTracker::probeCompared()
+{
+  if (!numProbes)
+    return;
+
+  advanceProbes(STAGE_DAMAGE, STAGE_COMPARE, nowUs());
+}
+
+rdr::U32 LatencyTracker::probeEncoded(bool willAck)
+{
+  bool any = false;
+
+  if (!numProbes)
+    return 0;
+
+  if (++probeUpdateId == 0)
+    probeUpdateId++;
+
+  const rdr::U64 now = nowUs();
+  for (unsigned i = 0; i < numProbes; i++) {
+    if (probes[i].stage != STAGE_COMPARE)
+      continue;
+
+    probes[i].stamps[STAGE_ENCODE] = now;
+    probes[i].stage = STAGE_ENCODE;
+    probes[i].update = probeUpdateId;
+    probes[i].willAck = willAck;
+    any = true;
   }
-  
-  if (stats.displayCount > 0) {
-    stats.minDisplayLatency = displayMin;
-    stats.maxDisplayLatency = displayMax;
-    stats.avgDisplayLatency = displaySum / stats.displayCount;
+
+  return any && willAck ? probeUpdateId : 0;
+}
+
+void LatencyTracker::probeFlushed()
+{
+  if (!numProbes)
+    return;
+
+  const rdr::U64 now = nowUs();
+  advanceProbes(STAGE_ENCODE, STAGE_FLUSH, now);
+
+  // Without fences this is as far as we can follow
+  for (unsigned i = 0; i < numProbes; ) {
+    if (probes[i].stage == STAGE_FLUSH && !probes[i].willAck) {
+      finishProbe(i);
+      continue;
+    }
+    i++;
   }
-  
-  return stats;
 }
 
-void LatencyTracker::pruneOldRecords(size_t maxRecords)
+void LatencyTracker::probeAcked(rdr::U32 id)
 {
-  os::AutoMutex a(mutex);
-  
-  if (recordedLatencies.size() > maxRecords) {
-    size_t toRemove = recordedLatencies.size() - maxRecords;
-    recordedLatencies.erase(recordedLatencies.begin(), 
-                           recordedLatencies.begin() + toRemove);
+  const rdr::U64 now = nowUs();
+
+  // Fences come back in order, so this also covers older updates
+  for (unsigned i = 0; i < numProbes; ) {
+    if ((probes[i].stage == STAGE_ENCODE || probes[i].stage == STAGE_FLUSH) &&
+        (rdr::S32) (probes[i].update - id) <= 0) {
+      // The fence only came back after the data, whether we saw the
+      // buffer drain or not
+      if (probes[i].stage == STAGE_ENCODE)
+        probes[i].stamps[STAGE_FLUSH] = now;
+      probes[i].stamps[STAGE_ACK] = now;
+      probes[i].stage = STAGE_ACK;
+      finishProbe(i);
+      continue;
+    }
+    i++;
   }
 }
+
+void LatencyTracker::finishProbe(unsigned idx)
+{
+  const Probe& p = probes[idx];
+
+  for (int stage = STAGE_DAMAGE; stage <= p.stage; stage++)
+    stageHistograms[stage].record(p.stamps[stage] - p.stamps[stage - 1]);
+
+  if (p.stage == STAGE_ACK) {
+    inputToPhotonHistogram.record(p.stamps[STAGE_ACK] - p.stamps[STAGE_INPUT]);
+
+    vlog.debug("Input to photon %.2f ms (damage %.2f, compare %.2f, "
+               "encode %.2f, flush %.2f, ack %.2f)",
+               (p.stamps[STAGE_ACK] - p.stamps[STAGE_INPUT]) / 1000.0,
+               (p.stamps[STAGE_DAMAGE] - p.stamps[STAGE_INPUT]) / 1000.0,
+               (p.stamps[STAGE_COMPARE] - p.stamps[STAGE_DAMAGE]) / 1000.0,
+               (p.stamps[STAGE_ENCODE] - p.stamps[STAGE_COMPARE]) / 1000.0,
+               (p.stamps[STAGE_FLUSH] - p.stamps[STAGE_ENCODE]) / 1000.0,
+               (p.stamps[STAGE_ACK] - p.stamps[STAGE_FLUSH]) / 1000.0);
+  }
+
+  for (unsigned i = idx + 1; i < numProbes; i++)
+    probes[i - 1] = probes[i];
+  numProbes--;
+}
+
+void LatencyTracker::getStageHistogram(int stage, LatencyHistogram::Snapshot* out) const
+{
+  stageHistograms[stage].snapshot(out);
+}
+
+void LatencyTracker::getInputToPhotonHistogram(LatencyHistogram::Snapshot* out) const
+{
+  inputToPhotonHistogram.snapshot(out);
+}
+
+void LatencyTracker::reset()
+{
+  for (unsigned i = 0; i < MAX_PENDING; i++) {
+    pendingClicks[i].id.store(0, std::memory_order_relaxed);
+    pendingClicks[i].startUs.store(0, std::memory_order_relaxed);
+    pendingDisplays[i].id.store(0, std::memory_order_relaxed);
+    pendingDisplays[i].startUs.store(0, std::memory_order_relaxed);
+  }
+
+  clickHistogram.reset();
+  displayHistogram.reset();
+
+  numProbes = 0;
+  probeUpdateId = 0;
+  for (unsigned i = 0; i < NUM_STAGES; i++)
+    stageHistograms[i].reset();
+  inputToPhotonHistogram.reset();
+}
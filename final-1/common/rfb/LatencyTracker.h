@@ -16,26 +16,23 @@
 #ifndef __RFB_LATENCYTRACKER_H__
 #define __RFB_LATENCYTRACKER_H__
 
-#include <map>
-#include <vector>
-#include <sys/time.h>
-#include <cstddef>
+#include <atomic>
 #include <rdr/types.h>
-#include <os/Mutex.h>
+#include <rfb/LatencyHistogram.h>
 
 namespace rfb {
 
-  struct LatencyData {
-    rdr::U32 id;
-    double latencyMs;
-    struct timeval timestamp;
-    int eventType; // 0=click, 1=display
-    
-    LatencyData() : id(0), latencyMs(0.0), eventType(0) {
-      timestamp.tv_sec = 0;
-      timestamp.tv_usec = 0;
-    }
-  };
+  // Per-connection click and display latencies. Memory use is fixed: in
+  // flight events live in small rings indexed by id, and completed ones
+  // only feed a histogram. Recording never takes a lock, so statistics
+  // can be read from another thread at any time.
+  //
+  // It also follows input through the whole pipeline to the client. An
+  // input event opens a probe, the first damage after it moves the probe
+  // on, then the next compare, the first update carrying data, the
+  // socket flush, and finally the fence the client returns once it has
+  // processed that update. Each step gets its own histogram. The probe
+  // calls are made from the main thread only.
 
   class LatencyTracker {
   public:
@@ -43,7 +40,7 @@ namespace rfb {
     ~LatencyTracker();
 
     // Click latency tracking
-    void recordClickStart(rdr::U32 clickId, int x, int y);
+    void recordClickStart(rdr::U32 clickId);
     void recordClickComplete(rdr::U32 clickId);
     
     // Display latency tracking
@@ -56,65 +53,107 @@ namespace rfb {
     double getAverageClickLatency() const;
     double getAverageDisplayLatency() const;
     
-    // Get all recorded latencies
-    const std::vector<LatencyData>& getAllLatencies() const;
-    
     // Statistics
     struct Statistics {
       double minClickLatency;
       double maxClickLatency;
       double avgClickLatency;
+      double p50ClickLatency, p95ClickLatency, p99ClickLatency, p999ClickLatency;
       double minDisplayLatency;
       double maxDisplayLatency;
       double avgDisplayLatency;
+      double p50DisplayLatency, p95DisplayLatency, p99DisplayLatency, p999DisplayLatency;
       int clickCount;
       int displayCount;
       
       Statistics() : minClickLatency(0), maxClickLatency(0), avgClickLatency(0),
+                     p50ClickLatency(0), p95ClickLatency(0), p99ClickLatency(0),
+                     p999ClickLatency(0),
                      minDisplayLatency(0), maxDisplayLatency(0), avgDisplayLatency(0),
+                     p50DisplayLatency(0), p95DisplayLatency(0), p99DisplayLatency(0),
+                     p999DisplayLatency(0),
                      clickCount(0), displayCount(0) {}
     };
     
     Statistics getStatistics() const;
-    
-    // Clear old records (keep only recent N)
-    void pruneOldRecords(size_t maxRecords = 1000);
+
+    // Full histograms, for exporting the distribution
+    void getClickHistogram(LatencyHistogram::Snapshot* out) const;
+    void getDisplayHistogram(LatencyHistogram::Snapshot* out) const;
+
+    // Input to photon pipeline
+    enum PipelineStage {
+      STAGE_INPUT,
+      STAGE_DAMAGE,
+      STAGE_COMPARE,
+      STAGE_ENCODE,
+      STAGE_FLUSH,
+      STAGE_ACK,
+      NUM_STAGES
+    };
+
+    static const char* stageName(int stage);
+
+    bool hasOpenProbes() const { return numProbes != 0; }
+
+    void probeInput();
+    void probeDamage();
+    void probeCompared();
+    // Returns the id to put in the acknowledging fence, 0 if nothing
+    // was waiting for this update or no fence will follow
+    rdr::U32 probeEncoded(bool willAck);
+    void probeFlushed();
+    void probeAcked(rdr::U32 id);
+
+    // Time spent getting from the previous stage into the given one
+    void getStageHistogram(int stage, LatencyHistogram::Snapshot* out) const;
+    // Whole input to client acknowledgement
+    void getInputToPhotonHistogram(LatencyHistogram::Snapshot* out) const;
+
+    void reset();
     
   private:
-    struct ClickEvent {
-      struct timeval startTime;
-      struct timeval completeTime;
-      int x, y;
-      bool completed;
-      
-      ClickEvent() : x(0), y(0), completed(false) {
-        startTime.tv_sec = 0;
-        startTime.tv_usec = 0;
-        completeTime.tv_sec = 0;
-        completeTime.tv_usec = 0;
-      }
+    // Starts that never complete are simply overwritten
+    enum { MAX_PENDING = 64 };
+
+    struct PendingEvent {
+      std::atomic<rdr::U32> id;
+      std::atomic<rdr::U64> startUs;
     };
+
+    static rdr::U64 nowUs();
+    static void startEvent(PendingEvent* ring, rdr::U32 id);
+    static bool completeEvent(PendingEvent* ring, rdr::U32 id, rdr::U64* us);
     
-    struct DisplayEvent {
-      struct timeval startTime;
-      struct timeval completeTime;
-      bool completed;
-      
-      DisplayEvent() : completed(false) {
-        startTime.tv_sec = 0;
-        startTime.tv_usec = 0;
-        completeTime.tv_sec = 0;
-        completeTime.tv_usec = 0;
-      }
+    PendingEvent pendingClicks[MAX_PENDING];
+    PendingEvent pendingDisplays[MAX_PENDING];
+
+    LatencyHistogram clickHistogram;
+    LatencyHistogram displayHistogram;
+
+    // Inputs beyond this many open probes are not measured. Damage more
+    // than a second after the input is assumed to be unrelated, and
+    // probes that get stuck are dropped after five.
+    enum { MAX_PROBES = 16 };
+    static const rdr::U64 damageTimeoutUs = 1000000;
+    static const rdr::U64 probeTimeoutUs = 5000000;
+
+    struct Probe {
+      rdr::U64 stamps[NUM_STAGES];
+      int stage;
+      rdr::U32 update;
+      bool willAck;
     };
-    
-    double timeDiffMs(const struct timeval& start, const struct timeval& end);
-    
-    std::map<rdr::U32, ClickEvent> clickEvents;
-    std::map<rdr::U32, DisplayEvent> displayEvents;
-    std::vector<LatencyData> recordedLatencies;
-    
-    os::Mutex* mutex;
+
+    void advanceProbes(int from, int to, rdr::U64 now);
+    void finishProbe(unsigned idx);
+
+    Probe probes[MAX_PROBES];
+    unsigned numProbes;
+    rdr::U32 probeUpdateId;
+
+    LatencyHistogram stageHistograms[NUM_STAGES];
+    LatencyHistogram inputToPhotonHistogram;
   };
 
 } // namespace rfb
@@ -0,0 +1,206 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include <rfb/QualityTracker.h>
+#include <rfb/util.h>
+
+using namespace rfb;
+
+#define SCORE_INCREMENT 32
+
+// Grid cells are this many pixels square (as a shift)
+static const int CellShift = 7;
+
+// How far around a rect to look for ones close enough to be the same.
+// Matches are near each other, apart from rare very thin ones.
+static const int SearchMargin = 64;
+
+static bool closeEnough(const Rect& unioned, const int& unionArea,
+                        const Rect& check, const int& checkArea) {
+  const Point p = unioned.tl.subtract(check.tl);
+  if (abs(p.x) > 32 ||
+      abs(p.y) > 32)
+      return false;
+
+  if (abs(unionArea - checkArea) > 4096)
+    return false;
+
+  return true;
+}
+
+// Is this close enough to match?
+// e.g. ads that change parts in one frame and more in others
+static bool matches(const Rect& cur, const Rect& rect) {
+  const int searchArea = rect.area();
+  const int curArea = cur.area();
+  const Rect unioned = cur.union_boundary(rect);
+  const int unionArea = unioned.area();
+
+  return rect.enclosed_by(cur) ||
+         cur.enclosed_by(rect) ||
+         closeEnough(unioned, unionArea, cur, curArea) ||
+         closeEnough(unioned, unionArea, rect, searchArea);
+}
+
+QualityTracker::QualityTracker() : nextSeq(0), used(0)
+{
+}
+
+int QualityTracker::find(const Rect& rect) const
+{
+  int found = -1;
+
+  const int x0 = __rfbmax(rect.tl.x - SearchMargin, 0) >> CellShift;
+  const int y0 = __rfbmax(rect.tl.y - SearchMargin, 0) >> CellShift;
+  const int x1 = __rfbmax(rect.br.x + SearchMargin, 0) >> CellShift;
+  const int y1 = __rfbmax(rect.br.y + SearchMargin, 0) >> CellShift;
+
+  // The oldest match wins, as it did when this was a list
+  for (int cy = y0; cy <= y1; cy++) {
+    for (int cx = x0; cx <= x1; cx++) {
+      const std::unordered_map<uint32_t, std::vector<int> >::const_iterator cell =
+        cells.find(cellKey(cx, cy));
+      if (cell == cells.end())
+        continue;
+
+      for (const int idx: cell->second) {
+        if (found >= 0 && nodes[idx].seq >= nodes[found].seq)
+          continue;
+        if (matches(nodes[idx].rect, rect))
+          found = idx;
+      }
+    }
+  }
+
+  return found;
+}
+
+void QualityTracker::link(int idx)
+{
+  const Rect& r = nodes[idx].rect;
+
+  for (int cy = __rfbmax(r.tl.y, 0) >> CellShift;
+       cy <= __rfbmax(r.br.y, 0) >> CellShift; cy++) {
+    for (int cx = __rfbmax(r.tl.x, 0) >> CellShift;
+         cx <= __rfbmax(r.br.x, 0) >> CellShift; cx++)
+      cells[cellKey(cx, cy)].push_back(idx);
+  }
+}
+
+void QualityTracker::unlink(int idx)
+{
+  const Rect& r = nodes[idx].rect;
+
+  for (int cy = __rfbmax(r.tl.y, 0) >> CellShift;
+       cy <= __rfbmax(r.br.y, 0) >> CellShift; cy++) {
+    for (int cx = __rfbmax(r.tl.x, 0) >> CellShift;
+         cx <= __rfbmax(r.br.x, 0) >> CellShift; cx++) {
+      std::unordered_map<uint32_t, std::vector<int> >::iterator cell =
+        cells.find(cellKey(cx, cy));
+      if (cell == cells.end())
+        continue;
+
+      std::vector<int>& v = cell->second;
+      std::vector<int>::iterator it = std::find(v.begin(), v.end(), idx);
+      if (it != v.end()) {
+        *it = v.back();
+        v.pop_back();
+      }
+      if (v.empty())
+        cells.erase(cell);
+    }
+  }
+}
+
+void QualityTracker::track(const Rect& rect, const struct timeval& now)
+{
+  int idx = find(rect);
+
+  if (idx >= 0) {
+    Node& cur = nodes[idx];
+
+    // This existing rect matched. Set it to the larger of the two,
+    // and add to its score.
+    if (rect.area() > cur.rect.area()) {
+      unlink(idx);
+      cur.rect = rect;
+      link(idx);
+    }
+
+    cur.score += SCORE_INCREMENT;
+    cur.lastUpdate = now;
+    return;
+  }
+
+  // It wasn't found, add it
+  if (!freeNodes.empty()) {
+    idx = freeNodes.back();
+    freeNodes.pop_back();
+  } else {
+    idx = nodes.size();
+    nodes.push_back(Node());
+  }
+
+  Node& node = nodes[idx];
+  node.rect = rect;
+  node.score = 0;
+  node.lastUpdate = now;
+  node.seq = nextSeq++;
+  node.used = true;
+  used++;
+
+  link(idx);
+}
+
+unsigned QualityTracker::getQuality(const Rect& rect) const
+{
+  const int idx = find(rect);
+
+  if (idx < 0)
+    return 128; // Not found, this shouldn't happen - return max quality then
+
+  unsigned score = nodes[idx].score;
+  if (score > 128)
+    score = 128;
+
+  return 128 - score;
+}
+
+void QualityTracker::update(const struct timeval& now)
+{
+  // Remove elements that haven't been touched in 5s. Update the scores.
+  for (size_t i = 0; i < nodes.size(); i++) {
+    Node& cur = nodes[i];
+
+    if (!cur.used)
+      continue;
+
+    if (msBetween(&cur.lastUpdate, &now) > 5000) {
+      unlink(i);
+      cur.used = false;
+      freeNodes.push_back(i);
+      used--;
+    } else {
+      cur.score -= cur.score / 16;
+    }
+  }
+}
@@ -0,0 +1,76 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+#ifndef __RFB_QUALITYTRACKER_H__
+#define __RFB_QUALITYTRACKER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include <rfb/Rect.h>
+
+namespace rfb {
+
+  // Remembers which areas of the screen keep changing, so that their
+  // quality can be lowered. The tracked rects are found through a grid,
+  // and live in a pool, so the cost of a lookup doesn't grow with how
+  // many there are.
+  class QualityTracker {
+  public:
+    QualityTracker();
+
+    // Count a change of this rect
+    void track(const Rect& rect, const struct timeval& now);
+
+    // 128 for still areas, down to 0 for the busiest ones
+    unsigned getQuality(const Rect& rect) const;
+
+    // Forget rects not changed in 5s, and decay the rest
+    void update(const struct timeval& now);
+
+    size_t size() const { return used; }
+
+  private:
+    struct Node {
+      Rect rect;
+      struct timeval lastUpdate;
+      unsigned score;
+      unsigned seq;
+      bool used;
+    };
+
+    int find(const Rect& rect) const;
+    void link(int idx);
+    void unlink(int idx);
+
+    static uint32_t cellKey(int cx, int cy) {
+      return ((uint32_t) cy << 16) | (uint16_t) cx;
+    }
+
+    std::vector<Node> nodes;
+    std::vector<int> freeNodes;
+    std::unordered_map<uint32_t, std::vector<int> > cells;
+    unsigned nextSeq;
+    size_t used;
+  };
+}
+
+#endif
@@ -0,0 +1,217 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <string.h>
+
+#include <rfb/RateController.h>
+
+using namespace rfb;
+
+// Bytes per pixel for mixed screen content, at each quality level.
+// Only used until there are samples of our own.
+static const float JPEG_BPP[10] = {
+  0.10f, 0.13f, 0.16f, 0.20f, 0.25f, 0.32f, 0.40f, 0.50f, 0.70f, 1.00f
+};
+static const float WEBP_SIZE = 0.8f;
+static const float JPEG_MSMP = 10.0f;
+static const float WEBP_MSMP = 40.0f;
+
+// Each level up costs about this much more, for levels not seen yet
+static const float LEVEL_STEP = 1.25f;
+
+// A frame of this many pixels moves the model halfway to it
+static const float SAMPLE_PIXELS = 262144.0f;
+
+static float powStep(unsigned d)
+{
+  float f = 1.0f;
+  while (d--)
+    f *= LEVEL_STEP;
+  return f;
+}
+
+RateController::RateController() :
+  lossyShare(1.0f), encoder(rateJPEG), quality(9),
+  byteBudget(0), predictedBytes(0), predictedMs(0)
+{
+  unsigned q;
+
+  memset(models, 0, sizeof(models));
+  memset(pending, 0, sizeof(pending));
+
+  for (q = 0; q < 10; q++) {
+    models[rateJPEG].bpp[q] = JPEG_BPP[q];
+    models[rateJPEG].msmp[q] = JPEG_MSMP;
+    models[rateWEBP].bpp[q] = JPEG_BPP[q] * WEBP_SIZE;
+    models[rateWEBP].msmp[q] = WEBP_MSMP;
+  }
+}
+
+void RateController::setWebpBenchmark(unsigned ms)
+{
+  unsigned q;
+
+  // Random data at the lowest quality, real content is slower
+  for (q = 0; q < 10; q++)
+    models[rateWEBP].msmp[q] = (ms + 1) * 1000000.0f / (256 * 256);
+}
+
+float RateController::bytesPerPixel(unsigned enc, unsigned q) const
+{
+  const model_t &m = models[enc];
+  unsigned d;
+
+  if (m.samples[q])
+    return m.bpp[q];
+
+  // Go from the closest level seen
+  for (d = 1; d < 10; d++) {
+    if (q >= d && m.samples[q - d])
+      return m.bpp[q - d] * powStep(d);
+    if (q + d < 10 && m.samples[q + d])
+      return m.bpp[q + d] / powStep(d);
+  }
+
+  return m.bpp[q];
+}
+
+float RateController::msPerMegapixel(unsigned enc, unsigned q) const
+{
+  const model_t &m = models[enc];
+  unsigned d;
+
+  if (m.samples[q])
+    return m.msmp[q];
+
+  // Speed barely depends on the level
+  for (d = 1; d < 10; d++) {
+    if (q >= d && m.samples[q - d])
+      return m.msmp[q - d];
+    if (q + d < 10 && m.samples[q + d])
+      return m.msmp[q + d];
+  }
+
+  return m.msmp[q];
+}
+
+void RateController::plan(size_t byteBudget_, unsigned msBudget,
+                          unsigned webpMsBudget, unsigned pixels,
+                          unsigned threads,
+                          unsigned qualityMin, unsigned qualityMax)
+{
+  float lossy, bytes, ms, bestBytes, bestMs;
+  unsigned q, enc, bestEnc;
+
+  byteBudget = byteBudget_;
+  if (threads < 1)
+    threads = 1;
+  if (qualityMax > 9)
+    qualityMax = 9;
+  if (qualityMin > qualityMax)
+    qualityMin = qualityMax;
+
+  lossy = pixels * lossyShare;
+
+  // The highest quality that fits. At the same quality, the encoder
+  // with the smaller output.
+  for (q = qualityMax; ; q--) {
+    bestEnc = rateEncoders;
+    bestBytes = bestMs = 0;
+
+    for (enc = 0; enc < rateEncoders; enc++) {
+      if (enc == rateWEBP && !webpMsBudget)
+        continue;
+
+      bytes = lossy * bytesPerPixel(enc, q);
+      ms = lossy * msPerMegapixel(enc, q) / 1000000.0f / threads;
+      if (bytes > byteBudget)
+        continue;
+      if (ms > (enc == rateWEBP ? webpMsBudget : msBudget))
+        continue;
+
+      if (bestEnc == rateEncoders || bytes < bestBytes) {
+        bestEnc = enc;
+        bestBytes = bytes;
+        bestMs = ms;
+      }
+    }
+
+    if (bestEnc != rateEncoders || q == qualityMin)
+      break;
+  }
+
+  // Nothing fits, go as small and fast as we can
+  if (bestEnc == rateEncoders) {
+    bestEnc = rateJPEG;
+    bestBytes = lossy * bytesPerPixel(rateJPEG, q);
+    bestMs = lossy * msPerMegapixel(rateJPEG, q) / 1000000.0f / threads;
+  }
+
+  encoder = bestEnc;
+  quality = q;
+  predictedBytes = bestBytes;
+  predictedMs = bestMs;
+}
+
+void RateController::addSample(unsigned enc, unsigned q, unsigned pixels,
+                               unsigned bytes, unsigned ms)
+{
+  if (enc >= rateEncoders || q > 9)
+    return;
+
+  pending[enc][q].pixels += pixels;
+  pending[enc][q].bytes += bytes;
+  // The times are cut to whole ms, half a ms per rect is lost on average
+  pending[enc][q].ms += ms + 0.5f;
+}
+
+void RateController::addFrame(unsigned damaged, unsigned lossy)
+{
+  unsigned enc, q;
+  float w;
+
+  if (damaged) {
+    w = damaged / (damaged + SAMPLE_PIXELS);
+    lossyShare += (lossy / (float) damaged - lossyShare) * w;
+  }
+
+  for (enc = 0; enc < rateEncoders; enc++) {
+    for (q = 0; q < 10; q++) {
+      pending_t &p = pending[enc][q];
+      model_t &m = models[enc];
+
+      if (!p.pixels)
+        continue;
+
+      const float bpp = p.bytes / (float) p.pixels;
+      const float msmp = p.ms * 1000000.0f / p.pixels;
+
+      if (!m.samples[q]) {
+        m.bpp[q] = bpp;
+        m.msmp[q] = msmp;
+      } else {
+        w = p.pixels / (p.pixels + SAMPLE_PIXELS);
+        m.bpp[q] += (bpp - m.bpp[q]) * w;
+        m.msmp[q] += (msmp - m.msmp[q]) * w;
+      }
+      m.samples[q]++;
+
+      memset(&p, 0, sizeof(p));
+    }
+  }
+}
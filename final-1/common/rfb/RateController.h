@@ -0,0 +1,85 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+#ifndef __RFB_RATECONTROLLER_H__
+#define __RFB_RATECONTROLLER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace rfb {
+
+  // Picks the lossy encoder and quality for each frame, so that the frame
+  // fits both the bytes the network can take until the next one, and the
+  // time we have to encode it. What each encoder costs at each quality,
+  // in bytes and time per pixel, is learned from the rects sent.
+  class RateController {
+  public:
+    enum { rateJPEG, rateWEBP, rateEncoders };
+
+    RateController();
+
+    // The one-off WEBP benchmark, in ms for 256x256 pixels. Only a first
+    // guess for the time model.
+    void setWebpBenchmark(unsigned ms);
+
+    // Decide for a frame with this much damage. byteBudget is what the
+    // network takes until the next frame, msBudget what we can spend
+    // encoding it, and webpMsBudget the same for WEBP, 0 to not use it.
+    void plan(size_t byteBudget, unsigned msBudget, unsigned webpMsBudget,
+              unsigned pixels, unsigned threads,
+              unsigned qualityMin, unsigned qualityMax);
+
+    // Feedback, one encoded rect at a time, then addFrame() with how
+    // much of the damage ended up lossy
+    void addSample(unsigned encoder, unsigned quality, unsigned pixels,
+                   unsigned bytes, unsigned ms);
+    void addFrame(unsigned damaged, unsigned lossy);
+
+    unsigned getQuality() const { return quality; }
+    bool useWebp() const { return encoder == rateWEBP; }
+
+    size_t getByteBudget() const { return byteBudget; }
+    size_t getPredictedBytes() const { return predictedBytes; }
+    unsigned getPredictedMs() const { return predictedMs; }
+
+  private:
+    float bytesPerPixel(unsigned encoder, unsigned quality) const;
+    float msPerMegapixel(unsigned encoder, unsigned quality) const;
+
+    struct model_t {
+      float bpp[10];
+      float msmp[10];
+      unsigned samples[10];
+    };
+
+    struct pending_t {
+      unsigned long long pixels, bytes;
+      float ms;
+    };
+
+    model_t models[rateEncoders];
+    pending_t pending[rateEncoders][10];
+    float lossyShare;
+
+    unsigned encoder, quality;
+    size_t byteBudget, predictedBytes;
+    unsigned predictedMs;
+  };
+}
+
+#endif
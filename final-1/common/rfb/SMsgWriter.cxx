@@ -30,6 +30,7 @@
 #include <rfb/ConnParams.h>
 #include <rfb/UpdateTracker.h>
 #include <rfb/Encoder.h>
+#include <rfb/FrameTrace.h>
 #include <rfb/SMsgWriter.h>
 #include <rfb/LogWriter.h>
 #include <rfb/ledStates.h>
@@ -414,10 +415,12 @@ void SMsgWriter::startRect(const Rect& r, int encoding)
 
 void SMsgWriter::endRect()
 {
-  if (cp->supportsUdp)
+  if (cp->supportsUdp) {
     udps->flush();
-  else
+  } else {
+    TraceSpan span(TRACE_FLUSH);
     os->flush();
+  }
 }
 
 void SMsgWriter::startMsg(int type)
@@ -427,6 +430,7 @@ void SMsgWriter::startMsg(int type)
 
 void SMsgWriter::endMsg()
 {
+  TraceSpan span(TRACE_FLUSH);
   os->flush();
 }
 
@@ -0,0 +1,86 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+#include <rfb/ScaledFrames.h>
+
+using namespace rfb;
+
+ScaledFrames::ScaledFrames() {
+}
+
+ScaledFrames::~ScaledFrames() {
+  std::list<entry_t>::iterator it;
+  for (it = entries.begin(); it != entries.end(); it++)
+    delete it->shadow;
+}
+
+void ScaledFrames::add_changed(const Region &region) {
+  std::list<entry_t>::iterator it;
+  for (it = entries.begin(); it != entries.end(); it++)
+    it->damage.assign_union(region);
+}
+
+ScaledShadow *ScaledFrames::acquire(const PixelBuffer *pb,
+                                    const uint16_t w, const uint16_t h,
+                                    const float diff, const int method) {
+  std::list<entry_t>::iterator it;
+
+  for (it = entries.begin(); it != entries.end(); it++) {
+    if (it->w == w && it->h == h && it->diff == diff && it->method == method)
+      break;
+  }
+
+  if (it == entries.end()) {
+    entry_t e;
+    e.shadow = new ScaledShadow(&pool);
+    e.refs = 0;
+    e.w = w;
+    e.h = h;
+    e.diff = diff;
+    e.method = method;
+
+    it = entries.insert(entries.end(), e);
+  }
+
+  it->refs++;
+
+  // The first viewer of a frame pays for the scaling, the others find it
+  // done. A different source size or format starts over.
+  it->shadow->setup(pb, w, h, diff, method);
+  if (!it->shadow->isValid() || !it->damage.is_empty()) {
+    it->shadow->update(pb, it->damage);
+    it->damage.clear();
+  }
+
+  return it->shadow;
+}
+
+void ScaledFrames::release(ScaledShadow *shadow) {
+  std::list<entry_t>::iterator it;
+
+  for (it = entries.begin(); it != entries.end(); it++) {
+    if (it->shadow != shadow)
+      continue;
+
+    if (--it->refs == 0) {
+      // Hands the buffers back to the pool
+      delete it->shadow;
+      entries.erase(it);
+    }
+    return;
+  }
+}
@@ -0,0 +1,64 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+#ifndef __RFB_SCALEDFRAMES_H__
+#define __RFB_SCALEDFRAMES_H__
+
+#include <list>
+
+#include <rfb/ScaledShadow.h>
+
+namespace rfb {
+
+  // The video mode scaled copies of the framebuffer, one per target size
+  // and method, shared by all viewers asking for the same. Each copy is
+  // scaled at most once per frame, from the damage of the whole server,
+  // however many viewers use it.
+  //
+  // Only used from the main thread, so no locking is needed.
+  class ScaledFrames {
+  public:
+    ScaledFrames();
+    ~ScaledFrames();
+
+    // Everything that changed in the framebuffer, once per frame
+    void add_changed(const Region &region);
+
+    // The scaled copy for that size, brought up to date with pb. Holds a
+    // reference until release(), the copy goes back to the pool once
+    // nobody uses it.
+    ScaledShadow *acquire(const PixelBuffer *pb, const uint16_t w, const uint16_t h,
+                          const float diff, const int method);
+    void release(ScaledShadow *shadow);
+
+  private:
+    struct entry_t {
+      ScaledShadow *shadow;
+      unsigned refs;
+      Region damage;
+
+      uint16_t w, h;
+      float diff;
+      int method;
+    };
+
+    std::list<entry_t> entries;
+    ScaledBufferPool pool;
+  };
+}
+
+#endif
@@ -0,0 +1,455 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <tbb/parallel_for.h>
+
+#include <rfb/ScaledShadow.h>
+#include <rfb/scale_simd.h>
+
+using namespace rfb;
+
+ScaledBufferPool::~ScaledBufferPool()
+{
+  for (size_t i = 0; i < spare.size(); i++)
+    delete spare[i];
+}
+
+ManagedPixelBuffer *ScaledBufferPool::get(const PixelFormat &pf, const int w, const int h)
+{
+  ManagedPixelBuffer *pb;
+  size_t i;
+
+  if (spare.empty())
+    return new ManagedPixelBuffer(pf, w, h);
+
+  // The same size is likely, otherwise reuse whichever is biggest
+  size_t best = 0;
+  for (i = 0; i < spare.size(); i++) {
+    if (spare[i]->width() == w && spare[i]->height() == h &&
+        spare[i]->getPF().equal(pf)) {
+      best = i;
+      break;
+    }
+    if (spare[i]->dataLen() > spare[best]->dataLen())
+      best = i;
+  }
+
+  pb = spare[best];
+  spare.erase(spare.begin() + best);
+
+  pb->setPF(pf);
+  pb->setSize(w, h);
+
+  return pb;
+}
+
+void ScaledBufferPool::put(ManagedPixelBuffer *pb)
+{
+  if (!pb)
+    return;
+
+  spare.push_back(pb);
+
+  if (spare.size() > maxSpare) {
+    delete spare.front();
+    spare.erase(spare.begin());
+  }
+}
+
+ScaledShadow::ScaledShadow(ScaledBufferPool *pool_): pool(pool_), scaled(NULL),
+  valid(false), srcw(0), srch(0), w(0), h(0), diff(0), method(-1)
+{
+}
+
+ScaledShadow::~ScaledShadow()
+{
+  invalidate();
+}
+
+void ScaledShadow::invalidate()
+{
+  pool->put(scaled);
+  scaled = NULL;
+
+  for (size_t i = 0; i < levels.size(); i++)
+    pool->put(levels[i]);
+  levels.clear();
+
+  valid = false;
+  method = -1;
+}
+
+void ScaledShadow::setup(const PixelBuffer *src, const uint16_t w_, const uint16_t h_,
+                         const float diff_, const int method_)
+{
+  if (method >= 0 && src->width() == srcw && src->height() == srch &&
+      w == w_ && h == h_ && diff == diff_ && method == method_ &&
+      src->getPF().equal(pf))
+    return;
+
+  invalidate();
+
+  srcw = src->width();
+  srch = src->height();
+  w = w_;
+  h = h_;
+  diff = diff_;
+  method = method_;
+  pf = src->getPF();
+
+  scaled = pool->get(pf, w, h);
+
+  // Same steps as progressiveBilinearScale()
+  if (method == 2 && diff < 0.5f) {
+    uint16_t neww = srcw, newh = srch;
+    do {
+      neww /= 2;
+      newh /= 2;
+      levels.push_back(pool->get(pf, neww, newh));
+    } while (w * 2 < neww);
+  }
+}
+
+void ScaledShadow::update(const PixelBuffer *src, const Region &changed)
+{
+  std::vector<Rect> rects;
+  std::vector<Rect>::const_iterator i;
+  unsigned area = 0;
+
+  if (!scaled)
+    return;
+
+  changed.get_rects(&rects);
+  for (i = rects.begin(); i != rects.end(); i++)
+    area += i->area();
+
+  // Overlapping footprints make a mostly changed screen cheaper in one go
+  if (!valid || area * 2 > (unsigned) srcw * srch) {
+    updateRect(src, src->getRect());
+    valid = true;
+    return;
+  }
+
+  for (i = rects.begin(); i != rects.end(); i++)
+    updateRect(src, *i);
+}
+
+// The range of destination pixels that interpolate from [lo, hi)
+static void footprint(const int lo, const int hi, const float diff,
+                      const int max, int *outlo, int *outhi)
+{
+  *outlo = floorf((lo - 1) * diff);
+  *outhi = floorf((hi - 1) * diff) + 2;
+
+  if (*outlo < 0)
+    *outlo = 0;
+  if (*outhi > max)
+    *outhi = max;
+}
+
+// Row bands of about this many pixels are scaled in parallel, on
+// whichever task arena the caller runs in
+static const int bandPixels = 64 * 1024;
+
+template<class F>
+static void forEachBand(const Rect &r, const F &f)
+{
+  const int grain = std::max(1, bandPixels / std::max(1, r.width()));
+
+  tbb::parallel_for(tbb::blocked_range<int>(r.tl.y, r.br.y, grain),
+                    [&](const tbb::blocked_range<int> &band) {
+    f(band.begin(), band.end());
+  });
+}
+
+void rfb::bilinearRect(const PixelBuffer *src, ManagedPixelBuffer *dst,
+                       const Rect &r, const float diff)
+{
+  const uint16_t bpp = src->getPF().bpp / 8;
+  int oldstride, newstride;
+
+  const rdr::U8 *oldpx = src->getBuffer(src->getRect(), &oldstride);
+  rdr::U8 *newpx = dst->getBufferRW(r, &newstride);
+
+  if (bpp == 4) {
+    const scaleFunc bilinear = bestScaleKernels().bilinear;
+
+    forEachBand(r, [&](const int y0, const int y1) {
+      bilinear(oldpx, src->width(), src->height(),
+               newpx + newstride * (y0 - r.tl.y) * 4,
+               r.tl.x, y0, r.width(), y1 - y0,
+               oldstride, newstride, diff);
+    });
+
+    dst->commitBufferRW(r);
+    return;
+  }
+
+  const float invdiff = 1 / diff;
+  const int maxx = src->width() - 1, maxy = src->height() - 1;
+  int x, y;
+
+  for (y = r.tl.y; y < r.br.y; y++) {
+    const float ny = y * invdiff;
+    const uint16_t lowy = ny;
+    const uint16_t highy = lowy < maxy ? lowy + 1 : lowy;
+    const uint16_t bot = (ny - lowy) * 256;
+    const uint16_t top = 256 - bot;
+
+    const rdr::U8 *lowyptr = oldpx + oldstride * bpp * lowy;
+    const rdr::U8 *highyptr = oldpx + oldstride * bpp * highy;
+    rdr::U8 *out = newpx;
+
+    for (x = r.tl.x; x < r.br.x; x++) {
+      const float nx = x * invdiff;
+      const uint16_t lowx = nx;
+      const uint16_t highx = lowx < maxx ? lowx + 1 : lowx;
+      const uint16_t right = (nx - lowx) * 256;
+      const uint16_t left = 256 - right;
+
+      unsigned i;
+      uint32_t val, val2;
+      for (i = 0; i < bpp; i++) {
+        val = lowyptr[lowx * bpp + i] * left;
+        val += lowyptr[highx * bpp + i] * right;
+        val >>= 8;
+
+        val2 = highyptr[lowx * bpp + i] * left;
+        val2 += highyptr[highx * bpp + i] * right;
+        val2 >>= 8;
+
+        out[i] = (val * top + val2 * bot) >> 8;
+      }
+      out += bpp;
+    }
+    newpx += newstride * bpp;
+  }
+
+  dst->commitBufferRW(r);
+}
+
+void rfb::nearestRect(const PixelBuffer *src, ManagedPixelBuffer *dst,
+                      const Rect &r, const float diff)
+{
+  const uint16_t bpp = src->getPF().bpp / 8;
+  int oldstride, newstride;
+
+  const rdr::U8 *oldpxorig = src->getBuffer(src->getRect(), &oldstride);
+  rdr::U8 *newpx = dst->getBufferRW(r, &newstride);
+
+  if (bpp == 4) {
+    const scaleFunc nearest = bestScaleKernels().nearest;
+
+    forEachBand(r, [&](const int y0, const int y1) {
+      nearest(oldpxorig, src->width(), src->height(),
+              newpx + newstride * (y0 - r.tl.y) * 4,
+              r.tl.x, y0, r.width(), y1 - y0,
+              oldstride, newstride, diff);
+    });
+
+    dst->commitBufferRW(r);
+    return;
+  }
+
+  const float rowstep = 1 / diff;
+  int x, y;
+
+  for (y = r.tl.y; y < r.br.y; y++) {
+    const uint16_t ny = rowstep * y;
+    const rdr::U8 *oldpx = oldpxorig + oldstride * bpp * ny;
+    for (x = r.tl.x; x < r.br.x; x++) {
+      const uint16_t newx = x / diff;
+      memcpy(&newpx[(x - r.tl.x) * bpp], &oldpx[newx * bpp], bpp);
+    }
+    newpx += newstride * bpp;
+  }
+
+  dst->commitBufferRW(r);
+}
+
+void rfb::halveRect(const PixelBuffer *src, ManagedPixelBuffer *dst, const Rect &r)
+{
+  const Rect dr(r.tl.x / 2, r.tl.y / 2, r.br.x / 2, r.br.y / 2);
+  const halveFunc halve = bestScaleKernels().halve;
+  int oldstride, newstride;
+
+  if (dr.is_empty())
+    return;
+
+  const rdr::U8 *oldpx = src->getBuffer(r, &oldstride);
+  rdr::U8 *newpx = dst->getBufferRW(dr, &newstride);
+
+  forEachBand(dr, [&](const int y0, const int y1) {
+    halve(oldpx + oldstride * (y0 - dr.tl.y) * 2 * 4, dr.width(), y1 - y0,
+          newpx + newstride * (y0 - dr.tl.y) * 4, oldstride, newstride);
+  });
+
+  dst->commitBufferRW(dr);
+}
+
+// Whole 2x2 blocks of r, inside what the next level covers
+static Rect halvingBlocks(const Rect &r, const PixelBuffer *level)
+{
+  Rect cur = r;
+
+  cur.tl.x &= ~1;
+  cur.tl.y &= ~1;
+  cur.br.x = (cur.br.x + 1) & ~1;
+  cur.br.y = (cur.br.y + 1) & ~1;
+
+  return cur.intersect(Rect(0, 0, level->width() * 2, level->height() * 2));
+}
+
+// Halves r down through the levels. Returns the damaged part of the last
+// level in top.
+void ScaledShadow::updateLevels(const PixelBuffer *src, const Rect &r, Rect *top)
+{
+  const PixelBuffer *from = src;
+  Rect cur = r;
+
+  for (size_t i = 0; i < levels.size(); i++) {
+    cur = halvingBlocks(cur, levels[i]);
+
+    halveRect(from, levels[i], cur);
+
+    cur = Rect(cur.tl.x / 2, cur.tl.y / 2, cur.br.x / 2, cur.br.y / 2);
+    from = levels[i];
+  }
+
+  if (top)
+    *top = cur;
+}
+
+// The scale of the final, non-halving step
+float ScaledShadow::finalDiff() const
+{
+  if (levels.empty())
+    return diff;
+
+  return w / (float) levels.back()->width();
+}
+
+// What the final step rewrites, given the damaged part sr of its input
+Rect ScaledShadow::finalRect(const Rect &sr) const
+{
+  Rect dr;
+
+  // The last level may already be the right size, then it's a copy
+  if (!levels.empty() &&
+      levels.back()->width() == w && levels.back()->height() == h)
+    return sr.intersect(scaled->getRect());
+
+  footprint(sr.tl.x, sr.br.x, finalDiff(), w, &dr.tl.x, &dr.br.x);
+  footprint(sr.tl.y, sr.br.y, finalDiff(), h, &dr.tl.y, &dr.br.y);
+
+  return dr;
+}
+
+Rect ScaledShadow::rewrittenRect(const Rect &r) const
+{
+  Rect cur = r;
+
+  for (size_t i = 0; i < levels.size(); i++) {
+    cur = halvingBlocks(cur, levels[i]);
+    cur = Rect(cur.tl.x / 2, cur.tl.y / 2, cur.br.x / 2, cur.br.y / 2);
+  }
+
+  return finalRect(cur);
+}
+
+void ScaledShadow::updateRect(const PixelBuffer *src, const Rect &r)
+{
+  const PixelBuffer *from = src;
+  Rect sr = r;
+
+  if (!levels.empty()) {
+    updateLevels(src, r, &sr);
+    from = levels.back();
+  }
+
+  const Rect dr = finalRect(sr);
+  if (dr.is_empty())
+    return;
+
+  if (from->width() == w && from->height() == h) {
+    int stride;
+    scaled->imageRect(dr, from->getBuffer(dr, &stride), stride);
+  } else if (method == 0) {
+    nearestRect(from, scaled, dr, finalDiff());
+  } else {
+    bilinearRect(from, scaled, dr, finalDiff());
+  }
+}
+
+Rect ScaledShadow::scaleRect(const Rect &r) const
+{
+  Rect out = r;
+  out.br.x *= diff;
+  out.br.y *= diff;
+  out.tl.x *= diff;
+  out.tl.y *= diff;
+
+  // Make sure everything is at least one pixel still
+  if (r.br.x != r.tl.x && out.br.x == out.tl.x) {
+    if (out.br.x < w - 1)
+      out.br.x++;
+    else
+      out.tl.x--;
+  }
+
+  if (r.br.y != r.tl.y && out.br.y == out.tl.y) {
+    if (out.br.y < h - 1)
+      out.br.y++;
+    else
+      out.tl.y--;
+  }
+
+  return out;
+}
+
+Rect ScaledShadow::sendRect(const Rect &r) const
+{
+  const Rect dr = rewrittenRect(r);
+  Rect out;
+
+  if (dr.is_empty())
+    return r;
+
+  // Back to source pixels, then nudged to make up for float rounding
+  // so that scaleRect() maps it over all of dr
+  out.tl.x = floorf(dr.tl.x / diff);
+  out.tl.y = floorf(dr.tl.y / diff);
+  out.br.x = ceilf(dr.br.x / diff);
+  out.br.y = ceilf(dr.br.y / diff);
+
+  while (out.tl.x > 0 && (int) (out.tl.x * diff) > dr.tl.x)
+    out.tl.x--;
+  while (out.tl.y > 0 && (int) (out.tl.y * diff) > dr.tl.y)
+    out.tl.y--;
+  while (out.br.x < srcw && (int) (out.br.x * diff) < dr.br.x)
+    out.br.x++;
+  while (out.br.y < srch && (int) (out.br.y * diff) < dr.br.y)
+    out.br.y++;
+
+  return out.union_boundary(r).intersect(Rect(0, 0, srcw, srch));
+}
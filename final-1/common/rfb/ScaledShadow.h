@@ -0,0 +1,104 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+#ifndef __RFB_SCALEDSHADOW_H__
+#define __RFB_SCALEDSHADOW_H__
+
+#include <stdint.h>
+#include <vector>
+
+#include <rfb/PixelBuffer.h>
+#include <rfb/Region.h>
+
+namespace rfb {
+
+  // Spare buffers for the scaled copies, so that viewers coming and going
+  // or changing sizes do not allocate tens of megabytes each time
+  class ScaledBufferPool {
+  public:
+    ~ScaledBufferPool();
+
+    ManagedPixelBuffer *get(const PixelFormat &pf, const int w, const int h);
+    void put(ManagedPixelBuffer *pb);
+
+  private:
+    static const size_t maxSpare = 8;
+    std::vector<ManagedPixelBuffer *> spare;
+  };
+
+  // A downscaled copy of the framebuffer for video mode, kept across
+  // frames. Only the parts of the source that changed get scaled again.
+  //
+  // For progressive scaling, the halved levels are kept too. Halving is
+  // a 2x2 box filter, so a damaged block aligned to the number of halvings
+  // gives the same pixels as halving the whole frame.
+  class ScaledShadow {
+  public:
+    ScaledShadow(ScaledBufferPool *pool);
+    ~ScaledShadow();
+
+    // Size and method of the scaled copy. Anything different from the
+    // last call starts over, and the next update() scales everything.
+    void setup(const PixelBuffer *src, const uint16_t w, const uint16_t h,
+               const float diff, const int method);
+    // Drops everything, for when source changes stop being tracked
+    void invalidate();
+
+    void update(const PixelBuffer *src, const Region &changed);
+
+    // Where a source rect ends up, at least one pixel big
+    Rect scaleRect(const Rect &r) const;
+    // Changing r rewrites more of the scaled copy than scaleRect(r), as
+    // interpolation and halving reach into the neighbours. This is r
+    // grown so that its scaled rect covers all of that.
+    Rect sendRect(const Rect &r) const;
+
+    const PixelBuffer *getBuffer() const { return valid ? scaled : NULL; }
+    bool isValid() const { return scaled && valid; }
+
+  private:
+    void updateRect(const PixelBuffer *src, const Rect &r);
+    void updateLevels(const PixelBuffer *src, const Rect &r, Rect *top);
+    // The part of the scaled copy that updateRect(r) rewrites
+    Rect rewrittenRect(const Rect &r) const;
+    Rect finalRect(const Rect &sr) const;
+    float finalDiff() const;
+
+    ScaledBufferPool *pool;
+    ManagedPixelBuffer *scaled;
+    std::vector<ManagedPixelBuffer *> levels;
+    bool valid;
+
+    uint16_t srcw, srch, w, h;
+    float diff;
+    int method;
+    PixelFormat pf;
+  };
+
+  // Scale only the r part of dst, with the same pixels as scaling the
+  // whole frame. 32bpp goes through the fastest SIMD kernels, in row
+  // bands run in parallel.
+  void bilinearRect(const PixelBuffer *src, ManagedPixelBuffer *dst,
+                    const Rect &r, const float diff);
+  void nearestRect(const PixelBuffer *src, ManagedPixelBuffer *dst,
+                   const Rect &r, const float diff);
+  // Halves the r part of src into dst, 32bpp only
+  void halveRect(const PixelBuffer *src, ManagedPixelBuffer *dst, const Rect &r);
+
+}
+
+#endif
@@ -22,6 +22,7 @@
 #include <rfb/SConnection.h>
 #include <rfb/ServerCore.h>
 #include <rfb/PixelBuffer.h>
+#include <rfb/QualityTracker.h>
 #include <rfb/TightJPEGEncoder.h>
 #include <rfb/TightWEBPEncoder.h>
 #include <rfb/util.h>
@@ -102,6 +103,8 @@ void SelfBench() {
 		test_case->SetAttribute("runs", runs);
 		test_case->SetAttribute("classname", "KasmVNC");
 		test_suit->InsertEndChild(test_case);
+
+		return value;
 	};
 
 	benchmark("Jpeg compression at quality 8", RUNS, [&jpeg, &vec, &f1](uint32_t) {
@@ -160,12 +163,25 @@ void SelfBench() {
 	Server::detectScrolling.setParam(false);
 	Server::detectHorizontal.setParam(false);
 
-	benchmark("Analysis (incl. memcpy overhead)", RUNS,
+	comparer->setSerialCompare(true);
+
+	const auto serialMs = benchmark("Analysis, serial memcmp (incl. memcpy overhead)", RUNS,
+	          [&screenptr, &comparer, &cursorReg, f1orig, f2orig](uint32_t i) {
+		          memcpy(screenptr, i % 2 ? f1orig : f2orig, WIDTH * HEIGHT * 4);
+		          comparer->compare(true, cursorReg);
+	          });
+
+	comparer->setSerialCompare(false);
+
+	const auto parallelMs = benchmark("Analysis (incl. memcpy overhead)", RUNS,
 	          [&screenptr, &comparer, &cursorReg, f1orig, f2orig](uint32_t i) {
 		          memcpy(screenptr, i % 2 ? f1orig : f2orig, WIDTH * HEIGHT * 4);
 		          comparer->compare(true, cursorReg);
 	          });
 
+	vlog.info("Parallel SIMD analysis speedup: %.2fx",
+	          parallelMs ? (double) serialMs / parallelMs : 0.0);
+
 	Server::detectScrolling.setParam(true);
 
 	benchmark("Analysis w/ scroll detection (incl. memcpy overhead)", RUNS,
@@ -184,6 +200,27 @@ void SelfBench() {
 		          comparer->compare(false, cursorReg);
 	          });
 
+	// Dynamic quality tracking, a busy page of small changing rects
+	std::vector<Rect> busy;
+	for (uint32_t i = 0; i < 1024; i++) {
+		const int x = rand() % (WIDTH - 64);
+		const int y = rand() % (HEIGHT - 16);
+		busy.push_back(Rect(x, y, x + 8 + rand() % 56, y + 16));
+	}
+
+	QualityTracker tracker;
+
+	benchmark("Quality tracking of 1024 small rects", RUNS, [&tracker, &busy](uint32_t) {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+
+		for (const Rect &r: busy)
+			tracker.track(r, now);
+		for (const Rect &r: busy)
+			tracker.getQuality(r);
+		tracker.update(now);
+	});
+
 	test_suit->SetAttribute("tests", test_cases);
 	test_suit->SetAttribute("failures", 0);
 	test_suit->SetAttribute("time", total_time);
@@ -56,6 +56,26 @@ rfb::IntParameter rfb::Server::frameRate
 ("FrameRate",
  "The maximum number of updates per second sent to each client",
  60);
+rfb::BoolParameter rfb::Server::adaptiveFramePacing
+("AdaptiveFramePacing",
+ "Send the first update after an idle period right away, and under "
+ "sustained updates slow down towards what the slowest client can take",
+ false);
+rfb::StringParameter rfb::Server::congestionControl
+("CongestionControl",
+ "How new connections avoid congestion (vegas: delay based window, "
+ "bbr: send at the estimated bottleneck bandwidth and minimum RTT)",
+ "vegas");
+rfb::BoolParameter rfb::Server::kernelTLS
+("KernelTLS",
+ "Let the kernel encrypt websocket TLS connections after the handshake, "
+ "where the kernel, OpenSSL and the cipher support it",
+ false);
+rfb::BoolParameter rfb::Server::zeroCopySend
+("ZeroCopySend",
+ "Send large framebuffer updates without copying them into the kernel "
+ "(MSG_ZEROCOPY), where the kernel supports it",
+ false);
 rfb::BoolParameter rfb::Server::protocol3_3
 ("Protocol3.3",
  "Always use protocol version 3.3 for backwards compatibility with "
@@ -302,3 +322,32 @@ rfb::IntParameter rfb::Server::webpEncodingTime
 ("webpEncodingTime",
  "Percentage of time allotted for encoding a frame, that can be used for encoding rects in webp.",
  30, 0, 100);
+
+rfb::BoolParameter rfb::Server::rateControl
+("RateControl",
+ "Pick the lossy encoder and quality of each frame from the estimated "
+ "bandwidth, the frame time, and how each encoder has done so far. "
+ "Needs dynamic quality.",
+ false);
+
+rfb::BoolParameter rfb::Server::regionOfInterest
+("RegionOfInterest",
+ "Raise the quality of rects near the pointer and in the focused window, "
+ "and send them first, lowering it elsewhere. Needs dynamic quality.",
+ false);
+
+rfb::IntParameter rfb::Server::refineBandwidth
+("RefineBandwidth",
+ "Percentage of the spare bandwidth used to resend lossy areas losslessly "
+ "once the screen goes idle.",
+ 100, 1, 100);
+
+rfb::IntParameter rfb::Server::encodeCacheSize
+("EncodeCacheSize",
+ "Memory in MB for caching encoded rects across frames and viewers. 0 to disable.",
+ 64, 0, 4096);
+
+rfb::BoolParameter rfb::Server::frameTracing
+("FrameTracing",
+ "Record how long each stage of every frame takes, for /api/get_frame_trace.",
+ true);
@@ -37,6 +37,10 @@ namespace rfb {
         static IntParameter clientWaitTimeMillis;
         static IntParameter compareFB;
         static IntParameter frameRate;
+        static BoolParameter adaptiveFramePacing;
+        static StringParameter congestionControl;
+        static BoolParameter kernelTLS;
+        static BoolParameter zeroCopySend;
         static IntParameter dynamicQualityMin;
         static IntParameter dynamicQualityMax;
         static IntParameter treatLossless;
@@ -92,6 +96,11 @@ namespace rfb {
         static StringParameter benchmarkResults;
         static PresetParameter preferBandwidth;
         static IntParameter webpEncodingTime;
+        static BoolParameter rateControl;
+        static BoolParameter regionOfInterest;
+        static IntParameter refineBandwidth;
+        static IntParameter encodeCacheSize;
+        static BoolParameter frameTracing;
     };
 };
 
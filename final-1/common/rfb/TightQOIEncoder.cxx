@@ -17,6 +17,7 @@
  */
 #include <rdr/OutStream.h>
 #include <rfb/encodings.h>
+#include <rfb/EncBuf.h>
 #include <rfb/LogWriter.h>
 #include <rfb/SConnection.h>
 #include <rfb/ServerCore.h>
@@ -37,35 +38,33 @@ static LogWriter vlog("QOI");
 static const PixelFormat pfRGBX(32, 24, false, true, 255, 255, 255, 0, 8, 16);
 static const PixelFormat pfBGRX(32, 24, false, true, 255, 255, 255, 16, 8, 0);
 
-// An optimized version that assumes 4-alignment and RGBX/BGRX
-static void *qoi_encode_kasm(const void *data, const qoi_desc *desc, int *out_len,
-                             const unsigned isrgb, const unsigned stride) {
-	int i, max_size, p, run;
+static int qoi_kasm_max_size(const qoi_desc *desc) {
+	return desc->width * desc->height * (3 + 1) +
+		QOI_HEADER_SIZE + sizeof(qoi_padding);
+}
+
+// An optimized version that assumes 4-alignment and RGBX/BGRX. Writes
+// into bytes, which must hold qoi_kasm_max_size(), and returns the length
+// used, 0 on error.
+static int qoi_encode_kasm(const void *data, const qoi_desc *desc, unsigned char *bytes,
+                           const unsigned isrgb, const unsigned stride) {
+	int i, p, run;
 	unsigned px_len, px_end, px_pos, y, x;
-	unsigned char *bytes;
 	const uint32_t *pixels;
 	qoi_rgba_t index[64];
 	qoi_rgba_t px, px_prev;
 
 	if (
-		data == NULL || out_len == NULL || desc == NULL ||
+		data == NULL || bytes == NULL || desc == NULL ||
 		desc->width == 0 || desc->height == 0 ||
 		desc->channels < 3 || desc->channels > 4 ||
 		desc->colorspace > 1 ||
 		desc->height >= QOI_PIXELS_MAX / desc->width
 	) {
-		return NULL;
+		return 0;
 	}
 
-	max_size =
-		desc->width * desc->height * (3 + 1) +
-		QOI_HEADER_SIZE + sizeof(qoi_padding);
-
 	p = 0;
-	bytes = (unsigned char *) QOI_MALLOC(max_size);
-	if (!bytes) {
-		return NULL;
-	}
 
 	qoi_write_32(bytes, &p, QOI_MAGIC);
 	qoi_write_32(bytes, &p, desc->width);
@@ -147,8 +146,7 @@ static void *qoi_encode_kasm(const void *data, const qoi_desc *desc, int *out_le
 		bytes[p++] = qoi_padding[i];
 	}
 
-	*out_len = p;
-	return bytes;
+	return p;
 }
 
 TightQOIEncoder::TightQOIEncoder(SConnection* conn) :
@@ -178,7 +176,6 @@ void TightQOIEncoder::compressOnly(const PixelBuffer* pb, const uint8_t qualityI
   const rdr::U8* buffer;
   int stride, len;
   qoi_desc desc;
-  void *encoded;
 
   buffer = pb->getBuffer(pb->getRect(), &stride);
 
@@ -187,17 +184,15 @@ void TightQOIEncoder::compressOnly(const PixelBuffer* pb, const uint8_t qualityI
   desc.colorspace = QOI_LINEAR;
   desc.channels = 4;
 
-  encoded = qoi_encode_kasm(buffer, &desc, &len, pfRGBX.equal(pb->getPF()), stride);
+  out.resize(qoi_kasm_max_size(&desc));
+  len = qoi_encode_kasm(buffer, &desc, &out[0], pfRGBX.equal(pb->getPF()), stride);
 
-  if (!encoded) {
+  if (!len) {
     // Error
     vlog.error("QOI error");
   }
 
   out.resize(len);
-  memcpy(&out[0], encoded, len);
-
-  free(encoded);
 }
 
 void TightQOIEncoder::writeOnly(const std::vector<uint8_t> &out) const
@@ -218,7 +213,7 @@ void TightQOIEncoder::writeRect(const PixelBuffer* pb, const Palette& palette)
   const rdr::U8* buffer;
   int stride, len;
   qoi_desc desc;
-  void *encoded;
+  EncBuf encoded;
 
   buffer = pb->getBuffer(pb->getRect(), &stride);
 
@@ -227,9 +222,11 @@ void TightQOIEncoder::writeRect(const PixelBuffer* pb, const Palette& palette)
   desc.colorspace = QOI_LINEAR;
   desc.channels = 4;
 
-  encoded = qoi_encode_kasm(buffer, &desc, &len, pfRGBX.equal(pb->getPF()), stride);
+  encoded = newEncBuf();
+  encoded->resize(qoi_kasm_max_size(&desc));
+  len = qoi_encode_kasm(buffer, &desc, &(*encoded)[0], pfRGBX.equal(pb->getPF()), stride);
 
-  if (!encoded) {
+  if (!len) {
     // Error
     vlog.error("QOI error");
   }
@@ -239,9 +236,7 @@ void TightQOIEncoder::writeRect(const PixelBuffer* pb, const Palette& palette)
   os->writeU8(tightQoi << 4);
 
   writeCompact(len, os);
-  os->writeBytes(encoded, len);
-
-  free(encoded);
+  os->writeBytes(&(*encoded)[0], len);
 }
 
 void TightQOIEncoder::writeSolidRect(int width, int height,
@@ -117,6 +117,15 @@ bool TightWEBPEncoder::treatLossless()
   return qualityLevel >= rfb::Server::treatLossless;
 }
 
+// Lets WEBP write straight into the rect's buffer
+static int vectorWrite(const uint8_t* data, size_t size, const WebPPicture* pic)
+{
+  std::vector<uint8_t> *out = (std::vector<uint8_t> *) pic->custom_ptr;
+
+  out->insert(out->end(), data, data + size);
+  return 1;
+}
+
 void TightWEBPEncoder::compressOnly(const PixelBuffer* pb, const uint8_t qualityIn,
                                     std::vector<uint8_t> &out, const bool lowVideoQuality) const
 {
@@ -125,7 +134,6 @@ void TightWEBPEncoder::compressOnly(const PixelBuffer* pb, const uint8_t quality
   uint8_t quality, method;
   WebPConfig cfg;
   WebPPicture pic;
-  WebPMemoryWriter wrt;
 
   buffer = pb->getBuffer(pb->getRect(), &stride);
 
@@ -168,20 +176,16 @@ void TightWEBPEncoder::compressOnly(const PixelBuffer* pb, const uint8_t quality
     delete [] tmpbuf;
   }
 
-  WebPMemoryWriterInit(&wrt);
-  pic.writer = WebPMemoryWrite;
-  pic.custom_ptr = &wrt;
+  out.clear();
+  pic.writer = vectorWrite;
+  pic.custom_ptr = &out;
 
   if (!WebPEncode(&cfg, &pic)) {
     // Error
     vlog.error("WEBP error %u", pic.error_code);
   }
 
-  out.resize(wrt.size);
-  memcpy(&out[0], wrt.mem, wrt.size);
-
   WebPPictureFree(&pic);
-  WebPMemoryWriterClear(&wrt);
 }
 
 void TightWEBPEncoder::writeOnly(const std::vector<uint8_t> &out) const
@@ -19,9 +19,11 @@
  
 #include <network/GetAPI.h>
 #include <network/TcpSocket.h>
+#include <network/Udp.h>
 
 #include <rfb/ComparingUpdateTracker.h>
 #include <rfb/Encoder.h>
+#include <rfb/FrameTrace.h>
 #include <rfb/KeyRemapper.h>
 #include <rfb/LogWriter.h>
 #include <rfb/Security.h>
@@ -66,7 +68,8 @@ VNCSConnectionST::VNCSConnectionST(VNCServerST* server_, network::Socket *s,
     losslessTimer(this), kbdLogTimer(this), binclipTimer(this),
     server(server_), updates(false),
     updateRenderedCursor(false), removeRenderedCursor(false),
-    continuousUpdates(false), encodeManager(this, &VNCServerST::encCache),
+    continuousUpdates(false),
+    encodeManager(this, &VNCServerST::encCache, &VNCServerST::scaledFrames),
     needsPermCheck(false), pointerEventTime(0),
     clientHasCursor(false),
     accessRights(AccessDefault), startTime(time(0)), frameTracking(false),
@@ -111,6 +114,12 @@ VNCSConnectionST::VNCSConnectionST(VNCServerST* server_, network::Socket *s,
 
   // Configure the socket
   setSocketTimeouts();
+
+  // Each connection gets its own controller, picked when it starts
+  if (!strcasecmp(rfb::Server::congestionControl, "bbr"))
+    congestion.setModel(Congestion::modelBBR, sock->getFd());
+  if (rfb::Server::zeroCopySend && !sock->outStream().setZeroCopy(true))
+    vlog.debug("Zero copy sending not available for %s", peerEndpoint.buf);
   lastEventTime = time(0);
   gettimeofday(&lastRealUpdate, NULL);
   gettimeofday(&lastClipboardOp, NULL);
@@ -154,6 +163,7 @@ VNCSConnectionST::~VNCSConnectionST()
   if (server->apimessager) {
     server->apimessager->mainUpdateUserInfo(checkOwnerConn(), server->clients.size());
     server->apimessager->mainClearBottleneckStats(peerEndpoint.buf);
+    server->apimessager->mainClearTransportStats(peerEndpoint.buf);
   }
 }
 
@@ -267,8 +277,10 @@ void VNCSConnectionST::flushSocket()
     sock->outStream().flush();
     // Flushing the socket might release an update that was previously
     // delayed because of congestion.
-    if (sock->outStream().bufferUsage() == 0)
+    if (sock->outStream().bufferUsage() == 0) {
+      latencyTracker.probeFlushed();
       writeFramebufferUpdate();
+    }
   } catch (rdr::Exception &e) {
     close(e.str());
   }
@@ -776,7 +788,8 @@ void VNCSConnectionST::pointerEvent(const Point& pos, const Point& abspos, int b
   // Track click latency
   static rdr::U32 clickId = 0;
   rdr::U32 currentClickId = clickId++;
-  latencyTracker.recordClickStart(currentClickId, pos.x, pos.y);
+  latencyTracker.recordClickStart(currentClickId);
+  latencyTracker.probeInput();
   
   pointerEventTime = lastEventTime = time(0);
   server->lastUserInputTime = lastEventTime;
@@ -888,6 +901,8 @@ void VNCSConnectionST::keyEvent(rdr::U32 keysym, rdr::U32 keycode, bool down) {
   server->lastUserInputTime = lastEventTime;
   if (!(accessRights & AccessKeyEvents)) return;
   if (!rfb::Server::acceptKeyEvents) return;
+
+  latencyTracker.probeInput();
   if (Server::DLP_KeyRateLimit > 0 && down &&
       msSince(&lastKeyEvent) < (1000 / (unsigned) Server::DLP_KeyRateLimit)) {
     vlog.info("DLP: client %s: refused keyboard event, too soon (%u ms vs %u)",
@@ -1136,6 +1151,17 @@ void VNCSConnectionST::fence(rdr::U32 flags, unsigned len, const char data[])
   case 1:
     congestion.gotPong();
     break;
+  case 2:
+    {
+      rdr::U32 id;
+      if (len != 1 + sizeof(id)) {
+        vlog.error("Latency probe response of unexpected size received");
+        break;
+      }
+      memcpy(&id, &data[1], sizeof(id));
+      latencyTracker.probeAcked(id);
+    }
+    break;
   default:
     vlog.error("Fence response of unexpected type received");
   }
@@ -1302,6 +1328,30 @@ void VNCSConnectionST::writeRTTPing()
   congestion.sentPing();
 }
 
+void VNCSConnectionST::writeLatencyProbe()
+{
+  char data[1 + sizeof(rdr::U32)];
+  rdr::U32 id;
+
+  if (!latencyTracker.hasOpenProbes())
+    return;
+
+  // Fences over TCP say nothing about updates sent over UDP
+  id = latencyTracker.probeEncoded(cp.supportsFence && !cp.supportsUdp);
+  if (id) {
+    // Blocking, so the client only answers once the update is processed
+    data[0] = 2;
+    memcpy(&data[1], &id, sizeof(id));
+    writer()->writeFence(fenceFlagRequest | fenceFlagBlockBefore,
+                         sizeof(data), data);
+  }
+
+  // The update flushed itself, but not the fence behind it
+  sock->outStream().flush();
+  if (sock->outStream().bufferUsage() == 0)
+    latencyTracker.probeFlushed();
+}
+
 bool VNCSConnectionST::isCongested()
 {
   int eta;
@@ -1314,6 +1364,8 @@ bool VNCSConnectionST::isCongested()
   if (sock->outStream().bufferUsage() > 0)
     return true;
 
+  latencyTracker.probeFlushed();
+
   if (!cp.supportsFence || cp.supportsUdp)
     return false;
 
@@ -1406,6 +1458,8 @@ void VNCSConnectionST::writeFramebufferUpdate()
   static rdr::U32 frameId = 0;
   rdr::U32 currentFrameId = frameId++;
   latencyTracker.recordDisplayStart(currentFrameId);
+
+  TraceSpan span(TRACE_CLIENT_UPDATE);
   
   sock->cork(true);
 
@@ -1585,9 +1639,12 @@ void VNCSConnectionST::writeDataUpdate()
   // FIXME: Bandwidth estimation without congestion control
   maxUpdateSize = congestion.getBandwidth() *
                   server->msToNextUpdate() / 1000;
+  encodeManager.setBandwidthKnown(cp.supportsFence && !cp.supportsUdp);
+  encodeManager.setRegionOfInterest(server->cursorPos, server->focusRect);
 
   if (!ui.is_empty()) {
     encodeManager.writeUpdate(ui, server->getPixelBuffer(), cursor, maxUpdateSize);
+    writeLatencyProbe();
     copypassed.clear();
     gettimeofday(&lastRealUpdate, NULL);
     losslessTimer.start(losslessThreshold);
@@ -1711,7 +1768,51 @@ void VNCSConnectionST::sendStats(const bool toClient) {
     vlog.info("Sending client stats:\n%s\n", buf);
     writer()->writeStats(buf, strlen(buf));
   } else if (server->apimessager) {
+    // Transport counters have their own endpoint, the bottleneck array
+    // above is a fixed format
+    char tbuf[512];
+    size_t tlen = 0;
+
+    // UDP piece loss and how it was recovered
+    if (cp.supportsUdp) {
+      const network::UdpStats udp =
+        ((network::UdpStream *) getOutStream(true))->getStats();
+      tlen += snprintf(tbuf + tlen, sizeof(tbuf) - tlen,
+                       "%s\"udp_sent\": %u, \"udp_parity\": %u, \"udp_lost\": %u, "
+                       "\"udp_recovered\": %u, \"udp_resent\": %u, \"udp_expired\": %u",
+                       tlen ? ", " : "",
+                       udp.sent, udp.parity, udp.lost, udp.recovered, udp.resent, udp.expired);
+    }
+
+    // What the rate controller went for in the last frame
+    const RateController *rate = encodeManager.getRateControl();
+    if (rate) {
+      tlen += snprintf(tbuf + tlen, sizeof(tbuf) - tlen,
+                       "%s\"rate_encoder\": \"%s\", \"rate_quality\": %u, "
+                       "\"rate_budget\": %zu, \"rate_predicted\": %zu, "
+                       "\"rate_predicted_ms\": %u",
+                       tlen ? ", " : "",
+                       rate->useWebp() ? "webp" : "jpeg", rate->getQuality(),
+                       rate->getByteBudget() == SIZE_MAX ? 0 : rate->getByteBudget(),
+                       rate->getPredictedBytes(), rate->getPredictedMs());
+    }
+
+    // How many system calls it takes to get a frame out
+    if (bstats_total[BS_FRAME]) {
+      tlen += snprintf(tbuf + tlen, sizeof(tbuf) - tlen,
+                       "%s\"syscalls_per_frame\": %.1f",
+                       tlen ? ", " : "",
+                       (double) sock->outStream().getSyscalls() /
+                       bstats_total[BS_FRAME]);
+    }
+
     server->apimessager->mainUpdateBottleneckStats(peerEndpoint.buf, buf);
+
+    if (tlen) {
+      CharArray stats(tlen + 5);
+      sprintf(stats.buf, "{ %s }", tbuf);
+      server->apimessager->mainUpdateTransportStats(peerEndpoint.buf, stats.buf);
+    }
   }
 }
 
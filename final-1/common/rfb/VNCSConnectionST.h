@@ -156,6 +156,13 @@ namespace rfb {
       return copypassed.size() != 0;
     }
 
+    // Input to photon tracking, the rest happens inside the connection
+    void latencyProbeDamage() {
+      if (latencyTracker.hasOpenProbes())
+        latencyTracker.probeDamage();
+    }
+    void latencyProbeCompared() { latencyTracker.probeCompared(); }
+
     const char* getPeerEndpoint() const {return peerEndpoint.buf;}
 
     // approveConnectionOrClose() is called some time after
@@ -197,6 +204,10 @@ namespace rfb {
     unsigned getEncodingTime() const {
       return encodeManager.getEncodingTime();
     }
+    // How long an update takes to encode and reach this client, in ms
+    unsigned getFrameBudget() const {
+      return encodeManager.getEncodingTime() + congestion.getPingTime();
+    }
     unsigned getScalingTime() const {
       return encodeManager.getScalingTime();
     }
@@ -284,6 +295,8 @@ namespace rfb {
     void writeRTTPing();
     bool isCongested();
 
+    void writeLatencyProbe();
+
     // writeFramebufferUpdate() attempts to write a framebuffer update to the
     // client.
 
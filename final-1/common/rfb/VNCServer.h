@@ -75,6 +75,10 @@ namespace rfb {
     // client calling XWarpPointer()).
     virtual void setCursorPos(const Point& p, bool warped) = 0;
 
+    // setFocusRect() tells the server where the window with the keyboard
+    // focus is, or an empty rect if none
+    virtual void setFocusRect(const Rect& r) = 0;
+
     // setName() tells the server what desktop title to supply to clients
     virtual void setName(const char* name) = 0;
 
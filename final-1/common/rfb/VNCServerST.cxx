@@ -56,6 +56,7 @@
 
 #include <rfb/cpuid.h>
 #include <rfb/ComparingUpdateTracker.h>
+#include <rfb/FrameTrace.h>
 #include <rfb/KeyRemapper.h>
 #include <rfb/ListConnInfo.h>
 #include <rfb/Security.h>
@@ -82,6 +83,7 @@ using namespace rfb;
 static LogWriter slog("VNCServerST");
 LogWriter VNCServerST::connectionsLog("Connections");
 EncCache VNCServerST::encCache;
+ScaledFrames VNCServerST::scaledFrames;
 
 void SelfBench();
 
@@ -139,20 +141,23 @@ VNCServerST::VNCServerST(const char* name_, SDesktop* desktop_)
     renderedCursorInvalid(false),
     queryConnectionHandler(nullptr), keyRemapper(&KeyRemapper::defInstance),
     lastConnectionTime(0), disableclients(false),
-    frameTimer(this), apimessager(nullptr), trackingFrameStats(0),
-    clipboardId(0), sendWatermark(false)
+    frameTimer(this), frameInterval(0), apimessager(nullptr), trackingFrameStats(0),
+    retryFrameStats(0), clipboardId(0), sendWatermark(false)
 {
     auto to_string = [](const bool value) {
         return value ? "yes" : "no";
     };
 
     lastUserInputTime = lastDisconnectTime = time(nullptr);
+    gettimeofday(&lastFrameTime, NULL);
     slog.debug("creating single-threaded server %s", name.buf);
-    slog.info("CPU capability: SSE2 %s, SSE4.1 %s, SSE4.2 %s, AVX512f %s",
+    slog.info("CPU capability: SSE2 %s, SSE4.1 %s, SSE4.2 %s, AVX2 %s, AVX512f %s, AVX512bw %s",
               to_string(cpu_info::has_sse2),
               to_string(cpu_info::has_sse4_1),
               to_string(cpu_info::has_sse4_2),
-              to_string(cpu_info::has_avx512f));
+              to_string(cpu_info::has_avx2),
+              to_string(cpu_info::has_avx512f),
+              to_string(cpu_info::has_avx512bw));
 
   DLPRegion.enabled = DLPRegion.percents = false;
 
@@ -616,6 +621,10 @@ void VNCServerST::add_changed(const Region& region)
 
   comparer->add_changed(region);
   startFrameClock();
+
+  std::list<VNCSConnectionST*>::iterator ci;
+  for (ci = clients.begin(); ci != clients.end(); ci++)
+    (*ci)->latencyProbeDamage();
 }
 
 void VNCServerST::add_copied(const Region& dest, const Point& delta)
@@ -625,6 +634,10 @@ void VNCServerST::add_copied(const Region& dest, const Point& delta)
 
   comparer->add_copied(dest, delta);
   startFrameClock();
+
+  std::list<VNCSConnectionST*>::iterator ci;
+  for (ci = clients.begin(); ci != clients.end(); ci++)
+    (*ci)->latencyProbeDamage();
 }
 
 void VNCServerST::setCursor(int width, int height, const Point& newHotspot,
@@ -665,6 +678,11 @@ void VNCServerST::setCursorPos(const Point& pos, bool warped)
   }
 }
 
+void VNCServerST::setFocusRect(const Rect& r)
+{
+  focusRect = r;
+}
+
 void VNCServerST::setLEDState(unsigned int state)
 {
   std::list<VNCSConnectionST*>::iterator ci, ci_next;
@@ -735,6 +753,16 @@ bool VNCServerST::handleTimeout(Timer* t)
 
     writeUpdate();
 
+    if (rfb::Server::adaptiveFramePacing) {
+      const unsigned interval = pacedFrameInterval();
+      if ((unsigned) frameTimer.getTimeoutMs() != interval) {
+        frameTimer.start(interval);
+        return false;
+      }
+
+      return true;
+    }
+
     // If this is the first iteration then we need to adjust the timeout
     if (frameTimer.getTimeoutMs() != 1000/rfb::Server::frameRate) {
       frameTimer.start(1000/rfb::Server::frameRate);
@@ -822,6 +850,17 @@ void VNCServerST::startFrameClock()
   if (!desktopStarted)
     return;
 
+  if (rfb::Server::adaptiveFramePacing) {
+    // Coming out of idle, so this is likely a keystroke echo or similar
+    // that should not wait for a clock tick. Only the frame rate limit
+    // since the last update applies.
+    const unsigned minInterval = 1000/rfb::Server::frameRate;
+    const unsigned since = msSince(&lastFrameTime);
+
+    frameTimer.start(since < minInterval ? minInterval - since : 0);
+    return;
+  }
+
   // The first iteration will be just half a frame as we get a very
   // unstable update rate if we happen to be perfectly in sync with
   // the application's update rate
@@ -838,12 +877,44 @@ int VNCServerST::msToNextUpdate()
   // FIXME: If the application is updating slower than frameRate then
   //        we could allow the clients more time here
 
-  if (!frameTimer.isStarted())
+  if (!frameTimer.isStarted()) {
+    if (rfb::Server::adaptiveFramePacing && frameInterval)
+      return frameInterval;
     return 1000/rfb::Server::frameRate/2;
-  else
+  } else
     return frameTimer.getRemainingMs();
 }
 
+// Under sustained damage, the update interval follows the slowest client's
+// encode time plus round trip, so frames it could not take in time are not
+// produced in the first place. It moves there gradually, and stays between
+// the frame rate limit and a quarter of it.
+unsigned VNCServerST::pacedFrameInterval()
+{
+  const unsigned minInterval = 1000/rfb::Server::frameRate;
+  const unsigned maxInterval = minInterval * 4;
+  unsigned budget = minInterval;
+
+  std::list<VNCSConnectionST*>::iterator ci;
+  for (ci = clients.begin(); ci != clients.end(); ci++) {
+    if (!(*ci)->authenticated())
+      continue;
+    budget = __rfbmax(budget, (*ci)->getFrameBudget());
+  }
+
+  if (budget > maxInterval)
+    budget = maxInterval;
+
+  if (!frameInterval)
+    frameInterval = minInterval;
+  frameInterval = (frameInterval * 3 + budget) / 4;
+
+  if (frameInterval < minInterval)
+    frameInterval = minInterval;
+
+  return frameInterval;
+}
+
 static void upgradeClientToUdp(const network::GetAPIMessager::action_data &act,
                                std::list<VNCSConnectionST*> &clients)
 {
@@ -881,15 +952,10 @@ static void upgradeClientToUdp(const network::GetAPIMessager::action_data &act,
 void VNCServerST::checkAPIMessages(network::GetAPIMessager *apimessager,
                              rdr::U8 &trackingFrameStats, char trackingClient[])
 {
-  if (pthread_mutex_lock(&apimessager->userMutex))
-    return;
-
-  const unsigned num = apimessager->actionQueue.size();
-  unsigned i;
-  for (i = 0; i < num; i++) {
-    slog.info("Main thread processing user API request %u/%u", i + 1, num);
+  network::GetAPIMessager::action_data act;
 
-    const network::GetAPIMessager::action_data &act = apimessager->actionQueue[i];
+  while (apimessager->mainGetAction(act)) {
+    slog.info("Main thread processing user API request");
 
     switch (act.action) {
       case network::GetAPIMessager::NONE:
@@ -922,9 +988,6 @@ void VNCServerST::checkAPIMessages(network::GetAPIMessager *apimessager,
       break;
     }
   }
-
-  apimessager->actionQueue.clear();
-  pthread_mutex_unlock(&apimessager->userMutex);
 }
 
 void VNCServerST::translateDLPRegion(rdr::U16 &x1, rdr::U16 &y1, rdr::U16 &x2, rdr::U16 &y2) const
@@ -1011,8 +1074,12 @@ void VNCServerST::writeUpdate()
   assert(blockCounter == 0);
   assert(desktopStarted);
 
+  FrameTrace::setEnabled(Server::frameTracing);
+  TraceSpan frameSpan(TRACE_FRAME, clients.size());
+
   struct timeval start;
   gettimeofday(&start, NULL);
+  lastFrameTime = start;
 
   if (DLPRegion.enabled) {
     comparer->enable_copyrect(false);
@@ -1038,7 +1105,10 @@ void VNCServerST::writeUpdate()
     cursorReg = clippedCursorRect;
   }
 
-  pb->grabRegion(toCheck);
+  {
+    TraceSpan span(TRACE_GRAB);
+    pb->grabRegion(toCheck);
+  }
 
   if (getComparerState())
     comparer->enable();
@@ -1049,16 +1119,22 @@ void VNCServerST::writeUpdate()
   gettimeofday(&beforeAnalysis, NULL);
 
   // Skip scroll detection if the client is slow, and didn't get the previous one yet
-  if (comparer->compare(clients.size() == 1 && (*clients.begin())->has_copypassed(),
-                        cursorReg))
-    comparer->getUpdateInfo(&ui, pb->getRect());
+  {
+    TraceSpan span(TRACE_COMPARE);
+    if (comparer->compare(clients.size() == 1 && (*clients.begin())->has_copypassed(),
+                          cursorReg))
+      comparer->getUpdateInfo(&ui, pb->getRect());
+  }
 
   comparer->clear();
 
+  // The video mode scaled copies follow the same damage as the viewers
+  scaledFrames.add_changed(ui.changed.union_(ui.copied));
+
   const unsigned analysisMs = msSince(&beforeAnalysis);
 
-  encCache.clear();
-  encCache.enabled = clients.size() > 1;
+  encCache.setMaxSize((size_t) Server::encodeCacheSize * 1024 * 1024);
+  encCache.enabled = Server::encodeCacheSize > 0;
 
   // Check if the password file was updated
   bool permcheck = false;
@@ -1089,8 +1165,14 @@ void VNCServerST::writeUpdate()
     apimessager->mainUpdateScreen(pb);
     shottime = msSince(&shotstart);
 
-    trackingFrameStats = 0;
+    trackingFrameStats = retryFrameStats;
+    retryFrameStats = 0;
     checkAPIMessages(apimessager, trackingFrameStats, trackingClient);
+
+    const EncCache::stats_t cachestats = encCache.getStats();
+    apimessager->mainUpdateEncCacheStats(cachestats.hits, cachestats.misses,
+                                         cachestats.hitBytes, cachestats.size,
+                                         cachestats.entries);
   }
   const rdr::U8 origtrackingFrameStats = trackingFrameStats;
 
@@ -1121,6 +1203,7 @@ void VNCServerST::writeUpdate()
         trackingFrameStats = network::GetAPIMessager::WANT_FRAME_STATS_SERVERONLY;
     }
 
+    (*ci)->latencyProbeCompared();
     (*ci)->add_copied(ui.copied, ui.copy_delta);
     (*ci)->add_copypassed(ui.copypassed);
     (*ci)->add_changed(ui.changed);
@@ -1166,16 +1249,7 @@ void VNCServerST::writeUpdate()
                                                 pb->getRect().height());
     } else {
       // Zero encoding time means this was a no-data frame; restore the stats request
-      if (apimessager && pthread_mutex_lock(&apimessager->userMutex) == 0) {
-
-        network::GetAPIMessager::action_data act;
-        act.action = (network::GetAPIMessager::USER_ACTION) origtrackingFrameStats;
-        memcpy(act.data.password, trackingClient, 128);
-
-        apimessager->actionQueue.push_back(act);
-
-        pthread_mutex_unlock(&apimessager->userMutex);
-      }
+      retryFrameStats = origtrackingFrameStats;
     }
   }
 }
@@ -27,6 +27,7 @@
 #include <sys/time.h>
 
 #include <rfb/EncCache.h>
+#include <rfb/ScaledFrames.h>
 #include <rfb/SDesktop.h>
 #include <rfb/VNCServer.h>
 #include <rfb/LogWriter.h>
@@ -107,6 +108,7 @@ namespace rfb {
     virtual void setCursor(int width, int height, const Point& hotspot,
                            const rdr::U8* data, const bool resizing = false);
     virtual void setCursorPos(const Point& p, bool warped);
+    virtual void setFocusRect(const Rect& r);
     virtual void setLEDState(unsigned state);
 
     virtual void bell();
@@ -237,10 +239,12 @@ namespace rfb {
     std::list<network::Socket*> closingSockets;
 
     static EncCache encCache;
+    static ScaledFrames scaledFrames;
 
     ComparingUpdateTracker* comparer;
 
     Point cursorPos;
+    Rect focusRect;
     Cursor* cursor;
     RenderedCursor renderedCursor;
     bool renderedCursorInvalid;
@@ -252,6 +256,7 @@ namespace rfb {
     void startFrameClock();
     void stopFrameClock();
     int msToNextUpdate();
+    unsigned pacedFrameInterval();
     void writeUpdate();
     void blackOut();
     Region getPendingRegion();
@@ -277,6 +282,8 @@ namespace rfb {
     bool disableclients;
 
     Timer frameTimer;
+    struct timeval lastFrameTime;
+    unsigned frameInterval;
 
     int inotifyfd;
 
@@ -284,6 +291,8 @@ namespace rfb {
 
     rdr::U8 trackingFrameStats;
     char trackingClient[128];
+    // A frame stats request that got a frame without data, to try again
+    rdr::U8 retryFrameStats;
 
     struct {
         bool enabled;
@@ -31,6 +31,7 @@
 
 #include "EncCache.h"
 #include "EncodeManager.h"
+#include "ScaledFrames.h"
 #include "SConnection.h"
 #include "screenTypes.h"
 #include "SMsgWriter.h"
@@ -147,7 +148,8 @@ namespace benchmarking {
         MockStream udps{};
 
         EncCache cache{};
-        EncodeManager manager{this, &cache};
+        ScaledFrames scaledFrames{};
+        EncodeManager manager{this, &cache, &scaledFrames};
     };
 
     class MockCConnection final : public MockTestConnection {
@@ -0,0 +1,69 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <string.h>
+#include <rfb/compare_simd.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace rfb {
+
+unsigned AVX2_firstChangedLine(const uint8_t *oldp,
+		const unsigned oldstride,
+		const uint8_t *newp, const unsigned newstride,
+		const unsigned widthBytes, const unsigned lines) {
+#if defined(__AVX2__)
+	unsigned y, x;
+	const unsigned vecBytes = widthBytes & ~127;
+
+	for (y = 0; y < lines; y++) {
+		// 128 bytes, 32 pixels per round
+		for (x = 0; x < vecBytes; x += 128) {
+			__m256i a, b, c, d;
+
+			a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) &oldp[x]),
+						_mm256_loadu_si256((const __m256i *) &newp[x]));
+			b = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) &oldp[x + 32]),
+						_mm256_loadu_si256((const __m256i *) &newp[x + 32]));
+			c = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) &oldp[x + 64]),
+						_mm256_loadu_si256((const __m256i *) &newp[x + 64]));
+			d = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) &oldp[x + 96]),
+						_mm256_loadu_si256((const __m256i *) &newp[x + 96]));
+
+			a = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+			if (!_mm256_testz_si256(a, a))
+				return y;
+		}
+
+		if (x < widthBytes && memcmp(&oldp[x], &newp[x], widthBytes - x))
+			return y;
+
+		oldp += oldstride;
+		newp += newstride;
+	}
+
+	return lines;
+#else
+	return SSE2_firstChangedLine(oldp, oldstride, newp, newstride,
+					widthBytes, lines);
+#endif
+}
+
+}; // namespace rfb
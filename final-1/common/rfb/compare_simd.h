@@ -0,0 +1,49 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#ifndef __RFB_COMPARE_SIMD_H__
+#define __RFB_COMPARE_SIMD_H__
+
+#include <stdint.h>
+
+namespace rfb {
+
+	// Returns the first of the given lines that differs between the two
+	// buffers, or lines if they are identical. Strides are in bytes.
+	typedef unsigned (*firstChangedLineFunc)(const uint8_t *oldp,
+			const unsigned oldstride,
+			const uint8_t *newp, const unsigned newstride,
+			const unsigned widthBytes, const unsigned lines);
+
+	unsigned SSE2_firstChangedLine(const uint8_t *oldp,
+			const unsigned oldstride,
+			const uint8_t *newp, const unsigned newstride,
+			const unsigned widthBytes, const unsigned lines);
+
+	unsigned AVX2_firstChangedLine(const uint8_t *oldp,
+			const unsigned oldstride,
+			const uint8_t *newp, const unsigned newstride,
+			const unsigned widthBytes, const unsigned lines);
+
+	unsigned memcmp_firstChangedLine(const uint8_t *oldp,
+			const unsigned oldstride,
+			const uint8_t *newp, const unsigned newstride,
+			const unsigned widthBytes, const unsigned lines);
+};
+
+#endif
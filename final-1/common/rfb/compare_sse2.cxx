@@ -0,0 +1,86 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <string.h>
+#include <rfb/compare_simd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace rfb {
+
+unsigned memcmp_firstChangedLine(const uint8_t *oldp,
+		const unsigned oldstride,
+		const uint8_t *newp, const unsigned newstride,
+		const unsigned widthBytes, const unsigned lines) {
+
+	unsigned y;
+	for (y = 0; y < lines; y++) {
+		if (memcmp(oldp, newp, widthBytes))
+			return y;
+
+		oldp += oldstride;
+		newp += newstride;
+	}
+
+	return lines;
+}
+
+unsigned SSE2_firstChangedLine(const uint8_t *oldp,
+		const unsigned oldstride,
+		const uint8_t *newp, const unsigned newstride,
+		const unsigned widthBytes, const unsigned lines) {
+#if defined(__SSE2__)
+	unsigned y, x;
+	const unsigned vecBytes = widthBytes & ~63;
+
+	for (y = 0; y < lines; y++) {
+		// 64 bytes, 16 pixels per round, only one branch for all of them
+		for (x = 0; x < vecBytes; x += 64) {
+			__m128i a, b, c, d;
+
+			a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &oldp[x]),
+						_mm_loadu_si128((const __m128i *) &newp[x]));
+			b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &oldp[x + 16]),
+						_mm_loadu_si128((const __m128i *) &newp[x + 16]));
+			c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &oldp[x + 32]),
+						_mm_loadu_si128((const __m128i *) &newp[x + 32]));
+			d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &oldp[x + 48]),
+						_mm_loadu_si128((const __m128i *) &newp[x + 48]));
+
+			a = _mm_and_si128(_mm_and_si128(a, b), _mm_and_si128(c, d));
+			if (_mm_movemask_epi8(a) != 0xffff)
+				return y;
+		}
+
+		if (x < widthBytes && memcmp(&oldp[x], &newp[x], widthBytes - x))
+			return y;
+
+		oldp += oldstride;
+		newp += newstride;
+	}
+
+	return lines;
+#else
+	return memcmp_firstChangedLine(oldp, oldstride, newp, newstride,
+					widthBytes, lines);
+#endif
+}
+
+}; // namespace rfb
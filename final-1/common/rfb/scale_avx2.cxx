@@ -0,0 +1,255 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <utility>
+#include <vector>
+#include <rfb/scale_simd.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace rfb {
+
+#if defined(__AVX2__)
+// a * wa + b * wb, >> 8. The weights add up to 256, so nothing overflows
+// the 16-bit lanes. Takes and gives 8 pixels.
+static inline __m256i blend8(const __m256i a, const __m256i b,
+				const __m256i wa0, const __m256i wa1,
+				const __m256i wb0, const __m256i wb1) {
+	__m256i lo, hi;
+
+	lo = _mm256_add_epi16(
+		_mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(a)), wa0),
+		_mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(b)), wb0));
+	hi = _mm256_add_epi16(
+		_mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(a, 1)), wa1),
+		_mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(b, 1)), wb1));
+
+	lo = _mm256_srli_epi16(lo, 8);
+	hi = _mm256_srli_epi16(hi, 8);
+
+	// packus works per 128-bit lane, put the pixels back in order
+	return _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xd8);
+}
+
+// One source row scaled horizontally
+static void hscale(const uint8_t *row, const int32_t *lowx, const int32_t *highx,
+			const uint16_t *left, uint8_t *out, const uint16_t tgtw) {
+	const __m256i full = _mm256_set1_epi16(256);
+	uint16_t x;
+	uint8_t i;
+
+	for (x = 0; x + 8 <= tgtw; x += 8) {
+		const __m256i a = _mm256_i32gather_epi32((const int *) row,
+				_mm256_loadu_si256((const __m256i *) &lowx[x]), 4);
+		const __m256i b = _mm256_i32gather_epi32((const int *) row,
+				_mm256_loadu_si256((const __m256i *) &highx[x]), 4);
+		const __m256i l0 = _mm256_loadu_si256((const __m256i *) &left[x * 4]);
+		const __m256i l1 = _mm256_loadu_si256((const __m256i *) &left[x * 4 + 16]);
+
+		_mm256_storeu_si256((__m256i *) &out[x * 4],
+				blend8(a, b, l0, l1,
+					_mm256_sub_epi16(full, l0),
+					_mm256_sub_epi16(full, l1)));
+	}
+
+	for (; x < tgtw; x++) {
+		const uint16_t l = left[x * 4];
+		for (i = 0; i < 4; i++)
+			out[x * 4 + i] = (row[lowx[x] * 4 + i] * l +
+					row[highx[x] * 4 + i] * (256 - l)) >> 8;
+	}
+}
+
+// Two horizontally scaled rows blended vertically
+static void vscale(const uint8_t *row0, const uint8_t *row1,
+			const uint16_t top, const uint16_t bot,
+			uint8_t *out, const unsigned bytes) {
+	const __m256i vtop = _mm256_set1_epi16(top);
+	const __m256i vbot = _mm256_set1_epi16(bot);
+	unsigned i;
+
+	for (i = 0; i + 32 <= bytes; i += 32) {
+		_mm256_storeu_si256((__m256i *) &out[i],
+				blend8(_mm256_loadu_si256((const __m256i *) &row0[i]),
+					_mm256_loadu_si256((const __m256i *) &row1[i]),
+					vtop, vtop, vbot, vbot));
+	}
+
+	for (; i < bytes; i++)
+		out[i] = (row0[i] * top + row1[i] * bot) >> 8;
+}
+#endif
+
+void AVX2_halve(const uint8_t *oldpx,
+		const uint16_t tgtw, const uint16_t tgth,
+		uint8_t *newpx,
+		const unsigned oldstride, const unsigned newstride) {
+#if defined(__AVX2__)
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	uint16_t x, y;
+	uint8_t i;
+
+	for (y = 0; y < tgth; y++) {
+		const uint8_t * const row0 = oldpx + oldstride * y * 2 * 4;
+		const uint8_t * const row1 = row0 + oldstride * 4;
+		uint8_t * const dst = newpx + newstride * y * 4;
+
+		// 16 source pixels into 8 per round
+		for (x = 0; x + 8 <= tgtw; x += 8) {
+			const uint8_t * const p0 = &row0[x * 8];
+			const uint8_t * const p1 = &row1[x * 8];
+			__m256i a, b, c, d;
+
+			// Each holds 4 pixels, both rows summed
+			a = _mm256_add_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) &p0[0])),
+					_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) &p1[0])));
+			b = _mm256_add_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) &p0[16])),
+					_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) &p1[16])));
+			c = _mm256_add_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) &p0[32])),
+					_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) &p1[32])));
+			d = _mm256_add_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) &p0[48])),
+					_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) &p1[48])));
+
+			// Even plus odd pixels
+			a = _mm256_add_epi16(_mm256_unpacklo_epi64(a, b), _mm256_unpackhi_epi64(a, b));
+			c = _mm256_add_epi16(_mm256_unpacklo_epi64(c, d), _mm256_unpackhi_epi64(c, d));
+
+			a = _mm256_srli_epi16(a, 2);
+			c = _mm256_srli_epi16(c, 2);
+
+			a = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(a, c), order);
+			_mm256_storeu_si256((__m256i *) &dst[x * 4], a);
+		}
+
+		for (; x < tgtw; x++) {
+			// Remainder in C
+			for (i = 0; i < 4; i++)
+				dst[x * 4 + i] = (row0[x * 8 + i] + row0[x * 8 + 4 + i] +
+						row1[x * 8 + i] + row1[x * 8 + 4 + i]) / 4;
+		}
+	}
+#else
+	C_halve(oldpx, tgtw, tgth, newpx, oldstride, newstride);
+#endif
+}
+
+void AVX2_bilinear(const uint8_t *oldpx,
+		const uint16_t srcw, const uint16_t srch,
+		uint8_t *newpx,
+		const uint16_t tgtx, const uint16_t tgty,
+		const uint16_t tgtw, const uint16_t tgth,
+		const unsigned oldstride, const unsigned newstride,
+		const float tgtdiff) {
+#if defined(__AVX2__)
+	const float invdiff = 1 / tgtdiff;
+	std::vector<int32_t> lowx(tgtw), highx(tgtw);
+	std::vector<uint16_t> left(tgtw * 4);
+	uint16_t x, y;
+
+	// The columns are the same for every row
+	for (x = 0; x < tgtw; x++) {
+		const float nx = (tgtx + x) * invdiff;
+		const uint16_t lx = nx;
+		const uint16_t right = (nx - lx) * 256;
+
+		lowx[x] = lx;
+		highx[x] = lx + 1 < srcw ? lx + 1 : lx;
+		left[x * 4] = left[x * 4 + 1] = left[x * 4 + 2] = left[x * 4 + 3] = 256 - right;
+	}
+
+	// When shrinking, the lower row of one output row is usually the
+	// upper row of the next, so the last two are kept
+	std::vector<uint8_t> buf0(tgtw * 4), buf1(tgtw * 4);
+	uint8_t *hrow0 = buf0.data(), *hrow1 = buf1.data();
+	int have0 = -1, have1 = -1;
+
+	for (y = 0; y < tgth; y++) {
+		const float ny = (tgty + y) * invdiff;
+		const uint16_t lowy = ny;
+		const uint16_t highy = lowy + 1 < srch ? lowy + 1 : lowy;
+		const uint16_t bot = (ny - lowy) * 256;
+		const uint16_t top = 256 - bot;
+
+		if (have0 != lowy) {
+			if (have1 == lowy) {
+				std::swap(hrow0, hrow1);
+				std::swap(have0, have1);
+			} else {
+				hscale(oldpx + oldstride * lowy * 4, lowx.data(), highx.data(),
+					left.data(), hrow0, tgtw);
+				have0 = lowy;
+			}
+		}
+
+		if (have1 != highy) {
+			hscale(oldpx + oldstride * highy * 4, lowx.data(), highx.data(),
+				left.data(), hrow1, tgtw);
+			have1 = highy;
+		}
+
+		vscale(hrow0, hrow1, top, bot, newpx + newstride * y * 4, tgtw * 4);
+	}
+#else
+	C_bilinear(oldpx, srcw, srch, newpx, tgtx, tgty, tgtw, tgth,
+			oldstride, newstride, tgtdiff);
+#endif
+}
+
+void AVX2_nearest(const uint8_t *oldpx,
+		const uint16_t srcw, const uint16_t srch,
+		uint8_t *newpx,
+		const uint16_t tgtx, const uint16_t tgty,
+		const uint16_t tgtw, const uint16_t tgth,
+		const unsigned oldstride, const unsigned newstride,
+		const float tgtdiff) {
+#if defined(__AVX2__)
+	const float rowstep = 1 / tgtdiff;
+	std::vector<int32_t> cols(tgtw);
+	uint16_t x, y;
+
+	for (x = 0; x < tgtw; x++) {
+		const uint16_t nx = (tgtx + x) / tgtdiff;
+		cols[x] = nx < srcw ? nx : srcw - 1;
+	}
+
+	for (y = 0; y < tgth; y++) {
+		uint16_t ny = rowstep * (tgty + y);
+		if (ny >= srch)
+			ny = srch - 1;
+
+		const int * const row = (const int *) (oldpx + oldstride * ny * 4);
+		uint32_t * const dst = (uint32_t *) (newpx + newstride * y * 4);
+
+		for (x = 0; x + 8 <= tgtw; x += 8) {
+			_mm256_storeu_si256((__m256i *) &dst[x],
+					_mm256_i32gather_epi32(row,
+						_mm256_loadu_si256((const __m256i *) &cols[x]), 4));
+		}
+
+		for (; x < tgtw; x++)
+			dst[x] = row[cols[x]];
+	}
+#else
+	C_nearest(oldpx, srcw, srch, newpx, tgtx, tgty, tgtw, tgth,
+			oldstride, newstride, tgtdiff);
+#endif
+}
+
+}; // namespace rfb
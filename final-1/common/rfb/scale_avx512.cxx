@@ -0,0 +1,251 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <utility>
+#include <vector>
+#include <rfb/scale_simd.h>
+
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+#include <immintrin.h>
+#endif
+
+namespace rfb {
+
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+// Same as the AVX2 one, 16 pixels at a time
+static inline __m512i blend16(const __m512i a, const __m512i b,
+				const __m512i wa0, const __m512i wa1,
+				const __m512i wb0, const __m512i wb1) {
+	const __m512i order = _mm512_setr_epi64(0, 2, 4, 6, 1, 3, 5, 7);
+	__m512i lo, hi;
+
+	lo = _mm512_add_epi16(
+		_mm512_mullo_epi16(_mm512_cvtepu8_epi16(_mm512_castsi512_si256(a)), wa0),
+		_mm512_mullo_epi16(_mm512_cvtepu8_epi16(_mm512_castsi512_si256(b)), wb0));
+	hi = _mm512_add_epi16(
+		_mm512_mullo_epi16(_mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(a, 1)), wa1),
+		_mm512_mullo_epi16(_mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(b, 1)), wb1));
+
+	lo = _mm512_srli_epi16(lo, 8);
+	hi = _mm512_srli_epi16(hi, 8);
+
+	return _mm512_permutexvar_epi64(order, _mm512_packus_epi16(lo, hi));
+}
+
+static void hscale(const uint8_t *row, const int32_t *lowx, const int32_t *highx,
+			const uint16_t *left, uint8_t *out, const uint16_t tgtw) {
+	const __m512i full = _mm512_set1_epi16(256);
+	uint16_t x;
+	uint8_t i;
+
+	for (x = 0; x + 16 <= tgtw; x += 16) {
+		const __m512i a = _mm512_i32gather_epi32(
+				_mm512_loadu_si512((const void *) &lowx[x]), (const void *) row, 4);
+		const __m512i b = _mm512_i32gather_epi32(
+				_mm512_loadu_si512((const void *) &highx[x]), (const void *) row, 4);
+		const __m512i l0 = _mm512_loadu_si512((const void *) &left[x * 4]);
+		const __m512i l1 = _mm512_loadu_si512((const void *) &left[x * 4 + 32]);
+
+		_mm512_storeu_si512((void *) &out[x * 4],
+				blend16(a, b, l0, l1,
+					_mm512_sub_epi16(full, l0),
+					_mm512_sub_epi16(full, l1)));
+	}
+
+	for (; x < tgtw; x++) {
+		const uint16_t l = left[x * 4];
+		for (i = 0; i < 4; i++)
+			out[x * 4 + i] = (row[lowx[x] * 4 + i] * l +
+					row[highx[x] * 4 + i] * (256 - l)) >> 8;
+	}
+}
+
+static void vscale(const uint8_t *row0, const uint8_t *row1,
+			const uint16_t top, const uint16_t bot,
+			uint8_t *out, const unsigned bytes) {
+	const __m512i vtop = _mm512_set1_epi16(top);
+	const __m512i vbot = _mm512_set1_epi16(bot);
+	unsigned i;
+
+	for (i = 0; i + 64 <= bytes; i += 64) {
+		_mm512_storeu_si512((void *) &out[i],
+				blend16(_mm512_loadu_si512((const void *) &row0[i]),
+					_mm512_loadu_si512((const void *) &row1[i]),
+					vtop, vtop, vbot, vbot));
+	}
+
+	for (; i < bytes; i++)
+		out[i] = (row0[i] * top + row1[i] * bot) >> 8;
+}
+#endif
+
+void AVX512_halve(const uint8_t *oldpx,
+		const uint16_t tgtw, const uint16_t tgth,
+		uint8_t *newpx,
+		const unsigned oldstride, const unsigned newstride) {
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+	const __m512i order = _mm512_setr_epi32(0, 4, 8, 12, 1, 5, 9, 13,
+						2, 6, 10, 14, 3, 7, 11, 15);
+	uint16_t x, y;
+	uint8_t i;
+
+	for (y = 0; y < tgth; y++) {
+		const uint8_t * const row0 = oldpx + oldstride * y * 2 * 4;
+		const uint8_t * const row1 = row0 + oldstride * 4;
+		uint8_t * const dst = newpx + newstride * y * 4;
+
+		// 32 source pixels into 16 per round
+		for (x = 0; x + 16 <= tgtw; x += 16) {
+			const uint8_t * const p0 = &row0[x * 8];
+			const uint8_t * const p1 = &row1[x * 8];
+			__m512i a, b, c, d;
+
+			// Each holds 8 pixels, both rows summed
+			a = _mm512_add_epi16(_mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) &p0[0])),
+					_mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) &p1[0])));
+			b = _mm512_add_epi16(_mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) &p0[32])),
+					_mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) &p1[32])));
+			c = _mm512_add_epi16(_mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) &p0[64])),
+					_mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) &p1[64])));
+			d = _mm512_add_epi16(_mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) &p0[96])),
+					_mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) &p1[96])));
+
+			// Even plus odd pixels
+			a = _mm512_add_epi16(_mm512_unpacklo_epi64(a, b), _mm512_unpackhi_epi64(a, b));
+			c = _mm512_add_epi16(_mm512_unpacklo_epi64(c, d), _mm512_unpackhi_epi64(c, d));
+
+			a = _mm512_srli_epi16(a, 2);
+			c = _mm512_srli_epi16(c, 2);
+
+			a = _mm512_permutexvar_epi32(order, _mm512_packus_epi16(a, c));
+			_mm512_storeu_si512((void *) &dst[x * 4], a);
+		}
+
+		for (; x < tgtw; x++) {
+			// Remainder in C
+			for (i = 0; i < 4; i++)
+				dst[x * 4 + i] = (row0[x * 8 + i] + row0[x * 8 + 4 + i] +
+						row1[x * 8 + i] + row1[x * 8 + 4 + i]) / 4;
+		}
+	}
+#else
+	AVX2_halve(oldpx, tgtw, tgth, newpx, oldstride, newstride);
+#endif
+}
+
+void AVX512_bilinear(const uint8_t *oldpx,
+		const uint16_t srcw, const uint16_t srch,
+		uint8_t *newpx,
+		const uint16_t tgtx, const uint16_t tgty,
+		const uint16_t tgtw, const uint16_t tgth,
+		const unsigned oldstride, const unsigned newstride,
+		const float tgtdiff) {
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+	const float invdiff = 1 / tgtdiff;
+	std::vector<int32_t> lowx(tgtw), highx(tgtw);
+	std::vector<uint16_t> left(tgtw * 4);
+	uint16_t x, y;
+
+	for (x = 0; x < tgtw; x++) {
+		const float nx = (tgtx + x) * invdiff;
+		const uint16_t lx = nx;
+		const uint16_t right = (nx - lx) * 256;
+
+		lowx[x] = lx;
+		highx[x] = lx + 1 < srcw ? lx + 1 : lx;
+		left[x * 4] = left[x * 4 + 1] = left[x * 4 + 2] = left[x * 4 + 3] = 256 - right;
+	}
+
+	std::vector<uint8_t> buf0(tgtw * 4), buf1(tgtw * 4);
+	uint8_t *hrow0 = buf0.data(), *hrow1 = buf1.data();
+	int have0 = -1, have1 = -1;
+
+	for (y = 0; y < tgth; y++) {
+		const float ny = (tgty + y) * invdiff;
+		const uint16_t lowy = ny;
+		const uint16_t highy = lowy + 1 < srch ? lowy + 1 : lowy;
+		const uint16_t bot = (ny - lowy) * 256;
+		const uint16_t top = 256 - bot;
+
+		if (have0 != lowy) {
+			if (have1 == lowy) {
+				std::swap(hrow0, hrow1);
+				std::swap(have0, have1);
+			} else {
+				hscale(oldpx + oldstride * lowy * 4, lowx.data(), highx.data(),
+					left.data(), hrow0, tgtw);
+				have0 = lowy;
+			}
+		}
+
+		if (have1 != highy) {
+			hscale(oldpx + oldstride * highy * 4, lowx.data(), highx.data(),
+				left.data(), hrow1, tgtw);
+			have1 = highy;
+		}
+
+		vscale(hrow0, hrow1, top, bot, newpx + newstride * y * 4, tgtw * 4);
+	}
+#else
+	AVX2_bilinear(oldpx, srcw, srch, newpx, tgtx, tgty, tgtw, tgth,
+			oldstride, newstride, tgtdiff);
+#endif
+}
+
+void AVX512_nearest(const uint8_t *oldpx,
+		const uint16_t srcw, const uint16_t srch,
+		uint8_t *newpx,
+		const uint16_t tgtx, const uint16_t tgty,
+		const uint16_t tgtw, const uint16_t tgth,
+		const unsigned oldstride, const unsigned newstride,
+		const float tgtdiff) {
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+	const float rowstep = 1 / tgtdiff;
+	std::vector<int32_t> cols(tgtw);
+	uint16_t x, y;
+
+	for (x = 0; x < tgtw; x++) {
+		const uint16_t nx = (tgtx + x) / tgtdiff;
+		cols[x] = nx < srcw ? nx : srcw - 1;
+	}
+
+	for (y = 0; y < tgth; y++) {
+		uint16_t ny = rowstep * (tgty + y);
+		if (ny >= srch)
+			ny = srch - 1;
+
+		const int * const row = (const int *) (oldpx + oldstride * ny * 4);
+		uint32_t * const dst = (uint32_t *) (newpx + newstride * y * 4);
+
+		for (x = 0; x + 16 <= tgtw; x += 16) {
+			_mm512_storeu_si512((void *) &dst[x],
+					_mm512_i32gather_epi32(
+						_mm512_loadu_si512((const void *) &cols[x]),
+						(const void *) row, 4));
+		}
+
+		for (; x < tgtw; x++)
+			dst[x] = row[cols[x]];
+	}
+#else
+	AVX2_nearest(oldpx, srcw, srch, newpx, tgtx, tgty, tgtw, tgth,
+			oldstride, newstride, tgtdiff);
+#endif
+}
+
+}; // namespace rfb
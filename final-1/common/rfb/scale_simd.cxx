@@ -0,0 +1,151 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <rfb/LogWriter.h>
+#include <rfb/cpuid.h>
+#include <rfb/scale_simd.h>
+#include <rfb/scale_sse2.h>
+
+namespace rfb {
+
+static LogWriter vlog("Scale");
+
+void C_halve(const uint8_t *oldpx,
+		const uint16_t tgtw, const uint16_t tgth,
+		uint8_t *newpx,
+		const unsigned oldstride, const unsigned newstride) {
+	uint16_t x, y;
+	uint8_t i;
+
+	for (y = 0; y < tgth; y++) {
+		const uint8_t * const row0 = oldpx + oldstride * y * 2 * 4;
+		const uint8_t * const row1 = row0 + oldstride * 4;
+		uint8_t * const dst = newpx + newstride * y * 4;
+
+		for (x = 0; x < tgtw; x++) {
+			for (i = 0; i < 4; i++)
+				dst[x * 4 + i] = (row0[x * 8 + i] + row0[x * 8 + 4 + i] +
+						row1[x * 8 + i] + row1[x * 8 + 4 + i]) / 4;
+		}
+	}
+}
+
+void C_bilinear(const uint8_t *oldpx,
+		const uint16_t srcw, const uint16_t srch,
+		uint8_t *newpx,
+		const uint16_t tgtx, const uint16_t tgty,
+		const uint16_t tgtw, const uint16_t tgth,
+		const unsigned oldstride, const unsigned newstride,
+		const float tgtdiff) {
+	const float invdiff = 1 / tgtdiff;
+	uint16_t x, y;
+	uint8_t i;
+
+	for (y = 0; y < tgth; y++) {
+		const float ny = (tgty + y) * invdiff;
+		const uint16_t lowy = ny;
+		const uint16_t highy = lowy + 1 < srch ? lowy + 1 : lowy;
+		const uint16_t bot = (ny - lowy) * 256;
+		const uint16_t top = 256 - bot;
+
+		const uint8_t * const row0 = oldpx + oldstride * lowy * 4;
+		const uint8_t * const row1 = oldpx + oldstride * highy * 4;
+		uint8_t * const dst = newpx + newstride * y * 4;
+
+		for (x = 0; x < tgtw; x++) {
+			const float nx = (tgtx + x) * invdiff;
+			const uint16_t lowx = nx;
+			const uint16_t highx = lowx + 1 < srcw ? lowx + 1 : lowx;
+			const uint16_t right = (nx - lowx) * 256;
+			const uint16_t left = 256 - right;
+
+			uint32_t val, val2;
+			for (i = 0; i < 4; i++) {
+				val = row0[lowx * 4 + i] * left;
+				val += row0[highx * 4 + i] * right;
+				val >>= 8;
+
+				val2 = row1[lowx * 4 + i] * left;
+				val2 += row1[highx * 4 + i] * right;
+				val2 >>= 8;
+
+				dst[x * 4 + i] = (val * top + val2 * bot) >> 8;
+			}
+		}
+	}
+}
+
+void C_nearest(const uint8_t *oldpx,
+		const uint16_t srcw, const uint16_t srch,
+		uint8_t *newpx,
+		const uint16_t tgtx, const uint16_t tgty,
+		const uint16_t tgtw, const uint16_t tgth,
+		const unsigned oldstride, const unsigned newstride,
+		const float tgtdiff) {
+	const float rowstep = 1 / tgtdiff;
+	uint16_t x, y;
+
+	for (y = 0; y < tgth; y++) {
+		uint16_t ny = rowstep * (tgty + y);
+		if (ny >= srch)
+			ny = srch - 1;
+
+		const uint32_t * const row = (const uint32_t *) (oldpx + oldstride * ny * 4);
+		uint32_t * const dst = (uint32_t *) (newpx + newstride * y * 4);
+
+		for (x = 0; x < tgtw; x++) {
+			uint16_t nx = (tgtx + x) / tgtdiff;
+			if (nx >= srcw)
+				nx = srcw - 1;
+			dst[x] = row[nx];
+		}
+	}
+}
+
+static ScaleKernels pickScaleKernels() {
+	ScaleKernels k;
+	const char *name;
+
+	if (cpu_info::has_avx512bw) {
+		k.halve = AVX512_halve;
+		k.bilinear = AVX512_bilinear;
+		k.nearest = AVX512_nearest;
+		name = "AVX-512";
+	} else if (cpu_info::has_avx2) {
+		k.halve = AVX2_halve;
+		k.bilinear = AVX2_bilinear;
+		k.nearest = AVX2_nearest;
+		name = "AVX2";
+	} else {
+		k.halve = cpu_info::has_sse2 ? SSE2_halve : C_halve;
+		k.bilinear = C_bilinear;
+		k.nearest = C_nearest;
+		name = cpu_info::has_sse2 ? "SSE2" : "C";
+	}
+
+	vlog.debug("Using %s scaling kernels", name);
+
+	return k;
+}
+
+const ScaleKernels &bestScaleKernels() {
+	static const ScaleKernels kernels = pickScaleKernels();
+	return kernels;
+}
+
+}; // namespace rfb
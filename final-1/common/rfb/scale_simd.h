@@ -0,0 +1,115 @@
+/* Copyright (C) 2022 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#ifndef __RFB_SCALE_SIMD_H__
+#define __RFB_SCALE_SIMD_H__
+
+#include <stdint.h>
+
+namespace rfb {
+
+	// Scaling kernels for 32bpp buffers. Strides are in pixels, like
+	// the SSE2 ones.
+
+	// Same as SSE2_halve, a 2x2 box filter
+	typedef void (*halveFunc)(const uint8_t *oldpx,
+			const uint16_t tgtw, const uint16_t tgth,
+			uint8_t *newpx,
+			const unsigned oldstride, const unsigned newstride);
+
+	// Fills the tgtw x tgth area at (tgtx, tgty) of the scaled image.
+	// oldpx is the whole srcw x srch source, newpx points at the first
+	// pixel of the area. All versions give the same pixels as the plain
+	// C one, for bilinear that is horizontal first, then vertical.
+	typedef void (*scaleFunc)(const uint8_t *oldpx,
+			const uint16_t srcw, const uint16_t srch,
+			uint8_t *newpx,
+			const uint16_t tgtx, const uint16_t tgty,
+			const uint16_t tgtw, const uint16_t tgth,
+			const unsigned oldstride, const unsigned newstride,
+			const float tgtdiff);
+
+	void C_halve(const uint8_t *oldpx,
+			const uint16_t tgtw, const uint16_t tgth,
+			uint8_t *newpx,
+			const unsigned oldstride, const unsigned newstride);
+	void C_bilinear(const uint8_t *oldpx,
+			const uint16_t srcw, const uint16_t srch,
+			uint8_t *newpx,
+			const uint16_t tgtx, const uint16_t tgty,
+			const uint16_t tgtw, const uint16_t tgth,
+			const unsigned oldstride, const unsigned newstride,
+			const float tgtdiff);
+	void C_nearest(const uint8_t *oldpx,
+			const uint16_t srcw, const uint16_t srch,
+			uint8_t *newpx,
+			const uint16_t tgtx, const uint16_t tgty,
+			const uint16_t tgtw, const uint16_t tgth,
+			const unsigned oldstride, const unsigned newstride,
+			const float tgtdiff);
+
+	void AVX2_halve(const uint8_t *oldpx,
+			const uint16_t tgtw, const uint16_t tgth,
+			uint8_t *newpx,
+			const unsigned oldstride, const unsigned newstride);
+	void AVX2_bilinear(const uint8_t *oldpx,
+			const uint16_t srcw, const uint16_t srch,
+			uint8_t *newpx,
+			const uint16_t tgtx, const uint16_t tgty,
+			const uint16_t tgtw, const uint16_t tgth,
+			const unsigned oldstride, const unsigned newstride,
+			const float tgtdiff);
+	void AVX2_nearest(const uint8_t *oldpx,
+			const uint16_t srcw, const uint16_t srch,
+			uint8_t *newpx,
+			const uint16_t tgtx, const uint16_t tgty,
+			const uint16_t tgtw, const uint16_t tgth,
+			const unsigned oldstride, const unsigned newstride,
+			const float tgtdiff);
+
+	// These need AVX-512BW on top of AVX-512F
+	void AVX512_halve(const uint8_t *oldpx,
+			const uint16_t tgtw, const uint16_t tgth,
+			uint8_t *newpx,
+			const unsigned oldstride, const unsigned newstride);
+	void AVX512_bilinear(const uint8_t *oldpx,
+			const uint16_t srcw, const uint16_t srch,
+			uint8_t *newpx,
+			const uint16_t tgtx, const uint16_t tgty,
+			const uint16_t tgtw, const uint16_t tgth,
+			const unsigned oldstride, const unsigned newstride,
+			const float tgtdiff);
+	void AVX512_nearest(const uint8_t *oldpx,
+			const uint16_t srcw, const uint16_t srch,
+			uint8_t *newpx,
+			const uint16_t tgtx, const uint16_t tgty,
+			const uint16_t tgtw, const uint16_t tgth,
+			const unsigned oldstride, const unsigned newstride,
+			const float tgtdiff);
+
+	struct ScaleKernels {
+		halveFunc halve;
+		scaleFunc bilinear;
+		scaleFunc nearest;
+	};
+
+	// The fastest kernels this CPU runs, picked once
+	const ScaleKernels &bestScaleKernels();
+};
+
+#endif
@@ -36,6 +36,7 @@
 #include "mipointer.h"
 #include "exevents.h"
 #include "scrnintstr.h"
+#include "windowstr.h"
 #include "xkbsrv.h"
 #include "xkbstr.h"
 #include "xserver-properties.h"
@@ -299,6 +300,38 @@ void vncGetPointerPos(int *x, int *y)
 	*y = cursorPosY;
 }
 
+/*
+ * The top level window holding the keyboard focus, with its frame if
+ * there is a window manager. Returns 0 if the focus is on no window.
+ */
+int vncGetFocusRect(int scrIdx, int *x, int *y, int *w, int *h)
+{
+	WindowPtr win;
+
+	if (inputInfo.keyboard == NULL || inputInfo.keyboard->focus == NULL)
+		return 0;
+
+	win = inputInfo.keyboard->focus->win;
+	if (win == NoneWin || win == PointerRootWin || win == FollowKeyboardWin)
+		return 0;
+
+	if (win->drawable.pScreen->myNum != scrIdx || win->parent == NULL)
+		return 0;
+
+	while (win->parent->parent != NULL)
+		win = win->parent;
+
+	if (!win->viewable)
+		return 0;
+
+	*x = win->drawable.x - wBorderWidth(win);
+	*y = win->drawable.y - wBorderWidth(win);
+	*w = win->drawable.width + 2 * wBorderWidth(win);
+	*h = win->drawable.height + 2 * wBorderWidth(win);
+
+	return 1;
+}
+
 static int vncPointerProc(DeviceIntPtr pDevice, int onoff)
 {
 	BYTE map[BUTTONS + 1];
@@ -40,6 +40,7 @@ void vncPointerMoveRelative(int x, int y, int absx, int absy);
 
 void vncScroll(int x, int y);
 void vncGetPointerPos(int *x, int *y);
+int vncGetFocusRect(int scrIdx, int *x, int *y, int *w, int *h);
 
 void vncKeyboardEvent(KeySym keysym, unsigned xtcode, int down);
 
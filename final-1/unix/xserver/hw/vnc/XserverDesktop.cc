@@ -374,6 +374,8 @@ bool XserverDesktop::handleListenerEvent(int fd,
     return false;
 
   Socket* sock = (*i)->accept();
+  if (!sock)
+    return true;
   sock->outStream().setBlocking(false);
   vlog.debug("new client, sock %d", sock->getFd());
   sockserv->addSocket(sock);
@@ -398,6 +400,10 @@ bool XserverDesktop::handleSocketEvent(int fd,
   if (i == sockets.end())
     return false;
 
+  // Zero copy completions arrive as errors, which we are woken for but
+  // not told about. Left unread, they'd wake us again right away.
+  (*i)->outStream().reapZeroCopy();
+
   if (read)
     sockserv->processSocketReadEvent(*i);
 
@@ -444,6 +450,16 @@ void XserverDesktop::blockHandler(int* timeout)
       server->setCursorPos(oldCursorPos, false);
     }
 
+    // And where the user is typing, for region of interest encoding
+    rfb::Rect focusRect;
+    int focusX, focusY, focusW, focusH;
+    if (vncGetFocusRect(screenIndex, &focusX, &focusY, &focusW, &focusH))
+      focusRect.setXYWH(focusX, focusY, focusW, focusH);
+    if (!focusRect.equals(oldFocusRect)) {
+      oldFocusRect = focusRect;
+      server->setFocusRect(focusRect);
+    }
+
     // Trigger timers and check when the next will expire
     int nextTimeout = server->checkTimeouts();
     if (nextTimeout > 0 && (*timeout == -1 || nextTimeout < *timeout))
@@ -139,6 +139,7 @@ private:
   OutputIdMap outputIdMap;
 
   rfb::Point oldCursorPos;
+  rfb::Rect oldFocusRect;
 
   bool resizing;
 